@@ -0,0 +1,390 @@
+/* Headless LOD benchmark: replays a camera path over a mesh or scene with no
+ * GL context, timing the front update and triangle extraction of every frame
+ * and reporting the LOD statistics as CSV or JSON. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "campath.h"
+#include "lod.h"
+#include "octree.h"
+#include "paged.h"
+#include "perfctr.h"
+#include "scene.h"
+#include "timer.h"
+#include "trace.h"
+#include "vec3.h"
+#include "view_params.h"
+
+typedef struct {
+    double  update, extract;		/* seconds			    */
+    int	    num_tests, num_saved;
+    int	    front_size, buckets;
+    int	    proxy_updates;
+    int	    collapsed, rendered;
+    /* of a paged octree */
+    int	    pages, pending, loads, evictions;
+    size_t  page_bytes;
+    /* hardware counters, with -P */
+    unsigned long long update_ctr[PERF_NCOUNTERS];
+    unsigned long long extract_ctr[PERF_NCOUNTERS];
+} frame_stats;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file | scene file | paged octree | "
+	"synth:<kind>:<triangles>> [camera path]\n"
+	"  -f csv|json   output format (csv)\n"
+	"  -o file       write frames to file (stdout)\n"
+	"  -n frames     frames of the default orbit (360)\n"
+	"  -d distance   distance of the default orbit (3)\n"
+	"  -W width, -H height   viewport aspect (1280x960)\n"
+	"  -D detail, -S silhouette   thresholds, in pixels\n"
+	"  -r incremental|hybrid|top-down   front update (hybrid)\n"
+	"  -b triangles  scene-wide triangle budget (none)\n"
+	"  -c            no front caching\n"
+	"  -i            no front sharing among instances\n"
+	"  -T file       write a Chrome trace (needs make TRACE=1)\n"
+	"  -P            count cycles, instructions and misses per phase\n"
+	"  -s            print only a summary of loading and all frames\n"
+	"  -w            wait for the pages each frame asks for (paged octrees)\n"
+	"A camera path has one frame per line,\n"
+	"  eye_x eye_y eye_z gaze_x gaze_y gaze_z up_x up_y up_z [fovy]\n"
+	"in the coordinates of the scene fitted to [-1,1]^3. Without one, the\n"
+	"camera orbits the scene.\n", prog);
+    exit(1);
+}
+
+static void
+run_frame(scene *sc, const view_params *vp, frame_stats *fs)
+{
+    const lod_context *lod;
+    double t;
+    int j;
+
+    memset(fs, 0, sizeof(*fs));
+    perfctr_reset(PHASE_LOD_UPDATE);
+    perfctr_reset(PHASE_LOD_EXTRACT);
+
+    t = get_timer();
+    scene_update(sc, vp);
+    fs->update = get_timer() - t;
+
+    t = get_timer();
+    for (j=0; j<sc->nbuckets; j++)
+	lod_extract(sc->buckets[j].lod);
+    if (sc->paged)
+	paged_extract(sc->paged);
+    fs->extract = get_timer() - t;
+    scene_publish(sc);
+
+    fs->buckets = sc->nbuckets;
+    for (j=0; j<sc->nbuckets; j++) {
+	lod = sc->buckets[j].lod;
+	fs->num_tests += lod->num_tests;
+	fs->num_saved += lod->num_saved;
+	fs->front_size += lod->front_size;
+	fs->proxy_updates += lod->proxy_updates;
+	fs->collapsed += lod->collapsed * sc->buckets[j].nobjects;
+	fs->rendered += lod->rendered * sc->buckets[j].nobjects;
+    }
+    if (sc->paged) {
+	lod = sc->paged->lod;
+	fs->buckets++;
+	fs->num_tests += lod->num_tests;
+	fs->num_saved += lod->num_saved;
+	fs->front_size += lod->front_size;
+	fs->collapsed += sc->paged->collapsed;
+	fs->rendered += sc->paged->rendered;
+	fs->pages = sc->paged->resident;
+	fs->page_bytes = sc->paged->bytes;
+	fs->pending = sc->paged->pending;
+	fs->loads = sc->paged->loads;
+	fs->evictions = sc->paged->evictions;
+    }
+    memcpy(fs->update_ctr, perfctr_phases[PHASE_LOD_UPDATE].count,
+	   sizeof(fs->update_ctr));
+    memcpy(fs->extract_ctr, perfctr_phases[PHASE_LOD_EXTRACT].count,
+	   sizeof(fs->extract_ctr));
+}
+
+static void
+print_header(FILE *fp, int paged, int counters)
+{
+    int k;
+
+    fprintf(fp, "frame,update_ms,extract_ms,num_tests,num_saved,"
+	    "front_size,fronts,proxy_updates,collapsed,rendered");
+    if (paged)
+	fprintf(fp, ",pages,resident_kb,pending,loads,evictions");
+    if (counters) {
+	for (k=0; k<PERF_NCOUNTERS; k++)
+	    fprintf(fp, ",update_%s", perfctr_counter_name(k));
+	for (k=0; k<PERF_NCOUNTERS; k++)
+	    fprintf(fp, ",extract_%s", perfctr_counter_name(k));
+    }
+    fprintf(fp, "\n");
+}
+
+static void
+print_frame(FILE *fp, int json, int paged, int counters, int frame,
+	    const frame_stats *fs)
+{
+    int k;
+
+    if (json) {
+	fprintf(fp, "%s\n  {\"frame\": %d, \"update_ms\": %.4f, "
+		"\"extract_ms\": %.4f, \"num_tests\": %d, \"num_saved\": %d, "
+		"\"front_size\": %d, \"fronts\": %d, \"proxy_updates\": %d, "
+		"\"collapsed\": %d, \"rendered\": %d",
+		frame ? "," : "[", frame, fs->update*1e3, fs->extract*1e3,
+		fs->num_tests, fs->num_saved, fs->front_size, fs->buckets,
+		fs->proxy_updates, fs->collapsed, fs->rendered);
+	if (paged)
+	    fprintf(fp, ", \"pages\": %d, \"resident_kb\": %zu, "
+		    "\"pending\": %d, \"loads\": %d, \"evictions\": %d",
+		    fs->pages, fs->page_bytes >> 10, fs->pending, fs->loads,
+		    fs->evictions);
+	if (counters) {
+	    for (k=0; k<PERF_NCOUNTERS; k++)
+		fprintf(fp, ", \"update_%s\": %llu",
+			perfctr_counter_name(k), fs->update_ctr[k]);
+	    for (k=0; k<PERF_NCOUNTERS; k++)
+		fprintf(fp, ", \"extract_%s\": %llu",
+			perfctr_counter_name(k), fs->extract_ctr[k]);
+	}
+	fprintf(fp, "}");
+    } else {
+	fprintf(fp, "%d,%.4f,%.4f,%d,%d,%d,%d,%d,%d,%d",
+		frame, fs->update*1e3, fs->extract*1e3,
+		fs->num_tests, fs->num_saved, fs->front_size, fs->buckets,
+		fs->proxy_updates, fs->collapsed, fs->rendered);
+	if (paged)
+	    fprintf(fp, ",%d,%zu,%d,%d,%d", fs->pages, fs->page_bytes >> 10,
+		    fs->pending, fs->loads, fs->evictions);
+	if (counters) {
+	    for (k=0; k<PERF_NCOUNTERS; k++)
+		fprintf(fp, ",%llu", fs->update_ctr[k]);
+	    for (k=0; k<PERF_NCOUNTERS; k++)
+		fprintf(fp, ",%llu", fs->extract_ctr[k]);
+	}
+	fprintf(fp, "\n");
+    }
+}
+
+/* counters of the phases of building the octrees, as a table on stderr */
+static void
+print_build_counters(void)
+{
+    int j, k;
+
+    fprintf(stderr, "%-18s", "phase");
+    for (k=0; k<PERF_NCOUNTERS; k++)
+	fprintf(stderr, " %14s", perfctr_counter_name(k));
+    fprintf(stderr, "\n");
+    for (j=PHASE_OCTREE_BUILD; j<=PHASE_OCTREE_CONES; j++) {
+	fprintf(stderr, "%-18s", perfctr_phase_name(j));
+	for (k=0; k<PERF_NCOUNTERS; k++)
+	    fprintf(stderr, " %14llu", perfctr_phases[j].count[k]);
+	fprintf(stderr, "\n");
+    }
+    if (perfctr_phases[PHASE_OCTREE_ASSOCIATE].spans <
+	perfctr_phases[PHASE_OCTREE_BUILD].spans)
+	fprintf(stderr, "(pipelined: %s includes associating the vertices "
+		"and\n finding the activators of all but the triangles across "
+		"the root)\n", perfctr_phase_name(PHASE_OCTREE_BUILD));
+}
+
+/* one row of sizes, load and build times and mean frame costs, for
+ * comparing scenes against each other */
+static void
+print_summary(FILE *fp, int json, const scene *sc, int nframes,
+	      double update, double extract, double rendered)
+{
+    unsigned long long nv = 0, nt = 0;
+    double load = 0, build = 0;
+    int j, nodes = 0, depth = 0, d;
+
+    for (j=0; j<sc->nmodels; j++) {
+	nv += sc->models[j].mesh->nv;
+	nt += sc->models[j].mesh->nt;
+	nodes += sc->models[j].tree->nnodes;
+	load += sc->models[j].load_time;
+	build += sc->models[j].build_time;
+	d = octree_depth(sc->models[j].tree->root);
+	if (depth < d)
+	    depth = d;
+    }
+    if (sc->paged) {
+	nv += sc->paged->nv;
+	nt += sc->paged->nt;
+	nodes += sc->paged->nnodes;
+	if (depth < sc->paged->depth)
+	    depth = sc->paged->depth;
+    }
+    update /= nframes;
+    extract /= nframes;
+    rendered /= nframes;
+    if (json)
+	fprintf(fp, "{\"triangles\": %llu, \"vertices\": %llu, "
+		"\"nodes\": %d, \"depth\": %d, \"load_s\": %.4f, "
+		"\"build_s\": %.4f, \"frames\": %d, \"update_ms\": %.4f, "
+		"\"extract_ms\": %.4f, \"rendered\": %.0f, "
+		"\"mtris_per_s\": %.2f}\n", nt, nv, nodes, depth, load, build,
+		nframes, update*1e3, extract*1e3, rendered,
+		rendered / (update + extract) * 1e-6);
+    else
+	fprintf(fp, "triangles,vertices,nodes,depth,load_s,build_s,frames,"
+		"update_ms,extract_ms,rendered,mtris_per_s\n"
+		"%llu,%llu,%d,%d,%.4f,%.4f,%d,%.4f,%.4f,%.0f,%.2f\n",
+		nt, nv, nodes, depth, load, build, nframes, update*1e3,
+		extract*1e3, rendered, rendered / (update + extract) * 1e-6);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out = NULL, *trace = NULL;
+    int json = 0, nframes = 360, width = 1280, height = 960;
+    int c, j, reseed_mode = RESEED_HYBRID;
+    real dist = 3.0, detail = -1, silhouette = -1;
+    int budget = 0, caching = 1, instancing = 1, counters = 0, summary = 0;
+    int wait = 0;
+    int stdout_fd;
+    camera *path;
+    scene *sc;
+    view_params vp;
+    frame_stats fs;
+    double update = 0, extract = 0, rendered = 0, t;
+    FILE *fp = stdout;
+
+    while ((c = getopt(argc, argv, "f:o:n:d:W:H:D:S:r:b:ciT:Psw")) != -1) {
+	switch (c) {
+	    case 'f':
+		if (strcmp(optarg, "json") == 0) json = 1;
+		else if (strcmp(optarg, "csv") == 0) json = 0;
+		else usage(argv[0]);
+		break;
+	    case 'o': out = optarg; break;
+	    case 'n': nframes = atoi(optarg); break;
+	    case 'd': dist = atof(optarg); break;
+	    case 'W': width = atoi(optarg); break;
+	    case 'H': height = atoi(optarg); break;
+	    case 'D': detail = atof(optarg); break;
+	    case 'S': silhouette = atof(optarg); break;
+	    case 'r':
+		if (strcmp(optarg, "incremental") == 0)
+		    reseed_mode = RESEED_NEVER;
+		else if (strcmp(optarg, "hybrid") == 0)
+		    reseed_mode = RESEED_HYBRID;
+		else if (strcmp(optarg, "top-down") == 0)
+		    reseed_mode = RESEED_ALWAYS;
+		else
+		    usage(argv[0]);
+		break;
+	    case 'b': budget = atoi(optarg); break;
+	    case 'c': caching = 0; break;
+	    case 'i': instancing = 0; break;
+	    case 'T': trace = optarg; break;
+	    case 'P': counters = 1; break;
+	    case 's': summary = 1; break;
+	    case 'w': wait = 1; break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-1 && optind != argc-2)
+	usage(argv[0]);
+    if (nframes < 1 || width < 1 || height < 1)
+	usage(argv[0]);
+
+    if (optind == argc-2) {
+	if ((path = campath_load(argv[optind+1], &nframes)) == NULL)
+	    exit(1);
+    } else {
+	path = campath_orbit(nframes, dist);
+    }
+
+    /* before loading, so the octree builds are counted too */
+    if (counters && !perfctr_enable()) {
+	fprintf(stderr, "warning: hardware counters unavailable\n");
+	counters = 0;
+    }
+
+    /* loading reports progress on stdout, keep that for the results */
+    fflush(stdout);
+    stdout_fd = dup(1);
+    dup2(2, 1);
+    t = get_timer();
+    sc = scene_load(argv[optind]);
+    t = get_timer() - t;
+    fflush(stdout);
+    dup2(stdout_fd, 1);
+    close(stdout_fd);
+    if (sc == NULL) {
+	fprintf(stderr, "error loading scene\n");
+	exit(1);
+    }
+    fprintf(stderr, "Loaded %d mesh(es) [%gs]\n",
+	    sc->nobjects + (sc->paged != NULL), t);
+    if (counters)
+	print_build_counters();
+    scene_fit(sc);
+
+    /* thresholds are given in pixels, like the viewer shows them */
+    if (detail > 0)
+	sc->detail_threshold = detail / (width * height);
+    if (silhouette > 0)
+	sc->silhouette_threshold = silhouette / (width * height);
+    sc->reseed_mode = reseed_mode;
+    sc->front_caching = caching;
+    sc->instancing = instancing;
+    if (budget > 0)
+	sc->budget = budget;
+
+    if (out && (fp = fopen(out, "w")) == NULL) {
+	perror(out);
+	exit(1);
+    }
+    if (!json && !summary)
+	print_header(fp, sc->paged != NULL, counters);
+
+#ifndef LOD_TRACE
+    if (trace)
+	fprintf(stderr, "warning: built without tracing, %s will be "
+		"empty\n", trace);
+#endif
+
+    for (j=0; j<nframes; j++) {
+	campath_view(&path[j], (real)width / (real)height, &vp);
+	run_frame(sc, &vp, &fs);
+	if (!summary)
+	    print_frame(fp, json, sc->paged != NULL, counters, j, &fs);
+	/* as if pages loaded between frames, for repeatable runs */
+	if (wait && sc->paged)
+	    paged_wait(sc->paged);
+	update += fs.update;
+	extract += fs.extract;
+	rendered += fs.rendered;
+    }
+    if (summary)
+	print_summary(fp, json, sc, nframes, update, extract, rendered);
+    else if (json)
+	fprintf(fp, "\n]\n");
+    if (fp != stdout)
+	fclose(fp);
+
+    fprintf(stderr, "%d frames: update %.4fms extract %.4fms per frame "
+	    "(%d rebuilds, %d restores)\n", nframes, update*1e3/nframes,
+	    extract*1e3/nframes, sc->num_reseeds, sc->num_restores);
+
+    if (trace && !trace_dump(trace))
+	exit(1);
+
+    scene_free(sc);
+    free(path);
+    return 0;
+}
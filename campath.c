@@ -0,0 +1,83 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "campath.h"
+#include "vec3.h"
+#include "view_params.h"
+
+camera *
+campath_load(const char *file, int *nframes)
+{
+    camera *path = NULL, *c;
+    char buf[1024];
+    int n = 0, max = 0, k, lineno = 0;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+	perror(file);
+	return NULL;
+    }
+    while (fgets(buf, sizeof(buf), fp)) {
+	lineno++;
+	buf[strcspn(buf, "#\r\n")] = '\0';
+	if (strspn(buf, " \t") == strlen(buf))
+	    continue;
+	if (n == max) {
+	    max = max ? 2*max : 256;
+	    path = realloc(path, sizeof(*path)*max);
+	}
+	c = &path[n];
+	c->fovy = 45.0;
+	c->detail = c->silhouette = -1;
+	k = sscanf(buf, "%f %f %f %f %f %f %f %f %f %f %f %f",
+		   &c->eye[0], &c->eye[1], &c->eye[2],
+		   &c->gaze[0], &c->gaze[1], &c->gaze[2],
+		   &c->up[0], &c->up[1], &c->up[2], &c->fovy,
+		   &c->detail, &c->silhouette);
+	if (k < 9) {
+	    fprintf(stderr, "%s:%d: expected eye, gaze and up vectors "
+		    "[and fovy and thresholds]\n", file, lineno);
+	    free(path);
+	    fclose(fp);
+	    return NULL;
+	}
+	n++;
+    }
+    fclose(fp);
+    if (n == 0) {
+	fprintf(stderr, "%s: empty camera path\n", file);
+	free(path);
+	return NULL;
+    }
+    *nframes = n;
+    return path;
+}
+
+camera *
+campath_orbit(int nframes, real dist)
+{
+    camera *path = malloc(sizeof(*path)*nframes);
+    real theta;
+    int j;
+
+    for (j=0; j<nframes; j++) {
+	theta = 2*M_PI * j / nframes;
+	path[j].eye[0] = dist * cos(theta);
+	path[j].eye[1] = 0;
+	path[j].eye[2] = dist * sin(theta);
+	VecScale(path[j].gaze, path[j].eye, -1);
+	path[j].up[0] = path[j].up[2] = 0;
+	path[j].up[1] = 1;
+	path[j].fovy = 45.0;
+	path[j].detail = path[j].silhouette = -1;
+    }
+    return path;
+}
+
+void
+campath_view(const camera *c, real aspect, view_params *vp)
+{
+    view_setup(vp, c->eye, c->gaze, c->up, c->fovy, aspect, .01, 100.0);
+}
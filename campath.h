@@ -0,0 +1,29 @@
+#ifndef _CAMPATH_H_
+#define _CAMPATH_H_
+
+#include "vec3.h"
+#include "view_params.h"
+
+/* one frame of a camera path */
+typedef struct {
+    vec3    eye, gaze, up;
+    real    fovy;			/* degrees			    */
+    real    detail, silhouette;		/* thresholds in pixels, or -1	    */
+} camera;
+
+/* Read a camera path, one frame per line,
+ *
+ *	eye_x eye_y eye_z gaze_x gaze_y gaze_z up_x up_y up_z
+ *		[fovy [detail [silhouette]]]
+ *
+ * with #-comments. The thresholds are for tools that take them per view,
+ * such as lod-export. Returns NULL (having said why) on error. */
+camera *campath_load(const char *file, int *nframes);
+
+/* the viewer's default camera, going once around the origin */
+camera *campath_orbit(int nframes, real dist);
+
+/* view of camera c, as the viewer sets it up for this aspect ratio */
+void	campath_view(const camera *c, real aspect, view_params *vp);
+
+#endif // !_CAMPATH_H_
@@ -0,0 +1,485 @@
+/* Golden-output check of the LOD fast paths: replays a camera path over
+ * meshes with the plain incremental front update as the reference, and
+ * compares the front and the extracted triangles of every alternative
+ * against it frame by frame, reporting the first divergence of each. */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "campath.h"
+#include "lod.h"
+#include "octree.h"
+#include "scene.h"
+#include "vec3.h"
+#include "view_params.h"
+
+enum {
+    VARIANT_HYBRID,			/* hybrid incremental/top-down	    */
+    VARIANT_TOPDOWN,			/* parallel top-down every frame    */
+    VARIANT_CACHE,			/* fronts restored from the cache,
+					 * on detours back along the path   */
+    VARIANT_MULTIVIEW,			/* one pass for the view, twice	    */
+    VARIANT_BUDGET,			/* scene_update() under a budget
+					 * too large to be reached	    */
+    VARIANT_FLIP,			/* scene_flip() twice, node by node */
+    NVARIANTS
+};
+
+static const char *const variant_names[NVARIANTS] = {
+    "hybrid", "top-down", "cache", "multiview", "budget", "flip"
+};
+
+/* Before each frame, the cache variant goes back to the camera this many
+ * frames earlier, turned aside by DETOUR_TURN degrees: near enough a pose
+ * it has been at for its front there to be restored and refined, checked
+ * against a reference following the detours. */
+#define DETOUR_BACK	8
+#define DETOUR_TURN	2.0
+
+static const char *const status_names[] = {
+    "active", "inactive", "boundary"
+};
+
+/* a front and its triangles, in a canonical order */
+typedef struct {
+    int	       *nodes;			/* ids of the boundary nodes	    */
+    int		nnodes;
+    int	      (*tris)[3];		/* lowest index first, same winding */
+    int		ntris;
+} lod_output;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file | synth:<kind>:<triangles>> ...\n"
+	"  -p file       camera path (see lod-bench), else an orbit\n"
+	"  -n frames     frames of the default orbit (360)\n"
+	"  -d distance   distance of the default orbit (3)\n"
+	"  -W width, -H height   viewport aspect (1280x960)\n"
+	"  -D detail, -S silhouette   thresholds, in pixels\n"
+	"  -v variants   comma-separated, of hybrid, top-down, cache,\n"
+	"                multiview, budget and flip (all)\n"
+	"The reference is the incremental front update without caching. Exits\n"
+	"with status 1 if any variant diverges from it, if the cache one\n"
+	"never restores a front (the path must be longer than %d frames), or\n"
+	"if flipping the mesh twice does not give back every node as it was.\n",
+	prog, DETOUR_BACK);
+    exit(1);
+}
+
+static int
+parse_variants(char *list)
+{
+    char *name;
+    int mask = 0, v;
+
+    for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+	for (v=0; v<NVARIANTS; v++)
+	    if (strcmp(name, variant_names[v]) == 0)
+		break;
+	if (v == NVARIANTS)
+	    return 0;
+	mask |= 1 << v;
+    }
+    return mask;
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+cmp_tri(const void *a, const void *b)
+{
+    const int *s = a, *t = b;
+    int k;
+
+    for (k=0; k<3; k++)
+	if (s[k] != t[k])
+	    return s[k] < t[k] ? -1 : 1;
+    return 0;
+}
+
+/* The front of ctx and the triangles of its last lod_extract(). The
+ * incremental update leaves entries for nodes collapsed into an ancestor
+ * further down the list for the next update to drop, so only the entries
+ * still on the boundary count. */
+static void
+get_output(const lod_context *ctx, lod_output *out)
+{
+    const active_node *a;
+    const int *t;
+    int j, k, r;
+
+    out->nnodes = 0;
+    for (a = ctx->active_list; a; a = a->next)
+	out->nnodes++;
+    out->nodes = realloc(out->nodes, sizeof(*out->nodes)*(out->nnodes+1));
+    for (a = ctx->active_list, j = 0; a; a = a->next)
+	if (ctx->status[a->node->id] == STATUS_BOUNDARY)
+	    out->nodes[j++] = a->node->id;
+    out->nnodes = j;
+    qsort(out->nodes, out->nnodes, sizeof(*out->nodes), cmp_int);
+
+    out->ntris = ctx->nindices / 3;
+    out->tris = realloc(out->tris, sizeof(*out->tris)*(out->ntris+1));
+    for (j=0; j<out->ntris; j++) {
+	t = &ctx->tri_index[3*j];
+	r = t[1] < t[0] ? (t[2] < t[1] ? 2 : 1) : (t[2] < t[0] ? 2 : 0);
+	for (k=0; k<3; k++)
+	    out->tris[j][k] = t[(r+k) % 3];
+    }
+    qsort(out->tris, out->ntris, sizeof(*out->tris), cmp_tri);
+}
+
+static void
+print_node(const octree_node *n, const lod_context *ref,
+	   const lod_context *alt, const view_params *vp)
+{
+    const octree_node *p;
+    real r;
+    vec3 c;
+
+    printf("    node %d: depth %d, %s, %d triangle(s) activated, "
+	   "parent %d\n", n->id, n->depth, n->leaf ? "leaf" : "interior",
+	   n->activated ? n->activated[0] : 0,
+	   n->parent ? n->parent->id : -1);
+    printf("      box (%g %g %g) +- (%g %g %g)\n",
+	   n->bb_midpt[0], n->bb_midpt[1], n->bb_midpt[2],
+	   n->bb_extent[0], n->bb_extent[1], n->bb_extent[2]);
+    if (!n->leaf) {
+	NodeSphere(c, r, n);
+	printf("      sphere (%g %g %g) radius %g, priority %g "
+	       "(expanded at >= 1)\n", c[0], c[1], c[2], r,
+	       lod_priority(ref, n, vp));
+    }
+    printf("      reference: %s, variant: %s\n",
+	   status_names[ref->status[n->id]], status_names[alt->status[n->id]]);
+    for (p = n->parent; p; p = p->parent)
+	if (alt->status[p->id] == STATUS_BOUNDARY) {
+	    printf("      variant front has ancestor %d (depth %d, priority "
+		   "%g) instead\n", p->id, p->depth, lod_priority(ref, p, vp));
+	    break;
+	}
+}
+
+static void
+print_triangle(const char *where, const int t[3], const lod_context *ref,
+	       const lod_context *alt)
+{
+    int k;
+
+    printf("    triangle %d %d %d only in the %s\n", t[0], t[1], t[2], where);
+    for (k=0; k<3; k++)
+	printf("      vertex %d: reference proxy %d, variant proxy %d\n",
+	       t[k], ref->proxies[t[k]] ? ref->proxies[t[k]]->id : -1,
+	       alt->proxies[t[k]] ? alt->proxies[t[k]]->id : -1);
+}
+
+/* 1 if the outputs are the same, else print the first difference */
+static int
+compare(const lod_output *r, const lod_output *a,
+	const lod_context *ref, const lod_context *alt,
+	octree_node **nodes, const view_params *vp)
+{
+    int i, j, c = 0;
+
+    for (i = j = 0; i < r->nnodes || j < a->nnodes; i++, j++) {
+	if (i < r->nnodes && j < a->nnodes && r->nodes[i] == a->nodes[j])
+	    continue;
+	printf("  front differs (%d nodes in the reference, %d in the "
+	       "variant)\n", r->nnodes, a->nnodes);
+	if (j == a->nnodes || (i < r->nnodes && r->nodes[i] < a->nodes[j])) {
+	    printf("  first node only in the reference front:\n");
+	    print_node(nodes[r->nodes[i]], ref, alt, vp);
+	} else {
+	    printf("  first node only in the variant front:\n");
+	    print_node(nodes[a->nodes[j]], ref, alt, vp);
+	}
+	return 0;
+    }
+
+    for (i = j = 0; i < r->ntris || j < a->ntris; i++, j++) {
+	if (i < r->ntris && j < a->ntris &&
+	    (c = cmp_tri(r->tris[i], a->tris[j])) == 0)
+	    continue;
+	printf("  triangles differ (%d in the reference, %d in the "
+	       "variant)\n", r->ntris, a->ntris);
+	if (j == a->ntris || (i < r->ntris && c < 0))
+	    print_triangle("reference", r->tris[i], ref, alt);
+	else
+	    print_triangle("variant", a->tris[j], ref, alt);
+	return 0;
+    }
+    return 1;
+}
+
+static void
+number_nodes(octree_node *n, octree_node **nodes)
+{
+    int k;
+
+    nodes[n->id] = n;
+    for (k=0; k<8; k++)
+	if (n->subtree[k])
+	    number_nodes(n->subtree[k], nodes);
+}
+
+/* camera c, turned aside about its up vector */
+static camera
+detour(const camera *c)
+{
+    camera d = *c;
+    real a = DETOUR_TURN * DEG2RAD;
+    vec3 right;
+
+    VecCross(right, c->gaze, c->up);
+    VecNormalize(right);
+    VecScale(d.gaze, c->gaze, cos(a));
+    VecSAdd(d.gaze, d.gaze, right, sin(a));
+    return d;
+}
+
+static void
+setup(lod_context *ctx, const scene *sc, int reseed_mode, int caching)
+{
+    ctx->detail_threshold = sc->detail_threshold;
+    ctx->silhouette_threshold = sc->silhouette_threshold;
+    ctx->reseed_mode = reseed_mode;
+    ctx->front_caching = caching;
+}
+
+/* flip the scene twice: once, every node's normals must be the exact
+ * negations of what they were, and twice, the nodes as they were. returns
+ * the id of the first node that is not, or -1 */
+static int
+check_flip(scene *sc, octree_node **nodes)
+{
+    int nnodes = sc->models[0].tree->nnodes, j, bad = -1;
+    octree_node *saved = malloc(sizeof(*saved)*nnodes);	/* by id */
+    vec3 n0, n1;
+    real a0, a1;
+
+    for (j=0; j<nnodes; j++)
+	saved[j] = *nodes[j];
+    scene_flip(sc);
+    for (j=0; j<nnodes && bad < 0; j++) {
+	octree_cone(&saved[j], n0, &a0);
+	octree_cone(nodes[j], n1, &a1);
+	if (n1[0] != -n0[0] || n1[1] != -n0[1] || n1[2] != -n0[2] ||
+	    a1 != a0 || nodes[j]->rep_vnormal[0] != -saved[j].rep_vnormal[0] ||
+	    nodes[j]->rep_vnormal[1] != -saved[j].rep_vnormal[1] ||
+	    nodes[j]->rep_vnormal[2] != -saved[j].rep_vnormal[2])
+	    bad = j;
+    }
+    scene_flip(sc);
+    for (j=0; j<nnodes && bad < 0; j++)
+	if (nodes[j]->cone_normal != saved[j].cone_normal ||
+	    nodes[j]->cone_angle != saved[j].cone_angle ||
+	    nodes[j]->cone_flip != saved[j].cone_flip ||
+	    memcmp(nodes[j]->rep_vnormal, saved[j].rep_vnormal,
+		   sizeof(saved[j].rep_vnormal)) != 0)
+	    bad = j;
+    free(saved);
+    return bad;
+}
+
+/* check every variant in mask on one mesh; returns the diverged variants */
+static int
+check_mesh(const char *file, const camera *path, int nframes, real aspect,
+	   real detail, real silhouette, int mask)
+{
+    lod_context *ref, *back = NULL, *ctx[NVARIANTS] = { NULL }, *alt;
+    lod_output rout = { NULL }, aout = { NULL }, bout = { NULL };
+    view_params vp, views[2];
+    scene_object o;
+    camera cam;
+    octree_node **nodes;
+    int failed = 0, stdout_fd, j, v;
+    scene *sc;
+
+    /* loading reports progress on stdout, keep that for the results */
+    fflush(stdout);
+    stdout_fd = dup(1);
+    dup2(2, 1);
+    sc = scene_load(file);
+    fflush(stdout);
+    dup2(stdout_fd, 1);
+    close(stdout_fd);
+    if (sc == NULL)
+	return mask;
+    if (sc->nobjects != 1) {
+	fprintf(stderr, "%s: expected a single mesh\n", file);
+	scene_free(sc);
+	return mask;
+    }
+    scene_fit(sc);
+    if (detail > 0)
+	sc->detail_threshold = detail;
+    if (silhouette > 0)
+	sc->silhouette_threshold = silhouette;
+
+    nodes = malloc(sizeof(*nodes)*sc->models[0].tree->nnodes);
+    number_nodes(sc->models[0].tree->root, nodes);
+
+    ref = lod_create(sc->models[0].tree);
+    setup(ref, sc, RESEED_NEVER, 0);
+    for (v=0; v<NVARIANTS; v++)
+	if (v != VARIANT_BUDGET && v != VARIANT_FLIP && (mask & 1 << v)) {
+	    ctx[v] = lod_create(sc->models[0].tree);
+	    /* the cache is only looked in when the front is rebuilt */
+	    setup(ctx[v], sc, v == VARIANT_HYBRID ? RESEED_HYBRID :
+		  v == VARIANT_TOPDOWN || v == VARIANT_CACHE ? RESEED_ALWAYS :
+		  RESEED_NEVER, v == VARIANT_CACHE);
+	}
+    if (ctx[VARIANT_CACHE]) {
+	back = lod_create(sc->models[0].tree);
+	setup(back, sc, RESEED_NEVER, 0);
+    }
+    sc->reseed_mode = RESEED_NEVER;
+    sc->front_caching = 0;
+    sc->budget = INT_MAX / 2;
+
+    printf("%s: %u triangles, %d nodes\n", file, sc->models[0].mesh->nt,
+	   sc->models[0].tree->nnodes);
+    /* first, so that the frames run on the tree as flipped back */
+    if ((mask & 1 << VARIANT_FLIP) &&
+	(j = check_flip(sc, nodes)) >= 0) {
+	printf("%s: flip does not give back node %d\n", file, j);
+	failed |= 1 << VARIANT_FLIP;
+    }
+    for (j=0; j<nframes && (mask & ~failed); j++) {
+	campath_view(&path[j], aspect, &vp);
+	scene_object_view(&sc->objects[0], &vp);
+	views[0] = views[1] = sc->objects[0].view;
+
+	lod_update(ref, &views[0]);
+	lod_extract(ref);
+	get_output(ref, &rout);
+
+	for (v=0; v<NVARIANTS; v++) {
+	    if (!(mask & ~failed & 1 << v) || v == VARIANT_FLIP)
+		continue;
+	    if (v == VARIANT_CACHE && j >= DETOUR_BACK) {
+		cam = detour(&path[j - DETOUR_BACK]);
+		campath_view(&cam, aspect, &vp);
+		o = sc->objects[0];
+		scene_object_view(&o, &vp);
+		lod_update(back, &o.view);
+		lod_extract(back);
+		get_output(back, &bout);
+		lod_update(ctx[v], &o.view);
+		lod_extract(ctx[v]);
+		get_output(ctx[v], &aout);
+		if (!compare(&bout, &aout, back, ctx[v], nodes, &o.view)) {
+		    printf("%s: cache diverges going back from frame %d to "
+			   "%d\n", file, j, j - DETOUR_BACK);
+		    failed |= 1 << v;
+		    continue;
+		}
+		campath_view(&path[j], aspect, &vp);
+	    }
+	    if (v == VARIANT_BUDGET) {
+		scene_update(sc, &vp);
+		alt = sc->buckets[0].lod;
+	    } else {
+		alt = ctx[v];
+		if (v == VARIANT_MULTIVIEW)
+		    lod_update_views(alt, views, 2);
+		else
+		    lod_update(alt, &views[0]);
+	    }
+	    lod_extract(alt);
+	    get_output(alt, &aout);
+	    if (!compare(&rout, &aout, ref, alt, nodes, &views[0])) {
+		printf("%s: %s diverges at frame %d (eye %g %g %g)\n",
+		       file, variant_names[v], j,
+		       path[j].eye[0], path[j].eye[1], path[j].eye[2]);
+		failed |= 1 << v;
+	    }
+	}
+    }
+    if ((mask & ~failed & 1 << VARIANT_CACHE) &&
+	ctx[VARIANT_CACHE]->num_restores == 0) {
+	printf("%s: cache restored no fronts\n", file);
+	failed |= 1 << VARIANT_CACHE;
+    }
+    for (v=0; v<NVARIANTS; v++)
+	if (v == VARIANT_FLIP && (mask & ~failed & 1 << v))
+	    printf("%s: flip twice gives back all %d nodes\n", file,
+		   sc->models[0].tree->nnodes);
+	else if (mask & ~failed & 1 << v)
+	    printf("%s: %s matches for %d frames%s\n", file,
+		   variant_names[v], nframes,
+		   v == VARIANT_CACHE ? " and detours" : "");
+
+    for (v=0; v<NVARIANTS; v++)
+	if (ctx[v])
+	    lod_free(ctx[v]);
+    lod_free(ref);
+    if (back)
+	lod_free(back);
+    free(rout.nodes); free(rout.tris);
+    free(bout.nodes); free(bout.tris);
+    free(aout.nodes); free(aout.tris);
+    free(nodes);
+    scene_free(sc);
+    return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path_file = NULL;
+    int nframes = 360, width = 1280, height = 960;
+    int c, j, mask = (1 << NVARIANTS) - 1, failed = 0;
+    real dist = 3.0, detail = -1, silhouette = -1;
+    camera *path;
+
+    while ((c = getopt(argc, argv, "p:n:d:W:H:D:S:v:")) != -1) {
+	switch (c) {
+	    case 'p': path_file = optarg; break;
+	    case 'n': nframes = atoi(optarg); break;
+	    case 'd': dist = atof(optarg); break;
+	    case 'W': width = atoi(optarg); break;
+	    case 'H': height = atoi(optarg); break;
+	    case 'D': detail = atof(optarg); break;
+	    case 'S': silhouette = atof(optarg); break;
+	    case 'v':
+		if ((mask = parse_variants(optarg)) == 0)
+		    usage(argv[0]);
+		break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind == argc || nframes < 1 || width < 1 || height < 1)
+	usage(argv[0]);
+
+    if (path_file) {
+	if ((path = campath_load(path_file, &nframes)) == NULL)
+	    exit(1);
+    } else {
+	path = campath_orbit(nframes, dist);
+    }
+
+    /* thresholds are given in pixels, like the viewer shows them */
+    if (detail > 0)
+	detail /= width * height;
+    if (silhouette > 0)
+	silhouette /= width * height;
+
+    for (j=optind; j<argc; j++)
+	failed |= check_mesh(argv[j], path, nframes,
+			     (real)width / (real)height, detail, silhouette,
+			     mask);
+    free(path);
+    return failed ? 1 : 0;
+}
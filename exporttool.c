@@ -0,0 +1,245 @@
+/* Exports the view-dependent LOD of a mesh for many viewpoints at once:
+ * loads the mesh and builds its octree once, then, for each camera of a
+ * path, selects the front for that view and writes its simplified
+ * triangles as a binary PLY file, with only the vertices they use,
+ * renumbered in the order they are first used. The views are spread over
+ * parallel_threads() workers, each with a lod_context of its own; every
+ * front is built from the root, so a view's file does not depend on which
+ * worker took it, or on the views before it. */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "campath.h"
+#include "lod.h"
+#include "mesh.h"
+#include "parallel.h"
+#include "ply.h"
+#include "scene.h"
+#include "timer.h"
+#include "vec3.h"
+#include "view_params.h"
+
+typedef struct {
+    const scene	 *sc;
+    const camera *path;
+    int		  nviews;
+    real	  aspect;
+    real	  pixels;		/* width times height		    */
+    const char	 *pattern;
+    size_t	  name_size;		/* of the longest file name	    */
+    atomic_int	  next;			/* next view to export		    */
+    atomic_int	  failed;
+
+    /* per view */
+    int		 *ntris, *nverts;
+} export_job;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file | synth:<kind>:<triangles>> "
+	"<camera path> <output>\n"
+	"  -W width, -H height   viewport aspect (1280x960)\n"
+	"  -D detail, -S silhouette   thresholds, in pixels\n"
+	"The output is a file name with one %%d, say views/%%05d.ply, for the\n"
+	"number of the camera (from 0). A camera path has one camera per line,\n"
+	"  eye_x eye_y eye_z gaze_x gaze_y gaze_z up_x up_y up_z\n"
+	"    [fovy [detail [silhouette]]]\n"
+	"in the coordinates of the mesh fitted to [-1,1]^3, with thresholds in\n"
+	"pixels for that camera, in place of -D and -S; the files are in the\n"
+	"coordinates of the mesh. LOD_THREADS sets the number of workers.\n",
+	prog);
+    exit(1);
+}
+
+/* 1 if s has just the one conversion, a %d with an optional width */
+static int
+valid_pattern(const char *s)
+{
+    const char *p = strchr(s, '%');
+
+    if (p == NULL)
+	return 0;
+    for (p++; *p >= '0' && *p <= '9'; p++)
+	;
+    return *p == 'd' && strchr(p, '%') == NULL;
+}
+
+/* expand every node that view vp needs expanded, as a top-down
+ * lod_update() would, without its threads: the workers are already one
+ * per processor */
+static void
+refine(lod_context *ctx, const octree_node *n, const view_params *vp)
+{
+    int k;
+
+    if (lod_priority(ctx, n, vp) < 1)
+	return;
+    lod_expand(ctx, n);
+    for (k=0; k<8; k++)
+	if (n->subtree[k])
+	    refine(ctx, n->subtree[k], vp);
+}
+
+static void
+export_task(void *arg, int unused)
+{
+    export_job *job = arg;
+    const octree *tree = job->sc->models[0].tree;
+    const mesh *m = tree->mesh;
+    scene_object o = job->sc->objects[0];
+    lod_context *ctx = lod_create(tree);
+    int *remap = malloc(sizeof(*remap)*m->nv);
+    vec3 *verts = malloc(sizeof(*verts)*m->nv);
+    vec3 *normals = malloc(sizeof(*normals)*m->nv);
+    index3u *tris = malloc(sizeof(*tris)*m->nt);
+    char *file = malloc(job->name_size);
+    view_params vp;
+    unsigned j, nv;
+    int i, k, v;
+
+    (void)unused;
+    if (!ctx || !remap || !verts || !normals || !tris || !file) {
+	fprintf(stderr, "out of memory\n");
+	atomic_store(&job->failed, 1);
+	goto done;
+    }
+    memset(remap, -1, sizeof(*remap)*m->nv);
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->nviews &&
+	   !atomic_load(&job->failed)) {
+	const camera *c = &job->path[i];
+
+	ctx->detail_threshold = c->detail > 0 ? c->detail / job->pixels :
+	    job->sc->detail_threshold;
+	ctx->silhouette_threshold = c->silhouette > 0 ?
+	    c->silhouette / job->pixels : job->sc->silhouette_threshold;
+	campath_view(c, job->aspect, &vp);
+	scene_object_view(&o, &vp);
+	lod_begin_front(ctx);
+	refine(ctx, tree->root, &o.view);
+	lod_end_front(ctx, &o.view);
+	lod_extract(ctx);
+
+	nv = 0;
+	for (j=0; j<(unsigned)ctx->nindices/3; j++)
+	    for (k=0; k<3; k++) {
+		v = ctx->tri_index[3*j + k];
+		if (remap[v] < 0) {
+		    MeshVertex(verts[nv], m, v);
+		    MeshNormal(normals[nv], m, v);
+		    remap[v] = nv++;
+		}
+		tris[j][k] = remap[v];
+	    }
+	/* ready for the next view, touching only what this one used */
+	for (j=0; j<(unsigned)ctx->nindices; j++)
+	    remap[ctx->tri_index[j]] = -1;
+
+	snprintf(file, job->name_size, job->pattern, i);
+	if (!ply_write(file, nv, verts, normals, ctx->nindices/3, tris)) {
+	    atomic_store(&job->failed, 1);
+	    break;
+	}
+	job->ntris[i] = ctx->nindices/3;
+	job->nverts[i] = nv;
+    }
+
+done:
+    if (ctx)
+	lod_free(ctx);
+    free(remap);
+    free(verts);
+    free(normals);
+    free(tris);
+    free(file);
+}
+
+int
+main(int argc, char **argv)
+{
+    int width = 1280, height = 960;
+    int c, j, n, nworkers;
+    real detail = -1, silhouette = -1;
+    double t, ntris = 0, nverts = 0;
+    export_job job;
+    camera *path;
+    scene *sc;
+
+    while ((c = getopt(argc, argv, "W:H:D:S:")) != -1) {
+	switch (c) {
+	    case 'W': width = atoi(optarg); break;
+	    case 'H': height = atoi(optarg); break;
+	    case 'D': detail = atof(optarg); break;
+	    case 'S': silhouette = atof(optarg); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-3 || width < 1 || height < 1)
+	usage(argv[0]);
+    if (!valid_pattern(argv[optind+2])) {
+	fprintf(stderr, "%s: expected one %%d for the camera number\n",
+		argv[optind+2]);
+	exit(1);
+    }
+
+    memset(&job, 0, sizeof(job));
+    if ((path = campath_load(argv[optind+1], &job.nviews)) == NULL)
+	exit(1);
+    if ((sc = scene_load(argv[optind])) == NULL)
+	exit(1);
+    if (sc->nobjects != 1) {
+	fprintf(stderr, "%s: expected a single mesh\n", argv[optind]);
+	exit(1);
+    }
+    scene_fit(sc);
+    /* thresholds are given in pixels, like the viewer shows them */
+    if (detail > 0)
+	sc->detail_threshold = detail / (width * height);
+    if (silhouette > 0)
+	sc->silhouette_threshold = silhouette / (width * height);
+
+    job.sc = sc;
+    job.path = path;
+    job.aspect = (real)width / (real)height;
+    job.pixels = (real)width * height;
+    job.pattern = argv[optind+2];
+    /* the width of the %d may be anything, and the last number is the
+     * longest */
+    if ((n = snprintf(NULL, 0, job.pattern, job.nviews-1)) < 0) {
+	fprintf(stderr, "%s: file names too long\n", job.pattern);
+	exit(1);
+    }
+    job.name_size = n + 1;
+    job.ntris = calloc(job.nviews, sizeof(*job.ntris));
+    job.nverts = calloc(job.nviews, sizeof(*job.nverts));
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    nworkers = parallel_threads() < job.nviews ? parallel_threads() :
+						 job.nviews;
+
+    t = get_timer();
+    parallel_for(nworkers, export_task, &job);
+    t = get_timer() - t;
+    if (atomic_load(&job.failed))
+	exit(1);
+
+    for (j=0; j<job.nviews; j++) {
+	ntris += job.ntris[j];
+	nverts += job.nverts[j];
+    }
+    printf("Exported %d views on %d thread(s): %.0f triangles and %.0f "
+	   "vertices per view [%gs, %.2fms per view]\n", job.nviews, nworkers,
+	   ntris / job.nviews, nverts / job.nviews, t, t*1e3 / job.nviews);
+
+    free(job.ntris);
+    free(job.nverts);
+    free(path);
+    scene_free(sc);
+    return 0;
+}
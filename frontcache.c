@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "frontcache.h"
+
+#define FRONTCACHE_MAGIC	0x46444f4c	/* "LODF" */
+
+typedef struct fc_entry fc_entry;
+struct fc_entry {
+    int		 key[6];		/* quantized eye and gaze	    */
+    unsigned	 tag;
+    vec3	 eye;			/* exact pose the front is for	    */
+    vec3	 gaze;
+    size_t	 size;
+    unsigned char *data;		/* encoded front		    */
+    fc_entry	*prev, *next;		/* LRU order, most recent first	    */
+};
+
+struct frontcache {
+    int		 capacity;
+    int		 count;
+    real	 cell;
+    real	 angle;
+    char	*spill_dir;
+    fc_entry	*head, *tail;
+};
+
+frontcache *
+frontcache_create(int capacity, real cell, real angle, const char *spill_dir)
+{
+    frontcache *fc = malloc(sizeof(*fc));
+
+    if (fc == NULL)
+	return NULL;
+    fc->capacity = capacity < 1 ? 1 : capacity;
+    fc->count = 0;
+    fc->cell = cell;
+    fc->angle = angle;
+    fc->spill_dir = spill_dir ? strdup(spill_dir) : NULL;
+    fc->head = fc->tail = NULL;
+    return fc;
+}
+
+static void
+entry_free(fc_entry *e)
+{
+    free(e->data);
+    free(e);
+}
+
+void
+frontcache_free(frontcache *fc)
+{
+    fc_entry *e, *next;
+
+    if (fc) {
+	for (e = fc->head; e; e = next) {
+	    next = e->next;
+	    entry_free(e);
+	}
+	free(fc->spill_dir);
+	free(fc);
+    }
+}
+
+static void
+quantize(const frontcache *fc, const vec3 eye, const vec3 gaze, int key[6])
+{
+    /* unit gaze vectors are bucketed on a grid whose spacing is about the
+     * angle step */
+    real g = 1.0 / fc->angle;
+    int j;
+
+    for (j=0; j<3; j++) {
+	key[j] = (int)floor(eye[j] / fc->cell);
+	key[3+j] = (int)floor(gaze[j] * g + 0.5);
+    }
+}
+
+static void
+unlink_entry(frontcache *fc, fc_entry *e)
+{
+    if (e->prev) e->prev->next = e->next; else fc->head = e->next;
+    if (e->next) e->next->prev = e->prev; else fc->tail = e->prev;
+    fc->count--;
+}
+
+static void
+push_front(frontcache *fc, fc_entry *e)
+{
+    e->prev = NULL;
+    e->next = fc->head;
+    if (fc->head) fc->head->prev = e; else fc->tail = e;
+    fc->head = e;
+    fc->count++;
+}
+
+static void
+spill_name(const frontcache *fc, unsigned tag, const int key[6],
+	   char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/front-%08x-%d_%d_%d-%d_%d_%d.bin",
+	     fc->spill_dir, tag, key[0], key[1], key[2], key[3], key[4], key[5]);
+}
+
+/* other caches, in this process or others, may be reading or writing the
+ * same file, so it is written aside and renamed into place whole */
+static void
+spill(const frontcache *fc, const fc_entry *e)
+{
+    char name[1024], tmp[1040];
+    unsigned hdr[2] = { FRONTCACHE_MAGIC, e->tag };
+    FILE *fp = NULL;
+    int fd, ok;
+
+    spill_name(fc, e->tag, e->key, name, sizeof(name));
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+    if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+	fprintf(stderr, "warning: cannot spill front to %s\n", name);
+	if (fd >= 0) {
+	    close(fd);
+	    unlink(tmp);
+	}
+	return;
+    }
+    ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+	 fwrite(e->eye, sizeof(e->eye), 1, fp) == 1 &&
+	 fwrite(e->gaze, sizeof(e->gaze), 1, fp) == 1 &&
+	 fwrite(&e->size, sizeof(e->size), 1, fp) == 1 &&
+	 fwrite(e->data, 1, e->size, fp) == e->size;
+    if (fclose(fp) != 0 || !ok || rename(tmp, name) != 0) {
+	fprintf(stderr, "warning: error writing %s\n", name);
+	unlink(tmp);
+    }
+}
+
+static fc_entry *
+unspill(const frontcache *fc, unsigned tag, const int key[6])
+{
+    char name[1024];
+    unsigned hdr[2];
+    fc_entry *e;
+    FILE *fp;
+
+    spill_name(fc, tag, key, name, sizeof(name));
+    if ((fp = fopen(name, "rb")) == NULL)
+	return NULL;
+
+    e = malloc(sizeof(*e));
+    e->data = NULL;
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+	hdr[0] != FRONTCACHE_MAGIC || hdr[1] != tag ||
+	fread(e->eye, sizeof(e->eye), 1, fp) != 1 ||
+	fread(e->gaze, sizeof(e->gaze), 1, fp) != 1 ||
+	fread(&e->size, sizeof(e->size), 1, fp) != 1 ||
+	(e->data = malloc(e->size)) == NULL ||
+	fread(e->data, 1, e->size, fp) != e->size) {
+	fprintf(stderr, "warning: ignoring bad front cache file %s\n", name);
+	fclose(fp);
+	entry_free(e);
+	return NULL;
+    }
+    fclose(fp);
+    memcpy(e->key, key, sizeof(e->key));
+    e->tag = tag;
+    return e;
+}
+
+static void
+insert(frontcache *fc, fc_entry *e)
+{
+    fc_entry *old;
+
+    push_front(fc, e);
+    while (fc->count > fc->capacity) {
+	old = fc->tail;
+	unlink_entry(fc, old);
+	if (fc->spill_dir)
+	    spill(fc, old);
+	entry_free(old);
+    }
+}
+
+void
+frontcache_store(frontcache *fc, unsigned tag, const view_params *vp,
+		 const unsigned char *data, size_t size)
+{
+    fc_entry *e;
+    int key[6];
+
+    quantize(fc, vp->eye, vp->gaze, key);
+
+    /* one front per cell; the newer one replaces the old */
+    for (e = fc->head; e; e = e->next)
+	if (e->tag == tag && !memcmp(e->key, key, sizeof(key))) {
+	    unlink_entry(fc, e);
+	    entry_free(e);
+	    break;
+	}
+
+    e = malloc(sizeof(*e));
+    memcpy(e->key, key, sizeof(key));
+    e->tag = tag;
+    VecSet(e->eye, vp->eye);
+    VecSet(e->gaze, vp->gaze);
+    e->size = size;
+    e->data = malloc(size);
+    memcpy(e->data, data, size);
+    insert(fc, e);
+}
+
+const unsigned char *
+frontcache_lookup(frontcache *fc, unsigned tag, const view_params *vp,
+		  size_t *size)
+{
+    fc_entry *e, *best = NULL;
+    real d, best_d = 2.0;
+    real cos_angle = cos(fc->angle);
+    vec3 t;
+    int key[6];
+
+    /* distance in units of a cell, plus the gaze difference in units of an
+     * angle step; anything more than one unit away on either is not near */
+    for (e = fc->head; e; e = e->next) {
+	if (e->tag != tag)
+	    continue;
+	VecSub(t, e->eye, vp->eye);
+	d = VecDot(t, t);
+	if (d > fc->cell*fc->cell || VecDot(e->gaze, vp->gaze) < cos_angle)
+	    continue;
+	d = sqrt(d) / fc->cell +
+	    acos(fmin(1.0, VecDot(e->gaze, vp->gaze))) / fc->angle;
+	if (d < best_d) {
+	    best_d = d;
+	    best = e;
+	}
+    }
+
+    if (best == NULL && fc->spill_dir) {
+	quantize(fc, vp->eye, vp->gaze, key);
+	if ((best = unspill(fc, tag, key)) != NULL)
+	    insert(fc, best);
+    }
+    if (best == NULL)
+	return NULL;
+
+    /* move to front of LRU list */
+    unlink_entry(fc, best);
+    push_front(fc, best);
+    *size = best->size;
+    return best->data;
+}
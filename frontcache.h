@@ -0,0 +1,32 @@
+#ifndef _FRONTCACHE_H_
+#define _FRONTCACHE_H_
+
+#include <stddef.h>
+
+#include "vec3.h"
+#include "view_params.h"
+
+/* LRU cache of encoded LOD fronts keyed by quantized camera pose. Eye
+ * positions are quantized to cubes of side "cell", gaze directions to steps
+ * of about "angle" radians. Entries evicted from memory are written to
+ * spill_dir (if not NULL) and read back when a pose in the same cell is
+ * looked up again. The tag identifies the tree and LOD settings a front was
+ * computed for; fronts are only returned for a matching tag. */
+typedef struct frontcache frontcache;
+
+frontcache *frontcache_create(int capacity, real cell, real angle,
+			      const char *spill_dir);
+void	    frontcache_free(frontcache *fc);
+
+void	    frontcache_store(frontcache *fc, unsigned tag,
+			     const view_params *vp,
+			     const unsigned char *data, size_t size);
+
+/* returns the front stored for the pose nearest to vp (within one cell and
+ * one angle step), or NULL. the returned data is owned by the cache and
+ * stays valid until the next store or lookup. */
+const unsigned char *
+	    frontcache_lookup(frontcache *fc, unsigned tag,
+			      const view_params *vp, size_t *size);
+
+#endif // !_FRONTCACHE_H_
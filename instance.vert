@@ -0,0 +1,16 @@
+#version 120
+
+attribute mat4 InstanceMatrix;
+
+varying vec3 V;
+varying vec3 N;
+
+void main(void)
+{
+	vec4 P = InstanceMatrix * gl_Vertex;
+
+	V = (gl_ModelViewMatrix * P).xyz;
+	N = normalize(gl_NormalMatrix * (mat3(InstanceMatrix) * gl_Normal));
+	gl_FrontColor = gl_Color;
+	gl_Position = gl_ModelViewProjectionMatrix * P;
+}
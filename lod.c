@@ -0,0 +1,960 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "lod.h"
+#include "octree.h"
+#include "parallel.h"
+#include "perfctr.h"
+#include "trace.h"
+#include "vec3.h"
+#include "vfc.h"
+#include "view_params.h"
+
+/* fronts remembered at previously visited camera poses; LOD_FRONT_CACHE_DIR
+ * names a directory to spill evicted fronts to */
+#define FRONT_CACHE_SIZE	64
+#define FRONT_CACHE_CELL	0.05
+#define FRONT_CACHE_ANGLE	(5*DEG2RAD)
+
+lod_context *
+lod_create(const octree *tree)
+{
+    lod_context *ctx = malloc(sizeof(*ctx));
+    const mesh *m = tree->mesh;
+    int j;
+
+    if (ctx == NULL)
+	return NULL;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->tree = tree;
+    ctx->status = malloc(sizeof(*ctx->status)*tree->nnodes);
+    ctx->testid = malloc(sizeof(*ctx->testid)*tree->nnodes);
+    ctx->tri_index = malloc(sizeof(*ctx->tri_index)*m->nt*3);
+    /* trees paged in from disk have no mesh to index (see paged.h) */
+    if (!ctx->status || !ctx->testid || (!ctx->tri_index && m->nt)) {
+	lod_free(ctx);
+	return NULL;
+    }
+    for (j=0; j<tree->nnodes; j++) {
+	ctx->status[j] = STATUS_INACTIVE;
+	ctx->testid[j] = 0;
+    }
+    ctx->detail_threshold = 1e-9;
+    ctx->silhouette_threshold = 5e-10;
+    ctx->reseed_mode = RESEED_HYBRID;
+    ctx->front_caching = 1;
+    return ctx;
+}
+
+static void
+free_list(lod_context *ctx)
+{
+    while (ctx->active_list) {
+	active_node *next = ctx->active_list->next;
+	free(ctx->active_list);
+	ctx->active_list = next;
+    }
+}
+
+void
+lod_free(lod_context *ctx)
+{
+    if (ctx) {
+	free_list(ctx);
+	frontcache_free(ctx->front_cache);
+	free(ctx->status);
+	free(ctx->testid);
+	free(ctx->proxies);
+	free(ctx->tri_index);
+	free(ctx->tri_views);
+	free(ctx->tri_faces);
+	free(ctx);
+    }
+}
+
+static int
+test_silhouette(const octree_node *n, const vec3 c, real r,
+		const view_params *vp)
+{
+    vec3 n_view, n_top, cone_normal;
+    real view_angle, theta, cone_angle;
+
+    /* find view cone and angle */
+    VecSub(n_view, c, vp->eye);
+    VecNormalize(n_view);
+
+    VecSAdd(n_top, c, vp->up, r);
+    VecSub(n_top, n_top, vp->eye);
+    VecNormalize(n_top);
+
+    view_angle = acos(VecDot(n_view, n_top));
+
+    octree_cone(n, cone_normal, &cone_angle);
+    theta = acos(VecDot(n_view, cone_normal));
+    if (theta - (cone_angle + view_angle) > M_PI*.5)
+	return 1;	/* front facing */
+    if (theta + (cone_angle + view_angle) < M_PI*.5)
+	return -1;	/* back facing */
+    return 0;		/* (possibly) on silhouette */
+}
+
+static real
+screen_area(const vec3 c, real r, const view_params *vp)
+{
+    /* size of sphere on screen is pi*r^2*f^2/d^2, where
+     * r = radius of sphere
+     * f = distance to view plane
+     * d = distance of center of sphere to view plane */
+
+    /* assuming eye is at origin, equation of image plane in gaze direction is
+     * G_x * x + G_y * y + G_z * z - D
+     * where G is the gaze direction vector and D is the view plane distance
+     * so we first subtract eye position from origin of sphere, and then
+     * compute it's project area. also check to see if sphere is entirely
+     * behind near plane or entire past far plane */
+    real s[3];
+    real d;
+
+    VecSub(s, c, vp->eye);
+    d = VecDot(vp->gaze, s);
+    if (d + r <= vp->znear || d - r >= vp->zfar)
+	/* sphere entirely behind or in front of viewing plane */
+	return 0.0;
+    d -= vp->znear;
+    return M_PI * (r*r) * (vp->znear*vp->znear) / (d*d);
+}
+
+/* The views being refined for, also transposed so the per-view parts of the
+ * refinement criterion can be evaluated for all views at once. Lanes past
+ * the last view repeat the first one. */
+typedef struct {
+    int			n;
+    const view_params  *vp;
+    real		eye[3][LOD_MAX_VIEWS];
+    real		gaze[3][LOD_MAX_VIEWS];
+    real		nr[3][LOD_MAX_VIEWS];
+    real		nl[3][LOD_MAX_VIEWS];
+    real		nt[3][LOD_MAX_VIEWS];
+    real		nb[3][LOD_MAX_VIEWS];
+    real		znear[LOD_MAX_VIEWS];
+    real		zfar[LOD_MAX_VIEWS];
+} lod_views;
+
+static void
+setup_views(lod_views *v, const view_params *vps, int nviews)
+{
+    const view_params *vp;
+    int i, j;
+
+    v->n = nviews;
+    v->vp = vps;
+    for (i=0; i<LOD_MAX_VIEWS; i++) {
+	vp = &vps[i < nviews ? i : 0];
+	for (j=0; j<3; j++) {
+	    v->eye[j][i] = vp->eye[j];
+	    v->gaze[j][i] = vp->gaze[j];
+	    v->nr[j][i] = vp->nr[j];
+	    v->nl[j][i] = vp->nl[j];
+	    v->nt[j][i] = vp->nt[j];
+	    v->nb[j][i] = vp->nb[j];
+	}
+	v->znear[i] = vp->znear;
+	v->zfar[i] = vp->zfar;
+    }
+}
+
+/* whether the sphere c,r is inside each view frustum, and its projected area
+ * there (0 if it is outside). the same tests as vf_sphere_inside() and
+ * screen_area(), written branch-free over a fixed number of lanes so they
+ * vectorize. */
+static void
+views_area(const lod_views *v, const vec3 c, real r, int inside[],
+	   real area[])
+{
+    real x, y, z, d, dn;
+    int i, in;
+
+    for (i=0; i<LOD_MAX_VIEWS; i++) {
+	x = c[0] - v->eye[0][i];
+	y = c[1] - v->eye[1][i];
+	z = c[2] - v->eye[2][i];
+	d = x*v->gaze[0][i] + y*v->gaze[1][i] + z*v->gaze[2][i];
+	in = (d + r > v->znear[i]) & (d - r < v->zfar[i]) &
+	     (x*v->nr[0][i] + y*v->nr[1][i] + z*v->nr[2][i] <= r) &
+	     (x*v->nl[0][i] + y*v->nl[1][i] + z*v->nl[2][i] <= r) &
+	     (x*v->nt[0][i] + y*v->nt[1][i] + z*v->nt[2][i] <= r) &
+	     (x*v->nb[0][i] + y*v->nb[1][i] + z*v->nb[2][i] <= r);
+	dn = d - v->znear[i];
+	inside[i] = in;
+	area[i] = in ? M_PI * (r*r) * (v->znear[i]*v->znear[i]) / (dn*dn) : 0;
+    }
+}
+
+/* bitmask of the views whose frustum the sphere c,r intersects */
+static unsigned
+views_mask(const lod_views *v, const vec3 c, real r)
+{
+    real area[LOD_MAX_VIEWS];
+    int i, in[LOD_MAX_VIEWS];
+    unsigned mask = 0;
+
+    views_area(v, c, r, in, area);
+    for (i=0; i<v->n; i++)
+	mask |= in[i] << i;
+    return mask;
+}
+
+/* the refinement criterion proper: should node n be expanded for any of the
+ * views? */
+static int
+refine_node(const lod_context *ctx, const octree_node *n,
+	    const lod_views *views)
+{
+    const view_params *vp = views->vp;
+    real threshold, area[LOD_MAX_VIEWS], r;
+    int i, k, in[LOD_MAX_VIEWS];
+    vec3 c;
+
+    NodeSphere(c, r, n);
+    if (views->n == 1) {
+	if (!vf_sphere_inside(vp, c, r))
+	    return 0;
+	k = test_silhouette(n, c, r, vp);
+	if (k < 0)
+	    return 0;
+	threshold = (k == 0 ? ctx->silhouette_threshold :
+			      ctx->detail_threshold);
+	return screen_area(c, r, vp) >= threshold;
+    }
+
+    /* the cheap tests for all views at once, then the silhouette test only
+     * for views in which the node is big enough to matter at all */
+    views_area(views, c, r, in, area);
+    threshold = fmin(ctx->silhouette_threshold, ctx->detail_threshold);
+    for (i=0; i<views->n; i++) {
+	if (!in[i] || area[i] < threshold)
+	    continue;
+	k = test_silhouette(n, c, r, &vp[i]);
+	if (k < 0)
+	    continue;
+	if (area[i] >= (k == 0 ? ctx->silhouette_threshold :
+				 ctx->detail_threshold))
+	    return 1;
+    }
+    return 0;
+}
+
+static int
+test_node(lod_context *ctx, const octree_node *n, const lod_views *views)
+{
+    if (ctx->testid[n->id] == ctx->current_testid) {
+	ctx->num_saved++;
+	return ctx->status[n->id] == STATUS_ACTIVE;
+    }
+
+    ctx->testid[n->id] = ctx->current_testid;
+    ctx->num_tests++;
+
+    return refine_node(ctx, n, views);
+}
+
+static void
+mark_inactive(lod_context *ctx, const octree_node *n)
+{
+    int k;
+
+    if (ctx->status[n->id] != STATUS_INACTIVE) {
+	ctx->status[n->id] = STATUS_INACTIVE;
+	for (k=0; k<8; k++)
+	    if (n->subtree[k])
+		mark_inactive(ctx, n->subtree[k]);
+    }
+}
+
+void
+lod_reset(lod_context *ctx)
+{
+    free_list(ctx);
+    mark_inactive(ctx, ctx->tree->root);
+}
+
+real
+lod_priority(const lod_context *ctx, const octree_node *n,
+	     const view_params *vp)
+{
+    real r;
+    vec3 c;
+    int k;
+
+    if (n->leaf)
+	return 0;
+    NodeSphere(c, r, n);
+    if (!vf_sphere_inside(vp, c, r))
+	return 0;
+    k = test_silhouette(n, c, r, vp);
+    if (k < 0)
+	return 0;
+    return screen_area(c, r, vp) / (k == 0 ? ctx->silhouette_threshold :
+					  ctx->detail_threshold);
+}
+
+void
+lod_begin_front(lod_context *ctx)
+{
+    lod_reset(ctx);
+    ctx->status[ctx->tree->root->id] = STATUS_BOUNDARY;
+}
+
+void
+lod_expand(lod_context *ctx, const octree_node *n)
+{
+    int k;
+
+    assert(ctx->status[n->id] == STATUS_BOUNDARY && !n->leaf);
+    ctx->status[n->id] = STATUS_ACTIVE;
+    for (k=0; k<8; k++)
+	if (n->subtree[k])
+	    ctx->status[n->subtree[k]->id] = STATUS_BOUNDARY;
+}
+
+static void
+collect_front(lod_context *ctx, octree_node *o, active_node ***tail)
+{
+    active_node *a;
+    int k;
+
+    if (ctx->status[o->id] == STATUS_ACTIVE) {
+	for (k=0; k<8; k++)
+	    if (o->subtree[k])
+		collect_front(ctx, o->subtree[k], tail);
+    } else {
+	a = malloc(sizeof(*a));
+	a->node = o;
+	a->next = NULL;
+	**tail = a;
+	*tail = &a->next;
+	ctx->front_size++;
+    }
+}
+
+void
+lod_end_front(lod_context *ctx, const view_params *vp)
+{
+    active_node **tail = &ctx->active_list;
+
+    ctx->front_size = 0;
+    collect_front(ctx, ctx->tree->root, &tail);
+    ctx->current_testid++;
+    ctx->num_tests = ctx->num_saved = 0;
+    ctx->views[0] = ctx->front_view = *vp;
+    ctx->nviews = ctx->front_nviews = 1;
+}
+
+/* Top-down front rebuild. The tree is cut into subtrees at RESEED_SPLIT_DEPTH
+ * (evaluating the few nodes above it serially), and the subtrees are then
+ * traversed in parallel, each job building its own piece of the active list.
+ * The pieces are spliced together in job order, so the resulting list has the
+ * same depth-first order as one built serially. */
+#define RESEED_SPLIT_DEPTH	3
+#define RESEED_MAX_JOBS		(8*8*8)
+
+typedef struct {
+    octree_node	*node;			/* root of subtree to traverse	    */
+    int		 tested;		/* node already failed refinement   */
+    int		 tests;			/* refinement tests performed	    */
+    active_node	*head, *tail;		/* boundary nodes found		    */
+} reseed_job;
+
+static void
+reseed_append(lod_context *ctx, reseed_job *job, octree_node *o)
+{
+    active_node *a = malloc(sizeof(*a));
+
+    ctx->status[o->id] = STATUS_BOUNDARY;
+    a->node = o;
+    a->next = NULL;
+    if (job->tail)
+	job->tail->next = a;
+    else
+	job->head = a;
+    job->tail = a;
+}
+
+static void
+reseed_subtree(lod_context *ctx, reseed_job *job, octree_node *o,
+	       const lod_views *views)
+{
+    int k;
+
+    if (!o->leaf) {
+	ctx->testid[o->id] = ctx->current_testid;
+	job->tests++;
+	if (refine_node(ctx, o, views)) {
+	    ctx->status[o->id] = STATUS_ACTIVE;
+	    for (k=0; k<8; k++)
+		if (o->subtree[k])
+		    reseed_subtree(ctx, job, o->subtree[k], views);
+	    return;
+	}
+    }
+    reseed_append(ctx, job, o);
+}
+
+typedef struct {
+    lod_context		*ctx;
+    reseed_job		*jobs;
+    const lod_views	*views;
+} reseed_work;
+
+static void
+reseed_worker(void *arg, int i)
+{
+    reseed_work *w = arg;
+    reseed_job *job = &w->jobs[i];
+
+    TRACE_BEGIN("reseed subtree");
+    if (job->tested)
+	reseed_append(w->ctx, job, job->node);
+    else
+	reseed_subtree(w->ctx, job, job->node, w->views);
+    TRACE_END();
+}
+
+static void
+reseed_split(lod_context *ctx, octree_node *o, const lod_views *views,
+	     reseed_job *jobs, int *njobs)
+{
+    reseed_job *job;
+    int k, tested = 0;
+
+    if (!o->leaf && o->depth < RESEED_SPLIT_DEPTH) {
+	ctx->testid[o->id] = ctx->current_testid;
+	ctx->num_tests++;
+	if (refine_node(ctx, o, views)) {
+	    ctx->status[o->id] = STATUS_ACTIVE;
+	    for (k=0; k<8; k++)
+		if (o->subtree[k])
+		    reseed_split(ctx, o->subtree[k], views, jobs, njobs);
+	    return;
+	}
+	tested = 1;
+    }
+    job = &jobs[(*njobs)++];
+    job->node = o;
+    job->tested = tested;
+    job->tests = 0;
+    job->head = job->tail = NULL;
+}
+
+/* throw away the current front and rebuild it from the root */
+static void
+reseed_front(lod_context *ctx, const lod_views *views)
+{
+    reseed_job *jobs;
+    reseed_work w;
+    active_node **tail;
+    int j, njobs;
+
+    TRACE_BEGIN("reseed front");
+    lod_reset(ctx);
+
+    jobs = malloc(sizeof(*jobs)*RESEED_MAX_JOBS);
+    njobs = 0;
+    reseed_split(ctx, ctx->tree->root, views, jobs, &njobs);
+
+    w.ctx = ctx;
+    w.jobs = jobs;
+    w.views = views;
+    parallel_for(njobs, reseed_worker, &w);
+
+    ctx->front_size = 0;
+    tail = &ctx->active_list;
+    for (j=0; j<njobs; j++) {
+	ctx->num_tests += jobs[j].tests;
+	if (jobs[j].head == NULL)
+	    continue;
+	*tail = jobs[j].head;
+	tail = &jobs[j].tail->next;
+	for (active_node *a = jobs[j].head; a; a = a->next)
+	    ctx->front_size++;
+    }
+    free(jobs);
+    ctx->num_reseeds++;
+    TRACE_END();
+}
+
+/* A front is encoded as one bit per node of the active subtree and its
+ * boundary, in depth-first order: 1 for an expanded (active) node, whose
+ * children follow, and 0 for a boundary node. Inactive nodes are implied. */
+typedef struct {
+    unsigned char *bits;
+    size_t	   nbits;
+    size_t	   max;
+} front_bits;
+
+static void
+snapshot_node(const lod_context *ctx, front_bits *fb, const octree_node *o)
+{
+    size_t old = fb->max;
+    int k;
+
+    if (fb->nbits == old*8) {
+	fb->max = old ? 2*old : 1024;
+	fb->bits = realloc(fb->bits, fb->max);
+	memset(fb->bits + old, 0, fb->max - old);
+    }
+    if (ctx->status[o->id] == STATUS_ACTIVE) {
+	fb->bits[fb->nbits>>3] |= 1 << (fb->nbits&7);
+	fb->nbits++;
+	for (k=0; k<8; k++)
+	    if (o->subtree[k])
+		snapshot_node(ctx, fb, o->subtree[k]);
+    } else {
+	fb->nbits++;
+    }
+}
+
+/* walk the encoded front; returns the number of bits used, or 0 if it does
+ * not fit this tree. with apply set, sets node statuses and appends the
+ * boundary nodes at *tail */
+static size_t
+restore_node(lod_context *ctx, const unsigned char *bits, size_t nbits,
+	     size_t i, octree_node *o, int apply, active_node ***tail)
+{
+    active_node *a;
+    int k;
+
+    if (i >= nbits)
+	return 0;
+    if (bits[i>>3] & (1 << (i&7))) {
+	if (o->leaf)
+	    return 0;
+	if (apply)
+	    ctx->status[o->id] = STATUS_ACTIVE;
+	i++;
+	for (k=0; k<8; k++)
+	    if (o->subtree[k] &&
+		(i = restore_node(ctx, bits, nbits, i, o->subtree[k],
+				  apply, tail)) == 0)
+		return 0;
+	return i;
+    }
+    if (apply) {
+	ctx->status[o->id] = STATUS_BOUNDARY;
+	a = malloc(sizeof(*a));
+	a->node = o;
+	a->next = NULL;
+	**tail = a;
+	*tail = &a->next;
+    }
+    return i+1;
+}
+
+size_t
+lod_snapshot(const lod_context *ctx, unsigned char **data)
+{
+    front_bits fb = { NULL, 0, 0 };
+
+    snapshot_node(ctx, &fb, ctx->tree->root);
+    *data = fb.bits;
+    return (fb.nbits+7)/8;
+}
+
+int
+lod_restore(lod_context *ctx, const unsigned char *data, size_t size)
+{
+    active_node **tail;
+
+    if (restore_node(ctx, data, size*8, 0, ctx->tree->root, 0, NULL) == 0)
+	return 0;
+
+    lod_reset(ctx);
+    tail = &ctx->active_list;
+    restore_node(ctx, data, size*8, 0, ctx->tree->root, 1, &tail);
+    return 1;
+}
+
+/* fronts are only valid for the tree they were taken from, and only useful
+ * for the thresholds and number of views they were computed with. the tree
+ * is told by its sizes, its root's box and whether it is flipped, which
+ * fronts spilled to files by other meshes or processes rarely share */
+static unsigned
+front_tag(const lod_context *ctx, int nviews)
+{
+    const octree_node *root = ctx->tree->root;
+    const mesh *m = ctx->tree->mesh;
+    float f[8] = { root->bb_midpt[0], root->bb_midpt[1], root->bb_midpt[2],
+		   root->bb_extent[0], root->bb_extent[1], root->bb_extent[2],
+		   ctx->detail_threshold, ctx->silhouette_threshold };
+    unsigned u[8], tag = 2166136261u;
+    int k;
+
+    memcpy(u, f, sizeof(u));
+    tag = (tag ^ m->nv) * 16777619u;
+    tag = (tag ^ m->nt) * 16777619u;
+    tag = (tag ^ ctx->tree->nnodes) * 16777619u;
+    tag = (tag ^ root->cone_flip) * 16777619u;
+    for (k=0; k<8; k++)
+	tag = (tag ^ u[k]) * 16777619u;
+    return (tag ^ nviews) * 16777619u;
+}
+
+/* Estimate whether rebuilding the front top-down is cheaper than updating it
+ * incrementally. A rebuild costs about one test per front node plus the
+ * internal nodes above them (~1/7 of the front in an octree), plus freeing
+ * and reallocating the list. The incremental update costs at least one visit
+ * per front node, plus one level of collapse or expansion for every doubling
+ * of distance to the model, plus up to a full climb and descent of the tree
+ * for the part of the front that panned out of view. RESEED_COST is the
+ * rebuild in units of that one visit: measured without front caching, a
+ * rebuild took 1.2 to 2 times as long as an incremental update by a quarter
+ * of a degree of orbit (500k-triangle sphere, 160k scan, 200k terrain).
+ * reseed.sh checks it over orbits, pans and teleports. */
+#define RESEED_COST	1.7
+
+static int
+reseed_cheaper(const lod_context *ctx, const view_params *vp)
+{
+    const octree_node *root = ctx->tree->root;
+    vec3 c, d0, d1, e0, e1;
+    real l0, l1, half_fov, turn, levels;
+
+    if (ctx->reseed_mode == RESEED_ALWAYS)
+	return 1;
+    if (ctx->reseed_mode == RESEED_NEVER)
+	return 0;
+
+    NodeCenter(c, root);
+    VecSub(d0, c, ctx->front_view.eye);
+    VecSub(d1, c, vp->eye);
+    l0 = sqrt(VecDot(d0, d0));
+    l1 = sqrt(VecDot(d1, d1));
+    if (l0 < vp->znear) l0 = vp->znear;
+    if (l1 < vp->znear) l1 = vp->znear;
+    /* projected area goes with 1/d^2, one octree level divides it by 4 */
+    levels = fabs(log2(l1 / l0));
+
+    /* fraction of the view that was replaced by panning: how far the
+     * model moved across the view, the angle between the directions to it
+     * in view coordinates before and after, so that pans and rolls count
+     * whichever way they go. orbiting a model kept in the middle of the
+     * view pans nothing. */
+    half_fov = atan(sqrt(vp->u*vp->u + vp->r*vp->r) / vp->znear);
+    VecNormalize(d0);
+    VecNormalize(d1);
+    e0[0] = VecDot(d0, ctx->front_view.right);
+    e0[1] = VecDot(d0, ctx->front_view.up);
+    e0[2] = VecDot(d0, ctx->front_view.gaze);
+    e1[0] = VecDot(d1, vp->right);
+    e1[1] = VecDot(d1, vp->up);
+    e1[2] = VecDot(d1, vp->gaze);
+    turn = acos(fmax(-1.0, fmin(1.0, VecDot(e0, e1))));
+    turn = fmin(1.0, turn / (2*half_fov));
+
+    return 1 + levels + turn * 2 * ctx->front_depth > RESEED_COST;
+}
+
+/* nodes on boundary are those whose parents are determined to be expanded but
+ * are not determined to be needing expansion themselves. to update the list,
+ * we look at every node on the boundary. if it needs to be expanded, take it
+ * off the list, and put it's children on the list, and come back to the
+ * children. */
+void
+lod_update(lod_context *ctx, const view_params *vp)
+{
+    lod_update_views(ctx, vp, 1);
+}
+
+/* with several views, a node is expanded if any view needs it expanded.
+ * the first view drives the choice between incremental and top-down update
+ * and keys the front cache. */
+void
+lod_update_views(lod_context *ctx, const view_params *vps, int nviews)
+{
+    const view_params *vp = &vps[0];
+    lod_views views;
+    active_node *n,*p,*a;
+    octree_node *o;
+    int j, k;
+    int allocs = 0;
+    int frees = 0;
+
+    assert(nviews >= 1 && nviews <= LOD_MAX_VIEWS);
+    TRACE_BEGIN("lod_update");
+    perfctr_begin(PHASE_LOD_UPDATE);
+    setup_views(&views, vps, nviews);
+    ctx->nviews = nviews;
+    for (j=0; j<nviews; j++)
+	ctx->views[j] = vps[j];
+
+    /* advance current test id no */
+    ctx->current_testid++;
+
+    ctx->num_saved = 0;
+    ctx->num_tests = 0;
+
+    /* if active_list is NULL, this is being run for the first time, so build
+     * the front from the root of the tree. also start over if the view moved
+     * so far that walking the old front there would cost more. */
+    if (ctx->active_list == NULL || reseed_cheaper(ctx, vp)) {
+	const unsigned char *cached = NULL;
+	unsigned char *data;
+	size_t size;
+
+	if (ctx->front_depth == 0)
+	    ctx->front_depth = octree_depth(ctx->tree->root);
+
+	/* the front we are leaving is converged for where we were, so
+	 * remember it, and see if we have been near the new pose before. a
+	 * restored front is then refined below like any other. */
+	if (ctx->front_caching) {
+	    if (ctx->front_cache == NULL)
+		ctx->front_cache =
+		    frontcache_create(FRONT_CACHE_SIZE, FRONT_CACHE_CELL,
+				      FRONT_CACHE_ANGLE,
+				      getenv("LOD_FRONT_CACHE_DIR"));
+	    if (ctx->active_list) {
+		size = lod_snapshot(ctx, &data);
+		frontcache_store(ctx->front_cache,
+				 front_tag(ctx, ctx->front_nviews),
+				 &ctx->front_view, data, size);
+		free(data);
+	    }
+	    cached = frontcache_lookup(ctx->front_cache,
+				       front_tag(ctx, nviews), vp, &size);
+	}
+	if (cached && lod_restore(ctx, cached, size)) {
+	    ctx->num_restores++;
+	} else {
+	    reseed_front(ctx, &views);
+	    ctx->front_view = *vp;
+	    ctx->front_nviews = nviews;
+	    perfctr_end(PHASE_LOD_UPDATE);
+	    TRACE_END();
+	    return;
+	}
+    }
+    ctx->front_size = 0;
+
+    p = NULL;
+    n = ctx->active_list;
+    while (n != NULL) {
+	o = n->node;
+	if (ctx->status[o->id] != STATUS_BOUNDARY) {
+	    if (ctx->status[o->id] != STATUS_INACTIVE)
+		printf("WARNING: %s node on active list!\n",
+		       ctx->status[o->id] == STATUS_ACTIVE ?
+		       "active" : "unknown");
+	    /* delete it from list */
+	    if (p) {
+		p->next = n->next;
+		free(n);
+		n = p->next;
+	    } else {
+		ctx->active_list = n->next;
+		free(n);
+		n = ctx->active_list;
+	    }
+	    frees++;
+	    continue;
+	}
+
+	/* check if this boundary node should be expanded. */
+	if (ctx->testid[o->id] == ctx->current_testid) {
+	    p = n;
+	    n = n->next;
+	    ctx->num_saved++;
+	    ctx->front_size++;
+	    continue;
+	}
+
+	if (!o->leaf && test_node(ctx, o, &views)) {
+	    /* mark it active, take it out of the list, and insert it's
+	     * children, keeping them in order */
+	    ctx->status[o->id] = STATUS_ACTIVE;
+	    for (k=7; k>=0; k--)
+		if (o->subtree[k]) {
+		    /* increment both, but be lazy about the real work ;-) */
+		    allocs++; frees++;
+		    ctx->status[o->subtree[k]->id] = STATUS_BOUNDARY;
+		    n->node = o->subtree[k];
+		    k--;
+		    break;
+		}
+	    for (; k>=0; k--)
+		if (o->subtree[k]) {
+		    allocs++;
+		    a = malloc(sizeof(*a));
+		    ctx->status[o->subtree[k]->id] = STATUS_BOUNDARY;
+		    a->node = o->subtree[k];
+		    a->next = n->next;
+		    n->next = a;
+		}
+	    continue;
+	}
+	while (o->parent && !test_node(ctx, o->parent, &views))
+	    o = o->parent;
+	if (n->node != o) {
+	    n->node = o;
+	    if (o->parent)
+		ctx->testid[o->parent->id] = ctx->current_testid;
+
+	    /* now we've come to a node which was active before and now needs
+	     * to be put on the boundary. mark all nodes below this one
+	     * inactive. this will ensure they get deleted from the active list
+	     * by the code at the beginning of the for loop. */
+	    ctx->status[o->id] = STATUS_BOUNDARY;
+	    for (k=0; k<8; k++)
+		if (o->subtree[k])
+		    mark_inactive(ctx, o->subtree[k]);
+	}
+	/* advance to next node */
+	p = n;
+	n = n->next;
+	ctx->front_size++;
+    }
+    ctx->front_view = *vp;
+    ctx->front_nviews = nviews;
+    perfctr_end(PHASE_LOD_UPDATE);
+    TRACE_END();
+
+//  printf("%d tests, %d remembered, %d allocated, %d freed\n",
+//	   ctx->num_tests, ctx->num_saved, allocs, frees);
+}
+
+/* move a vertex proxy to the boundary node now covering vertex v: down
+ * through newly expanded nodes, or up out of newly collapsed ones */
+static octree_node *
+update_proxy(const lod_context *ctx, octree_node *n, int v)
+{
+    const mesh *m = ctx->tree->mesh;
+    vec3 p;
+    int k;
+
+    if (ctx->status[n->id] == STATUS_ACTIVE) {
+	MeshVertex(p, m, v);
+	do {
+	    k = 0;
+	    if (p[0] >= n->bb_midpt[0]) k|=4;
+	    if (p[1] >= n->bb_midpt[1]) k|=2;
+	    if (p[2] >= n->bb_midpt[2]) k|=1;
+	    n = n->subtree[k];
+	} while (ctx->status[n->id] != STATUS_BOUNDARY);
+    } else {
+	assert(ctx->status[n->id] == STATUS_INACTIVE);
+	do {
+	    n = n->parent;
+	} while (ctx->status[n->id] != STATUS_BOUNDARY);
+    }
+    return n;
+}
+
+/* the views in which the simplified triangle v0,v1,v2 may be visible: those
+ * whose frustum intersects its bounding sphere */
+static unsigned char
+tri_views(const lod_views *views, const mesh *m, int v0, int v1, int v2)
+{
+    vec3 p0, p1, p2, c, d;
+    real r2, t;
+
+    MeshVertex(p0, m, v0);
+    MeshVertex(p1, m, v1);
+    MeshVertex(p2, m, v2);
+    VecAdd(c, p0, p1);
+    VecAdd(c, c, p2);
+    VecScale(c, c, (1.0/3.0));
+    VecSub(d, p0, c);
+    r2 = VecDot(d, d);
+    VecSub(d, p1, c);
+    if (r2 < (t = VecDot(d, d))) r2 = t;
+    VecSub(d, p2, c);
+    if (r2 < (t = VecDot(d, d))) r2 = t;
+    return views_mask(views, c, sqrt(r2));
+}
+
+int
+lod_extract(lod_context *ctx)
+{
+    const octree *tree = ctx->tree;
+    const mesh *m = tree->mesh;
+    octree_node *c,*n0,*n1,*n2;
+    lod_views views;
+    int j, ti, nt;
+
+    if (ctx->nviews > 1) {
+	setup_views(&views, ctx->views, ctx->nviews);
+	if (ctx->tri_views == NULL)
+	    ctx->tri_views = malloc(sizeof(*ctx->tri_views)*m->nt);
+    }
+
+    /* We could be even lazier, and initialize this all to null, check for that
+     * when we are lazily updating proxies, but it think it's alright since it
+     * is only a one-time thing. */
+    TRACE_BEGIN("lod_extract");
+    if (ctx->proxies==NULL) {
+	TRACE_BEGIN("init proxies");
+	ctx->proxies=malloc(sizeof(*ctx->proxies)*m->nv);
+	for (j=0; j<(int)m->nv; j++) {
+	    c=tree->vertex_nodes[j];
+	    while (ctx->status[c->id] != STATUS_BOUNDARY)
+		c=c->parent;
+	    ctx->proxies[j]=c;
+	}
+	TRACE_END();
+    }
+
+    /* proxies are refreshed lazily as the triangles referring to them are
+     * emitted, so the two are traced as one span */
+    TRACE_BEGIN("refresh proxies + emit indices");
+    perfctr_begin(PHASE_LOD_EXTRACT);
+    ctx->collapsed = ctx->rendered = ctx->proxy_updates = 0;
+    nt = 0;
+    for (j=0; j<(int)m->nt; j++) {
+	if (ctx->status[tree->activators[j]->id] == STATUS_INACTIVE) {
+	    ctx->collapsed++;
+	    continue;
+	}
+	n0=ctx->proxies[ti = m->tris[j][0]];
+	if (ctx->status[n0->id] != STATUS_BOUNDARY) {
+	    ctx->proxies[ti] = n0 = update_proxy(ctx, n0, ti);
+	    ctx->proxy_updates++;
+	}
+	n1=ctx->proxies[ti = m->tris[j][1]];
+	if (ctx->status[n1->id] != STATUS_BOUNDARY) {
+	    ctx->proxies[ti] = n1 = update_proxy(ctx, n1, ti);
+	    ctx->proxy_updates++;
+	}
+	if (n0 == n1 || n0->rep_vindex == n1->rep_vindex) {
+	    ctx->collapsed++;
+	    continue;
+	}
+	n2=ctx->proxies[ti = m->tris[j][2]];
+	if (ctx->status[n2->id] != STATUS_BOUNDARY) {
+	    ctx->proxies[ti] = n2 = update_proxy(ctx, n2, ti);
+	    ctx->proxy_updates++;
+	}
+	if (n0==n2 || n1==n2 || n0->rep_vindex == n2->rep_vindex ||
+	    n1->rep_vindex == n2->rep_vindex) {
+	    ctx->collapsed++;
+	    continue;
+	}
+
+	if (ctx->nviews > 1)
+	    ctx->tri_views[nt/3] = tri_views(&views, m, n0->rep_vindex,
+					     n1->rep_vindex, n2->rep_vindex);
+	if (ctx->tri_faces)
+	    ctx->tri_faces[nt/3] = j;
+	ctx->tri_index[nt++] = n0->rep_vindex;
+	ctx->tri_index[nt++] = n1->rep_vindex;
+	ctx->tri_index[nt++] = n2->rep_vindex;
+	ctx->rendered++;
+    }
+    perfctr_end(PHASE_LOD_EXTRACT);
+    TRACE_END();
+    TRACE_END();
+    ctx->nindices = nt;
+    return nt;
+}
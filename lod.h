@@ -0,0 +1,113 @@
+#ifndef _LOD_H_
+#define _LOD_H_
+
+#include <stddef.h>
+
+#include "frontcache.h"
+#include "octree.h"
+#include "view_params.h"
+
+/* active lists point to boundary octree nodes */
+typedef struct active_node active_node;
+struct active_node {
+    octree_node	*node;
+    active_node	*next;
+};
+
+/* most views one front can be selected for at once */
+#define LOD_MAX_VIEWS	8
+
+/* front update strategy: incremental only, hybrid (incremental unless the
+ * view changed enough that a top-down rebuild is cheaper), or always
+ * top-down */
+enum { RESEED_NEVER, RESEED_HYBRID, RESEED_ALWAYS };
+
+/* All per-view LOD state over a shared, read-only octree. Contexts do not
+ * share any mutable state, so any number of them can be updated concurrently
+ * on separate threads. */
+typedef struct {
+    const octree   *tree;		/* shared octree		    */
+
+    unsigned char  *status;		/* per-node octree_status	    */
+    int		   *testid;		/* per-node id of last test	    */
+    int		    current_testid;
+    active_node	   *active_list;	/* boundary nodes		    */
+    octree_node	  **proxies;		/* per-vertex boundary node	    */
+
+    float	    detail_threshold;
+    float	    silhouette_threshold;
+
+    int		    reseed_mode;
+    int		    front_depth;	/* depth of octree, for cost model  */
+    view_params	    front_view;		/* (first) view of last update	    */
+    int		    front_nviews;	/* number of views of last update   */
+
+    view_params	    views[LOD_MAX_VIEWS];   /* views of last update	    */
+    int		    nviews;
+
+    int		    front_caching;
+    frontcache	   *front_cache;	/* fronts at visited poses	    */
+
+    int		   *tri_index;		/* simplified triangles, 3 per tri  */
+    int		    nindices;		/* indices in tri_index		    */
+    unsigned char  *tri_views;		/* per triangle, bit i set if it may
+					 * be visible in view i (only kept
+					 * for multi-view updates)	    */
+    int		   *tri_faces;		/* per triangle, the mesh triangle it
+					 * stands for (only kept if the
+					 * caller allocates it, for nt)	    */
+
+    /* statistics from the last lod_update() */
+    int		    num_tests;
+    int		    num_saved;
+    int		    front_size;		/* boundary nodes after update	    */
+    int		    num_reseeds;	/* since creation		    */
+    int		    num_restores;	/* since creation		    */
+
+    /* statistics from the last lod_extract() */
+    int		    collapsed;
+    int		    rendered;
+    int		    proxy_updates;
+} lod_context;
+
+lod_context *lod_create(const octree *tree);
+void	     lod_free(lod_context *ctx);
+
+/* forget the current front; the next update starts from the root */
+void	     lod_reset(lod_context *ctx);
+
+/* update the front (the boundary nodes) for view vp */
+void	     lod_update(lod_context *ctx, const view_params *vp);
+
+/* update the front in one pass for nviews (at most LOD_MAX_VIEWS) views at
+ * once, refining wherever any of them requires it. for stereo pairs, shadow
+ * maps and the like, where one cut valid for all views is wanted. */
+void	     lod_update_views(lod_context *ctx, const view_params *vps,
+			      int nviews);
+
+/* Fronts can also be built node by node from outside, e.g. to share a
+ * triangle budget among several contexts. lod_priority() tells how much node
+ * n needs expanding for view vp: its projected area relative to the
+ * threshold that applies to it (lod_update expands it at >= 1), or 0 if it
+ * is a leaf, outside the view or back-facing. lod_begin_front() leaves only
+ * the root on the boundary, lod_expand() expands boundary node n, and
+ * lod_end_front() makes the result the current front for view vp. */
+real	     lod_priority(const lod_context *ctx, const octree_node *n,
+			  const view_params *vp);
+void	     lod_begin_front(lod_context *ctx);
+void	     lod_expand(lod_context *ctx, const octree_node *n);
+void	     lod_end_front(lod_context *ctx, const view_params *vp);
+
+/* collect the simplified triangles for the current front into
+ * ctx->tri_index, returning the number of indices. after a multi-view update
+ * this also fills in ctx->tri_views. */
+int	     lod_extract(lod_context *ctx);
+
+/* encode the current front compactly; *data must be freed by the caller */
+size_t	     lod_snapshot(const lod_context *ctx, unsigned char **data);
+/* replace the current front by an encoded one. returns 0 if it does not fit
+ * this tree, leaving the front unchanged */
+int	     lod_restore(lod_context *ctx, const unsigned char *data,
+			 size_t size);
+
+#endif // !_LOD_H_
@@ -7,10 +7,15 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #if defined(__APPLE__)
 # include <OpenGL/gl.h>
+# include <OpenGL/glext.h>
 # include <GLUT/glut.h>
+# define glDrawElementsInstanced	glDrawElementsInstancedARB
+# define glVertexAttribDivisor		glVertexAttribDivisorARB
 #else
 # include <GL/gl.h>
 # include <GL/glut.h>
@@ -27,6 +32,11 @@
 #include "vfc.h"
 #include "shader.h"
 #include "timer.h"
+#include "trace.h"
+#include "lod.h"
+#include "paged.h"
+#include "perfctr.h"
+#include "scene.h"
 
 int		win_width = 640*2;
 int		win_height = 480*2;
@@ -43,6 +53,7 @@ int		help = 0;
 int		wire = 0;
 int		bf_cull = 1;
 int		top_view = 0;
+int		show_counters = 0;
 int		mouse_state = 0;
 int		mouse_x, mouse_y;
 
@@ -52,25 +63,25 @@ GLuint		shader_vert_program = 0;
 GLuint		shader_frag_program = 0;
 GLuint		shader_program = 0;
 
-int		vbo_init = 0;
-GLuint		vbo_id[3];
-
-mesh*		m;
-octree*		tree;
+GLuint		instance_vert_program = 0;
+GLuint		instance_frag_program = 0;
+GLuint		instance_program = 0;
+GLint		instance_matrix = -1;	/* attribute location */
 
-int*		tri_index=NULL;
-octree_node**	proxies=NULL;
+int		vbo_init = 0;
+GLuint	      (*vbo_id)[3];		/* per scene model */
+GLuint		instance_vbo;		/* instance matrices */
 
-/* active lists point to boundary octree nodes */
-typedef struct active_node active_node;
-struct active_node {
-    octree_node	*node;
-    active_node	*next;
-} *active_list;
+scene*		sc;
+int		scene_tris;		/* triangles in all meshes */
+int		budget = 100000;	/* budget when turned on */
 
-int		current_testid = 0;
-int		num_tests = 0;
-int		num_saved = 0;
+/* the scene loads in a thread of its own while the window is already up,
+ * showing the models' preview points once their meshes are in */
+enum { LOAD_MESHES, LOAD_OCTREES, LOAD_DONE, LOAD_FAILED };
+atomic_int	load_state = LOAD_MESHES;
+int		loaded = 0;		/* LOAD_DONE seen and set up for */
+double		load_start;
 
 void		spherical(real v[3], real r, real theta, real phi);
 void		mouse_button(int button, int state, int x, int y);
@@ -78,14 +89,11 @@ void		mouse_motion(int x, int y);
 void		display(void);
 void		reshape(int w, int h);
 void		key_press(unsigned char c, int x, int y);
-void		render_octree(const octree_node *o);
+void		render_octree(const scene_object *so, const octree_node *o);
 void		lod_render(int update, const view_params *vp,
 			   int *collapsed, int *culled, int *rendered);
 void		fullres_render();
-int		tree_depth(const octree_node *o);
-
-float		detail_threshold = 1e-9;
-float		silhouette_threshold = 5e-10;
+void		preview_render();
 
 static void
 print_info(GLuint program)
@@ -104,9 +112,10 @@ print_info(GLuint program)
     }
 }
 
-void
-init_shader()
+GLuint
+build_program(const char *name, GLuint *vert_program, GLuint *frag_program)
 {
+    GLuint program;
     GLint status;
 
     /* if (!LoadGLFunc(glCreateShaderObject) ||
@@ -126,48 +135,69 @@ init_shader()
 	exit(1);
     } */
 
-    shader_strings = shader_load("shader");
+    shader_strings = shader_load(name);
     if (shader_strings == NULL) {
-	printf("Could not load ``simple-shader'' source.\n");
+	printf("Could not load ``%s'' source.\n", name);
 	exit(1);
     }
 
-    shader_vert_program = glCreateShader(GL_VERTEX_SHADER);
-    shader_frag_program = glCreateShader(GL_FRAGMENT_SHADER);
+    *vert_program = glCreateShader(GL_VERTEX_SHADER);
+    *frag_program = glCreateShader(GL_FRAGMENT_SHADER);
 
-    glShaderSource(shader_vert_program, 1,
+    glShaderSource(*vert_program, 1,
 		   (const GLchar **)&shader_strings->vshader, NULL);
-    glShaderSource(shader_frag_program, 1,
+    glShaderSource(*frag_program, 1,
 		   (const GLchar **)&shader_strings->fshader, NULL);
 
-    glCompileShader(shader_vert_program);
-    glGetProgramiv(shader_vert_program, GL_COMPILE_STATUS, &status);
-    print_info(shader_vert_program);
+    glCompileShader(*vert_program);
+    glGetProgramiv(*vert_program, GL_COMPILE_STATUS, &status);
+    print_info(*vert_program);
     if (!status) {
 	printf("vertex program compilation failed\n");
 	exit(1);
     }
 
-    glCompileShader(shader_frag_program);
-    glGetProgramiv(shader_frag_program, GL_COMPILE_STATUS, &status);
-    print_info(shader_frag_program);
+    glCompileShader(*frag_program);
+    glGetProgramiv(*frag_program, GL_COMPILE_STATUS, &status);
+    print_info(*frag_program);
     if (!status) {
 	printf("fragment program compilation failed\n");
 	exit(1);
     }
 
-    shader_program = glCreateProgram();
-    glAttachShader(shader_program, shader_vert_program);
-    glAttachShader(shader_program, shader_frag_program);
+    shader_free(shader_strings);
+    shader_strings = NULL;
+
+    program = glCreateProgram();
+    glAttachShader(program, *vert_program);
+    glAttachShader(program, *frag_program);
 
-    glLinkProgram(shader_program);
+    glLinkProgram(program);
 
-    glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
-    print_info(shader_program);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    print_info(program);
     if (!status) {
 	printf("program link failed\n");
 	exit(1);
     }
+    return program;
+}
+
+void
+init_shader()
+{
+    shader_program = build_program("shader", &shader_vert_program,
+				    &shader_frag_program);
+}
+
+/* per-pixel lighting like shader.*, with a per-instance model matrix */
+void
+init_instance_shader()
+{
+    instance_program = build_program("instance", &instance_vert_program,
+				     &instance_frag_program);
+    instance_matrix = glGetAttribLocation(instance_program,
+					  "InstanceMatrix");
 }
 
 void
@@ -196,6 +226,8 @@ delete_shader()
 void
 create_vbos()
 {
+    int j;
+
     if (!vbo_init) {
 	/*
 	if (glGenBuffers == NULL) {
@@ -210,19 +242,50 @@ create_vbos()
 	}
 	*/
 
-	glGenBuffers(3, vbo_id);
+	vbo_id = malloc(sizeof(*vbo_id)*sc->nmodels);
+	for (j=0; j<sc->nmodels; j++) {
+	    const mesh *m = sc->models[j].mesh;
+
+	    glGenBuffers(3, vbo_id[j]);
+
+	    if (m->qverts) {
+		/* fixed-function normals can't be octahedral: decode them
+		 * to bytes */
+		int8_t (*normals)[4] = malloc(sizeof(*normals)*m->nv);
+		unsigned v;
+		vec3 n;
+
+		for (v=0; v<m->nv; v++) {
+		    MeshNormal(n, m, v);
+		    normals[v][0] = rint(n[0]*127);
+		    normals[v][1] = rint(n[1]*127);
+		    normals[v][2] = rint(n[2]*127);
+		    normals[v][3] = 0;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][0]);
+		glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(*m->qverts),
+			     m->qverts, GL_STATIC_DRAW);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][1]);
+		glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(*normals),
+			     normals, GL_STATIC_DRAW);
+		free(normals);
+	    } else {
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][0]);
+		glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(vec3),
+				m->verts, GL_STATIC_DRAW);
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id[0]);
-	glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(vec3),
-			m->verts, GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][1]);
+		glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(vec3),
+				m->vnormals, GL_STATIC_DRAW);
+	    }
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id[1]);
-	glBufferData(GL_ARRAY_BUFFER, m->nv*sizeof(vec3),
-			m->vnormals, GL_STATIC_DRAW);
+	    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[j][2]);
+	    glBufferData(GL_ELEMENT_ARRAY_BUFFER,  m->nt*sizeof(index3u),
+			    m->tris, GL_STATIC_DRAW);
+	}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[2]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,  m->nt*sizeof(index3u),
-			m->tris, GL_STATIC_DRAW);
+	glGenBuffers(1, &instance_vbo);
 
 	vbo_init = 1;
 
@@ -234,256 +297,99 @@ create_vbos()
 void
 delete_vbos()
 {
+    int j;
+
     if (vbo_init) {
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id[0]);
-	glBufferData(GL_ARRAY_BUFFER, 0, NULL, 0);
+	for (j=0; j<sc->nmodels; j++) {
+	    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][0]);
+	    glBufferData(GL_ARRAY_BUFFER, 0, NULL, 0);
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo_id[1]);
-	glBufferData(GL_ARRAY_BUFFER, 0, NULL, 0);
+	    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][1]);
+	    glBufferData(GL_ARRAY_BUFFER, 0, NULL, 0);
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[2]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, 0, NULL, 0);
+	    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[j][2]);
+	    glBufferData(GL_ELEMENT_ARRAY_BUFFER, 0, NULL, 0);
 
-	glDeleteBuffers(3, vbo_id);
+	    glDeleteBuffers(3, vbo_id[j]);
+	}
+	glDeleteBuffers(1, &instance_vbo);
+	free(vbo_id);
+	vbo_id = NULL;
 	vbo_init = 0;
     }
 }
 
-static int
-test_silhouette(const octree_node *n, const view_params *vp)
+static void *
+load_scene(void *arg)
 {
-    vec3 n_view, n_top;
-    real view_angle, theta;
-
-    /* find view cone and angle */
-    VecSub(n_view, n->sp_center, vp->eye);
-    VecNormalize(n_view);
+    (void)arg;
 
-    VecSAdd(n_top, n->sp_center, vp->up, n->sp_radius);
-    VecSub(n_top, n_top, vp->eye);
-    VecNormalize(n_top);
-
-    view_angle = acos(VecDot(n_view, n_top));
-
-    theta = acos(VecDot(n_view, n->cone_normal));
-    if (theta - (n->cone_angle + view_angle) > M_PI*.5)
-	return 1;	/* front facing */
-    if (theta + (n->cone_angle + view_angle) < M_PI*.5)
-	return -1;	/* back facing */
-    return 0;		/* (possibly) on silhouette */
+    if (!scene_load_meshes(sc)) {
+	atomic_store(&load_state, LOAD_FAILED);
+	return NULL;
+    }
+    scene_fit(sc);
+    atomic_store(&load_state, LOAD_OCTREES);
+    atomic_store(&load_state, scene_build(sc) ? LOAD_DONE : LOAD_FAILED);
+    return NULL;
 }
 
-static real
-screen_area(const octree_node *n, const view_params *vp)
+/* the rest of the setup, once the scene is all loaded */
+static void
+finish_loading(void)
 {
-    /* size of sphere on screen is pi*r^2*f^2/d^2, where
-     * r = radius of sphere
-     * f = distance to view plane
-     * d = distance of center of sphere to view plane */
-
-    /* assuming eye is at origin, equation of image plane in gaze direction is
-     * G_x * x + G_y * y + G_z * z - D
-     * where G is the gaze direction vector and D is the view plane distance
-     * so we first subtract eye position from origin of sphere, and then
-     * compute it's project area. also check to see if sphere is entirely
-     * behind near plane or entire past far plane */
-    real s[3];
-    real d;
-
-    VecSub(s, n->sp_center, vp->eye);
-    d = VecDot(vp->gaze, s);
-    if (d + n->sp_radius <= vp->znear || d - n->sp_radius >= vp->zfar)
-	/* sphere entirely behind or in front of viewing plane */
-	return 0.0;
-    d -= vp->znear;
-    return M_PI * (n->sp_radius*n->sp_radius) * (vp->znear*vp->znear) / (d*d);
-}
+    int j;
 
-static int
-test_node(octree_node *n, const view_params *vp)
-{
-    real threshold;
-    int k;
+    printf("Loaded %d mesh(es) [%gs]\n",
+	    sc->nobjects + (sc->paged != NULL), get_timer() - load_start);
 
-    if (n->testid == current_testid) {
-	num_saved++;
-	return n->status == STATUS_ACTIVE;
+    scene_tris = 0;
+    for (j=0; j<sc->nobjects; j++)
+	scene_tris += sc->models[sc->objects[j].model].mesh->nt;
+    /* a paged octree is never all in memory to draw at full resolution */
+    if (sc->paged) {
+	scene_tris += sc->paged->nt;
+	fullres = 0;
     }
 
-    n->testid = current_testid;
-    num_tests++;
-
-    if (!vf_sphere_inside(vp, n->sp_center, n->sp_radius))
-	return 0;
-    k = test_silhouette(n, vp);
-    if (k < 0)
-	return 0;
-    threshold = (k == 0 ? silhouette_threshold : detail_threshold);
-    return screen_area(n, vp) >= threshold;
-}
-
-void
-mark_inactive(octree_node *n)
-{
-    int k;
-
-    if (n->status != STATUS_INACTIVE) {
-	n->status = STATUS_INACTIVE;
-	for (k=0; k<8; k++)
-	    if (n->subtree[k])
-		mark_inactive(n->subtree[k]);
-    }
+    create_vbos();
+    loaded = 1;
 }
 
-/* nodes on boundary are those whose parents are determined to be expanded but
- * are not determined to be needing expansion themselves. to update the list,
- * we look at every node on the boundary. if it needs to be expanded, take it
- * off the list, and put it's children on the list, and come back to the
- * children. */
-void
-update_active_list(const view_params *vp)
+/* redraw while loading, to show how far it has got */
+static void
+poll_loading(int value)
 {
-    active_node *n,*p,*a;
-    octree_node *o;
-    int k;
-    int allocs = 0;
-    int frees = 0;
-
-    /* advance current test id no */
-    current_testid++;
-
-    /* if active_list is NULL, this is being run for the first time, so
-     * allocate a node pointing to root of tree */
-    if (active_list == NULL) {
-	active_list = malloc(sizeof(*active_list));
-	active_list->node = tree->root;
-	active_list->node->status = STATUS_BOUNDARY;
-	active_list->next = NULL;
-    }
-
-    num_saved = 0;
-    num_tests = 0;
-
-    p = NULL;
-    n = active_list;
-    while (n != NULL) {
-	o = n->node;
-	if (o->status != STATUS_BOUNDARY) {
-	    if (o->status != STATUS_INACTIVE)
-		printf("WARNING: %s node on active list!\n",
-		       o->status == STATUS_ACTIVE ? "active" : "unknown");
-	    /* delete it from list */
-	    if (p) {
-		p->next = n->next;
-		free(n);
-		n = p->next;
-	    } else {
-		active_list = n->next;
-		free(n);
-		n = active_list;
-	    }
-	    frees++;
-	    continue;
-	}
+    (void)value;
 
-	/* check if this boundary node should be expanded. */
-	if (o->testid == current_testid) {
-	    p = n;
-	    n = n->next;
-	    num_saved++;
-	    continue;
-	}
-
-	if (!o->leaf && test_node(o, vp)) {
-	    /* mark it active, take it out of the list, and insert it's
-	     * children, keeping them in order */
-	    o->status = STATUS_ACTIVE;
-	    for (k=7; k>=0; k--)
-		if (o->subtree[k]) {
-		    /* increment both, but be lazy about the real work ;-) */
-		    allocs++; frees++;
-		    o->subtree[k]->status = STATUS_BOUNDARY;
-		    n->node = o->subtree[k];
-		    k--;
-		    break;
-		}
-	    for (; k>=0; k--)
-		if (o->subtree[k]) {
-		    allocs++;
-		    a = malloc(sizeof(*a));
-		    o->subtree[k]->status = STATUS_BOUNDARY;
-		    a->node = o->subtree[k];
-		    a->next = n->next;
-		    n->next = a;
-		}
-	    continue;
-	}
-	while (o->parent && !test_node(o->parent, vp))
-	    o = o->parent;
-	if (n->node != o) {
-	    n->node = o;
-	    if (o->parent)
-		o->parent->testid = current_testid;
-
-	    /* now we've come to a node which was active before and now needs
-	     * to be put on the boundary. mark all nodes below this one
-	     * inactive. this will ensure they get deleted from the active list
-	     * by the code at the beginning of the for loop. */
-	    o->status = STATUS_BOUNDARY;
-	    for (k=0; k<8; k++)
-		if (o->subtree[k])
-		    mark_inactive(o->subtree[k]);
-	}
-	/* advance to next node */
-	p = n;
-	n = n->next;
+    if (atomic_load(&load_state) == LOAD_FAILED) {
+	fprintf(stderr, "error loading scene\n");
+	exit(1);
     }
-
-//  printf("%d tests, %d remembered, %d allocated, %d freed\n",
-//	   num_tests, num_saved, allocs, frees);
+    glutPostRedisplay();
+    if (atomic_load(&load_state) != LOAD_DONE)
+	glutTimerFunc(100, poll_loading, 0);
 }
 
 int
 main(int argc, char **argv)
 {
-    int j;
-    vec3 mid;
-    double s, scale, t;
+    pthread_t loader;
 
     if (argc != 2) {
-	fprintf(stderr, "usage: %s [PLY file]\n", argv[0]);
+	fprintf(stderr, "usage: %s [PLY file | scene file | paged octree | "
+		"synth:<kind>:<triangles>]\n", argv[0]);
 	exit(1);
     }
 
-    printf("Loading mesh... ");
-    fflush(stdout);
-
-    t=get_timer();
-    m=mesh_load(argv[1]);
-    t=get_timer()-t;
-    if (m==NULL) {
-	fprintf(stderr, "error loading mesh\n");
+    load_start=get_timer();
+    sc=scene_open(argv[1]);
+    if (sc==NULL) {
+	fprintf(stderr, "error loading scene\n");
 	exit(1);
     }
-    printf("done [%gs]\n", t);
-
-    scale = 0;
-    for (j=0; j<3; j++) {
-	s = m->max[j] - m->min[j];
-	if (scale < s) scale = s;
-    }
-    scale = 2.0 / scale;
-    VecBlend(mid, m->min, m->max, 0.5);
-    VecSub(m->min, m->min, mid);
-    VecSub(m->max, m->max, mid);
-    VecScale(m->min, m->min, scale);
-    VecScale(m->max, m->max, scale);
-    for (j=0; j<m->nv; j++) {
-	VecSub(m->verts[j], m->verts[j], mid);
-	VecScale(m->verts[j], m->verts[j], scale);
-    }
-
-    tree=octree_create(m);
+    if (sc->budget > 0)
+	budget = sc->budget;
 
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
@@ -499,10 +405,21 @@ main(int argc, char **argv)
 
     glEnable(GL_LIGHTING);
     glEnable(GL_LIGHT0);
+    /* object transforms may scale */
+    glEnable(GL_NORMALIZE);
 
     glShadeModel(GL_SMOOTH);
 
-    create_vbos();
+    /* a paged octree is loaded already, and has nothing to preview */
+    if (sc->paged) {
+	scene_fit(sc);
+	atomic_store(&load_state, LOAD_DONE);
+    } else if (pthread_create(&loader, NULL, load_scene, NULL) == 0) {
+	pthread_detach(loader);
+    } else {
+	load_scene(NULL);
+    }
+    poll_loading(0);
 
     glutMainLoop();
 
@@ -600,6 +517,56 @@ setup_lighting()
     glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
 }
 
+/* one HUD line of this frame's hardware counters for a phase */
+static void
+draw_counters(char *buf, const char *label, int phase)
+{
+    const unsigned long long *c = perfctr_phases[phase].count;
+
+    sprintf(buf, "%s %.3gM CYCLES IPC %.2f L1D-MISS %llu LLC-MISS %llu "
+	    "BR-MISS %llu", label, c[PERF_CYCLES] * 1e-6,
+	    c[PERF_CYCLES] ? (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES] : 0,
+	    c[PERF_L1D_MISSES], c[PERF_LLC_MISSES], c[PERF_BRANCH_MISSES]);
+}
+
+/* while the scene loads: its preview points once there are any, and how
+ * far loading has got */
+static void
+display_loading(void)
+{
+    char buf[128];
+    int j, n = 0;
+
+    if (atomic_load(&load_state) >= LOAD_OCTREES) {
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_LIGHTING);
+	preview_render();
+	for (j=0; j<sc->nobjects; j++)
+	    n += sc->models[sc->objects[j].model].npreview;
+    }
+    glDisable(GL_LIGHTING);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, win_width, 0, win_height, -1, +1);
+
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glEnable(GL_COLOR_LOGIC_OP);
+    glLogicOp(GL_XOR);
+    if (n > 0)
+	sprintf(buf, "BUILDING OCTREES (%d POINTS SHOWN) [%.1fs]", n,
+		get_timer() - load_start);
+    else
+	sprintf(buf, "LOADING MESHES [%.1fs]", get_timer() - load_start);
+    glRasterPos2f(0, win_height - 12);
+    draw_string(buf, ~0);
+    glDisable(GL_COLOR_LOGIC_OP);
+
+    glutSwapBuffers();
+}
+
 void
 display(void)
 {
@@ -609,6 +576,7 @@ display(void)
     char buf[512];
     int coll, cull, rend;
     int update = !lock;
+    int j;
 
     /* XXX shader load */
     if (pixel_shade) {
@@ -624,6 +592,9 @@ display(void)
 	}
     }
 
+    perfctr_reset(PHASE_LOD_UPDATE);
+    perfctr_reset(PHASE_LOD_EXTRACT);
+
     /* compute eye position */
     spherical(eye, eye_dist, view_theta, view_phi);
     VecScale(gaze, eye, -1);
@@ -669,6 +640,13 @@ display(void)
     glClearColor(1.0, 1.0, 1.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    if (!loaded && atomic_load(&load_state) == LOAD_DONE)
+	finish_loading();
+    if (!loaded) {
+	display_loading();
+	return;
+    }
+
     if (top_view)
 	view_setup(&view_info, eye, gaze, up,
 		   45.0, (real)win_width / (real)win_height, .01, 100.0);
@@ -698,8 +676,17 @@ display(void)
 	if (draw_octree) {
 	    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	    glDisable(GL_LIGHTING);
-	    update_active_list(&view_info);
-	    render_octree(tree->root);
+	    scene_update(sc, &view_info);
+	    for (j=0; j<sc->nobjects; j++) {
+		real mat[16];
+
+		scene_matrix(&sc->objects[j], mat);
+		glPushMatrix();
+		glMultMatrixf(mat);
+		render_octree(&sc->objects[j],
+			      sc->models[sc->objects[j].model].tree->root);
+		glPopMatrix();
+	    }
 	    coll=cull=rend=0;
 	} else {
 	    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -708,7 +695,7 @@ display(void)
 	    if (fullres) {
 		fullres_render();
 		coll=cull=0;
-		rend=m->nt;
+		rend=scene_tris;
 	    } else {
 		lod_render(update, &view_info, &coll, &cull, &rend);
 	    }
@@ -795,15 +782,44 @@ display(void)
     if (!draw_octree) {
 	sprintf(buf,
 		"COLLAPSED %d VIEW-FRUSTUM CULLED %d RENDERED %d [%d%%]",
-		coll, cull, rend, (int)(100 * (double)rend / (double)m->nt));
+		coll, cull, rend, (int)(100 * (double)rend / (double)scene_tris));
 	glRasterPos2f(0, win_height - 12);
 	draw_string(buf, ~0);
 
-	sprintf(buf, "DETAIL=%.2g SILHOUETTE=%.2g",
-		detail_threshold * win_width * win_height,
-		silhouette_threshold * win_width * win_height);
+	sprintf(buf, "DETAIL=%.2g SILHOUETTE=%.2g FRONT=%s (%d REBUILDS) "
+		"CACHE=%s (%d RESTORES)",
+		sc->detail_threshold * win_width * win_height,
+		sc->silhouette_threshold * win_width * win_height,
+		sc->reseed_mode == RESEED_NEVER ? "INCREMENTAL" :
+		sc->reseed_mode == RESEED_HYBRID ? "HYBRID" : "TOP-DOWN",
+		sc->num_reseeds, sc->front_caching ? "ON" : "OFF",
+		sc->num_restores);
 	glRasterPos2f(0, 0);
 	draw_string(buf, ~0);
+
+	if (sc->paged)
+	    sprintf(buf, "PAGES %d OF %d (%.1f MB, CAP %.0f MB) PENDING %d",
+		    sc->paged->resident, sc->paged->npages,
+		    sc->paged->bytes / 1048576.0, sc->paged->cap / 1048576.0,
+		    sc->paged->pending);
+	else if (sc->budget > 0)
+	    sprintf(buf, "OBJECTS %d (%d FRONTS) BUDGET=%d (%d USED, "
+		    "%d EXPANSIONS)", sc->nobjects, sc->nbuckets, sc->budget,
+		    sc->triangles, sc->expansions);
+	else
+	    sprintf(buf, "OBJECTS %d (%d FRONTS) BUDGET=OFF", sc->nobjects,
+		    sc->nbuckets);
+	glRasterPos2f(0, 12);
+	draw_string(buf, ~0);
+
+	if (show_counters) {
+	    draw_counters(buf, "UPDATE", PHASE_LOD_UPDATE);
+	    glRasterPos2f(0, 24);
+	    draw_string(buf, ~0);
+	    draw_counters(buf, "EXTRACT", PHASE_LOD_EXTRACT);
+	    glRasterPos2f(0, 36);
+	    draw_string(buf, ~0);
+	}
     }
 
     if (help) {
@@ -826,14 +842,30 @@ display(void)
 	glRasterPos2f(20, win_height - 12*10);
 	draw_string("[/] TO DECREASE/INCREASE SILHOUETTE THRESHOLD", ~0);
 	glRasterPos2f(20, win_height - 12*11);
-	draw_string("CLICK AND DRAG 1ST MOUSE BUTTON TO CHANGE VIEW", ~0);
+	draw_string("r/R - CYCLE INCREMENTAL/HYBRID/TOP-DOWN FRONT UPDATE", ~0);
 	glRasterPos2f(20, win_height - 12*12);
+	draw_string("k/K - TOGGLE CACHING FRONTS AT VISITED VIEWPOINTS", ~0);
+	glRasterPos2f(20, win_height - 12*13);
+	draw_string("b/B - TOGGLE SCENE-WIDE TRIANGLE BUDGET", ~0);
+	glRasterPos2f(20, win_height - 12*14);
+	draw_string("</> TO DECREASE/INCREASE TRIANGLE BUDGET", ~0);
+	glRasterPos2f(20, win_height - 12*15);
+	draw_string("n/N - TOGGLE SHARING FRONTS AMONG INSTANCES", ~0);
+	glRasterPos2f(20, win_height - 12*16);
+	draw_string("x/X - TOGGLE HARDWARE PERFORMANCE COUNTERS", ~0);
+	glRasterPos2f(20, win_height - 12*17);
+	draw_string("CLICK AND DRAG 1ST MOUSE BUTTON TO CHANGE VIEW", ~0);
+	glRasterPos2f(20, win_height - 12*18);
 	draw_string("CLICK AND DRAG 3RD MOUSE BUTTON TO CHANGE ZOOM", ~0);
     }
 
     glDisable(GL_COLOR_LOGIC_OP);
 
     glutSwapBuffers();
+
+    /* keep drawing until the pages asked for are in */
+    if (sc->paged && sc->paged->pending)
+	glutPostRedisplay();
 }
 
 void
@@ -878,204 +910,247 @@ render_aabb(const vec3 min, const vec3 max)
     glEnd();
 }
 
+/* point the vertex and normal arrays at the buffers of model j */
 void
-lod_render(int update,
-	   const view_params *vp, int *collapsed, int *culled, int *rendered)
+bind_model(int j)
 {
-    int j, k, ti;
-    octree_node *c,*n0,*n1,*n2;
-    double t;
-    int pupdates = 0;
-    int nt;
+    const mesh *m = sc->models[j].mesh;
 
-    if (tri_index == NULL)
-	tri_index = malloc(sizeof(*tri_index) * m->nt * 3);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][0]);
+    if (m->qverts)
+	glVertexPointer(4, GL_SHORT, 0, 0);
+    else
+	glVertexPointer(3, GL_FLOAT, 0, 0);
 
-    *collapsed = *culled = *rendered = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[j][1]);
+    if (m->qverts)
+	glNormalPointer(GL_BYTE, 4, 0);
+    else
+	glNormalPointer(GL_FLOAT, 0, 0);
+}
 
-    if (update) {
-	t = get_timer();
-	update_active_list(vp);
-	t = get_timer()-t;
-//	printf("recomputed boundary [%gs]\n", t);
-    }
+/* the matrix of object o for drawing its model's buffers: for compact
+ * models, the one taking quantized positions to the object */
+void
+model_matrix(const scene_object *o, real mat[16])
+{
+    const mesh *m = sc->models[o->model].mesh;
+    int j;
 
-    /* We could be even lazier, and initialize this all to null, check for that
-     * when we are lazily updating proxies, but it think it's alright since it
-     * is only a one-time thing. */
-    if (proxies==NULL) {
-	proxies=malloc(sizeof(*proxies)*m->nv);
-	for (j=0; j<m->nv; j++) {
-	    c=tree->vertex_nodes[j];
-	    while (c->status != STATUS_BOUNDARY)
-		c=c->parent;
-	    proxies[j]=c;
-	}
+    scene_matrix(o, mat);
+    if (m->qverts) {
+	for (j=0; j<3; j++)
+	    mat[12+j] += mat[j]*m->qbox.mid[0] + mat[4+j]*m->qbox.mid[1] +
+			 mat[8+j]*m->qbox.mid[2];
+	for (j=0; j<12; j++)
+	    mat[j] *= m->qbox.scale;
     }
+}
 
-    t = get_timer();
-    nt = 0;
-    for (j=0; j<m->nt; j++) {
-	if (tree->activators[j]->status == STATUS_INACTIVE) {
-	    ++*collapsed;
-	    continue;
-	}
-	n0=proxies[ti = m->tris[j][0]];
-	if (n0->status != STATUS_BOUNDARY) {
-	    if (n0->status == STATUS_ACTIVE) {
-		do {
-		    k = 0;
-		    if (m->verts[ti][0] >= n0->bb_midpt[0]) k|=4;
-		    if (m->verts[ti][1] >= n0->bb_midpt[1]) k|=2;
-		    if (m->verts[ti][2] >= n0->bb_midpt[2]) k|=1;
-		    n0 = n0->subtree[k];
-		} while (n0->status != STATUS_BOUNDARY);
-	    } else {
-		assert(n0->status == STATUS_INACTIVE);
-		do {
-		    n0 = n0->parent;
-		} while (n0->status != STATUS_BOUNDARY);
-	    }
-	    proxies[ti] = n0;
-	    pupdates++;
-	}
-	n1=proxies[ti = m->tris[j][1]];
-	if (n1->status != STATUS_BOUNDARY) {
-	    if (n1->status == STATUS_ACTIVE) {
-		do {
-		    k = 0;
-		    if (m->verts[ti][0] >= n1->bb_midpt[0]) k|=4;
-		    if (m->verts[ti][1] >= n1->bb_midpt[1]) k|=2;
-		    if (m->verts[ti][2] >= n1->bb_midpt[2]) k|=1;
-		    n1 = n1->subtree[k];
-		} while (n1->status != STATUS_BOUNDARY);
-	    } else {
-		assert(n1->status == STATUS_INACTIVE);
-		do {
-		    n1 = n1->parent;
-		} while (n1->status != STATUS_BOUNDARY);
-	    }
-	    proxies[ti] = n1;
-	    pupdates++;
-	}
-	if (n0 == n1 || n0->rep_vindex == n1->rep_vindex) {
-	    ++*collapsed;
-	    continue;
-	}
-	n2=proxies[ti = m->tris[j][2]];
-	if (n2->status != STATUS_BOUNDARY) {
-	    if (n2->status == STATUS_ACTIVE) {
-		do {
-		    k = 0;
-		    if (m->verts[ti][0] >= n2->bb_midpt[0]) k|=4;
-		    if (m->verts[ti][1] >= n2->bb_midpt[1]) k|=2;
-		    if (m->verts[ti][2] >= n2->bb_midpt[2]) k|=1;
-		    n2 = n2->subtree[k];
-		} while (n2->status != STATUS_BOUNDARY);
-	    } else {
-		assert(n2->status == STATUS_INACTIVE);
-		do {
-		    n2 = n2->parent;
-		} while (n2->status != STATUS_BOUNDARY);
-	    }
-	    proxies[ti] = n2;
-	    pupdates++;
+/* draw the simplified triangles of every object in a bucket; with
+ * instancing, in one call, taking the object matrices from instance_vbo */
+void
+draw_bucket(const scene_bucket *b, int nt, int instanced)
+{
+    const scene_object *o;
+    real mat[16];
+    int j;
+
+    if (instanced) {
+	size_t offset = (b->objects - sc->bucket_objects)*sizeof(mat);
+
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	for (j=0; j<4; j++) {
+	    glEnableVertexAttribArray(instance_matrix+j);
+	    glVertexAttribPointer(instance_matrix+j, 4, GL_FLOAT, GL_FALSE,
+				  sizeof(mat),
+				  (const GLvoid *)(offset + 4*j*sizeof(real)));
+	    glVertexAttribDivisor(instance_matrix+j, 1);
 	}
-	if (n0==n2 || n1==n2 || n0->rep_vindex == n2->rep_vindex ||
-	    n1->rep_vindex == n2->rep_vindex) { ++*collapsed; continue; }
-
-#if 0
-	if (!vf_point_inside(vp, m->verts[n0->rep_vindex]) &&
-	    !vf_point_inside(vp, m->verts[n1->rep_vindex]) &&
-	    !vf_point_inside(vp, m->verts[n2->rep_vindex])) {
-	    ++*culled; continue;
+	glDrawElementsInstanced(GL_TRIANGLES, nt, GL_UNSIGNED_INT,
+				b->lod->tri_index, b->nobjects);
+	for (j=0; j<4; j++) {
+	    glVertexAttribDivisor(instance_matrix+j, 0);
+	    glDisableVertexAttribArray(instance_matrix+j);
 	}
-#endif
+	return;
+    }
 
-#if 0
-	glNormal3fv(n0->rep_vnormal);
-	glArrayElement(n0->rep_vindex);
-	glNormal3fv(n1->rep_vnormal);
-	glArrayElement(n1->rep_vindex);
-	glNormal3fv(n2->rep_vnormal);
-	glArrayElement(n2->rep_vindex);
-#else
-	tri_index[nt++] = n0->rep_vindex;
-	tri_index[nt++] = n1->rep_vindex;
-	tri_index[nt++] = n2->rep_vindex;
-#endif
+    for (j=0; j<b->nobjects; j++) {
+	o = &sc->objects[b->objects[j]];
+	model_matrix(o, mat);
+	glPushMatrix();
+	glMultMatrixf(mat);
+	glDrawElements(GL_TRIANGLES, nt, GL_UNSIGNED_INT, b->lod->tri_index);
+	glPopMatrix();
+    }
+}
+
+void
+lod_render(int update,
+	   const view_params *vp, int *collapsed, int *culled, int *rendered)
+{
+    int j, nt;
+    int instanced = sc->instancing;
+    GLint program = 0;
+    const scene_bucket *b;
+    real *mat;
+
+    TRACE_BEGIN("lod_render");
+    if (update)
+	scene_update(sc, vp);
+
+    *collapsed = *culled = *rendered = 0;
 
-	++*rendered;
+    if (instanced) {
+	if (instance_program == 0)
+	    init_instance_shader();
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	glUseProgram(instance_program);
+	glUniform1i(glGetUniformLocation(instance_program, "Lighting"),
+		    glIsEnabled(GL_LIGHTING));
+
+	/* all object matrices, in bucket order */
+	mat = malloc(sizeof(*mat)*16*sc->nobjects);
+	for (j=0; j<sc->nobjects; j++)
+	    model_matrix(&sc->objects[sc->bucket_objects[j]], &mat[16*j]);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(*mat)*16*sc->nobjects, mat,
+		     GL_STREAM_DRAW);
+	free(mat);
     }
 
     glEnableClientState(GL_VERTEX_ARRAY);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[0]);
-    glVertexPointer(3, GL_FLOAT, 0, 0);
-
     glEnableClientState(GL_NORMAL_ARRAY);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[1]);
-    glNormalPointer(GL_FLOAT, 0, 0);
-
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-    glPushMatrix();
-    glTranslatef(-tree->root->bb_midpt[0],
-		 -tree->root->bb_midpt[1],
-		 -tree->root->bb_midpt[2]);
-    glDrawElements(GL_TRIANGLES, nt, GL_UNSIGNED_INT, tri_index);
-    glPopMatrix();
+    for (j=0; j<sc->nbuckets; j++) {
+	b = &sc->buckets[j];
+	nt = lod_extract(b->lod);
+	*collapsed += b->lod->collapsed * b->nobjects;
+	*rendered += b->lod->rendered * b->nobjects;
+
+	bind_model(b->key[0]);
+
+	TRACE_BEGIN("draw");
+	draw_bucket(b, nt, instanced);
+	TRACE_END();
+    }
+    scene_publish(sc);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glDisableClientState(GL_NORMAL_ARRAY);
     glDisableClientState(GL_VERTEX_ARRAY);
 
-    t = get_timer()-t;
-    printf("lod render [%gs] (%d proxy updates)\n", t, pupdates);
+    if (instanced)
+	glUseProgram(program);
+
+    if (sc->paged) {
+	real matrix[16];
+
+	nt = paged_extract(sc->paged);
+	*collapsed += sc->paged->collapsed;
+	*rendered += sc->paged->rendered;
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, sc->paged->verts);
+	glNormalPointer(GL_FLOAT, 0, sc->paged->normals);
+	scene_matrix(&sc->paged_object, matrix);
+	glPushMatrix();
+	glMultMatrixf(matrix);
+	TRACE_BEGIN("draw");
+	glDrawArrays(GL_TRIANGLES, 0, 3*nt);
+	TRACE_END();
+	glPopMatrix();
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+    TRACE_END();
 }
 
 void
 fullres_render()
 {
-    double t = get_timer();
+    const scene_object *o;
+    real mat[16];
+    int j;
 
+    TRACE_BEGIN("fullres_render");
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_NORMAL_ARRAY);
 
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[0]);
-    glVertexPointer(3, GL_FLOAT, 0, 0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_id[1]);
-    glNormalPointer(GL_FLOAT, 0, 0);
+    for (j=0; j<sc->nobjects; j++) {
+	o = &sc->objects[j];
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[2]);
+	bind_model(o->model);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id[o->model][2]);
 
-    glPushMatrix();
-    glTranslatef(-tree->root->bb_midpt[0],
-		 -tree->root->bb_midpt[1],
-		 -tree->root->bb_midpt[2]);
-    glDrawElements(GL_TRIANGLES, m->nt*3, GL_UNSIGNED_INT, 0);
-    glPopMatrix();
+	model_matrix(o, mat);
+	glPushMatrix();
+	glMultMatrixf(mat);
+	TRACE_BEGIN("draw");
+	glDrawElements(GL_TRIANGLES, sc->models[o->model].mesh->nt*3,
+		       GL_UNSIGNED_INT, 0);
+	TRACE_END();
+	glPopMatrix();
+    }
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     glDisableClientState(GL_VERTEX_ARRAY);
     glDisableClientState(GL_NORMAL_ARRAY);
 
-    t = get_timer()-t;
-    printf("full-res render [%gs]\n", t);
+    TRACE_END();
 }
 
 void
-render_octree(const octree_node *o)
+preview_render()
 {
+    const scene_model *m;
+    real mat[16];
+    int j;
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glPointSize(2);
+
+    for (j=0; j<sc->nobjects; j++) {
+	m = &sc->models[sc->objects[j].model];
+
+	glVertexPointer(3, GL_FLOAT, 0, m->preview_points);
+	glNormalPointer(GL_FLOAT, 0, m->preview_normals);
+
+	scene_matrix(&sc->objects[j], mat);
+	glPushMatrix();
+	glMultMatrixf(mat);
+	glDrawArrays(GL_POINTS, 0, m->npreview);
+	glPopMatrix();
+    }
+
+    glPointSize(1);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+}
+
+void
+render_octree(const scene_object *so, const octree_node *o)
+{
+    const lod_context *lod = sc->buckets[so->bucket].lod;
+
     if (o == NULL)
 	return;
 
-    if (o->status == STATUS_BOUNDARY) {
+    if (lod->status[o->id] == STATUS_BOUNDARY) {
 	if (o->leaf) {
+	    vec3 p;
+
+	    MeshVertex(p, sc->models[so->model].mesh, o->rep_vindex);
 	    glColor3f(0.7f, 0.0f, 1.0f);
 	    glBegin(GL_POINTS);
-	    glVertex3fv(m->verts[o->rep_vindex]);
+	    glVertex3fv(p);
 	    glEnd();
 	} else {
 	    vec3 min, max;
@@ -1087,7 +1162,7 @@ render_octree(const octree_node *o)
 	int j;
 
 	for (j=0; j<8; j++)
-	    render_octree(o->subtree[j]);
+	    render_octree(so, o->subtree[j]);
     }
 }
 
@@ -1110,6 +1185,10 @@ key_press(unsigned char key, int x, int y)
 	case 27:
 	case 'q':
 	case 'Q':
+#ifdef LOD_TRACE
+	    trace_dump(getenv("LOD_TRACE_FILE") ? getenv("LOD_TRACE_FILE") :
+		       "lod-trace.json");
+#endif
 	    exit(0);
 
 	case 'h':
@@ -1129,7 +1208,7 @@ key_press(unsigned char key, int x, int y)
 
 	case 'f':
 	case 'F':
-	    fullres = !fullres;
+	    fullres = !fullres && !sc->paged;
 	    break;
 
 	case 'o':
@@ -1149,17 +1228,10 @@ key_press(unsigned char key, int x, int y)
 
 	case 'i':
 	case 'I':
-	    octree_free(tree);
-	    free(proxies);
-	    proxies=NULL;
-
-	    mesh_flip(m);
-	    tree=octree_create(m);
-	    while (active_list) {
-		active_node *next = active_list->next;
-		free(active_list);
-		active_list = next;
-	    }
+	    /* the octrees may still be being built */
+	    if (!loaded)
+		break;
+	    scene_flip(sc);
 	    delete_vbos();
 	    create_vbos();
 	    break;
@@ -1169,40 +1241,65 @@ key_press(unsigned char key, int x, int y)
 	    pixel_shade = !pixel_shade;
 	    break;
 
+	case 'r':
+	case 'R':
+	    sc->reseed_mode = (sc->reseed_mode+1) % 3;
+	    break;
+
+	case 'k':
+	case 'K':
+	    sc->front_caching = !sc->front_caching;
+	    break;
+
 	case '-':
-	    detail_threshold /= 0.9;
+	    sc->detail_threshold /= 0.9;
 	    break;
 
 	case '+':
-	    detail_threshold *= 0.9;
+	    sc->detail_threshold *= 0.9;
 	    break;
 
 	case '[':
-	    silhouette_threshold /= 0.9;
+	    sc->silhouette_threshold /= 0.9;
 	    break;
 
 	case ']':
-	    silhouette_threshold *= 0.9;
+	    sc->silhouette_threshold *= 0.9;
 	    break;
 
-	default:
-	    return;
-    }
+	case 'n':
+	case 'N':
+	    sc->instancing = !sc->instancing;
+	    break;
 
-    glutPostRedisplay();
-}
+	case 'x':
+	case 'X':
+	    if (!show_counters && !perfctr_enable()) {
+		printf("hardware counters unavailable\n");
+		break;
+	    }
+	    show_counters = !show_counters;
+	    break;
 
-int
-tree_depth(const octree_node *o)
-{
-    int max = 0, d, j;
+	case 'b':
+	case 'B':
+	    sc->budget = sc->budget ? 0 : budget;
+	    break;
+
+	case '<':
+	    budget = budget * 0.9;
+	    if (budget < 1) budget = 1;
+	    if (sc->budget) sc->budget = budget;
+	    break;
 
-    if (o == NULL) return 0;
-    if (o->leaf) return 1;
+	case '>':
+	    budget = budget / 0.9 + 1;
+	    if (sc->budget) sc->budget = budget;
+	    break;
 
-    for (j=0; j<8; j++) {
-	d = tree_depth(o->subtree[j]);
-	if (max < d) max = d;
+	default:
+	    return;
     }
-    return 1+max;
+
+    glutPostRedisplay();
 }
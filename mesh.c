@@ -1,440 +1,412 @@
-#include <assert.h>
-#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "mesh.h"
-
-static void face_normals(mesh *m);
+#include "parallel.h"
+#include "ply.h"
+#include "trace.h"
+
+/* vertices or triangles per parallel task */
+#define CHUNK		65536
+/* tasks the bounding box is split into at most */
+#define BBOX_TASKS	64
+/* slices of the triangles summed into vertex normals separately, at most */
+#define NORMAL_SLICES	8
+/* chunks in flight between the stages of mesh_load() */
+#define LOAD_CHUNKS	4
+
+static void face_normals(mesh *m, int normalize);
+static int  finish_normals(mesh *m);
 static void vertex_normals(mesh *m);
 static void vertex_bbox(mesh *m);
+static void set_qnormal(mesh *m, unsigned v, uint32_t o);
+
+/* mesh_load() reads the file a chunk at a time on a stage of its own,
+ * taking the bounds of each chunk of vertices and the face normals of each
+ * chunk of triangles as they arrive. Vertices are read into the mesh
+ * itself, triangles into the chunks and then copied out, as polygons may
+ * leave more of them than there are faces. With one thread, the chunks are
+ * read and taken in turn. */
+typedef struct {
+    int		  faces;		/* else vertices		    */
+    unsigned	  first, n;
+    index3u	 *tris;
+} load_chunk;
+
+typedef struct {
+    mesh	 *m;
+    ply_reader	 *r;
+    load_chunk	  chunks[LOAD_CHUNKS];
+    queue	 *full, *empty;
+    unsigned	  vread;		/* vertices read		    */
+    unsigned	  size;			/* of the triangle arrays	    */
+    int		  error;		/* in reading ..		    */
+    int		  nomem;		/* .. or taking the chunks	    */
+} load_job;
+
+/* the next chunk, into c; NULL at the end, or on error */
+static load_chunk *
+read_chunk(load_job *job, load_chunk *c)
+{
+    mesh *m = job->m;
+    int k;
+
+    if (job->vread < m->nv) {
+	c->faces = 0;
+	c->first = job->vread;
+	c->n = m->nv - c->first < CHUNK ? m->nv - c->first : CHUNK;
+	if (!ply_read_vertices(job->r, c->n, m->verts + c->first,
+			       m->vnormals ? m->vnormals + c->first : NULL,
+			       m->vcolors ? m->vcolors + c->first : NULL)) {
+	    job->error = 1;
+	    return NULL;
+	}
+	job->vread += c->n;
+	return c;
+    }
+    if ((k = ply_read_faces(job->r, CHUNK, c->tris)) <= 0) {
+	job->error = k < 0;
+	return NULL;
+    }
+    c->faces = 1;
+    c->n = k;
+    return c;
+}
 
-enum Field {
-    X,Y,Z,
-    NX,NY,NZ,
-    RED,GREEN,BLUE,
-    IGNORED
-};
-
-static const char *const kFieldStrings[] = {
-  "x","y","z",
-  "nx","ny","nz",
-  "red","green","blue",
-  "ignored"
-};
-// static const unsigned kNumFieldStrings = sizeof(kFieldStrings)/sizeof(kFieldStrings[0]);
-
-enum FieldType {
-    BYTE,
-    FLOAT,
-};
-static const char *const kFieldTypeStrings[] = {
-  "Byte", "Float",
-};
-// static const unsigned kNumFieldTypeStrings = sizeof(kFieldTypeStrings)/sizeof(kFieldTypeStrings[0]);
-
-struct FieldAndType {
-    enum Field field;
-    enum FieldType type;
-};
-
-static const char kComment[] = "comment";
-static const char kElementVertex[] = "element vertex ";
-static const char kElementFace[] = "element face ";
-static const char kPropertyList[] = "property list ";
+static void
+take_chunk(load_job *job, const load_chunk *c)
+{
+    mesh *m = job->m;
+
+    if (!c->faces) {
+	if (c->first == 0) {
+	    VecSet(m->min, m->verts[0]);
+	    VecSet(m->max, m->verts[0]);
+	}
+	for (unsigned j=c->first; j<c->first+c->n; j++)
+	    for (int k=0; k<3; k++) {
+		m->min[k] = m->min[k] < m->verts[j][k] ? m->min[k] :
+							  m->verts[j][k];
+		m->max[k] = m->max[k] > m->verts[j][k] ? m->max[k] :
+							  m->verts[j][k];
+	    }
+	return;
+    }
+    if (job->nomem)
+	return;
+    if (m->nt + c->n > job->size) {
+	unsigned size = job->size + job->size/2 + c->n;
+	index3u *tris = realloc(m->tris, sizeof(*tris)*size);
+	vec3 *tnormals = tris ? realloc(m->tnormals, sizeof(*tnormals)*size) :
+				NULL;
+
+	if (tris)
+	    m->tris = tris;
+	if (!tris || !tnormals) {
+	    job->nomem = 1;
+	    return;
+	}
+	m->tnormals = tnormals;
+	job->size = size;
+    }
+    memcpy(m->tris + m->nt, c->tris, sizeof(*c->tris)*c->n);
+    /* not normalized, for finish_normals() */
+    for (unsigned j=m->nt; j<m->nt+c->n; j++)
+	Normal(m->tnormals[j], m->verts[m->tris[j][0]],
+	       m->verts[m->tris[j][1]], m->verts[m->tris[j][2]]);
+    m->nt += c->n;
+}
+
+static void
+read_stage(void *arg)
+{
+    load_job *job = arg;
+    load_chunk *c;
+
+    while ((c = queue_get(job->empty)) != NULL &&
+	   (c = read_chunk(job, c)) != NULL)
+	queue_put(job->full, c);
+    queue_close(job->full);
+}
 
 mesh *
 mesh_load(const char *file)
 {
+    TRACE_BEGIN("mesh_load");
     mesh *const m=malloc(sizeof(*m));
-    FILE *const fp=fopen(file, "r");
-    if (!m || !fp)
+    load_job job;
+    load_chunk *c;
+    stage *s = NULL;
+    int normals, colors;
+    memset(&job, 0, sizeof(job));
+    if (!m)
 	goto fail;
     memset(m, 0, sizeof(*m));
 
-    char buf[256]={0};
-    if (!fgets(buf, sizeof(buf), fp) || strcmp(buf, "ply\n"))
-	goto fail;
-    if (!fgets(buf, sizeof(buf), fp))
-	goto fail;
-    bool ascii = !strcmp(buf, "format ascii 1.0\n");
-    bool binary_le = !strcmp(buf, "format binary_little_endian 1.0\n");
-    bool binary_be = !strcmp(buf, "format binary_big_endian 1.0\n");
-    if (!ascii && !binary_le && !binary_be) {
-	fprintf(stderr, "expected ascii, binary_little_endian, or binary_big_endian 1.0 format!\n");
-	goto fail;
-    }
-    do {
-	fgets(buf, sizeof(buf), fp);
-    } while (strncmp(buf, kComment, strlen(kComment)) == 0);
-
-    /* read number of vertices */
-    if (strncmp(buf, kElementVertex, strlen(kElementVertex)) == 0) {
-	m->nv=strtoul(buf+strlen(kElementVertex), NULL, 10);
-    } else {
-	fprintf(stderr, "Expected line starting with: '%s', got: %s\n", kElementVertex, buf);
-    }
-    if (m->nv <= 0)
+    job.m = m;
+    job.r=ply_open(file, &m->nv, &job.size, &normals, &colors);
+    if (!job.r)
 	goto fail;
-
-    const unsigned kMaxVertexFields = 32;
-    struct FieldAndType fields[kMaxVertexFields];
-    memset(fields, 0, sizeof(fields));
-
-    int xField = -1, yField = -1, zField = -1;
-    int nxField = -1, nyField = -1, nzField = -1;
-    int rField = -1, gField = -1, bField = -1;
-    unsigned nfields = 0;
-    for (unsigned i=0; fgets(buf,sizeof(buf),fp) && strncmp(buf,"property ",9)==0; ++i) {
-	if (nfields == kMaxVertexFields) {
-	    fprintf(stderr, "Too many per-vertex fields\n");
-	    goto fail;
-	}
-	char type[256]={0}, field[256]={0};
-	sscanf(buf, "property %255s %255s\n", type, field);
-	bool isFloat = false;
-	bool isByte = false;
-	if ((strcmp("float", type) == 0 || strcmp("float32", type) == 0)) {
-	    isFloat = true;
-	} else if (strcmp("uint8", type) == 0 || strcmp("uchar", type) == 0) {
-	    isByte = true;
-	} else {
-	    fprintf(stderr, "only float and uchar properties are supported at this time\n");
-	    goto fail;
-	}
-	if (!strcmp("x", field)) {
-	    if (xField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = X; fields[nfields].type = FLOAT; xField = nfields++;
-	} else if (!strcmp("y", field)) {
-	    if (yField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = Y; fields[nfields].type = FLOAT; yField = nfields++;
-	} else if (!strcmp("z", field)) {
-	    if (zField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = Z; fields[nfields].type = FLOAT; zField = nfields++;
-	} else if (!strcmp("nx", field)) {
-	    if (nxField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = NX; fields[nfields].type = FLOAT; nxField = nfields++;
-	} else if (!strcmp("ny", field)) {
-	    if (nyField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = NY; fields[nfields].type = FLOAT; nyField = nfields++;
-	} else if (!strcmp("nz", field)) {
-	    if (nzField != -1 || !isFloat) goto fail;
-	    fields[nfields].field = NZ; fields[nfields].type = FLOAT; nzField = nfields++;
-	} else if (!strcmp("red", field)) {
-	    if (rField != -1 || !isByte) goto fail;
-	    fields[nfields].field = RED; fields[nfields].type = BYTE; rField = nfields++;
-	} else if (!strcmp("green", field)) {
-	    if (gField != -1 || !isByte) goto fail;
-	    fields[nfields].field = GREEN; fields[nfields].type = BYTE; gField = nfields++;
-	} else if (!strcmp("blue", field)) {
-	    if (bField != -1 || !isByte) goto fail;
-	    fields[nfields].field = BLUE; fields[nfields].type = BYTE; bField = nfields++;
-	} else {
-	    fprintf(stderr, "Warning: ignoring field %s %s\n", type, field);
-	    fields[nfields].field = IGNORED; fields[nfields].type = isFloat ? FLOAT : BYTE; nfields++;
-	}
-    }
-    printf("{x,y,z}={%d,%d,%d} {nx,ny,nz}={%d,%d,%d} {r,g,b}={%d,%d,%d}\n",
-	   xField, yField, zField,
-	   nxField, nyField, nzField,
-	   rField, gField, bField);
-    for (unsigned i=0; i<nfields; ++i) {
-	printf("Field %u: %s %s\n",
-	       i, kFieldStrings[fields[i].field], kFieldTypeStrings[fields[i].type]);
-    }
-    if (xField<0 || yField<0 || zField<0) {
-	fprintf(stderr, "Missing X, Y, or Z field(s)\n");
-	goto fail;
-    }
     m->verts=malloc(sizeof(*m->verts)*m->nv);
-
-    if (nxField>=0 || nyField>=0 || nzField>=0) {
-	if (nxField<0 || nyField<0 || nzField<0) {
-	    fprintf(stderr, "Bad NX, NY, or NZ field(s)\n");
-	    goto fail;
-	}
+    if (normals)
 	m->vnormals=malloc(sizeof(*m->vnormals)*m->nv);
-    }
-
-    if (rField>=0 || gField>=0 || bField>=0) {
-	if (rField<0 || gField<0 || bField<0) {
-	    fprintf(stderr, "Bad R, G, or B field(s)\n");
-	    goto fail;
-	}
+    if (colors)
 	m->vcolors=malloc(sizeof(*m->vcolors)*m->nv);
-    }
+    /* as many triangles as faces, unless some are polygons */
+    m->tris=malloc(sizeof(*m->tris)*job.size);
+    m->tnormals=malloc(sizeof(*m->tnormals)*job.size);
+    if (!m->verts || !m->tris || !m->tnormals ||
+	(normals && !m->vnormals) || (colors && !m->vcolors))
+	goto fail;
+    for (int i=0; i<LOAD_CHUNKS; i++)
+	if ((job.chunks[i].tris = malloc(sizeof(index3u)*CHUNK)) == NULL)
+	    goto fail;
 
-    if (strncmp(buf, kElementFace, strlen(kElementFace)) == 0) {
-	m->nt=strtoul(buf+strlen(kElementFace), NULL, 10);
+    /* read the vertices and triangles, each chunk taken as it comes */
+    TRACE_BEGIN("read");
+    if ((job.full = queue_create(LOAD_CHUNKS)) != NULL &&
+	(job.empty = queue_create(LOAD_CHUNKS)) != NULL &&
+	(s = stage_start(read_stage, &job)) != NULL) {
+	for (int i=0; i<LOAD_CHUNKS; i++)
+	    queue_put(job.empty, &job.chunks[i]);
+	while ((c = queue_get(job.full)) != NULL) {
+	    take_chunk(&job, c);
+	    queue_put(job.empty, c);
+	}
+	stage_join(s);
     } else {
-	fprintf(stderr, "Expected: '%s', but got: %s\n", kElementFace, buf);
+	while ((c = read_chunk(&job, &job.chunks[0])) != NULL)
+	    take_chunk(&job, c);
     }
-    if (m->nt <= 0)
+    TRACE_END();
+    if (job.error || job.nomem)
 	goto fail;
 
-    bool got_face_format = false;
-    unsigned before_tri_skip = 0, after_tri_skip = 0;
-    for (;;) {
-	if (!fgets(buf, sizeof(buf), fp))
-	    goto fail;
-	if (strncmp(buf, kPropertyList, strlen(kPropertyList)) == 0) {
-	    char s0[32] = {0}, s1[32] = {0}, s2[32] = {0};
-	    if (sscanf(buf + strlen(kPropertyList), "%31s %31s %31s\n", s0, s1, s2) != 3) {
-		fprintf(stderr, "Ignoring property list line: %s", buf);
-		continue;
-	    }
-	    if (strcmp(s0, "uchar") && strcmp(s0, "uint8")) {
-		fprintf(stderr, "only uchar or uint8 vertex count type is supported\n");
-		goto fail;
-	    }
-	    if (strcmp(s1, "int") && strcmp(s1, "int32")) {
-		fprintf(stderr, "only int or int32 vertex index type is supported\n");
-		goto fail;
-	    }
-	    if (strcmp(s2, "vertex_index") && strcmp(s2, "vertex_indices")) {
-		fprintf(stderr, "only vertex_index or vertex_indices are supported\n");
-		goto fail;
-	    }
-	    got_face_format = true;
-	} else if (strncmp(buf, "property uchar ", 15) == 0 ||
-		   strncmp(buf, "property uint8 ", 15) == 0) {
-	    fprintf(stderr, "ignoring: %s\n", buf);
-	    if (got_face_format)
-		after_tri_skip += 1;
-	    else
-		before_tri_skip += 1;
-	} else if (strncmp(buf, "property float ", 15) == 0 ||
-		   strncmp(buf, "property float32 ", 17) == 0) {
-	    fprintf(stderr, "ignoring: %s\n", buf);
-	    if (got_face_format)
-		after_tri_skip += 4;
-	    else
-		before_tri_skip += 4;
-	} else if (strcmp(buf, "end_header\n") == 0) {
-	    break;
-	} else {
-	    fprintf(stderr, "Warning: ignoring PLY line: %s\n", buf);
-	}
-    }
-    if (!got_face_format)
+    if (!mesh_weld(m, 0) || !finish_normals(m))
 	goto fail;
 
-    while (strcmp(buf, "end_header\n")) {
-	fprintf(stderr, "Warning: ignoring PLY line: %s\n", buf);
-	if (!fgets(buf, sizeof(buf), fp))
-	    goto fail;
-    }
+    ply_close(job.r);
+    for (int i=0; i<LOAD_CHUNKS; i++)
+	free(job.chunks[i].tris);
+    queue_free(job.full);
+    queue_free(job.empty);
+    TRACE_END();
+    return m;
 
-    /* read vertices */
-    if (ascii) {
-	for (unsigned i=0; i<m->nv; i++) {
-	    double dfields[11];
-	    if (!fgets(buf, sizeof(buf), fp))
-		goto fail;
-	    char *ptr=buf;
-	    for (unsigned j=0; j<nfields; j++)
-		dfields[j]=strtod(ptr,&ptr);
-
-	    m->verts[i][0]=dfields[xField];
-	    m->verts[i][1]=dfields[yField];
-	    m->verts[i][2]=dfields[zField];
-
-	    if (m->vnormals) {
-		m->vnormals[i][0]=dfields[nxField];
-		m->vnormals[i][1]=dfields[nyField];
-		m->vnormals[i][2]=dfields[nzField];
-	    }
-	    if (m->vcolors) {
-		m->vcolors[i][0]=(uint8_t)dfields[rField];
-		m->vcolors[i][1]=(uint8_t)dfields[gField];
-		m->vcolors[i][2]=(uint8_t)dfields[bField];
-	    }
-	    assert(!m->vtexcoords);
-	}
-    } else {
-	for (unsigned i=0; i<m->nv; ++i) {
-	    for (unsigned j=0; j<nfields; ++j) {
-		union {
-		    float f;
-		    uint8_t b[4];
-		} v;
-		if (fields[j].type == FLOAT) {
-		    if (fread(&v.f, sizeof(v.f), 1, fp) != 1) {
-			fprintf(stderr, "float I/O error\n");
-			goto fail;
-		    }
-		    if (binary_be) { // XXX assumes little-endian machine.
-			uint8_t t;
-			t = v.b[0]; v.b[0] = v.b[3]; v.b[3] = t;
-			t = v.b[1]; v.b[1] = v.b[2]; v.b[2] = t;
-		    }
-		} else {
-		    assert(fields[j].type == BYTE);
-		    if (fread(&v.b[0], 1, 1, fp) != 1) {
-			fprintf(stderr, "byte I/O error\n");
-			goto fail;
-		    }
-		}
-		switch (fields[j].field) {
-		    case X: m->verts[i][0] = v.f; break;
-		    case Y: m->verts[i][1] = v.f; break;
-		    case Z: m->verts[i][2] = v.f; break;
-
-		    case NX: m->vnormals[i][0] = v.f; break;
-		    case NY: m->vnormals[i][1] = v.f; break;
-		    case NZ: m->vnormals[i][2] = v.f; break;
-
-		    case RED: m->vcolors[i][0] = v.b[0]; break;
-		    case GREEN: m->vcolors[i][1] = v.b[0]; break;
-		    case BLUE: m->vcolors[i][2] = v.b[0]; break;
-
-		    case IGNORED: break;
-
-		    default:
-			assert(false && "This should never happen!");
-		}
-	    }
-	}
-    }
+fail:
+    mesh_free(m);
+    ply_close(job.r);
+    for (int i=0; i<LOAD_CHUNKS; i++)
+	free(job.chunks[i].tris);
+    queue_free(job.full);
+    queue_free(job.empty);
+    TRACE_END();
+    return NULL;
+}
 
-    m->tris=malloc(sizeof(*m->tris)*m->nt);
-    /* read triangles */
-    for (unsigned i=0; i<m->nt; i++) {
-	if (ascii) {
-	    if (!fgets(buf, sizeof(buf), fp))
-		goto fail;
-	    unsigned num_vertices;
-	    int r = sscanf(buf, "%u %u %u %u", &num_vertices,
-			   &m->tris[i][0], &m->tris[i][1], &m->tris[i][2]);
-	    if (r != 4 || num_vertices != 3) {
-		fprintf(stderr, "triangle %u failed to read: %s\n", i, buf);
-		goto fail;
-	    }
-	} else {
-	    if (before_tri_skip + (i > 0 ? after_tri_skip : 0))
-		fseek(fp, before_tri_skip + (i > 0 ? after_tri_skip : 0), SEEK_CUR);
-
-	    uint8_t num_vertices;
-	    union { uint8_t b[4]; uint32_t i; } t[3];
-	    if (fread(&num_vertices, sizeof(num_vertices), 1, fp) != 1 || num_vertices != 3) {
-		fprintf(stderr, "triangle vertex I/O error: %u\n", num_vertices);
-		goto fail;
-	    }
-	    if (fread(&t[0], sizeof(t), 1, fp) != 1) {
-		fprintf(stderr, "triangle index I/O error\n");
-		goto fail;
-	    }
-	    if (after_tri_skip && i+1 == m->nt)
-		fseek(fp, after_tri_skip, SEEK_CUR);
-	    // printf("tris=%u %u %u\n", t[0].i, t[1].i, t[2].i);
-	    if (binary_be) {
-		for (unsigned j=0; j<3; ++j) {
-		    uint8_t tmp;
-		    tmp = t[j].b[0]; t[j].b[0] = t[j].b[3]; t[j].b[3] = tmp;
-		    tmp = t[j].b[1]; t[j].b[1] = t[j].b[2]; t[j].b[2] = tmp;
-		}
-		// printf("tris=%u %u %u\n", t[0].i, t[1].i, t[2].i);
-	    }
-	    for (unsigned j=0; j<3; ++j)
-		m->tris[i][j] = t[j].i;
-	}
-	if (m->tris[i][0]==m->tris[i][1] ||
-	    m->tris[i][0]==m->tris[i][2] ||
-	    m->tris[i][1]==m->tris[i][2]) {
-	    fprintf(stderr, "triangle %u is degenerate: %u %u %u\n",
-		    i, m->tris[i][0], m->tris[i][1], m->tris[i][2]);
-	    goto fail;
-	}
-	// Hack for killeroo
-	// m->tris[i][0]--;
-	// m->tris[i][1]--;
-	// m->tris[i][2]--;
-	for (unsigned j = 0; j < 3; ++j) {
-	    if (m->tris[i][j] >= m->nv) {
-		fprintf(stderr, "triangle %u index %u (%u) out of range\n",
-			i, j, m->tris[i][j]);
-		goto fail;
-	    }
-	}
-    }
+int
+mesh_finish(mesh *m)
+{
+    int ok;
 
+    /* as mesh_load() does, so a mesh is the same read or built */
+    if (!mesh_weld(m, 0))
+	return 0;
     m->tnormals = malloc(sizeof(*m->tnormals)*m->nt);
     if (!m->tnormals)
-	goto fail;
+	return 0;
 
+    TRACE_BEGIN("normals");
     vertex_bbox(m);
-    face_normals(m);
-    if (!m->vnormals) {
-	m->vnormals = malloc(sizeof(*m->vnormals)*m->nv);
-	if (!m->vnormals)
-	    goto fail;
-	vertex_normals(m);
-    }
-    /* normalize face normals */
-    for (unsigned i=0; i<m->nt; i++)
-	VecNormalize(m->tnormals[i]);
-
-    long position = ftell(fp);
-    fseek(fp, 0, SEEK_END);
-    if (ftell(fp) != position)
-	fprintf(stderr, "warning: %ld byte(s) not read\n", ftell(fp) - position);
-    fclose(fp);
-    return m;
+    face_normals(m, 0);
+    ok = finish_normals(m);
+    TRACE_END();
+    return ok;
+}
 
-fail:
-    mesh_free(m);
-    fclose(fp);
-    return NULL;
+/* end of chunk i of n vertices or triangles (which may be past the last) */
+static unsigned
+chunk_end(int i, unsigned n)
+{
+    return (unsigned)i*CHUNK < n && n - (unsigned)i*CHUNK > CHUNK ?
+	(i+1u)*CHUNK : n;
 }
 
+static unsigned
+chunks(unsigned n)
+{
+    return (n + CHUNK-1) / CHUNK;
+}
+
+/* The normals and bounds are computed in parallel, a chunk of triangles or
+ * vertices to a task. Vertex normals are scattered from a slice of the
+ * triangles per thread, each slice into its own sums (the first into the
+ * normals themselves), which are then added up a chunk of vertices at a
+ * time. With one thread that is the serial loop; with more, the normals may
+ * differ in the last bits, as the sums are added in another order. */
+typedef struct {
+    mesh	 *m;
+    int		  normalize;
+    int		  nslices;
+    vec3	 *sums[NORMAL_SLICES];	/* of each slice of triangles	    */
+    vec3	(*bounds)[2];		/* of each task's vertices ..	    */
+    unsigned	  per;			/* .. of which there are this many  */
+} normals_job;
+
 static void
-face_normals(mesh *m)
+face_normals_task(void *arg, int i)
 {
-    for (unsigned j=0; j<m->nt; j++) {
+    normals_job *job = arg;
+    mesh *m = job->m;
+    unsigned end = chunk_end(i, m->nt);
+
+    for (unsigned j=i*CHUNK; j<end; j++) {
 	real* v0=m->verts[m->tris[j][0]];
 	real* v1=m->verts[m->tris[j][1]];
 	real* v2=m->verts[m->tris[j][2]];
 	Normal(m->tnormals[j], v0, v1, v2);
-//	VecNormalize(m->tnormals[j]);
+	if (job->normalize)
+	    VecNormalize(m->tnormals[j]);
     }
 }
 
 static void
-vertex_normals(mesh *m)
+face_normals(mesh *m, int normalize)
 {
-    for (unsigned j=0; j<m->nv; j++)
-	m->vnormals[j][0]=m->vnormals[j][1]=m->vnormals[j][2]=0;
+    normals_job job = { m, normalize, 0, { NULL }, NULL, 0 };
 
-    for (unsigned j=0; j<m->nt; j++) {
+    parallel_for(chunks(m->nt), face_normals_task, &job);
+}
+
+static void
+normalize_task(void *arg, int i)
+{
+    mesh *m = ((normals_job *)arg)->m;
+    unsigned end = chunk_end(i, m->nt);
+
+    for (unsigned j=i*CHUNK; j<end; j++)
+	VecNormalize(m->tnormals[j]);
+}
+
+/* with the face normals computed but not normalized: normalize them, and
+ * compute the vertex normals unless the mesh has them. 0 if out of memory */
+static int
+finish_normals(mesh *m)
+{
+    normals_job job = { m, 0, 0, { NULL }, NULL, 0 };
+
+    if (m->vnormals) {
+	parallel_for(chunks(m->nt), normalize_task, &job);
+	return 1;
+    }
+    /* vertex normals are weighted by area, so they are summed before the
+     * face normals are normalized, which vertex_normals() then does */
+    m->vnormals = malloc(sizeof(*m->vnormals)*m->nv);
+    if (!m->vnormals)
+	return 0;
+    vertex_normals(m);
+    return 1;
+}
+
+static void
+slice_task(void *arg, int i)
+{
+    normals_job *job = arg;
+    mesh *m = job->m;
+    vec3 *sums = job->sums[i];
+    unsigned begin = (uint64_t)m->nt*i / job->nslices;
+    unsigned end = (uint64_t)m->nt*(i+1) / job->nslices;
+
+    for (unsigned j=0; j<m->nv; j++)
+	VecZero(sums[j]);
+    for (unsigned j=begin; j<end; j++) {
 	unsigned k = m->tris[j][0];
-	VecAdd(m->vnormals[k], m->vnormals[k], m->tnormals[j]);
+	VecAdd(sums[k], sums[k], m->tnormals[j]);
 	k = m->tris[j][1];
-	VecAdd(m->vnormals[k], m->vnormals[k], m->tnormals[j]);
+	VecAdd(sums[k], sums[k], m->tnormals[j]);
 	k = m->tris[j][2];
-	VecAdd(m->vnormals[k], m->vnormals[k], m->tnormals[j]);
+	VecAdd(sums[k], sums[k], m->tnormals[j]);
     }
-
-    for (unsigned j=0; j<m->nv; j++)
-	VecNormalize(m->vnormals[j]);
 }
 
 static void
-vertex_bbox(mesh *m)
+sum_task(void *arg, int i)
 {
-    VecSet(m->min, m->verts[0]);
-    VecSet(m->max, m->verts[0]);
+    normals_job *job = arg;
+    mesh *m = job->m;
+    unsigned end = chunk_end(i, m->nv);
+
+    for (unsigned v=i*CHUNK; v<end; v++) {
+	for (int s=1; s<job->nslices; s++)
+	    VecAdd(m->vnormals[v], m->vnormals[v], job->sums[s][v]);
+	VecNormalize(m->vnormals[v]);
+    }
+    /* the face normals are done with, and can be normalized too */
+    end = chunk_end(i, m->nt);
+    for (unsigned j=i*CHUNK; j<end; j++)
+	VecNormalize(m->tnormals[j]);
+}
 
-    for (unsigned j=0; j<m->nv; j++) {
-	if (m->min[0]>m->verts[j][0]) m->min[0]=m->verts[j][0]; else
-	if (m->max[0]<m->verts[j][0]) m->max[0]=m->verts[j][0];
+static void
+vertex_normals(mesh *m)
+{
+    normals_job job = { m, 0, 0, { NULL }, NULL, 0 };
+    int s;
+
+    job.nslices = parallel_threads() < NORMAL_SLICES ? parallel_threads() :
+							 NORMAL_SLICES;
+    /* short of memory, one slice */
+    job.sums[0] = m->vnormals;
+    for (s=1; s<job.nslices; s++)
+	if ((job.sums[s] = malloc(sizeof(**job.sums)*m->nv)) == NULL)
+	    job.nslices = 1;
+    parallel_for(job.nslices, slice_task, &job);
+    parallel_for(chunks(m->nv > m->nt ? m->nv : m->nt), sum_task, &job);
+    for (s=1; s<NORMAL_SLICES; s++)
+	free(job.sums[s]);
+}
 
-	if (m->min[1]>m->verts[j][1]) m->min[1]=m->verts[j][1]; else
-	if (m->max[1]<m->verts[j][1]) m->max[1]=m->verts[j][1];
+static void
+bbox_task(void *arg, int i)
+{
+    normals_job *job = arg;
+    const vec3 *verts = job->m->verts;
+    unsigned begin = i*job->per;
+    unsigned end = job->m->nv - begin > job->per ? begin + job->per :
+						    job->m->nv;
+    real *min = job->bounds[i][0], *max = job->bounds[i][1];
+
+    VecSet(min, verts[begin]);
+    VecSet(max, verts[begin]);
+    for (unsigned j=begin+1; j<end; j++)
+	for (int k=0; k<3; k++) {
+	    min[k] = min[k] < verts[j][k] ? min[k] : verts[j][k];
+	    max[k] = max[k] > verts[j][k] ? max[k] : verts[j][k];
+	}
+}
 
-	if (m->min[2]>m->verts[j][2]) m->min[2]=m->verts[j][2]; else
-	if (m->max[2]<m->verts[j][2]) m->max[2]=m->verts[j][2];
-    }
+static void
+vertex_bbox(mesh *m)
+{
+    vec3 bounds[BBOX_TASKS][2];
+    normals_job job = { m, 0, 0, { NULL }, bounds, 0 };
+    unsigned n = chunks(m->nv) < BBOX_TASKS ? chunks(m->nv) : BBOX_TASKS;
+
+    if (m->nv == 0)
+	return;
+    job.per = (m->nv + n-1) / n;
+    n = (m->nv + job.per-1) / job.per;
+    parallel_for(n, bbox_task, &job);
+    VecSet(m->min, bounds[0][0]);
+    VecSet(m->max, bounds[0][1]);
+    for (unsigned i=1; i<n; i++)
+	for (int k=0; k<3; k++) {
+	    m->min[k] = m->min[k] < bounds[i][0][k] ? m->min[k] :
+						       bounds[i][0][k];
+	    m->max[k] = m->max[k] > bounds[i][1][k] ? m->max[k] :
+						       bounds[i][1][k];
+	}
 }
 
 void
@@ -447,6 +419,8 @@ mesh_free(mesh *m)
 	free(m->vtexcoords);
 	free(m->tris);
 	free(m->tnormals);
+	free(m->qverts);
+	free(m->qnormals);
 	free(m);
     }
 }
@@ -454,14 +428,389 @@ mesh_free(mesh *m)
 void
 mesh_flip(mesh *m)
 {
+    vec3 n;
+
     /* flip all normals and change triangle orientation */
     for (unsigned j=0; j<m->nt; j++) {
 	unsigned k=m->tris[j][1];
 	m->tris[j][1]=m->tris[j][2];
 	m->tris[j][2]=k;
-	VecScale(m->tnormals[j], m->tnormals[j], -1);
+	if (m->tnormals)
+	    VecScale(m->tnormals[j], m->tnormals[j], -1);
+    }
+    for (unsigned j=0; j<m->nv; j++) {
+	if (m->vnormals) {
+	    VecScale(m->vnormals[j], m->vnormals[j], -1);
+	} else {
+	    MeshNormal(n, m, j);
+	    VecScale(n, n, -1);
+	    set_qnormal(m, j, oct_encode(n, m->normal_bits));
+	}
+    }
+}
+
+uint32_t
+mesh_qnormal(const mesh *m, unsigned v)
+{
+    if (m->normal_bits == 16)
+	return m->qnormals[v];
+    return m->qnormals[2*v] | (uint32_t)m->qnormals[2*v+1] << 16;
+}
+
+static void
+set_qnormal(mesh *m, unsigned v, uint32_t o)
+{
+    if (m->normal_bits == 16) {
+	m->qnormals[v] = o;
+    } else {
+	m->qnormals[2*v] = o & 0xffff;
+	m->qnormals[2*v+1] = o >> 16;
+    }
+}
+
+int
+mesh_compact(mesh *m, int normal_bits)
+{
+    vec3 p, n, d;
+    real e;
+
+    m->qverts = malloc(sizeof(*m->qverts)*m->nv);
+    m->qnormals = malloc(sizeof(*m->qnormals)*m->nv*(normal_bits/16));
+    if (!m->qverts || !m->qnormals) {
+	free(m->qverts);
+	free(m->qnormals);
+	m->qverts = NULL;
+	m->qnormals = NULL;
+	return 0;
     }
+    m->normal_bits = normal_bits;
+    quant_box_init(&m->qbox, m->min, m->max);
+    m->position_error = m->normal_error = 0;
     for (unsigned j=0; j<m->nv; j++) {
-	VecScale(m->vnormals[j], m->vnormals[j], -1);
+	quant_encode(&m->qbox, m->verts[j], m->qverts[j]);
+	m->qverts[j][3] = 1;
+	QuantDecode(p, &m->qbox, m->qverts[j]);
+	VecSub(d, p, m->verts[j]);
+	if (m->position_error < (e = sqrt(VecDot(d, d))))
+	    m->position_error = e;
+	VecSet(m->verts[j], p);
+
+	set_qnormal(m, j, oct_encode(m->vnormals[j], normal_bits));
+	oct_decode(mesh_qnormal(m, j), normal_bits, n);
+	if (VecDot(m->vnormals[j], m->vnormals[j]) > 0) {
+	    VecSet(d, m->vnormals[j]);
+	    VecNormalize(d);
+	    e = VecDot(n, d);
+	    if (m->normal_error < (e = acos(e < 1 ? e : 1)))
+		m->normal_error = e;
+	}
+	VecSet(m->vnormals[j], n);
+    }
+    /* triangle normals of the mesh as it now is */
+    face_normals(m, 1);
+
+    printf("Compacted %u vertices to %zu bytes each: position error %g "
+	   "(%g of the box), normal error %.3g degrees\n", m->nv,
+	   sizeof(*m->qverts) + sizeof(*m->qnormals)*(normal_bits/16),
+	   m->position_error, m->position_error/(2*QUANT_MAX*m->qbox.scale),
+	   m->normal_error*RAD2DEG);
+    return 1;
+}
+
+void
+mesh_release(mesh *m)
+{
+    if (m->qverts == NULL)
+	return;
+    free(m->verts);
+    free(m->vnormals);
+    free(m->tnormals);
+    m->verts = m->vnormals = m->tnormals = NULL;
+}
+
+/* Welding hashes every vertex by the cell of a grid it falls in (for an
+ * epsilon of 0, by its position itself). The vertices are split by the top
+ * bits of their hashes into partitions, each of which gets its own chained
+ * hash table, so that the tables are built in parallel without locking;
+ * the chains list vertices in increasing order. Each vertex then looks up
+ * the lowest-numbered vertex close enough to it in its own cell and, for a
+ * nonzero epsilon, the cells around it, and is welded to that one's own
+ * choice, which comes first. */
+
+#define WELD_PARTS	256		/* hash tables			    */
+#define WELD_NONE	UINT32_MAX
+
+typedef struct {
+    mesh	*m;
+    real	 eps;
+    unsigned	 nchunks;
+    uint32_t	*hash;			/* of each vertex's cell	    */
+    uint32_t	*count;			/* per chunk and partition	    */
+    uint32_t	*start;			/* of partitions in order	    */
+    uint32_t	*order;			/* vertices, by partition	    */
+    uint32_t	*next;			/* in the chains, by order	    */
+    uint32_t	*table;			/* chain heads, by order	    */
+    uint32_t	*tstart;		/* of partitions' tables	    */
+    uint32_t	*rep;			/* vertex welded to		    */
+} weld_job;
+
+static void
+weld_cell(const weld_job *w, const real *p, int64_t c[3])
+{
+    float f;
+    uint32_t u;
+
+    for (int k=0; k<3; k++) {
+	if (w->eps > 0) {
+	    c[k] = floor(p[k] / w->eps);
+	} else {
+	    f = p[k] + 0.0f;	/* -0 is 0 */
+	    memcpy(&u, &f, sizeof(u));
+	    c[k] = u;
+	}
+    }
+}
+
+static uint32_t
+weld_hash(const int64_t c[3])
+{
+    uint64_t h = 0;
+
+    for (int k=0; k<3; k++) {
+	h ^= (uint64_t)c[k] + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	h *= 0xff51afd7ed558ccdull;
+    }
+    return h ^ h >> 32;
+}
+
+static void
+weld_hash_task(void *arg, int i)
+{
+    weld_job *w = arg;
+    uint32_t *count = &w->count[i*WELD_PARTS];
+    unsigned end = chunk_end(i, w->m->nv);
+    int64_t c[3];
+
+    for (unsigned v=i*CHUNK; v<end; v++) {
+	weld_cell(w, w->m->verts[v], c);
+	w->hash[v] = weld_hash(c);
+	count[w->hash[v] >> 24]++;
+    }
+}
+
+static void
+weld_scatter_task(void *arg, int i)
+{
+    weld_job *w = arg;
+    uint32_t *offset = &w->count[i*WELD_PARTS];
+    unsigned end = chunk_end(i, w->m->nv);
+
+    for (unsigned v=i*CHUNK; v<end; v++)
+	w->order[offset[w->hash[v] >> 24]++] = v;
+}
+
+static void
+weld_table_task(void *arg, int p)
+{
+    weld_job *w = arg;
+    uint32_t *table = &w->table[w->tstart[p]];
+    uint32_t mask = w->tstart[p+1] - w->tstart[p] - 1, h;
+
+    for (uint32_t j=0; j<=mask; j++)
+	table[j] = WELD_NONE;
+    /* backwards, so that the chains come out in increasing order */
+    for (uint32_t j=w->start[p+1]; j-- > w->start[p]; ) {
+	h = w->hash[w->order[j]] & mask;
+	w->next[j] = table[h];
+	table[h] = j;
+    }
+}
+
+/* the lowest-numbered vertex below rep in the chain of cell c close enough
+ * to p, or rep */
+static uint32_t
+weld_find(const weld_job *w, const int64_t c[3], const real *p, uint32_t rep)
+{
+    uint32_t h = weld_hash(c), p0 = h >> 24, u, j;
+    uint32_t mask = w->tstart[p0+1] - w->tstart[p0] - 1;
+    const real *q;
+    vec3 d;
+
+    for (j=w->table[w->tstart[p0] + (h & mask)]; j != WELD_NONE;
+	 j=w->next[j]) {
+	if ((u = w->order[j]) >= rep)
+	    break;
+	q = w->m->verts[u];
+	if (w->eps > 0) {
+	    VecSub(d, q, p);
+	    if (VecDot(d, d) <= w->eps*w->eps)
+		return u;
+	} else if (q[0] == p[0] && q[1] == p[1] && q[2] == p[2]) {
+	    return u;
+	}
+    }
+    return rep;
+}
+
+static void
+weld_find_task(void *arg, int i)
+{
+    weld_job *w = arg;
+    unsigned end = chunk_end(i, w->m->nv);
+    int64_t c[3], n[3];
+    uint32_t rep;
+    int r = w->eps > 0 ? 1 : 0;
+
+    for (unsigned v=i*CHUNK; v<end; v++) {
+	weld_cell(w, w->m->verts[v], c);
+	rep = v;
+	for (n[0]=c[0]-r; n[0]<=c[0]+r; n[0]++)
+	    for (n[1]=c[1]-r; n[1]<=c[1]+r; n[1]++)
+		for (n[2]=c[2]-r; n[2]<=c[2]+r; n[2]++)
+		    rep = weld_find(w, n, w->m->verts[v], rep);
+	w->rep[v] = rep;
+    }
+}
+
+static void
+weld_tris_task(void *arg, int i)
+{
+    weld_job *w = arg;
+    unsigned end = chunk_end(i, w->m->nt);
+
+    for (unsigned j=i*CHUNK; j<end; j++)
+	for (int k=0; k<3; k++)
+	    w->m->tris[j][k] = w->rep[w->m->tris[j][k]];
+}
+
+static void
+shrink(void **p, size_t size)
+{
+    void *q;
+
+    if (*p && size && (q = realloc(*p, size)))
+	*p = q;
+}
+
+int
+mesh_weld(mesh *m, real epsilon)
+{
+    weld_job w;
+    uint32_t *id, nv = 0, size;
+    unsigned nt = 0, p, i;
+    int ok = 0;
+
+    if (m->nv == 0)
+	return 1;
+    TRACE_BEGIN("weld");
+    memset(&w, 0, sizeof(w));
+    w.m = m;
+    w.eps = epsilon;
+    w.nchunks = (m->nv + CHUNK-1) / CHUNK;
+    w.hash = malloc(sizeof(*w.hash)*m->nv);
+    w.count = calloc(w.nchunks*WELD_PARTS, sizeof(*w.count));
+    w.start = malloc(sizeof(*w.start)*(WELD_PARTS+1));
+    w.tstart = malloc(sizeof(*w.tstart)*(WELD_PARTS+1));
+    w.order = malloc(sizeof(*w.order)*m->nv);
+    w.next = malloc(sizeof(*w.next)*m->nv);
+    w.rep = malloc(sizeof(*w.rep)*m->nv);
+    if (!w.hash || !w.count || !w.start || !w.tstart || !w.order ||
+	!w.next || !w.rep)
+	goto done;
+
+    /* hash, then sort by partition, the counts becoming each chunk's
+     * offsets into its partitions */
+    parallel_for(w.nchunks, weld_hash_task, &w);
+    w.start[0] = w.tstart[0] = 0;
+    for (p=0; p<WELD_PARTS; p++) {
+	w.start[p+1] = w.start[p];
+	for (i=0; i<w.nchunks; i++) {
+	    uint32_t n = w.count[i*WELD_PARTS + p];
+
+	    w.count[i*WELD_PARTS + p] = w.start[p+1];
+	    w.start[p+1] += n;
+	}
+	for (size=1; size < 2*(w.start[p+1] - w.start[p]); size*=2)
+	    ;
+	w.tstart[p+1] = w.tstart[p] + size;
+    }
+    parallel_for(w.nchunks, weld_scatter_task, &w);
+    if ((w.table = malloc(sizeof(*w.table)*w.tstart[WELD_PARTS])) == NULL)
+	goto done;
+    parallel_for(WELD_PARTS, weld_table_task, &w);
+    parallel_for(w.nchunks, weld_find_task, &w);
+
+    /* follow each vertex to the end of its chain of choices (which are
+     * lower-numbered, so done already), number the vertices left, and
+     * move them down, summing the normals of those welded */
+    id = w.hash;
+    for (uint32_t v=0; v<m->nv; v++) {
+	w.rep[v] = w.rep[w.rep[v]];
+	if (w.rep[v] == v)
+	    id[v] = nv++;
+	else if (m->vnormals)
+	    VecAdd(m->vnormals[w.rep[v]], m->vnormals[w.rep[v]],
+		   m->vnormals[v]);
+    }
+    for (uint32_t v=0; v<m->nv; v++) {
+	if (w.rep[v] != v)
+	    continue;
+	VecSet(m->verts[id[v]], m->verts[v]);
+	if (m->vnormals) {
+	    VecSet(m->vnormals[id[v]], m->vnormals[v]);
+	    if (nv < m->nv)
+		VecNormalize(m->vnormals[id[v]]);
+	}
+	if (m->vcolors)
+	    memcpy(m->vcolors[id[v]], m->vcolors[v], sizeof(*m->vcolors));
+	if (m->vtexcoords)
+	    memcpy(m->vtexcoords[id[v]], m->vtexcoords[v],
+		   sizeof(*m->vtexcoords));
+    }
+    for (uint32_t v=0; v<m->nv; v++)
+	w.rep[v] = id[w.rep[v]];
+
+    /* renumber the triangles, and drop those left with a repeated vertex */
+    parallel_for((m->nt + CHUNK-1) / CHUNK, weld_tris_task, &w);
+    for (unsigned j=0; j<m->nt; j++) {
+	if (m->tris[j][0] == m->tris[j][1] || m->tris[j][0] == m->tris[j][2] ||
+	    m->tris[j][1] == m->tris[j][2])
+	    continue;
+	memcpy(m->tris[nt], m->tris[j], sizeof(*m->tris));
+	if (m->tnormals)
+	    VecSet(m->tnormals[nt], m->tnormals[j]);
+	nt++;
+    }
+
+    if (nv < m->nv || nt < m->nt) {
+	printf("Welded %u vertices into %u, dropping %u degenerate "
+	       "triangle(s)\n", m->nv, nv, m->nt - nt);
+	shrink((void **)&m->verts, sizeof(*m->verts)*nv);
+	shrink((void **)&m->vnormals, sizeof(*m->vnormals)*nv);
+	shrink((void **)&m->vcolors, sizeof(*m->vcolors)*nv);
+	shrink((void **)&m->vtexcoords, sizeof(*m->vtexcoords)*nv);
+	shrink((void **)&m->tris, sizeof(*m->tris)*nt);
+	shrink((void **)&m->tnormals, sizeof(*m->tnormals)*nt);
+    }
+    m->nv = nv;
+    m->nt = nt;
+    if (epsilon > 0) {
+	/* the positions may have moved */
+	if (m->tnormals)
+	    face_normals(m, 1);
+	vertex_bbox(m);
     }
+    ok = 1;
+
+done:
+    free(w.hash);
+    free(w.count);
+    free(w.start);
+    free(w.tstart);
+    free(w.order);
+    free(w.next);
+    free(w.table);
+    free(w.rep);
+    TRACE_END();
+    return ok;
 }
@@ -2,6 +2,7 @@
 #define _MESH_H_
 
 #include <stdint.h>
+#include "quant.h"
 #include "vec3.h"
 
 typedef uint32_t    index3u[3];
@@ -21,10 +22,53 @@ typedef struct {
 
     vec3	 min;		/* bounding box on vertices */
     vec3	 max;
+
+    /* compact meshes (see mesh_compact()) have these instead of verts,
+     * vnormals and tnormals */
+    int16_t	(*qverts)[4];	/* quantized positions, and 1 */
+    quant_box	 qbox;
+    uint16_t	*qnormals;	/* octahedral vertex normals, normal_bits/16
+				   per vertex */
+    int		 normal_bits;	/* 16 or 32; 0 if not compact */
+    real	 position_error;	/* largest error, in mesh units */
+    real	 normal_error;		/* largest error, in radians */
 } mesh;
 
+/* position and normal of vertex v of mesh m, compact or not */
+#define MeshVertex(p, m, v) do { \
+    if ((m)->verts) { VecSet(p, (m)->verts[v]); } \
+    else { QuantDecode(p, &(m)->qbox, (m)->qverts[v]); } } while (0)
+#define MeshNormal(n, m, v) do { \
+    if ((m)->vnormals) { VecSet(n, (m)->vnormals[v]); } \
+    else oct_decode(mesh_qnormal(m, v), (m)->normal_bits, n); } while (0)
+
 mesh *mesh_load(const char *file);
+/* weld the equal vertices of a mesh built in memory, as mesh_load() does,
+ * and compute its bounding box, triangle normals and, unless it has them
+ * already, vertex normals; 0 if out of memory */
+int   mesh_finish(mesh *m);
 void  mesh_free(mesh *m);
+/* Weld together vertices within epsilon of each other (exactly equal ones
+ * if 0), each to the lowest-numbered one near it, and drop the triangles
+ * that are left with a repeated vertex. The normals of welded vertices are
+ * averaged and the first one's other attributes kept. mesh_load() and
+ * mesh_finish() weld equal vertices; this can be called again to weld more.
+ * 0 if out of memory. */
+int   mesh_weld(mesh *m, real epsilon);
+/* Renumber the vertices of a loaded mesh along a Morton curve, and reorder
+ * the triangles for the post-transform vertex cache (see reorder.c). 0 if
+ * out of memory. */
+int   mesh_reorder(mesh *m);
 void  mesh_flip(mesh *m);
 
+/* Quantize the positions to 16 bits within the bounding box and encode the
+ * vertex normals in normal_bits (16 or 32) octahedral bits, recording the
+ * largest errors, and round the full-precision arrays to match, so that an
+ * octree built next agrees with the compact mesh. mesh_release() then drops
+ * the full-precision arrays, leaving what drawing and LOD updates need.
+ * 0 if out of memory. */
+int   mesh_compact(mesh *m, int normal_bits);
+void  mesh_release(mesh *m);
+uint32_t mesh_qnormal(const mesh *m, unsigned v);
+
 #endif // !_MESH_H_
@@ -6,10 +6,39 @@
 
 #include "aabb.h"
 #include "octree.h"
+#include "parallel.h"
+#include "perfctr.h"
 #include "vec3.h"
 #include "vfc.h"
 #include "view_params.h"
 #include "timer.h"
+#include "trace.h"
+
+/* While the octree is built, the vertices and triangles under each
+ * finished subtree of the root are associated with its nodes and given
+ * their activators by a stage of their own, alongside the building of the
+ * rest. Once the root is split they are sorted by the octant of the root
+ * they fall in, a triangle by the one with two or more of its corners;
+ * those with a corner in each of three are activated by the root itself,
+ * once the tree is done. */
+#define ROOT_SPLIT	8
+
+typedef struct {
+    octree	 *tree;
+    octree_node	 *root;
+    uint32_t	 *verts, *tris;		/* sorted by octant ..		    */
+    unsigned	  vfirst[9], tfirst[10];	/* .. from these		    */
+    int		  items[9];		/* octants queued, or ROOT_SPLIT    */
+    queue	 *done;
+    int		  split;
+} build_pipe;
+
+static void
+queue_octant(build_pipe *pipe, int k)
+{
+    pipe->items[k] = k;
+    queue_put(pipe->done, &pipe->items[k]);
+}
 
 static int
 verify(real mid, int d, vec3 verts[], int lo, int hi, int code)
@@ -62,11 +91,28 @@ partition(vec3 verts[], int itable[], int lo, int hi, int dim, real d)
     return j;
 }
 
+static octree_node *build(int lo, int hi, unsigned char depth, vec3 verts[],
+			  int itable[], mesh *mesh, build_pipe *pipe);
+
+/* build the subtree in octant k of o from vertices lo to hi */
+static void
+attach(octree_node *o, int k, int lo, int hi, vec3 verts[], int itable[],
+       mesh *m, build_pipe *pipe)
+{
+    octree_node *so = build(lo, hi, o->depth+1, verts, itable, m, NULL);
+
+    so->parent = o;
+    o->subtree[k] = so;
+    if (pipe)
+	queue_octant(pipe, k);
+}
+
+/* pipe, if not NULL, is told of the root's split and finished subtrees */
 static octree_node *
 build(int lo, int hi, unsigned char depth,
-      vec3 verts[], int itable[], mesh *mesh)
+      vec3 verts[], int itable[], mesh *mesh, build_pipe *pipe)
 {
-    octree_node *o, *so;
+    octree_node *o;
     vec3 min, max, cen, span, d, dia1, dia2;
     real rad, rad2, p, q;
     int i, j, mini[3], maxi[3];
@@ -82,9 +128,7 @@ build(int lo, int hi, unsigned char depth,
 	hi--;
 
     o = malloc(sizeof(*o));
-    o->status = STATUS_INACTIVE;
     o->depth = depth;
-    o->testid = 0; /* XXX */
     o->activated = NULL; /* XXX */
 
     if (lo == hi) {
@@ -96,6 +140,7 @@ build(int lo, int hi, unsigned char depth,
 	VecSet(o->rep_vnormal, mesh->vnormals[itable[lo]]);
 	VecSet(o->bb_midpt, verts[lo]);
 	o->bb_extent[0] = o->bb_extent[1] = o->bb_extent[2] = 0;
+	octree_set_sphere(o, verts[lo], 0);
 	return o;
     }
 
@@ -156,8 +201,7 @@ build(int lo, int hi, unsigned char depth,
 	}
     }
 
-    VecSet(o->sp_center, cen);
-    o->sp_radius = rad;
+    octree_set_sphere(o, cen, rad);
 
     /* set representative normal to closest to average of vertex normals */
     i=itable[lo];
@@ -179,9 +223,6 @@ build(int lo, int hi, unsigned char depth,
     }
     o->rep_vindex = itable[m];
 
-    VecZero(o->cone_normal);
-    o->cone_angle = 1.0;
-
     /* x partition
      * |x-|x+|
      * lo m  hi
@@ -196,6 +237,11 @@ build(int lo, int hi, unsigned char depth,
      */
     for (j=0; j<8; j++)
 	o->subtree[j]=NULL;
+    if (pipe) {
+	pipe->root = o;
+	pipe->split = 1;
+	queue_octant(pipe, ROOT_SPLIT);
+    }
 
     /* partition array on x */
     m = partition(verts, itable, lo, hi, 0, o->bb_midpt[0]);
@@ -204,27 +250,19 @@ build(int lo, int hi, unsigned char depth,
 	if (lo < l) {
 	    ll = partition(verts, itable, lo, l-1, 2, o->bb_midpt[2]);
 	    if (lo < ll) {
-		so = build(lo, ll-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[LEFT|BOTTOM|BACK] = so;
+		attach(o, LEFT|BOTTOM|BACK, lo, ll-1, verts, itable, mesh, pipe);
 	    }
 	    if (ll < l) {
-		so = build(ll, l-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[LEFT|BOTTOM|FRONT] = so;
+		attach(o, LEFT|BOTTOM|FRONT, ll, l-1, verts, itable, mesh, pipe);
 	    }
 	}
 	if (l < m) {
 	    lh = partition(verts, itable, l, m-1, 2, o->bb_midpt[2]);
 	    if (l < lh) {
-		so = build(l, lh-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[LEFT|TOP|BACK] = so;
+		attach(o, LEFT|TOP|BACK, l, lh-1, verts, itable, mesh, pipe);
 	    }
 	    if (lh < m) {
-		so = build(lh, m-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[LEFT|TOP|FRONT] = so;
+		attach(o, LEFT|TOP|FRONT, lh, m-1, verts, itable, mesh, pipe);
 	    }
 	}
     }
@@ -233,27 +271,19 @@ build(int lo, int hi, unsigned char depth,
 	if (m < h) {
 	    hl = partition(verts, itable, m, h-1, 2, o->bb_midpt[2]);
 	    if (m < hl) {
-		so = build(m, hl-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[RIGHT|BOTTOM|BACK] = so;
+		attach(o, RIGHT|BOTTOM|BACK, m, hl-1, verts, itable, mesh, pipe);
 	    }
 	    if (hl < h) {
-		so = build(hl, h-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[RIGHT|BOTTOM|FRONT] = so;
+		attach(o, RIGHT|BOTTOM|FRONT, hl, h-1, verts, itable, mesh, pipe);
 	    }
 	}
 	if (h <= hi) {
 	    hh = partition(verts, itable, h,  hi, 2, o->bb_midpt[2]);
 	    if (h < hh) {
-		so = build(h, hh-1, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[RIGHT|TOP|BACK] = so;
+		attach(o, RIGHT|TOP|BACK, h, hh-1, verts, itable, mesh, pipe);
 	    }
 	    if (hh <= hi) {
-		so = build(hh, hi, depth+1, verts, itable, mesh);
-		so->parent = o;
-		o->subtree[RIGHT|TOP|FRONT] = so;
+		attach(o, RIGHT|TOP|FRONT, hh, hi, verts, itable, mesh, pipe);
 	    }
 	}
     }
@@ -262,257 +292,489 @@ build(int lo, int hi, unsigned char depth,
 }
 
 static void
-normalize_cones(octree_node *o)
+number_nodes(octree_node *o, int *id)
 {
     int k;
     if (o != NULL) {
-	VecNormalize(o->cone_normal);
+	o->id = (*id)++;
 	if (!o->leaf)
 	    for (k=0; k<8; k++)
-		normalize_cones(o->subtree[k]);
+		number_nodes(o->subtree[k], id);
     }
 }
 
+/* store the cones found, converting the cosines to radians */
 static void
-fix_cones(octree_node *o)
+set_cones(octree_node *o, vec3 cones[], real cosines[])
 {
     int k;
     if (o != NULL) {
-	o->cone_angle = acos(o->cone_angle);
+	octree_set_cone(o, cones[o->id], acos(cosines[o->id]));
 	if (!o->leaf)
 	    for (k=0; k<8; k++)
-		fix_cones(o->subtree[k]);
+		set_cones(o->subtree[k], cones, cosines);
     }
 }
 
-octree *
-octree_create(mesh *m)
+void
+octree_set_sphere(octree_node *n, const vec3 center, real radius)
 {
-    vec3 *vtmp;
-    octree *tree;
-    int j, k;
-    octree_node *n;
-    int *itable;
-    double t;
-    int wrong = 0;
-    real angle;
+    real scale = n->bb_extent[0] + n->bb_extent[1] + n->bb_extent[2];
+    real t, r;
+    vec3 c, d;
+    int k;
 
-#if 0
-    int old, new;
-    unsigned char uc;
-    float tc;
-#endif
+    /* the center within the box, and the radius grown by how far it moved */
+    for (k=0; k<3; k++) {
+	t = n->bb_extent[k] > 0 ?
+	    rint((center[k] - n->bb_midpt[k])/n->bb_extent[k]*QUANT_MAX) : 0;
+	n->sp_center[k] = t > QUANT_MAX ? QUANT_MAX :
+			  t < -QUANT_MAX ? -QUANT_MAX : t;
+    }
+    n->sp_radius = 0;
+    NodeSphere(c, r, n);
+    VecSub(d, c, center);
+    radius += sqrt(VecDot(d, d));
+
+    /* the sphere around the box, if that is smaller */
+    t = sqrt(VecDot(n->bb_extent, n->bb_extent));
+    if (radius > t) {
+	n->sp_center[0] = n->sp_center[1] = n->sp_center[2] = 0;
+	radius = t;
+    }
 
-    tree=malloc(sizeof(*tree));
-    tree->mesh=m;
+    t = scale > 0 ? ceil(radius/scale*65535) : 0;
+    n->sp_radius = t < 65535 ? t : 65535;
+    /* in case decoding rounds down */
+    NodeSphere(c, r, n);
+    while (r < radius && n->sp_radius < 65535) {
+	n->sp_radius++;
+	NodeSphere(c, r, n);
+    }
+}
 
-    printf("Constructing vertex octree... ");
-    fflush(stdout);
+void
+octree_set_cone(octree_node *n, const vec3 normal, real angle)
+{
+    vec3 d;
+    real a, t;
+
+    n->cone_flip = 0;
+    if (VecDot(normal, normal) == 0) {
+	/* no triangles: any direction */
+	n->cone_normal = oct_encode(normal, 32);
+	n->cone_angle = 255;
+	return;
+    }
+    n->cone_normal = oct_encode(normal, 32);
+    oct_decode(n->cone_normal, 32, d);
+    t = VecDot(d, normal);
+    angle += acos(t < 1 ? t : 1);
+    a = ceil(angle/CONE_ANGLE_STEP);
+    n->cone_angle = a < 255 ? a : 255;
+    if (n->cone_angle < 255 && n->cone_angle*CONE_ANGLE_STEP < angle)
+	n->cone_angle++;
+}
+
+void
+octree_cone(const octree_node *n, vec3 normal, real *angle)
+{
+    oct_decode(n->cone_normal, 32, normal);
+    if (n->cone_flip)
+	VecScale(normal, normal, -1);
+    *angle = n->cone_angle*CONE_ANGLE_STEP;
+}
+
+void
+octree_restore_sphere(octree_node *n, const vec3 center, real radius)
+{
+    real scale = n->bb_extent[0] + n->bb_extent[1] + n->bb_extent[2];
+    real t, r;
+    vec3 c;
+    int k;
+
+    for (k=0; k<3; k++) {
+	t = n->bb_extent[k] > 0 ?
+	    rint((center[k] - n->bb_midpt[k])/n->bb_extent[k]*QUANT_MAX) : 0;
+	n->sp_center[k] = t > QUANT_MAX ? QUANT_MAX :
+			  t < -QUANT_MAX ? -QUANT_MAX : t;
+    }
+    t = scale > 0 ? rint(radius/scale*65535) : 0;
+    n->sp_radius = t < 65535 ? t : 65535;
+    NodeSphere(c, r, n);
+    if (c[0] != center[0] || c[1] != center[1] || c[2] != center[2] ||
+	r != radius)
+	octree_set_sphere(n, center, radius);
+}
+
+void
+octree_restore_cone(octree_node *n, const vec3 normal, real angle)
+{
+    vec3 d;
+    real a;
+
+    n->cone_flip = 0;
+    n->cone_normal = oct_encode(normal, 32);
+    a = rint(angle/CONE_ANGLE_STEP);
+    n->cone_angle = a < 255 ? a : 255;
+    octree_cone(n, d, &a);
+    if (d[0] != normal[0] || d[1] != normal[1] || d[2] != normal[2] ||
+	a != angle)
+	octree_set_cone(n, normal, angle);
+}
+
+static octree_node *
+build_tree(mesh *m, int depth, build_pipe *pipe)
+{
+    octree_node *root;
+    vec3 *vtmp;
+    int *itable;
+    unsigned j;
 
-    t=get_timer();
     /* use a copy of vertices so we dont mess up vertex indices in mesh */
     itable=malloc(sizeof(*itable)*m->nv);
     for (j=0; j<m->nv; j++)
 	itable[j]=j;
     vtmp=malloc(sizeof(*vtmp)*m->nv);
     memcpy(vtmp, m->verts, sizeof(*vtmp)*m->nv);
-    tree->root=build(0, m->nv-1, 0, vtmp, itable, m);
-    tree->root->parent=NULL;
-    tree->root->status=STATUS_BOUNDARY;
+    root=build(0, m->nv-1, depth, vtmp, itable, m, pipe);
+    root->parent=NULL;
     free(itable);
     free(vtmp);
+    return root;
+}
 
-    t=get_timer()-t;
-    printf("done [%gs]\n", t);
+octree_node *
+octree_build(mesh *m, int depth, int *nnodes)
+{
+    octree_node *root = build_tree(m, depth, NULL);
 
-    printf("Associating vertices with nodes... ");
-    fflush(stdout);
+    *nnodes=0;
+    number_nodes(root, nnodes);
+    return root;
+}
 
-    t=get_timer();
-    tree->vertex_nodes=malloc(sizeof(*tree->vertex_nodes)*m->nv);
-    for (j=0; j<m->nv; j++) {
-	n=tree->root;
+static int
+octant(const octree_node *n, const real *p)
+{
+    int k=0;
+
+    if (p[0] >= n->bb_midpt[0]) k|=4;
+    if (p[1] >= n->bb_midpt[1]) k|=2;
+    if (p[2] >= n->bb_midpt[2]) k|=1;
+    return k;
+}
+
+octree_node *
+octree_activator(octree_node *n, const real *p0, const real *p1,
+		 const real *p2)
+{
+    int k0=0, k1=0, k2=0;
+
+    if (p2) {
+	/* down while all three corners are in one node .. */
 	while (!n->leaf) {
-	    if (!aabb_midpt_pt_inside(n->bb_midpt, n->bb_extent, m->verts[j])) {
-		vec3 min, max;
-		aabb_midpt_to_corners(min, max, n->bb_midpt, n->bb_extent);
-
-		printf("warning!! not inside extent anymore (depth=%d)\n",
-		       n->depth);
-		printf("min={%g,%g,%g} max={%g,%g,%g} v={%g,%g,%g}\n",
-		       min[0], min[1], min[2], max[0], max[1], max[2],
-		       m->verts[j][0], m->verts[j][1], m->verts[j][2]);
-	    }
-	    k=0;
-	    if (m->verts[j][0] >= n->bb_midpt[0]) k|=4;
-	    if (m->verts[j][1] >= n->bb_midpt[1]) k|=2;
-	    if (m->verts[j][2] >= n->bb_midpt[2]) k|=1;
-	    if (n->subtree[k]==NULL) break;
-	    n=n->subtree[k];
+	    k0=octant(n, p0);
+	    k1=octant(n, p1);
+	    k2=octant(n, p2);
+	    if (k0 != k1 || k0 != k2) break;
+	    n=n->subtree[k0];
 	}
-	tree->vertex_nodes[j]=n;
-	if (m->verts[n->rep_vindex][0] != m->verts[j][0] ||
-	    m->verts[n->rep_vindex][1] != m->verts[j][1] ||
-	    m->verts[n->rep_vindex][2] != m->verts[j][2]) {
-	    printf("  orig vertex=(%g,%g,%g)\n",
+	/* .. then while two of them are */
+	if (k0 == k1) ;
+	else if (k0 == k2) p1=p2;
+	else if (k1 == k2) p0=p2;
+	else return n;
+    }
+    while (!n->leaf) {
+	k0=octant(n, p0);
+	k1=octant(n, p1);
+	if (k0 != k1) break;
+	n=n->subtree[k0];
+    }
+    return n;
+}
+
+/* the leaf of vertex j, from node n down */
+static void
+associate(octree *tree, octree_node *n, int j)
+{
+    const mesh *m = tree->mesh;
+    int k;
+
+    while (!n->leaf) {
+	if (!aabb_midpt_pt_inside(n->bb_midpt, n->bb_extent, m->verts[j])) {
+	    vec3 min, max;
+	    aabb_midpt_to_corners(min, max, n->bb_midpt, n->bb_extent);
+
+	    printf("warning!! not inside extent anymore (depth=%d)\n",
+		   n->depth);
+	    printf("min={%g,%g,%g} max={%g,%g,%g} v={%g,%g,%g}\n",
+		   min[0], min[1], min[2], max[0], max[1], max[2],
 		   m->verts[j][0], m->verts[j][1], m->verts[j][2]);
-	    printf("faulty vertex=(%g,%g,%g) leaf=%d\n\n",
-		   m->verts[n->rep_vindex][0], m->verts[n->rep_vindex][1],
-		   m->verts[n->rep_vindex][2], n->leaf);
-	    wrong++;
 	}
+	k=0;
+	if (m->verts[j][0] >= n->bb_midpt[0]) k|=4;
+	if (m->verts[j][1] >= n->bb_midpt[1]) k|=2;
+	if (m->verts[j][2] >= n->bb_midpt[2]) k|=1;
+	if (n->subtree[k]==NULL) break;
+	n=n->subtree[k];
     }
-    t=get_timer()-t;
-    if (t<0) t=0;
-    printf("done [%gs]\n", t);
+    tree->vertex_nodes[j]=n;
+    if (m->verts[n->rep_vindex][0] != m->verts[j][0] ||
+	m->verts[n->rep_vindex][1] != m->verts[j][1] ||
+	m->verts[n->rep_vindex][2] != m->verts[j][2]) {
+	printf("  orig vertex=(%g,%g,%g)\n",
+	       m->verts[j][0], m->verts[j][1], m->verts[j][2]);
+	printf("faulty vertex=(%g,%g,%g) leaf=%d\n\n",
+	       m->verts[n->rep_vindex][0], m->verts[n->rep_vindex][1],
+	       m->verts[n->rep_vindex][2], n->leaf);
+    }
+}
 
-    printf("Finding triangle activators... ");
-    fflush(stdout);
-    t=get_timer();
+/* find the activator of triangle j, from the root down */
+static void
+activate(octree *tree, octree_node *root, int j)
+{
+    const mesh *m = tree->mesh;
+    octree_node *n;
 
-    tree->activators=malloc(sizeof(*tree->activators)*m->nt);
-    for (j=0; j<m->nt; j++) {
-	int v0,v1,v2;
-	int k0,k1,k2;
-
-	v0=m->tris[j][0];
-	v1=m->tris[j][1];
-	v2=m->tris[j][2];
-	n=tree->root;
-	do {
-	    k0=k1=k2=0;
-	    if (m->verts[v0][0] >= n->bb_midpt[0]) k0|=4;
-	    if (m->verts[v0][1] >= n->bb_midpt[1]) k0|=2;
-	    if (m->verts[v0][2] >= n->bb_midpt[2]) k0|=1;
-
-	    if (m->verts[v1][0] >= n->bb_midpt[0]) k1|=4;
-	    if (m->verts[v1][1] >= n->bb_midpt[1]) k1|=2;
-	    if (m->verts[v1][2] >= n->bb_midpt[2]) k1|=1;
-
-	    if (m->verts[v2][0] >= n->bb_midpt[0]) k2|=4;
-	    if (m->verts[v2][1] >= n->bb_midpt[1]) k2|=2;
-	    if (m->verts[v2][2] >= n->bb_midpt[2]) k2|=1;
-
-	    if (k0 != k1 || k0 != k2 || k1 != k2) break;
-	    n=n->subtree[k0];
-	} while (!n->leaf);
+    n=octree_activator(root, m->verts[m->tris[j][0]],
+		       m->verts[m->tris[j][1]], m->verts[m->tris[j][2]]);
+    tree->activators[j]=n;
+    if (n->activated==NULL) {
+	n->activated=malloc(sizeof(*n->activated)*2);
+	n->activated[0]=1;
+	n->activated[1]=j;
+    } else {
+	n->activated[0]+=1;
+	n->activated=realloc(n->activated,
+			     sizeof(*n->activated)*(n->activated[0]+1));
+	n->activated[n->activated[0]]=j;
+    }
+}
 
-	if (k0 == k1) {
-	    while (!n->leaf) {
-		k0=k1=0;
-		if (m->verts[v0][0] >= n->bb_midpt[0]) k0|=4;
-		if (m->verts[v0][1] >= n->bb_midpt[1]) k0|=2;
-		if (m->verts[v0][2] >= n->bb_midpt[2]) k0|=1;
+/* the octant of the root of triangle j (see build_pipe) */
+static int
+tri_octant(const octree_node *root, const mesh *m, int j)
+{
+    int k0 = octant(root, m->verts[m->tris[j][0]]);
+    int k1 = octant(root, m->verts[m->tris[j][1]]);
+    int k2 = octant(root, m->verts[m->tris[j][2]]);
 
-		if (m->verts[v1][0] >= n->bb_midpt[0]) k1|=4;
-		if (m->verts[v1][1] >= n->bb_midpt[1]) k1|=2;
-		if (m->verts[v1][2] >= n->bb_midpt[2]) k1|=1;
+    return k0 == k1 || k0 == k2 ? k0 : k1 == k2 ? k1 : ROOT_SPLIT;
+}
 
-		if (k0 != k1) break;
-		n=n->subtree[k0];
-	    }
-	} else if (k0 == k2) {
-	    while (!n->leaf) {
-		k0=k2=0;
-		if (m->verts[v0][0] >= n->bb_midpt[0]) k0|=4;
-		if (m->verts[v0][1] >= n->bb_midpt[1]) k0|=2;
-		if (m->verts[v0][2] >= n->bb_midpt[2]) k0|=1;
-
-		if (m->verts[v2][0] >= n->bb_midpt[0]) k2|=4;
-		if (m->verts[v2][1] >= n->bb_midpt[1]) k2|=2;
-		if (m->verts[v2][2] >= n->bb_midpt[2]) k2|=1;
-
-		if (k0 != k2) break;
-		n=n->subtree[k0];
-	    }
-	} else if (k1 == k2) {
-	    while (!n->leaf) {
-		k1=k2=0;
-		if (m->verts[v1][0] >= n->bb_midpt[0]) k1|=4;
-		if (m->verts[v1][1] >= n->bb_midpt[1]) k1|=2;
-		if (m->verts[v1][2] >= n->bb_midpt[2]) k1|=1;
-
-		if (m->verts[v2][0] >= n->bb_midpt[0]) k2|=4;
-		if (m->verts[v2][1] >= n->bb_midpt[1]) k2|=2;
-		if (m->verts[v2][2] >= n->bb_midpt[2]) k2|=1;
-
-		if (k1 != k2) break;
-		n=n->subtree[k1];
-	    }
-	}
-	tree->activators[j]=n;
-	if (n->activated==NULL) {
-	    n->activated=malloc(sizeof(*n->activated)*2);
-	    n->activated[0]=1;
-	    n->activated[1]=j;
-	} else {
-	    n->activated[0]+=1;
-	    n->activated=realloc(n->activated,
-				 sizeof(*n->activated)*(n->activated[0]+1));
-	    n->activated[n->activated[0]]=j;
+static void
+sort_by_octant(build_pipe *pipe)
+{
+    const mesh *m = pipe->tree->mesh;
+    unsigned j, k;
+
+    memset(pipe->vfirst, 0, sizeof(pipe->vfirst));
+    memset(pipe->tfirst, 0, sizeof(pipe->tfirst));
+    for (j=0; j<m->nv; j++)
+	pipe->vfirst[octant(pipe->root, m->verts[j]) + 1]++;
+    for (j=0; j<m->nt; j++)
+	pipe->tfirst[tri_octant(pipe->root, m, j) + 1]++;
+    for (k=1; k<9; k++)
+	pipe->vfirst[k] += pipe->vfirst[k-1];
+    for (k=1; k<10; k++)
+	pipe->tfirst[k] += pipe->tfirst[k-1];
+    /* the counts, then the starts again */
+    for (j=0; j<m->nv; j++)
+	pipe->verts[pipe->vfirst[octant(pipe->root, m->verts[j])]++] = j;
+    for (j=0; j<m->nt; j++)
+	pipe->tris[pipe->tfirst[tri_octant(pipe->root, m, j)]++] = j;
+    for (k=8; k>0; k--)
+	pipe->vfirst[k] = pipe->vfirst[k-1];
+    for (k=9; k>0; k--)
+	pipe->tfirst[k] = pipe->tfirst[k-1];
+    pipe->vfirst[0] = pipe->tfirst[0] = 0;
+}
+
+static void
+subtree_stage(void *arg)
+{
+    build_pipe *pipe = arg;
+    unsigned j;
+    int *k;
+
+    while ((k = queue_get(pipe->done)) != NULL) {
+	if (*k == ROOT_SPLIT) {
+	    sort_by_octant(pipe);
+	    continue;
 	}
+	for (j=pipe->vfirst[*k]; j<pipe->vfirst[*k+1]; j++)
+	    associate(pipe->tree, pipe->root, pipe->verts[j]);
+	for (j=pipe->tfirst[*k]; j<pipe->tfirst[*k+1]; j++)
+	    activate(pipe->tree, pipe->root, pipe->tris[j]);
     }
+}
+
+octree *
+octree_create(mesh *m)
+{
+    octree *tree;
+    int j;
+    octree_node *n;
+    double t;
+    real angle, *cosines;
+    vec3 *cones;
+    build_pipe pipe;
+    stage *s = NULL;
+
+#if 0
+    int old, new;
+    unsigned char uc;
+    float tc;
+#endif
+
+    TRACE_BEGIN("octree_create");
+    tree=malloc(sizeof(*tree));
+    tree->mesh=m;
+    tree->vertex_nodes=malloc(sizeof(*tree->vertex_nodes)*m->nv);
+    tree->activators=malloc(sizeof(*tree->activators)*m->nt);
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.tree = tree;
+    pipe.verts = malloc(sizeof(*pipe.verts)*m->nv);
+    pipe.tris = malloc(sizeof(*pipe.tris)*(m->nt ? m->nt : 1));
+    if (pipe.verts && pipe.tris &&
+	(pipe.done = queue_create(ROOT_SPLIT+1)) != NULL)
+	s = stage_start(subtree_stage, &pipe);
+
+    printf(s ? "Constructing vertex octree, associating vertices and "
+	   "finding triangle activators alongside... " :
+	   "Constructing vertex octree... ");
+    fflush(stdout);
+
+    t=get_timer();
+    TRACE_BEGIN("build");
+    perfctr_begin(PHASE_OCTREE_BUILD);
+    tree->root=build_tree(m, 0, s ? &pipe : NULL);
+    if (s) {
+	queue_close(pipe.done);
+	stage_join(s);
+    }
+    tree->nnodes=0;
+    number_nodes(tree->root, &tree->nnodes);
+    perfctr_end(PHASE_OCTREE_BUILD);
+    TRACE_END();
 
     t=get_timer()-t;
     printf("done [%gs]\n", t);
 
+    if (s && pipe.split) {
+	/* the triangles across the root, last as they were in turn */
+	TRACE_BEGIN("find activators");
+	perfctr_begin(PHASE_OCTREE_ACTIVATORS);
+	for (j=pipe.tfirst[ROOT_SPLIT]; j<(int)pipe.tfirst[ROOT_SPLIT+1]; j++)
+	    activate(tree, tree->root, pipe.tris[j]);
+	perfctr_end(PHASE_OCTREE_ACTIVATORS);
+	TRACE_END();
+    } else {
+	printf("Associating vertices with nodes... ");
+	fflush(stdout);
+
+	t=get_timer();
+	TRACE_BEGIN("associate vertices");
+	perfctr_begin(PHASE_OCTREE_ASSOCIATE);
+	for (j=0; j<(int)m->nv; j++)
+	    associate(tree, tree->root, j);
+	perfctr_end(PHASE_OCTREE_ASSOCIATE);
+	TRACE_END();
+	t=get_timer()-t;
+	if (t<0) t=0;
+	printf("done [%gs]\n", t);
+
+	printf("Finding triangle activators... ");
+	fflush(stdout);
+	t=get_timer();
+	TRACE_BEGIN("find activators");
+	perfctr_begin(PHASE_OCTREE_ACTIVATORS);
+	for (j=0; j<(int)m->nt; j++)
+	    activate(tree, tree->root, j);
+	perfctr_end(PHASE_OCTREE_ACTIVATORS);
+	TRACE_END();
+
+	t=get_timer()-t;
+	printf("done [%gs]\n", t);
+    }
+    free(pipe.verts);
+    free(pipe.tris);
+    queue_free(pipe.done);
+
     printf("Computing normal cones... ");
     fflush(stdout);
     t=get_timer();
+    TRACE_BEGIN("normal cones");
+    perfctr_begin(PHASE_OCTREE_CONES);
+
+    cones=calloc(tree->nnodes, sizeof(*cones));
+    cosines=malloc(sizeof(*cosines)*tree->nnodes);
+    for (j=0; j<tree->nnodes; j++)
+	cosines[j]=1.0;
 
     /* for each triangle... */
     for (j=0; j<m->nt; j++) {
 	n=tree->vertex_nodes[m->tris[j][0]];
 	while (n) {
-	    VecAdd(n->cone_normal, n->cone_normal, m->tnormals[j]);
+	    VecAdd(cones[n->id], cones[n->id], m->tnormals[j]);
 	    n=n->parent;
 	}
 	n=tree->vertex_nodes[m->tris[j][1]];
 	while (n) {
-	    VecAdd(n->cone_normal, n->cone_normal, m->tnormals[j]);
+	    VecAdd(cones[n->id], cones[n->id], m->tnormals[j]);
 	    n=n->parent;
 	}
 	n=tree->vertex_nodes[m->tris[j][2]];
 	while (n) {
-	    VecAdd(n->cone_normal, n->cone_normal, m->tnormals[j]);
+	    VecAdd(cones[n->id], cones[n->id], m->tnormals[j]);
 	    n=n->parent;
 	}
     }
 
     /* now go and normalize them all */
-    normalize_cones(tree->root);
+    for (j=0; j<tree->nnodes; j++)
+	VecNormalize(cones[j]);
 
     /* now go back and compute the angles */
     for (j=0; j<m->nt; j++) {
 	n=tree->vertex_nodes[m->tris[j][0]];
 	while (n) {
-	    angle=VecDot(n->cone_normal, m->tnormals[j]);
-	    if (n->cone_angle > angle)
-		n->cone_angle = angle;
+	    angle=VecDot(cones[n->id], m->tnormals[j]);
+	    if (cosines[n->id] > angle)
+		cosines[n->id] = angle;
 	    n=n->parent;
 	}
 	n=tree->vertex_nodes[m->tris[j][1]];
 	while (n) {
-	    angle=VecDot(n->cone_normal, m->tnormals[j]);
-	    if (n->cone_angle > angle)
-		n->cone_angle = angle;
+	    angle=VecDot(cones[n->id], m->tnormals[j]);
+	    if (cosines[n->id] > angle)
+		cosines[n->id] = angle;
 	    n=n->parent;
 	}
 	n=tree->vertex_nodes[m->tris[j][2]];
 	while (n) {
-	    angle=VecDot(n->cone_normal, m->tnormals[j]);
-	    if (n->cone_angle > angle)
-		n->cone_angle = angle;
+	    angle=VecDot(cones[n->id], m->tnormals[j]);
+	    if (cosines[n->id] > angle)
+		cosines[n->id] = angle;
 	    n=n->parent;
 	}
     }
 
-    /* now convert to radians using acos */
-    fix_cones(tree->root);
+    /* now convert to radians using acos, and compress */
+    set_cones(tree->root, cones, cosines);
+    free(cones);
+    free(cosines);
+    perfctr_end(PHASE_OCTREE_CONES);
+    TRACE_END();
 
     t=get_timer()-t;
     printf("done [%gs]\n", t);
 
+    TRACE_END();
     return tree;
 }
 
@@ -536,3 +798,38 @@ octree_free(octree *o)
     free(o->activators);
     free(o);
 }
+
+static void
+flip_node(octree_node *n)
+{
+    int k;
+
+    if (n != NULL) {
+	VecScale(n->rep_vnormal, n->rep_vnormal, -1);
+	n->cone_flip = !n->cone_flip;
+	if (!n->leaf)
+	    for (k=0; k<8; k++)
+		flip_node(n->subtree[k]);
+    }
+}
+
+void
+octree_flip(octree *o)
+{
+    flip_node(o->root);
+}
+
+int
+octree_depth(const octree_node *o)
+{
+    int max = 0, d, j;
+
+    if (o == NULL) return 0;
+    if (o->leaf) return 1;
+
+    for (j=0; j<8; j++) {
+	d = octree_depth(o->subtree[j]);
+	if (max < d) max = d;
+    }
+    return 1+max;
+}
@@ -8,11 +8,15 @@
 #define BACK	0
 #define FRONT	1
 
+#include <stdint.h>
+
 #include "mesh.h"
+#include "quant.h"
 #include "vec3.h"
 
 typedef struct octree_node  octree_node;
 
+/* per-view node status, kept by each lod_context (see lod.h) */
 typedef enum {
     STATUS_ACTIVE,
     STATUS_INACTIVE,
@@ -20,23 +24,22 @@ typedef enum {
 } octree_status;
 
 struct octree_node {
-    octree_status   status;		/* active, inactive, boundary	    */
     unsigned char   depth;		/* depth in tree (root has 0 depth) */
     char	    leaf;		/* whether or not node is leaf	    */
+    unsigned char   cone_angle;		/* normal cone angle, in steps	    */
+    unsigned char   cone_flip;		/* cone direction negated	    */
 
-    int		    testid;
+    int		    id;			/* preorder index, [0,nnodes)	    */
 
     int		    rep_vindex;		/* representative vertex index	    */
     vec3	    rep_vnormal;	/* representative vertex normal	    */
 
-    vec3	    sp_center;		/* bounding sphere center ..	    */
-    float	    sp_radius;		/*		    .. and radius   */
-
     vec3	    bb_midpt;		/* bounding box center ..	    */
     vec3	    bb_extent;		/*		    .. and extents  */
 
-    vec3	    cone_normal;	/* normal cone direction ..	    */
-    double	    cone_angle;		/*		    .. and angle    */
+    int16_t	    sp_center[3];	/* bounding sphere center, in box ..*/
+    uint16_t	    sp_radius;		/*		    .. and radius   */
+    uint32_t	    cone_normal;	/* normal cone direction, octahedral */
 
     int		   *activated;		/* activated[0]=# tris,		    */
 
@@ -44,14 +47,63 @@ struct octree_node {
     octree_node	   *subtree[8];		/* pointers to children (x,y,z)	    */
 };
 
+/* The bounding sphere and normal cone of a node are stored compressed, and
+ * decoded when tested. The sphere's center is quantized to 16 bits within
+ * the node's box and its radius to 16 bits of the sum of the box's extents;
+ * the cone's direction is octahedral-encoded in 32 bits and its angle
+ * quantized to 8 bits of pi, widened by the direction's error. Both are
+ * rounded so that the decoded sphere and cone contain the exact ones. */
+#define CONE_ANGLE_STEP	(M_PI/255)
+
+void	octree_set_sphere(octree_node *n, const vec3 center, real radius);
+/* normal is unit length, or zero if no triangles are at the node */
+void	octree_set_cone(octree_node *n, const vec3 normal, real angle);
+void	octree_cone(const octree_node *n, vec3 normal, real *angle);
+/* the same for a sphere or cone that may have been decoded from a node
+ * with this box: if so, the node gets its encoding back as it was, rather
+ * than one widened again */
+void	octree_restore_sphere(octree_node *n, const vec3 center, real radius);
+void	octree_restore_cone(octree_node *n, const vec3 normal, real angle);
+
+#define NodeCenter(c, n) \
+    (c)[0] = (n)->bb_midpt[0] + (n)->bb_extent[0]*(n)->sp_center[0] * \
+	     (real)(1.0/QUANT_MAX), \
+    (c)[1] = (n)->bb_midpt[1] + (n)->bb_extent[1]*(n)->sp_center[1] * \
+	     (real)(1.0/QUANT_MAX), \
+    (c)[2] = (n)->bb_midpt[2] + (n)->bb_extent[2]*(n)->sp_center[2] * \
+	     (real)(1.0/QUANT_MAX)
+
+#define NodeSphere(c, r, n) \
+    NodeCenter(c, n), \
+    (r) = ((n)->bb_extent[0] + (n)->bb_extent[1] + (n)->bb_extent[2]) * \
+	  (n)->sp_radius * (real)(1.0/65535)
+
 typedef struct {
     mesh	 *mesh;			/* pointer to mesh		    */
     octree_node	 *root;			/* root of vertex octree	    */
+    int		  nnodes;		/* number of nodes in tree	    */
     octree_node	**vertex_nodes;		/* per-vertex leaf node		    */
     octree_node	**activators;		/* per-triangle "activating" node   */
 } octree;
 
 octree *octree_create(mesh *m);
 void	octree_free(octree *o);
+int	octree_depth(const octree_node *o);
+/* negate the normals of the nodes, to go with mesh_flip(): the same as
+ * rebuilding the tree, without needing full-precision positions. The cones
+ * keep their encoding and are negated as decoded, so flipping twice leaves
+ * the tree as it was, bit for bit */
+void	octree_flip(octree *o);
+
+/* The steps of octree_create() that out-of-core builders (see paged.h) use
+ * on parts of a mesh. octree_build() builds just the nodes over the
+ * vertices of m, with the root at the given depth, numbering them in
+ * preorder from 0. octree_activator() finds the node below n at which the
+ * triangle with corners p0, p1, p2 is activated: where the last two corners
+ * that share a node part; given only p0 and p1 (p2 NULL), where those
+ * part. */
+octree_node *octree_build(mesh *m, int depth, int *nnodes);
+octree_node *octree_activator(octree_node *n, const real *p0,
+			      const real *p1, const real *p2);
 
 #endif // !_OCTREE_H_
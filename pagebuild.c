@@ -0,0 +1,1276 @@
+/* Out-of-core construction of paged octrees (see paged.h), for meshes too
+ * large to load. The PLY file is read a chunk at a time, in a few passes:
+ *
+ *  - the vertex positions (and normals) are copied to temporary files,
+ *    which the later passes read instead of decoding the PLY file again;
+ *  - the top levels of the tree are split on a regular grid, each pass over
+ *    the positions counting the vertices in the children of the nodes that
+ *    are still too big, until every node holds few enough vertices to be
+ *    built in memory: those are the cells;
+ *  - the vertices, the corners of the triangles, and the triangles are
+ *    binned by cell into temporary files;
+ *  - the cells are built in parallel, each as an ordinary octree over its
+ *    vertices, with its pages written to another temporary file;
+ *  - and the grid nodes are stitched on top of the cells and written with
+ *    them to the paged file.
+ *
+ * Below the cells the tree is the one octree_create() builds. Above them
+ * it is approximated: the boxes of the grid nodes are grid boxes rather
+ * than tight ones, their spheres bound their children's, and each takes
+ * the representative vertex of one of its children, the one whose normal
+ * is closest to the average normal below. The triangle pass looks the
+ * positions of the corners up in the memory-mapped positions file, so it
+ * relies on the page cache when that is larger than memory. A mesh that
+ * fits in one cell gives the tree paged_write() writes. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "aabb.h"
+#include "mesh.h"
+#include "octree.h"
+#include "paged.h"
+#include "pagefile.h"
+#include "parallel.h"
+#include "ply.h"
+#include "timer.h"
+#include "vec3.h"
+
+/* vertices or triangles read from the PLY file at a time */
+#define CHUNK			65536
+/* memory a cell takes to build, per vertex (with its triangles) */
+#define CELL_VERTEX_BYTES	640
+/* cells hold at least this many vertices, whatever the memory */
+#define CELL_MIN_VERTICES	1024
+/* grid nodes are cells at this depth, however many vertices they hold */
+#define GRID_MAX_DEPTH		21
+
+static int
+read_all(int fd, void *buf, size_t size, uint64_t offset)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (size > 0) {
+	r = pread(fd, p, size, offset);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+	offset += r;
+    }
+    return 1;
+}
+
+static int
+write_all(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const char *p = buf;
+    ssize_t r;
+
+    while (size > 0) {
+	r = pwrite(fd, p, size, offset);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+	offset += r;
+    }
+    return 1;
+}
+
+/* an anonymous file in dir, gone once closed */
+static int
+temp_file(const char *dir)
+{
+    char *path = malloc(strlen(dir) + 32);
+    int fd;
+
+    sprintf(path, "%s/lod-page.XXXXXX", dir);
+    if ((fd = mkstemp(path)) < 0)
+	perror(path);
+    else
+	unlink(path);
+    free(path);
+    return fd;
+}
+
+/* Spill files: fixed-size records appended to buckets, buffered in memory
+ * and written out a chunk per bucket whenever the buffers fill up. Once
+ * flushed, buckets can be read back from any thread. */
+
+typedef struct {
+    uint64_t	offset;
+    uint32_t	n;
+    int32_t	next;			/* next chunk of the bucket, or -1  */
+} spill_chunk;
+
+typedef struct {
+    int		 fd;
+    size_t	 size;			/* of a record			    */
+    int		 nbuckets;
+    char	**buf;			/* per bucket ..		    */
+    uint32_t	*nbuf, *maxbuf;
+    int32_t	*head, *tail;		/*	.. and its chunks	    */
+    uint64_t	*count;
+    spill_chunk	*chunks;
+    int		 nchunks, maxchunks;
+    size_t	 buffered, cap;		/* bytes			    */
+    uint64_t	 end;
+    int		 error;
+} spill;
+
+static spill *
+spill_create(const char *dir, size_t size, int nbuckets, size_t cap)
+{
+    spill *s = calloc(1, sizeof(*s));
+    int b;
+
+    s->size = size;
+    s->nbuckets = nbuckets;
+    s->cap = cap;
+    s->buf = calloc(nbuckets, sizeof(*s->buf));
+    s->nbuf = calloc(nbuckets, sizeof(*s->nbuf));
+    s->maxbuf = calloc(nbuckets, sizeof(*s->maxbuf));
+    s->head = malloc(sizeof(*s->head)*nbuckets);
+    s->tail = malloc(sizeof(*s->tail)*nbuckets);
+    s->count = calloc(nbuckets, sizeof(*s->count));
+    for (b=0; b<nbuckets; b++)
+	s->head[b] = s->tail[b] = -1;
+    if ((s->fd = temp_file(dir)) < 0)
+	s->error = 1;
+    return s;
+}
+
+/* write out every buffer, and free them */
+static void
+spill_flush(spill *s)
+{
+    spill_chunk *c;
+    int b;
+
+    for (b=0; b<s->nbuckets; b++) {
+	if (s->nbuf[b] == 0)
+	    continue;
+	if (s->nchunks == s->maxchunks) {
+	    s->maxchunks = s->maxchunks ? 2*s->maxchunks : 1024;
+	    s->chunks = realloc(s->chunks, sizeof(*s->chunks)*s->maxchunks);
+	}
+	c = &s->chunks[s->nchunks];
+	c->offset = s->end;
+	c->n = s->nbuf[b];
+	c->next = -1;
+	if (!s->error && !write_all(s->fd, s->buf[b], s->size*c->n, c->offset))
+	    s->error = 1;
+	s->end += s->size*c->n;
+	if (s->tail[b] >= 0)
+	    s->chunks[s->tail[b]].next = s->nchunks;
+	else
+	    s->head[b] = s->nchunks;
+	s->tail[b] = s->nchunks++;
+	free(s->buf[b]);
+	s->buf[b] = NULL;
+	s->nbuf[b] = s->maxbuf[b] = 0;
+    }
+    s->buffered = 0;
+}
+
+static void
+spill_add(spill *s, int b, const void *rec)
+{
+    if (s->nbuf[b] == s->maxbuf[b]) {
+	s->maxbuf[b] = s->maxbuf[b] ? 2*s->maxbuf[b] : 64;
+	s->buf[b] = realloc(s->buf[b], s->size*s->maxbuf[b]);
+    }
+    memcpy(s->buf[b] + s->size*s->nbuf[b]++, rec, s->size);
+    s->count[b]++;
+    if ((s->buffered += s->size) >= s->cap)
+	spill_flush(s);
+}
+
+/* the records of bucket b, once flushed, in the order they were added;
+ * NULL on error */
+static void *
+spill_read(const spill *s, int b, size_t *n)
+{
+    char *recs = malloc(s->size*(s->count[b] ? s->count[b] : 1));
+    size_t got = 0;
+    int32_t c;
+
+    for (c=s->head[b]; c>=0 && recs; c=s->chunks[c].next) {
+	if (!read_all(s->fd, recs + s->size*got, s->size*s->chunks[c].n,
+		      s->chunks[c].offset)) {
+	    free(recs);
+	    return NULL;
+	}
+	got += s->chunks[c].n;
+    }
+    *n = got;
+    return recs;
+}
+
+static void
+spill_free(spill *s)
+{
+    int b;
+
+    if (s == NULL)
+	return;
+    for (b=0; b<s->nbuckets; b++)
+	free(s->buf[b]);
+    free(s->buf);
+    free(s->nbuf);
+    free(s->maxbuf);
+    free(s->head);
+    free(s->tail);
+    free(s->count);
+    free(s->chunks);
+    if (s->fd >= 0)
+	close(s->fd);
+    free(s);
+}
+
+/* a vertex of a cell */
+typedef struct {
+    uint32_t	index;
+    float	p[3], n[3];
+} vertex_rec;
+
+/* a corner of a triangle at a vertex of a cell, with the (unnormalized)
+ * normal of the triangle */
+typedef struct {
+    uint32_t	v;
+    float	n[3];
+} corner_rec;
+
+/* a triangle activated in a cell, or (in the last bucket) at a grid node */
+typedef struct {
+    float	p[9];			/* its corners			    */
+    int32_t	node;			/* grid node activating it	    */
+    int32_t	follow;			/* 3 if all its corners are in the
+					   cell, else the one that is not   */
+} tri_rec;
+
+typedef struct {
+    vec3	 mid, ext;		/* grid box			    */
+    int		 depth, parent;
+    int		 child[8];		/* grid nodes, -1 if none	    */
+    int		 cell;			/* cell it is, or -1		    */
+    int		 open;			/* index while being split, or -1   */
+    uint64_t	 count;			/* vertices below		    */
+
+    double	 cone_sum[3];		/* of the normals of the triangles
+					   at the vertices below	    */
+    vec3	 cone_normal;
+    float	 cone_cos;
+    uint32_t	 first_tri, ntris;	/* grid triangles it activates	    */
+
+    /* filled in by stitching (for cells, by building them) */
+    paged_disk_node disk;
+    vec3	 normal;		/* of the representative vertex	    */
+    double	 nsum[3];		/* of the vertex normals below	    */
+    int		 page, local;		/* where it is written		    */
+} grid_node;
+
+typedef struct {
+    int		  grid;			/* its grid node		    */
+    int		  nnodes, npages;
+    paged_entry	 *pages;		/* offsets in the cells file	    */
+    float	(*tris)[9];		/* activated at its root	    */
+    float	 *cone_cos;		/* per grid ancestor, from parent   */
+    int		  depth;		/* levels below the root	    */
+    int		  page_base;		/* first page in the paged file	    */
+    int		  ok;
+} build_cell;
+
+typedef struct {
+    const char	 *ply, *tmpdir;
+    ply_reader	 *r;			/* at the faces after the first pass */
+    int		  page_depth;
+    size_t	  mem;
+
+    uint32_t	  nv, nt;
+    uint32_t	  ndegenerate;		/* triangles dropped		    */
+    int		  normals;
+    vec3	  min, max;
+    int		  vfd, nfd;		/* positions and normals	    */
+
+    grid_node	 *grid;
+    int		  ngrid, maxgrid;
+    build_cell	 *cells;
+    int		  ncells;
+
+    spill	 *verts, *corners, *tris;
+    float	(*grid_tris)[9];
+
+    int		  cfd;			/* pages of the cells		    */
+    uint64_t	  cend;
+    pthread_mutex_t lock;
+    int		  error;
+} builder;
+
+static int
+octant(const real *mid, const real *p)
+{
+    int k = 0;
+
+    if (p[0] >= mid[0]) k |= 4;
+    if (p[1] >= mid[1]) k |= 2;
+    if (p[2] >= mid[2]) k |= 1;
+    return k;
+}
+
+/* pass 1: the bounding box, and the positions and normals copied out */
+static int
+copy_vertices(builder *b)
+{
+    vec3 *verts = malloc(sizeof(*verts)*CHUNK);
+    vec3 *normals = malloc(sizeof(*normals)*CHUNK);
+    uint32_t i, j, n;
+    int colors, ok = 1;
+
+    if ((b->r = ply_open(b->ply, &b->nv, &b->nt, &b->normals, &colors)) ==
+	NULL)
+	ok = 0;
+    if (ok && ((b->vfd = temp_file(b->tmpdir)) < 0 ||
+	       (b->normals && (b->nfd = temp_file(b->tmpdir)) < 0)))
+	ok = 0;
+    for (i=0; ok && i<b->nv; i+=n) {
+	n = b->nv - i < CHUNK ? b->nv - i : CHUNK;
+	if (!ply_read_vertices(b->r, n, verts, b->normals ? normals : NULL,
+			       NULL)) {
+	    ok = 0;
+	    break;
+	}
+	for (j=0; j<n; j++) {
+	    if (i+j == 0) {
+		VecSet(b->min, verts[j]);
+		VecSet(b->max, verts[j]);
+	    }
+	    if (b->min[0] > verts[j][0]) b->min[0] = verts[j][0];
+	    if (b->min[1] > verts[j][1]) b->min[1] = verts[j][1];
+	    if (b->min[2] > verts[j][2]) b->min[2] = verts[j][2];
+	    if (b->max[0] < verts[j][0]) b->max[0] = verts[j][0];
+	    if (b->max[1] < verts[j][1]) b->max[1] = verts[j][1];
+	    if (b->max[2] < verts[j][2]) b->max[2] = verts[j][2];
+	}
+	if (!write_all(b->vfd, verts, sizeof(*verts)*n,
+		       (uint64_t)i*sizeof(*verts)) ||
+	    (b->normals && !write_all(b->nfd, normals, sizeof(*normals)*n,
+				      (uint64_t)i*sizeof(*normals)))) {
+	    perror(b->tmpdir);
+	    ok = 0;
+	}
+    }
+    if (ok && b->nv == 0) {
+	fprintf(stderr, "%s: no vertices\n", b->ply);
+	ok = 0;
+    }
+    free(verts);
+    free(normals);
+    return ok;
+}
+
+static int
+add_grid_node(builder *b, int parent, int k, uint64_t count)
+{
+    grid_node *g;
+    int i;
+
+    if (b->ngrid == b->maxgrid) {
+	b->maxgrid = b->maxgrid ? 2*b->maxgrid : 64;
+	b->grid = realloc(b->grid, sizeof(*b->grid)*b->maxgrid);
+    }
+    g = &b->grid[b->ngrid];
+    memset(g, 0, sizeof(*g));
+    g->parent = parent;
+    g->count = count;
+    g->cell = g->open = -1;
+    g->cone_cos = 1.0;
+    for (i=0; i<8; i++)
+	g->child[i] = -1;
+    if (parent < 0) {
+	aabb_corners_to_midpt(g->mid, g->ext, b->min, b->max);
+    } else {
+	grid_node *p = &b->grid[parent];
+
+	g->depth = p->depth + 1;
+	for (i=0; i<3; i++) {
+	    g->ext[i] = p->ext[i]/2;
+	    g->mid[i] = p->mid[i] + (k & (4>>i) ? g->ext[i] : -g->ext[i]);
+	}
+	p->child[k] = b->ngrid;
+    }
+    return b->ngrid++;
+}
+
+/* the cell or still open grid node vertex p is in */
+static int
+find_grid_node(const builder *b, const real *p)
+{
+    int g = 0;
+
+    while (b->grid[g].cell < 0 && b->grid[g].open < 0)
+	g = b->grid[g].child[octant(b->grid[g].mid, p)];
+    return g;
+}
+
+static void
+make_cell(builder *b, int g)
+{
+    b->cells = realloc(b->cells, sizeof(*b->cells)*(b->ncells+1));
+    memset(&b->cells[b->ncells], 0, sizeof(*b->cells));
+    b->cells[b->ncells].grid = g;
+    b->grid[g].cell = b->ncells++;
+}
+
+/* split the grid until the cells are small enough, a pass over the
+ * positions per level */
+static int
+split_grid(builder *b)
+{
+    vec3 *verts = malloc(sizeof(*verts)*CHUNK);
+    uint64_t limit, *counts;
+    int *open = NULL, nopen = 0, *next, nnext, g, j, k;
+    uint32_t i, n, v;
+
+    limit = b->mem / ((uint64_t)parallel_threads()*CELL_VERTEX_BYTES);
+    if (limit < CELL_MIN_VERTICES)
+	limit = CELL_MIN_VERTICES;
+
+    add_grid_node(b, -1, 0, b->nv);
+    if (b->nv <= limit) {
+	make_cell(b, 0);
+    } else {
+	open = malloc(sizeof(*open));
+	open[nopen++] = 0;
+	b->grid[0].open = 0;
+    }
+
+    while (nopen > 0) {
+	counts = calloc(8*nopen, sizeof(*counts));
+	for (i=0; i<b->nv; i+=n) {
+	    n = b->nv - i < CHUNK ? b->nv - i : CHUNK;
+	    if (!read_all(b->vfd, verts, sizeof(*verts)*n,
+			  (uint64_t)i*sizeof(*verts))) {
+		perror(b->tmpdir);
+		free(counts);
+		free(open);
+		free(verts);
+		return 0;
+	    }
+	    for (v=0; v<n; v++) {
+		grid_node *o = &b->grid[find_grid_node(b, verts[v])];
+
+		if (o->open >= 0)
+		    counts[8*o->open + octant(o->mid, verts[v])]++;
+	    }
+	}
+
+	next = malloc(sizeof(*next)*8*nopen);
+	nnext = 0;
+	for (j=0; j<nopen; j++) {
+	    for (k=0; k<8; k++) {
+		if (counts[8*j+k] == 0)
+		    continue;
+		g = add_grid_node(b, open[j], k, counts[8*j+k]);
+		if (counts[8*j+k] > limit && b->grid[g].depth < GRID_MAX_DEPTH)
+		    next[nnext++] = g;
+		else
+		    make_cell(b, g);
+	    }
+	}
+	for (j=0; j<nopen; j++)
+	    b->grid[open[j]].open = -1;
+	for (j=0; j<nnext; j++)
+	    b->grid[next[j]].open = j;
+	free(open);
+	free(counts);
+	open = next;
+	nopen = nnext;
+    }
+    free(open);
+    free(verts);
+    return 1;
+}
+
+/* bin the vertices by cell */
+static int
+bin_vertices(builder *b)
+{
+    vec3 *verts = malloc(sizeof(*verts)*CHUNK);
+    vec3 *normals = malloc(sizeof(*normals)*CHUNK);
+    vertex_rec rec;
+    uint32_t i, j, n;
+    int ok = 1;
+
+    b->verts = spill_create(b->tmpdir, sizeof(rec), b->ncells, b->mem/4);
+    memset(&rec, 0, sizeof(rec));
+    for (i=0; ok && i<b->nv; i+=n) {
+	n = b->nv - i < CHUNK ? b->nv - i : CHUNK;
+	if (!read_all(b->vfd, verts, sizeof(*verts)*n,
+		      (uint64_t)i*sizeof(*verts)) ||
+	    (b->normals && !read_all(b->nfd, normals, sizeof(*normals)*n,
+				     (uint64_t)i*sizeof(*normals)))) {
+	    ok = 0;
+	    break;
+	}
+	for (j=0; j<n; j++) {
+	    rec.index = i+j;
+	    VecSet(rec.p, verts[j]);
+	    if (b->normals)
+		VecSet(rec.n, normals[j]);
+	    spill_add(b->verts, b->grid[find_grid_node(b, verts[j])].cell,
+		      &rec);
+	}
+    }
+    spill_flush(b->verts);
+    if (!ok || b->verts->error) {
+	perror(b->tmpdir);
+	ok = 0;
+    }
+    free(verts);
+    free(normals);
+    return ok;
+}
+
+/* Where triangle p is activated, as octree_activator() finds it, down the
+ * grid: the cell all three corners are in (follow 3), the cell two of them
+ * are in (follow being the other), or the grid node where they part. */
+static int
+grid_activator(const builder *b, const real *p[3], int *follow)
+{
+    const grid_node *grid = b->grid;
+    int g = 0, k0, k1, k2, a = 0, c = 1;
+
+    for (;;) {
+	if (grid[g].cell >= 0) {
+	    *follow = 3;
+	    return g;
+	}
+	k0 = octant(grid[g].mid, p[0]);
+	k1 = octant(grid[g].mid, p[1]);
+	k2 = octant(grid[g].mid, p[2]);
+	if (k0 != k1 || k0 != k2)
+	    break;
+	g = grid[g].child[k0];
+    }
+    if (k0 == k1) ;
+    else if (k0 == k2) c = 2;
+    else if (k1 == k2) a = 1, c = 2;
+    else {
+	*follow = -1;
+	return g;
+    }
+    *follow = 3 - a - c;
+    for (;;) {
+	if (grid[g].cell >= 0)
+	    return g;
+	k0 = octant(grid[g].mid, p[a]);
+	k1 = octant(grid[g].mid, p[c]);
+	if (k0 != k1) {
+	    *follow = -1;
+	    return g;
+	}
+	g = grid[g].child[k0];
+    }
+}
+
+/* bin the triangles and their corners by cell, summing the normal cones of
+ * the grid nodes on the way */
+static int
+bin_triangles(builder *b)
+{
+    index3u *tris = malloc(sizeof(*tris)*CHUNK);
+    size_t size = sizeof(vec3)*b->nv;
+    const vec3 *verts;
+    const real *p[3];
+    int follow, g, k, nread, ok = 1;
+    uint32_t j, n;
+    corner_rec corner;
+    tri_rec tri;
+    vec3 t;
+
+    verts = mmap(NULL, size, PROT_READ, MAP_SHARED, b->vfd, 0);
+    if (verts == MAP_FAILED) {
+	perror(b->tmpdir);
+	free(tris);
+	return 0;
+    }
+    b->corners = spill_create(b->tmpdir, sizeof(corner), b->ncells,
+			      b->mem/4);
+    b->tris = spill_create(b->tmpdir, sizeof(tri), b->ncells+1, b->mem/4);
+    memset(&tri, 0, sizeof(tri));
+    b->nt = 0;
+    while (ok && (nread = ply_read_faces(b->r, CHUNK, tris)) != 0) {
+	if (nread < 0) {
+	    ok = 0;
+	    break;
+	}
+	n = nread;
+	b->nt += n;
+	for (j=0; j<n; j++) {
+	    if (tris[j][0] == tris[j][1] || tris[j][0] == tris[j][2] ||
+		tris[j][1] == tris[j][2]) {
+		b->ndegenerate++;
+		continue;
+	    }
+	    for (k=0; k<3; k++)
+		p[k] = verts[tris[j][k]];
+	    Normal(corner.n, p[0], p[1], p[2]);
+	    VecSet(t, corner.n);
+	    VecNormalize(t);
+
+	    for (k=0; k<3; k++) {
+		for (g=0; b->grid[g].cell < 0;
+		     g=b->grid[g].child[octant(b->grid[g].mid, p[k])])
+		    VecAdd(b->grid[g].cone_sum, b->grid[g].cone_sum, t);
+		corner.v = tris[j][k];
+		spill_add(b->corners, b->grid[g].cell, &corner);
+	    }
+
+	    g = grid_activator(b, p, &follow);
+	    for (k=0; k<9; k++)
+		tri.p[k] = p[k/3][k%3];
+	    tri.node = g;
+	    tri.follow = follow;
+	    spill_add(b->tris, follow < 0 ? b->ncells : b->grid[g].cell,
+		      &tri);
+	}
+    }
+    spill_flush(b->corners);
+    spill_flush(b->tris);
+    if (ok && (b->corners->error || b->tris->error)) {
+	perror(b->tmpdir);
+	ok = 0;
+    }
+    munmap((void *)verts, size);
+    free(tris);
+
+    for (g=0; g<b->ngrid; g++) {
+	VecSet(b->grid[g].cone_normal, b->grid[g].cone_sum);
+	VecNormalize(b->grid[g].cone_normal);
+    }
+    return ok;
+}
+
+static int
+cmp_vertex_rec(const void *a, const void *b)
+{
+    uint32_t i = ((const vertex_rec *)a)->index;
+    uint32_t j = ((const vertex_rec *)b)->index;
+
+    return i < j ? -1 : i > j;
+}
+
+static void
+free_nodes(octree_node *n)
+{
+    int k;
+
+    if (n != NULL) {
+	if (!n->leaf)
+	    for (k=0; k<8; k++)
+		free_nodes(n->subtree[k]);
+	free(n->activated);
+	free(n);
+    }
+}
+
+static void
+set_cones(octree_node *n, vec3 cones[], real cosines[])
+{
+    int k;
+
+    if (n != NULL) {
+	octree_set_cone(n, cones[n->id], acos(cosines[n->id]));
+	if (!n->leaf)
+	    for (k=0; k<8; k++)
+		set_cones(n->subtree[k], cones, cosines);
+    }
+}
+
+/* build cell i as octree_create() builds a tree, and write its pages below
+ * the root to the cells file */
+static void
+build_cell_task(void *arg, int i)
+{
+    builder *b = arg;
+    build_cell *cell = &b->cells[i];
+    grid_node *g = &b->grid[cell->grid];
+    vertex_rec *vrecs = NULL, key;
+    corner_rec *crecs = NULL;
+    tri_rec *trecs = NULL;
+    size_t nv = 0, nc = 0, nt = 0, j;
+    uint32_t *vindex = NULL, *local = NULL;
+    octree_node **leaves = NULL, *root = NULL, *n;
+    const size_t node_size = sizeof(paged_disk_node);
+    float (*tris)[9];
+    page_plan pp;
+    int a, k, nanc = 0;
+    vec3 t, *cones = NULL;
+    real dot, *cosines = NULL;
+    mesh m;
+
+    memset(&m, 0, sizeof(m));
+    memset(&pp, 0, sizeof(pp));
+    if ((vrecs = spill_read(b->verts, i, &nv)) == NULL ||
+	(crecs = spill_read(b->corners, i, &nc)) == NULL ||
+	(trecs = spill_read(b->tris, i, &nt)) == NULL)
+	goto done;
+    qsort(vrecs, nv, sizeof(*vrecs), cmp_vertex_rec);
+
+    /* the cell's vertices, then the corners of its triangles */
+    m.nv = nv;
+    m.nt = nt;
+    m.verts = malloc(sizeof(*m.verts)*(nv + 3*nt));
+    m.vnormals = calloc(nv, sizeof(*m.vnormals));
+    m.tris = malloc(sizeof(*m.tris)*(nt ? nt : 1));
+    vindex = malloc(sizeof(*vindex)*nv);
+    local = malloc(sizeof(*local)*(nc ? nc : 1));
+    for (j=0; j<nv; j++) {
+	vindex[j] = vrecs[j].index;
+	VecSet(m.verts[j], vrecs[j].p);
+	if (b->normals)
+	    VecSet(m.vnormals[j], vrecs[j].n);
+    }
+    for (j=0; j<nt; j++)
+	for (k=0; k<3; k++) {
+	    m.tris[j][k] = nv + 3*j + k;
+	    VecSet(m.verts[m.tris[j][k]], trecs[j].p + 3*k);
+	}
+    for (j=0; j<nc; j++) {
+	key.index = crecs[j].v;
+	local[j] = (vertex_rec *)bsearch(&key, vrecs, nv, sizeof(*vrecs),
+					 cmp_vertex_rec) - vrecs;
+	if (!b->normals)
+	    VecAdd(m.vnormals[local[j]], m.vnormals[local[j]], crecs[j].n);
+    }
+    if (!b->normals)
+	for (j=0; j<nv; j++)
+	    VecNormalize(m.vnormals[j]);
+
+    root = octree_build(&m, g->depth, &cell->nnodes);
+
+    /* the leaf of every vertex */
+    leaves = malloc(sizeof(*leaves)*nv);
+    for (j=0; j<nv; j++) {
+	n = root;
+	while (!n->leaf && n->subtree[octant(n->bb_midpt, m.verts[j])])
+	    n = n->subtree[octant(n->bb_midpt, m.verts[j])];
+	leaves[j] = n;
+    }
+
+    for (j=0; j<nt; j++) {
+	const real *p[3];
+
+	for (k=0; k<3; k++)
+	    p[k] = m.verts[m.tris[j][k]];
+	if (trecs[j].follow == 3)
+	    n = octree_activator(root, p[0], p[1], p[2]);
+	else
+	    n = octree_activator(root, p[trecs[j].follow == 0 ? 1 : 0],
+				 p[trecs[j].follow == 2 ? 1 : 2], NULL);
+	if (n->activated == NULL) {
+	    n->activated = malloc(sizeof(*n->activated)*2);
+	    n->activated[0] = 1;
+	    n->activated[1] = j;
+	} else {
+	    n->activated[0] += 1;
+	    n->activated = realloc(n->activated,
+				   sizeof(*n->activated)*(n->activated[0]+1));
+	    n->activated[n->activated[0]] = j;
+	}
+    }
+
+    /* normal cones, and the cones of the grid nodes above as seen from
+     * here */
+    cones = calloc(cell->nnodes, sizeof(*cones));
+    cosines = malloc(sizeof(*cosines)*cell->nnodes);
+    for (a=0; a<cell->nnodes; a++)
+	cosines[a] = 1.0;
+    for (j=0; j<nc; j++) {
+	VecSet(t, crecs[j].n);
+	VecNormalize(t);
+	for (n=leaves[local[j]]; n; n=n->parent)
+	    VecAdd(cones[n->id], cones[n->id], t);
+    }
+    for (a=0; a<cell->nnodes; a++)
+	VecNormalize(cones[a]);
+    for (a=g->parent; a>=0; a=b->grid[a].parent)
+	nanc++;
+    cell->cone_cos = malloc(sizeof(*cell->cone_cos)*(nanc ? nanc : 1));
+    for (a=0; a<nanc; a++)
+	cell->cone_cos[a] = 1.0;
+    for (j=0; j<nc; j++) {
+	VecSet(t, crecs[j].n);
+	VecNormalize(t);
+	for (n=leaves[local[j]]; n; n=n->parent) {
+	    dot = VecDot(cones[n->id], t);
+	    if (cosines[n->id] > dot)
+		cosines[n->id] = dot;
+	}
+	for (a=0, k=g->parent; k>=0; a++, k=b->grid[k].parent) {
+	    dot = VecDot(b->grid[k].cone_normal, t);
+	    if (cell->cone_cos[a] > dot)
+		cell->cone_cos[a] = dot;
+	}
+    }
+    set_cones(root, cones, cosines);
+
+    /* the root, which the top levels link to .. */
+    if (!page_plan_init(&pp, root, cell->nnodes, 0, b->page_depth))
+	goto done;
+    tris = malloc(sizeof(*tris)*(root->activated ? root->activated[0] : 1));
+    page_plan_fill(&pp, -1, root, &m, vindex, &g->disk, tris);
+    cell->tris = tris;
+    VecSet(g->normal, m.vnormals[root->rep_vindex]);
+    for (j=0; j<nv; j++)
+	VecAdd(g->nsum, g->nsum, m.vnormals[j]);
+    cell->depth = octree_depth(root);
+
+    /* .. and the pages below it */
+    cell->npages = pp.npages;
+    cell->pages = pp.entries;
+    for (a=0; a<pp.npages; a++) {
+	paged_entry *e = &pp.entries[a];
+	size_t bytes = node_size*e->nnodes + sizeof(*tris)*e->ntris;
+	char *buf = malloc(bytes);
+	int ok;
+
+	page_plan_fill(&pp, a, root, &m, vindex, (paged_disk_node *)buf,
+		       (float (*)[9])(buf + node_size*e->nnodes));
+	pthread_mutex_lock(&b->lock);
+	e->offset = b->cend;
+	b->cend += bytes;
+	pthread_mutex_unlock(&b->lock);
+	ok = write_all(b->cfd, buf, bytes, e->offset);
+	free(buf);
+	if (!ok)
+	    goto done;
+    }
+    pp.entries = NULL;
+    cell->ok = 1;
+
+done:
+    page_plan_free(&pp);
+    free_nodes(root);
+    free(cones);
+    free(cosines);
+    free(leaves);
+    free(local);
+    free(vindex);
+    free(m.verts);
+    free(m.vnormals);
+    free(m.tris);
+    free(vrecs);
+    free(crecs);
+    free(trecs);
+}
+
+static void
+merge_sphere(float center[3], float *radius, const float c[3], float r)
+{
+    vec3 d;
+    real dist, nr;
+
+    VecSub(d, c, center);
+    dist = sqrt(VecDot(d, d));
+    if (dist + r <= *radius)
+	return;
+    if (dist + *radius <= r) {
+	VecSet(center, c);
+	*radius = r;
+	return;
+    }
+    nr = (dist + *radius + r)/2;
+    VecSAdd(center, center, d, (nr - *radius)/dist);
+    /* a little slack for rounding */
+    *radius = nr*(1 + 1e-6);
+}
+
+/* fill in the grid nodes above the cells, and number all nodes in
+ * preorder */
+static void
+stitch(builder *b, int i, int *id)
+{
+    grid_node *g = &b->grid[i], *c;
+    paged_disk_node *d = &g->disk;
+    real best = -2, dot;
+    int k, first = 1;
+
+    if (g->cell >= 0) {
+	d->id = *id;
+	*id += b->cells[g->cell].nnodes;
+	return;
+    }
+    memset(d, 0, sizeof(*d));
+    d->id = (*id)++;
+    d->depth = g->depth;
+    VecSet(d->bb_midpt, g->mid);
+    VecSet(d->bb_extent, g->ext);
+    VecSet(d->cone_normal, g->cone_normal);
+    for (k=0; k<8; k++) {
+	if (g->child[k] < 0)
+	    continue;
+	stitch(b, g->child[k], id);
+	c = &b->grid[g->child[k]];
+	VecAdd(g->nsum, g->nsum, c->nsum);
+	if (first) {
+	    VecSet(d->sp_center, c->disk.sp_center);
+	    d->sp_radius = c->disk.sp_radius;
+	    first = 0;
+	} else {
+	    merge_sphere(d->sp_center, &d->sp_radius, c->disk.sp_center,
+			 c->disk.sp_radius);
+	}
+    }
+    VecSet(d->rep_vnormal, g->nsum);
+    VecNormalize(d->rep_vnormal);
+    for (k=0; k<8; k++) {
+	if (g->child[k] < 0)
+	    continue;
+	c = &b->grid[g->child[k]];
+	dot = VecDot(d->rep_vnormal, c->normal);
+	if (best < dot) {
+	    best = dot;
+	    d->rep_vindex = c->disk.rep_vindex;
+	    VecSet(d->rep_vertex, c->disk.rep_vertex);
+	    VecSet(g->normal, c->normal);
+	}
+    }
+    d->cone_angle = acos(g->cone_cos);
+}
+
+/* the pages of the grid nodes and cell roots, laid out as page_plan does */
+typedef struct {
+    paged_entry	*entries;
+    int		*anchors;		/* grid node, -1 for the root's	    */
+    int		 npages, maxpages;
+} top_plan;
+
+static int
+top_page(top_plan *tp, const builder *b, int anchor_page, int anchor)
+{
+    paged_entry *e;
+
+    if (tp->npages == tp->maxpages) {
+	tp->maxpages = tp->maxpages ? 2*tp->maxpages : 64;
+	tp->entries = realloc(tp->entries, sizeof(*tp->entries)*tp->maxpages);
+	tp->anchors = realloc(tp->anchors, sizeof(*tp->anchors)*tp->maxpages);
+    }
+    e = &tp->entries[tp->npages];
+    memset(e, 0, sizeof(*e));
+    e->anchor_page = anchor_page;
+    e->anchor = anchor >= 0 ? b->grid[anchor].local : -1;
+    tp->anchors[tp->npages] = anchor;
+    return tp->npages++;
+}
+
+static void
+plan_top(top_plan *tp, builder *b, int i, int page)
+{
+    grid_node *g = &b->grid[i];
+    int k, child_page = page;
+
+    g->page = page;
+    g->local = tp->entries[page].nnodes++;
+    tp->entries[page].ntris += g->cell >= 0 ? g->disk.ntris : g->ntris;
+    if (g->cell >= 0)
+	return;
+    if ((g->depth + 1) % b->page_depth == 0)
+	child_page = top_page(tp, b, page, i);
+    for (k=0; k<8; k++)
+	if (g->child[k] >= 0)
+	    plan_top(tp, b, g->child[k], child_page);
+}
+
+static void
+fill_top(const builder *b, int i, int octant, paged_disk_node *nodes,
+	 float (*tris)[9], unsigned *ntris)
+{
+    const grid_node *g = &b->grid[i], *c;
+    paged_disk_node *d = &nodes[g->local];
+    const build_cell *cell;
+    int k;
+
+    *d = g->disk;
+    d->octant = octant;
+    d->parent = g->parent >= 0 && b->grid[g->parent].page == g->page ?
+		b->grid[g->parent].local : -1;
+    d->first_tri = *ntris;
+    if (g->cell >= 0) {
+	cell = &b->cells[g->cell];
+	memcpy(tris + *ntris, cell->tris, sizeof(*tris)*d->ntris);
+	*ntris += d->ntris;
+	d->child_page = cell->npages ? cell->page_base : -1;
+	return;
+    }
+    d->ntris = g->ntris;
+    memcpy(tris + *ntris, b->grid_tris + g->first_tri,
+	   sizeof(*tris)*g->ntris);
+    *ntris += g->ntris;
+    d->child_page = -1;
+    for (k=0; k<8; k++) {
+	d->child[k] = -1;
+	if (g->child[k] < 0)
+	    continue;
+	c = &b->grid[g->child[k]];
+	if (c->page == g->page) {
+	    d->child[k] = c->local;
+	    fill_top(b, g->child[k], k, nodes, tris, ntris);
+	} else {
+	    d->child_page = c->page;
+	}
+    }
+}
+
+/* gather the triangles activated at grid nodes */
+static int
+grid_triangles(builder *b)
+{
+    tri_rec *trecs;
+    size_t nt, j;
+    uint32_t first = 0;
+    int g;
+
+    if ((trecs = spill_read(b->tris, b->ncells, &nt)) == NULL)
+	return 0;
+    for (j=0; j<nt; j++)
+	b->grid[trecs[j].node].ntris++;
+    for (g=0; g<b->ngrid; g++) {
+	b->grid[g].first_tri = first;
+	first += b->grid[g].ntris;
+	b->grid[g].ntris = 0;
+    }
+    b->grid_tris = malloc(sizeof(*b->grid_tris)*(nt ? nt : 1));
+    for (j=0; j<nt; j++) {
+	grid_node *n = &b->grid[trecs[j].node];
+
+	memcpy(b->grid_tris[n->first_tri + n->ntris++], trecs[j].p,
+	       sizeof(trecs[j].p));
+    }
+    free(trecs);
+    return 1;
+}
+
+/* write the top pages, then copy in the pages of the cells */
+static int
+write_file(builder *b, const char *file)
+{
+    top_plan tp;
+    paged_header h;
+    paged_disk_node *nodes;
+    float (*tris)[9];
+    unsigned ntris;
+    int i, j, k, nnodes = 0, depth = 0, ok = 1;
+    build_cell *cell;
+    FILE *fp;
+
+    stitch(b, 0, &nnodes);
+    for (i=0; i<b->ncells; i++) {
+	cell = &b->cells[i];
+	if (depth < b->grid[cell->grid].depth + cell->depth)
+	    depth = b->grid[cell->grid].depth + cell->depth;
+    }
+
+    memset(&tp, 0, sizeof(tp));
+    top_page(&tp, b, -1, -1);
+    plan_top(&tp, b, 0, 0);
+    for (i=0, k=tp.npages; i<b->ncells; i++) {
+	b->cells[i].page_base = k;
+	k += b->cells[i].npages;
+    }
+
+    if ((fp = fopen(file, "wb")) == NULL) {
+	perror(file);
+	free(tp.entries);
+	free(tp.anchors);
+	return 0;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PAGED_MAGIC, sizeof(h.magic));
+    h.byte_order = PAGED_BYTE_ORDER;
+    h.page_depth = b->page_depth;
+    h.nv = b->nv;
+    h.nt = b->nt - b->ndegenerate;
+    h.nnodes = nnodes;
+    h.npages = k;
+    h.depth = depth;
+    VecSet(h.min, b->min);
+    VecSet(h.max, b->max);
+    fwrite(&h, sizeof(h), 1, fp);
+
+    for (j=0; j<tp.npages && ok; j++) {
+	paged_entry *e = &tp.entries[j];
+
+	nodes = malloc(sizeof(*nodes)*e->nnodes);
+	tris = malloc(sizeof(*tris)*(e->ntris ? e->ntris : 1));
+	ntris = 0;
+	if (tp.anchors[j] < 0) {
+	    fill_top(b, 0, 0, nodes, tris, &ntris);
+	} else {
+	    const grid_node *a = &b->grid[tp.anchors[j]];
+
+	    for (k=0; k<8; k++)
+		if (a->child[k] >= 0)
+		    fill_top(b, a->child[k], k, nodes, tris, &ntris);
+	}
+	e->offset = ftello(fp);
+	if (fwrite(nodes, sizeof(*nodes), e->nnodes, fp) != e->nnodes ||
+	    fwrite(tris, sizeof(*tris), e->ntris, fp) != e->ntris)
+	    ok = 0;
+	free(nodes);
+	free(tris);
+    }
+
+    for (i=0; i<b->ncells && ok; i++) {
+	const grid_node *g;
+
+	cell = &b->cells[i];
+	g = &b->grid[cell->grid];
+	for (j=0; j<cell->npages && ok; j++) {
+	    paged_entry *e = &cell->pages[j];
+	    size_t size = sizeof(*nodes)*e->nnodes;
+	    char *buf = malloc(size + sizeof(*tris)*e->ntris);
+
+	    if (!read_all(b->cfd, buf, size + sizeof(*tris)*e->ntris,
+			  e->offset)) {
+		free(buf);
+		ok = 0;
+		break;
+	    }
+	    nodes = (paged_disk_node *)buf;
+	    for (k=0; k<(int)e->nnodes; k++) {
+		nodes[k].id += g->disk.id;
+		if (nodes[k].child_page >= 0)
+		    nodes[k].child_page += cell->page_base;
+	    }
+	    if (e->anchor_page < 0) {
+		e->anchor_page = g->page;
+		e->anchor = g->local;
+	    } else {
+		e->anchor_page += cell->page_base;
+	    }
+	    e->offset = ftello(fp);
+	    if (fwrite(buf, size + sizeof(*tris)*e->ntris, 1, fp) != 1)
+		ok = 0;
+	    free(buf);
+	}
+    }
+
+    h.table = ftello(fp);
+    if (ok && fwrite(tp.entries, sizeof(*tp.entries), tp.npages, fp) !=
+	(size_t)tp.npages)
+	ok = 0;
+    for (i=0; i<b->ncells && ok; i++)
+	if (fwrite(b->cells[i].pages, sizeof(paged_entry),
+		   b->cells[i].npages, fp) != (size_t)b->cells[i].npages)
+	    ok = 0;
+    if (ok && (fseeko(fp, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, fp) != 1))
+	ok = 0;
+    if (fclose(fp) != 0)
+	ok = 0;
+    if (!ok)
+	perror(file);
+    free(tp.entries);
+    free(tp.anchors);
+    return ok;
+}
+
+int
+paged_build(const char *ply, const char *file, int page_depth, size_t mem,
+	    const char *tmpdir)
+{
+    builder b;
+    double t;
+    int i, a, k, ok = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.ply = ply;
+    b.tmpdir = tmpdir;
+    b.page_depth = page_depth < 1 ? 1 : page_depth;
+    b.mem = mem;
+    b.vfd = b.nfd = b.cfd = -1;
+    pthread_mutex_init(&b.lock, NULL);
+
+    printf("Copying vertices... ");
+    fflush(stdout);
+    t = get_timer();
+    if (!copy_vertices(&b))
+	goto done;
+    printf("done [%gs]\n", get_timer() - t);
+
+    printf("Splitting grid... ");
+    fflush(stdout);
+    t = get_timer();
+    if (!split_grid(&b))
+	goto done;
+    printf("%d cells [%gs]\n", b.ncells, get_timer() - t);
+
+    printf("Binning vertices and triangles... ");
+    fflush(stdout);
+    t = get_timer();
+    if (!bin_vertices(&b) || !bin_triangles(&b))
+	goto done;
+    if (b.ndegenerate)
+	printf("dropped %u degenerate triangle(s) ", b.ndegenerate);
+    printf("done [%gs]\n", get_timer() - t);
+
+    printf("Building cells... ");
+    fflush(stdout);
+    t = get_timer();
+    if ((b.cfd = temp_file(tmpdir)) < 0)
+	goto done;
+    parallel_for(b.ncells, build_cell_task, &b);
+    for (i=0; i<b.ncells; i++) {
+	if (!b.cells[i].ok) {
+	    fprintf(stderr, "%s: error building cell %d\n", file, i);
+	    goto done;
+	}
+	/* each cell's view of the cones of the grid nodes above it */
+	for (a=0, k=b.grid[b.cells[i].grid].parent; k>=0;
+	     a++, k=b.grid[k].parent)
+	    if (b.grid[k].cone_cos > b.cells[i].cone_cos[a])
+		b.grid[k].cone_cos = b.cells[i].cone_cos[a];
+    }
+    printf("done [%gs]\n", get_timer() - t);
+
+    printf("Writing %s... ", file);
+    fflush(stdout);
+    t = get_timer();
+    if (!grid_triangles(&b) || !write_file(&b, file))
+	goto done;
+    printf("done [%gs]\n", get_timer() - t);
+    ok = 1;
+
+done:
+    if (b.r != NULL)
+	ply_close(b.r);
+    spill_free(b.verts);
+    spill_free(b.corners);
+    spill_free(b.tris);
+    for (i=0; i<b.ncells; i++) {
+	free(b.cells[i].pages);
+	free(b.cells[i].tris);
+	free(b.cells[i].cone_cos);
+    }
+    free(b.cells);
+    free(b.grid);
+    free(b.grid_tris);
+    if (b.vfd >= 0) close(b.vfd);
+    if (b.nfd >= 0) close(b.nfd);
+    if (b.cfd >= 0) close(b.cfd);
+    pthread_mutex_destroy(&b.lock);
+    return ok;
+}
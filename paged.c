@@ -0,0 +1,1187 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lod.h"
+#include "octree.h"
+#include "paged.h"
+#include "pagefile.h"
+#include "trace.h"
+#include "vec3.h"
+
+/* pages below front nodes this close to expanding are loaded ahead */
+#define PREFETCH_PRIORITY	0.25
+/* how many frames ahead the camera's motion is extrapolated */
+#define PREFETCH_FRAMES		8
+/* no prefetching once this much of the cap is in use */
+#define PREFETCH_FULL		0.9
+/* how often a stream's loader looks up from waiting to see if it is done */
+#define STREAM_POLL_MS		100
+
+/* in memory, a node of the octree and what paging needs besides */
+typedef struct {
+    octree_node	 node;			/* first, so the two cast	    */
+    vec3	 rep_vertex;
+    int		 page;			/* page the node is in		    */
+    int		 child_page;		/* page of its children, or -1	    */
+    int		 octant;		/* in its parent		    */
+    unsigned	 first_tri, ntris;	/* triangles it activates	    */
+} paged_node;
+
+enum {
+    PAGE_ABSENT,
+    PAGE_QUEUED,			/* waiting for the loader	    */
+    PAGE_LOADING,			/* being read by the loader	    */
+    PAGE_LOADED,			/* read, waiting to be linked	    */
+    PAGE_LINKED,			/* part of the tree		    */
+    PAGE_BROKEN				/* could not be read		    */
+};
+
+typedef struct {
+    paged_entry	 e;
+    int		 state;
+    real	 want;			/* priority of a queued page	    */
+    unsigned	 stamp;			/* update it was last needed in	    */
+    int		 nlinked;		/* linked pages hanging from it	    */
+    size_t	 bytes;
+    paged_node	*nodes;
+    vec3       (*tris)[3];
+    const paged_node *(*proxies)[3];	/* per triangle corner, the front
+					 * node it was last found in, or
+					 * NULL ..			    */
+    unsigned	 proxy_evictions;	/*	.. as of this many evictions*/
+    int		 next_loaded;
+} paged_page;
+
+struct paged_io {
+    int		     fd;
+    int		     stream;		/* read in order, never evicted	    */
+    paged_page	    *pages;
+    int		     npages;
+    unsigned	     frame;
+    vec3	     last_eye;
+    int		     have_eye;
+    int		     maxtris;		/* room in verts and normals	    */
+    unsigned	     evicted;		/* pages evicted since opening	    */
+
+    pthread_t	     thread;
+    pthread_mutex_t  lock;		/* guards the fields below and the
+					 * state of queued pages	    */
+    pthread_cond_t   wake;		/* work queued, or quitting	    */
+    pthread_cond_t   done;		/* a page was read		    */
+    int		     quit;
+    int		    *queue;
+    int		     nqueued;
+    int		     loading;
+    int		     loaded;		/* list of loaded pages ..	    */
+    int		     nloaded;		/*	.. and its length	    */
+    int		     remaining;		/* pages of a stream still to come  */
+};
+
+/* writing */
+
+static int
+plan_page(page_plan *pp, int anchor_page, const octree_node *anchor)
+{
+    paged_entry *e;
+
+    if (pp->npages == pp->maxpages) {
+	pp->maxpages = pp->maxpages ? 2*pp->maxpages : 64;
+	pp->entries = realloc(pp->entries, sizeof(*pp->entries)*pp->maxpages);
+	pp->anchors = realloc(pp->anchors, sizeof(*pp->anchors)*pp->maxpages);
+    }
+    e = &pp->entries[pp->npages];
+    memset(e, 0, sizeof(*e));
+    e->anchor_page = anchor_page;
+    e->anchor = anchor_page >= 0 ? pp->local[anchor->id] : -1;
+    pp->anchors[pp->npages] = anchor;
+    return pp->npages++;
+}
+
+static void
+plan_node(page_plan *pp, const octree_node *n, int page)
+{
+    int k, child_page = page;
+
+    pp->page[n->id] = page;
+    pp->local[n->id] = page >= 0 ? (int)pp->entries[page].nnodes++ : 0;
+    if (page >= 0)
+	pp->entries[page].ntris += n->activated ? n->activated[0] : 0;
+    if (n->leaf)
+	return;
+    if ((n->depth - pp->base) % pp->page_depth == 0)
+	child_page = plan_page(pp, page, n);
+    for (k=0; k<8; k++)
+	if (n->subtree[k])
+	    plan_node(pp, n->subtree[k], child_page);
+}
+
+int
+page_plan_init(page_plan *pp, const octree_node *root, int nnodes,
+	       int with_root, int page_depth)
+{
+    memset(pp, 0, sizeof(*pp));
+    pp->page_depth = page_depth < 1 ? 1 : page_depth;
+    pp->page = malloc(sizeof(*pp->page)*nnodes);
+    pp->local = malloc(sizeof(*pp->local)*nnodes);
+    if (!pp->page || !pp->local) {
+	page_plan_free(pp);
+	return 0;
+    }
+    if (with_root) {
+	/* the root page holds the top page_depth levels */
+	pp->base = root->depth - 1;
+	plan_page(pp, -1, NULL);
+	plan_node(pp, root, 0);
+    } else {
+	pp->base = root->depth;
+	plan_node(pp, root, -1);
+    }
+    return 1;
+}
+
+void
+page_plan_free(page_plan *pp)
+{
+    free(pp->page);
+    free(pp->local);
+    free(pp->entries);
+    free(pp->anchors);
+    memset(pp, 0, sizeof(*pp));
+}
+
+/* fill in the nodes and triangles of page p below n, in plan order */
+static void
+fill_node(const page_plan *pp, const octree_node *n, int octant,
+	  const mesh *m, const uint32_t *vindex,
+	  paged_disk_node *nodes, float (*tris)[9], unsigned *ntris)
+{
+    const octree_node *c;
+    paged_disk_node *d = &nodes[pp->local[n->id]];
+    int j, k, p = pp->page[n->id];
+    vec3 center, normal;
+    real radius, angle;
+
+    memset(d, 0, sizeof(*d));
+    d->id = n->id;
+    d->depth = n->depth;
+    d->leaf = n->leaf;
+    d->octant = octant;
+    d->rep_vindex = vindex ? vindex[n->rep_vindex] : (uint32_t)n->rep_vindex;
+    NodeSphere(center, radius, n);
+    octree_cone(n, normal, &angle);
+    for (k=0; k<3; k++) {
+	d->rep_vertex[k] = m->verts[n->rep_vindex][k];
+	d->rep_vnormal[k] = n->rep_vnormal[k];
+	d->sp_center[k] = center[k];
+	d->bb_midpt[k] = n->bb_midpt[k];
+	d->bb_extent[k] = n->bb_extent[k];
+	d->cone_normal[k] = normal[k];
+    }
+    d->sp_radius = radius;
+    d->cone_angle = angle;
+    d->parent = n->parent && pp->page[n->parent->id] == p ?
+		pp->local[n->parent->id] : -1;
+    d->child_page = -1;
+    d->first_tri = *ntris;
+    d->ntris = n->activated ? n->activated[0] : 0;
+    for (j=0; j<(int)d->ntris; j++)
+	for (k=0; k<9; k++)
+	    tris[*ntris + j][k] =
+		m->verts[m->tris[n->activated[j+1]][k/3]][k%3];
+    *ntris += d->ntris;
+
+    for (k=0; k<8; k++) {
+	d->child[k] = -1;
+	if ((c = n->subtree[k]) == NULL || n->leaf)
+	    continue;
+	if (pp->page[c->id] == p) {
+	    d->child[k] = pp->local[c->id];
+	    fill_node(pp, c, k, m, vindex, nodes, tris, ntris);
+	} else {
+	    d->child_page = pp->page[c->id];
+	}
+    }
+}
+
+void
+page_plan_fill(const page_plan *pp, int page, const octree_node *root,
+	       const mesh *m, const uint32_t *vindex,
+	       paged_disk_node *nodes, float (*tris)[9])
+{
+    const octree_node *a = page >= 0 ? pp->anchors[page] : NULL;
+    unsigned ntris = 0;
+    int k;
+
+    if (a == NULL) {
+	fill_node(pp, root, 0, m, vindex, nodes, tris, &ntris);
+    } else {
+	for (k=0; k<8; k++)
+	    if (a->subtree[k])
+		fill_node(pp, a->subtree[k], k, m, vindex, nodes, tris,
+			  &ntris);
+    }
+}
+
+int
+paged_write(const octree *t, const char *file, int page_depth)
+{
+    const mesh *m = t->mesh;
+    page_plan pp;
+    paged_header h;
+    paged_disk_node *nodes;
+    float (*tris)[9];
+    int j, ok = 1;
+    FILE *fp;
+
+    if (!page_plan_init(&pp, t->root, t->nnodes, 1, page_depth)) {
+	fprintf(stderr, "%s: out of memory\n", file);
+	return 0;
+    }
+    if ((fp = fopen(file, "wb")) == NULL) {
+	perror(file);
+	page_plan_free(&pp);
+	return 0;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PAGED_MAGIC, sizeof(h.magic));
+    h.byte_order = PAGED_BYTE_ORDER;
+    h.page_depth = pp.page_depth;
+    h.nv = m->nv;
+    h.nt = m->nt;
+    h.nnodes = t->nnodes;
+    h.npages = pp.npages;
+    h.depth = octree_depth(t->root);
+    VecSet(h.min, m->min);
+    VecSet(h.max, m->max);
+    fwrite(&h, sizeof(h), 1, fp);
+
+    for (j=0; j<pp.npages && ok; j++) {
+	paged_entry *e = &pp.entries[j];
+
+	nodes = malloc(sizeof(*nodes)*e->nnodes);
+	tris = malloc(sizeof(*tris)*(e->ntris ? e->ntris : 1));
+	page_plan_fill(&pp, j, t->root, m, NULL, nodes, tris);
+	e->offset = ftello(fp);
+	if (fwrite(nodes, sizeof(*nodes), e->nnodes, fp) != e->nnodes ||
+	    fwrite(tris, sizeof(*tris), e->ntris, fp) != e->ntris)
+	    ok = 0;
+	free(nodes);
+	free(tris);
+    }
+    h.table = ftello(fp);
+    if (ok && fwrite(pp.entries, sizeof(*pp.entries), pp.npages, fp) !=
+	(size_t)pp.npages)
+	ok = 0;
+    if (ok && (fseeko(fp, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, fp) != 1))
+	ok = 0;
+    if (fclose(fp) != 0)
+	ok = 0;
+    if (!ok)
+	perror(file);
+
+    page_plan_free(&pp);
+    return ok;
+}
+
+static int
+read_all(int fd, void *buf, size_t size, uint64_t offset)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (size > 0) {
+	r = pread(fd, p, size, offset);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+	offset += r;
+    }
+    return 1;
+}
+
+/* pages whose anchor has been written, by the size of the node they refine:
+ * a max-heap of page numbers */
+typedef struct {
+    int		*pages;
+    float	*error;			/* per page			    */
+    int		 n;
+} page_heap;
+
+static int
+heap_before(const page_heap *h, int a, int b)
+{
+    return h->error[a] > h->error[b] || (h->error[a] == h->error[b] && a < b);
+}
+
+static void
+page_heap_push(page_heap *h, int p)
+{
+    int j = h->n++, up;
+
+    while (j > 0 && heap_before(h, p, h->pages[up = (j-1)/2])) {
+	h->pages[j] = h->pages[up];
+	j = up;
+    }
+    h->pages[j] = p;
+}
+
+static int
+page_heap_pop(page_heap *h)
+{
+    int top = h->pages[0], last = h->pages[--h->n], j = 0, c;
+
+    while ((c = 2*j + 1) < h->n) {
+	if (c+1 < h->n && heap_before(h, h->pages[c+1], h->pages[c]))
+	    c++;
+	if (!heap_before(h, h->pages[c], last))
+	    break;
+	h->pages[j] = h->pages[c];
+	j = c;
+    }
+    h->pages[j] = last;
+    return top;
+}
+
+int
+paged_stream_write(const char *paged_file, const char *stream_file)
+{
+    paged_header h;
+    paged_entry *table = NULL, e;
+    paged_disk_node *nodes = NULL, anchor;
+    float (*tris)[9] = NULL;
+    int *order = NULL, *renumber = NULL, *first = NULL, *below = NULL;
+    page_heap heap = { NULL, NULL, 0 };
+    unsigned maxnodes = 0, maxtris = 0, j;
+    int fd, p, q, n, ok = 0;
+    FILE *fp = NULL;
+
+    if ((fd = open(paged_file, O_RDONLY)) < 0) {
+	perror(paged_file);
+	return 0;
+    }
+    if (!read_all(fd, &h, sizeof(h), 0) ||
+	memcmp(h.magic, PAGED_MAGIC, sizeof(h.magic)) != 0 ||
+	h.byte_order != PAGED_BYTE_ORDER) {
+	fprintf(stderr, "%s: not a paged octree of this machine\n",
+		paged_file);
+	close(fd);
+	return 0;
+    }
+    table = malloc(sizeof(*table)*h.npages);
+    order = malloc(sizeof(*order)*h.npages);
+    renumber = malloc(sizeof(*renumber)*h.npages);
+    first = calloc(h.npages + 1, sizeof(*first));
+    below = malloc(sizeof(*below)*h.npages);
+    heap.pages = malloc(sizeof(*heap.pages)*h.npages);
+    heap.error = malloc(sizeof(*heap.error)*h.npages);
+    if (!table || !order || !renumber || !first || !below || !heap.pages ||
+	!heap.error) {
+	fprintf(stderr, "%s: out of memory\n", stream_file);
+	goto done;
+    }
+    if (!read_all(fd, table, sizeof(*table)*h.npages, h.table))
+	goto fail;
+
+    /* the pages hanging from each page, and the radius of the node each
+     * one refines: coarse pages first, every page after its anchor's */
+    for (p=1; p<h.npages; p++) {
+	first[table[p].anchor_page + 1]++;
+	if (!read_all(fd, &anchor, sizeof(anchor),
+		      table[table[p].anchor_page].offset +
+		      sizeof(anchor)*table[p].anchor))
+	    goto fail;
+	heap.error[p] = anchor.sp_radius;
+    }
+    for (p=0; p<h.npages; p++)
+	first[p+1] += first[p];
+    memcpy(order, first, sizeof(*order)*h.npages);
+    for (p=1; p<h.npages; p++)
+	below[order[table[p].anchor_page]++] = p;
+    heap.error[0] = HUGE_VAL;
+    page_heap_push(&heap, 0);
+    for (n=0; heap.n > 0; n++) {
+	p = page_heap_pop(&heap);
+	order[n] = p;
+	renumber[p] = n;
+	for (q=first[p]; q<first[p+1]; q++)
+	    page_heap_push(&heap, below[q]);
+    }
+
+    if ((fp = fopen(stream_file, "wb")) == NULL) {
+	perror(stream_file);
+	goto done;
+    }
+    memcpy(h.magic, PAGED_STREAM_MAGIC, sizeof(h.magic));
+    h.table = 0;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1)
+	goto fail;
+    for (n=0; n<h.npages; n++) {
+	e = table[order[n]];
+	if (e.nnodes > maxnodes) {
+	    maxnodes = e.nnodes;
+	    free(nodes);
+	    if ((nodes = malloc(sizeof(*nodes)*maxnodes)) == NULL)
+		goto fail;
+	}
+	if (e.ntris > maxtris || tris == NULL) {
+	    maxtris = e.ntris;
+	    free(tris);
+	    if ((tris = malloc(sizeof(*tris)*(maxtris ? maxtris : 1))) == NULL)
+		goto fail;
+	}
+	if (!read_all(fd, nodes, sizeof(*nodes)*e.nnodes, e.offset) ||
+	    !read_all(fd, tris, sizeof(*tris)*e.ntris,
+		      e.offset + sizeof(*nodes)*e.nnodes))
+	    goto fail;
+	for (j=0; j<e.nnodes; j++)
+	    if (nodes[j].child_page >= 0)
+		nodes[j].child_page = renumber[nodes[j].child_page];
+	if (e.anchor_page >= 0)
+	    e.anchor_page = renumber[e.anchor_page];
+	e.offset = 0;
+	if (fwrite(&e, sizeof(e), 1, fp) != 1 ||
+	    fwrite(nodes, sizeof(*nodes), e.nnodes, fp) != e.nnodes ||
+	    fwrite(tris, sizeof(*tris), e.ntris, fp) != e.ntris)
+	    goto fail;
+    }
+    if (fclose(fp) != 0) {
+	fp = NULL;
+	goto fail;
+    }
+    fp = NULL;
+    ok = 1;
+    goto done;
+
+fail:
+    fprintf(stderr, "%s: error writing stream of %s\n", stream_file,
+	    paged_file);
+done:
+    if (fp)
+	fclose(fp);
+    close(fd);
+    free(table);
+    free(order);
+    free(renumber);
+    free(first);
+    free(below);
+    free(heap.pages);
+    free(heap.error);
+    free(nodes);
+    free(tris);
+    return ok;
+}
+
+/* reading */
+
+/* the nodes of page p, as read into disk, in memory. nodes with children
+ * on another page are leaves until that page is linked */
+static void
+unpack_page(paged_page *pg, int p, const paged_disk_node *disk)
+{
+    const paged_entry *e = &pg->e;
+    paged_node *pn;
+    octree_node *n;
+    unsigned j;
+    int k;
+
+    for (j=0; j<e->nnodes; j++) {
+	const paged_disk_node *d = &disk[j];
+
+	pn = &pg->nodes[j];
+	n = &pn->node;
+	memset(pn, 0, sizeof(*pn));
+	n->depth = d->depth;
+	n->leaf = d->leaf || d->child_page >= 0;
+	n->id = d->id;
+	n->rep_vindex = d->rep_vindex;
+	VecSet(n->rep_vnormal, d->rep_vnormal);
+	VecSet(n->bb_midpt, d->bb_midpt);
+	VecSet(n->bb_extent, d->bb_extent);
+	octree_restore_sphere(n, d->sp_center, d->sp_radius);
+	octree_restore_cone(n, d->cone_normal, d->cone_angle);
+	n->activated = NULL;
+	n->parent = d->parent >= 0 ? &pg->nodes[d->parent].node : NULL;
+	for (k=0; k<8; k++)
+	    n->subtree[k] = d->child[k] >= 0 ? &pg->nodes[d->child[k]].node
+					     : NULL;
+	VecSet(pn->rep_vertex, d->rep_vertex);
+	pn->page = p;
+	pn->child_page = d->child_page;
+	pn->octant = d->octant;
+	pn->first_tri = d->first_tri;
+	pn->ntris = d->ntris;
+    }
+    pg->bytes = sizeof(*pg->nodes)*e->nnodes + sizeof(*pg->tris)*e->ntris;
+}
+
+/* read page p into newly allocated memory, leaving it unlinked */
+static int
+read_page(int fd, paged_page *pg, int p)
+{
+    const paged_entry *e = &pg->e;
+    paged_disk_node *disk;
+
+    disk = malloc(sizeof(*disk)*e->nnodes);
+    pg->nodes = malloc(sizeof(*pg->nodes)*e->nnodes);
+    pg->tris = malloc(sizeof(*pg->tris)*(e->ntris ? e->ntris : 1));
+    if (!disk || !pg->nodes || !pg->tris ||
+	!read_all(fd, disk, sizeof(*disk)*e->nnodes, e->offset) ||
+	!read_all(fd, pg->tris, sizeof(*pg->tris)*e->ntris,
+		  e->offset + sizeof(*disk)*e->nnodes)) {
+	free(disk);
+	free(pg->nodes);
+	free(pg->tris);
+	pg->nodes = NULL;
+	pg->tris = NULL;
+	return 0;
+    }
+    unpack_page(pg, p, disk);
+    free(disk);
+    return 1;
+}
+
+/* read size bytes from the stream, giving up if the octree is closed while
+ * waiting for them */
+static int
+read_stream(paged_io *io, void *buf, size_t size)
+{
+    struct pollfd pfd = { io->fd, POLLIN, 0 };
+    char *p = buf;
+    ssize_t r;
+    int quit;
+
+    while (size > 0) {
+	pthread_mutex_lock(&io->lock);
+	quit = io->quit;
+	pthread_mutex_unlock(&io->lock);
+	if (quit)
+	    return 0;
+	if (poll(&pfd, 1, STREAM_POLL_MS) == 0)
+	    continue;
+	r = read(io->fd, p, size);
+	if (r < 0 && (errno == EINTR || errno == EAGAIN))
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+    }
+    return 1;
+}
+
+/* read the next page of a stream, page p, into newly allocated memory */
+static int
+read_record(paged_io *io, paged_page *pg, int p)
+{
+    paged_entry *e = &pg->e;
+    paged_disk_node *disk;
+
+    if (!read_stream(io, e, sizeof(*e)))
+	return 0;
+    /* a page hangs from one that came before it */
+    if (e->nnodes == 0 || (p == 0) != (e->anchor_page < 0) ||
+	e->anchor_page >= p ||
+	(p > 0 && (e->anchor < 0 ||
+		   (unsigned)e->anchor >= io->pages[e->anchor_page].e.nnodes)))
+	return 0;
+    disk = malloc(sizeof(*disk)*e->nnodes);
+    pg->nodes = malloc(sizeof(*pg->nodes)*e->nnodes);
+    pg->tris = malloc(sizeof(*pg->tris)*(e->ntris ? e->ntris : 1));
+    if (!disk || !pg->nodes || !pg->tris ||
+	!read_stream(io, disk, sizeof(*disk)*e->nnodes) ||
+	!read_stream(io, pg->tris, sizeof(*pg->tris)*e->ntris)) {
+	free(disk);
+	free(pg->nodes);
+	free(pg->tris);
+	pg->nodes = NULL;
+	pg->tris = NULL;
+	return 0;
+    }
+    unpack_page(pg, p, disk);
+    free(disk);
+    return 1;
+}
+
+/* the loader of a stream: every page, in order */
+static void *
+streamer(void *arg)
+{
+    paged_io *io = arg;
+    int p, ok = 1;
+
+    for (p=1; ok && p<io->npages; p++) {
+	ok = read_record(io, &io->pages[p], p);
+
+	pthread_mutex_lock(&io->lock);
+	if (ok) {
+	    io->pages[p].state = PAGE_LOADED;
+	    io->pages[p].next_loaded = io->loaded;
+	    io->loaded = p;
+	    io->nloaded++;
+	    io->remaining--;
+	} else {
+	    if (!io->quit)
+		fprintf(stderr, "paged: stream ended after %d of %d pages\n",
+			p, io->npages);
+	    io->remaining = 0;
+	}
+	pthread_cond_broadcast(&io->done);
+	pthread_mutex_unlock(&io->lock);
+    }
+    return NULL;
+}
+
+static void *
+loader(void *arg)
+{
+    paged_io *io = arg;
+    paged_page *pg;
+    int j, best, p, ok;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+	while (!io->quit && io->nqueued == 0)
+	    pthread_cond_wait(&io->wake, &io->lock);
+	if (io->quit)
+	    break;
+	for (best=0, j=1; j<io->nqueued; j++)
+	    if (io->pages[io->queue[j]].want > io->pages[io->queue[best]].want)
+		best = j;
+	p = io->queue[best];
+	io->queue[best] = io->queue[--io->nqueued];
+	pg = &io->pages[p];
+	pg->state = PAGE_LOADING;
+	io->loading++;
+	pthread_mutex_unlock(&io->lock);
+
+	ok = read_page(io->fd, pg, p);
+
+	pthread_mutex_lock(&io->lock);
+	io->loading--;
+	if (ok) {
+	    pg->state = PAGE_LOADED;
+	    pg->next_loaded = io->loaded;
+	    io->loaded = p;
+	    io->nloaded++;
+	} else {
+	    fprintf(stderr, "paged: page %d could not be read\n", p);
+	    pg->state = PAGE_BROKEN;
+	}
+	pthread_cond_broadcast(&io->done);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+paged_octree *
+paged_open(const char *file, size_t cap)
+{
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0) {
+	perror(file);
+	return NULL;
+    }
+    return paged_fdopen(fd, file, cap);
+}
+
+paged_octree *
+paged_fdopen(int fd, const char *name, size_t cap)
+{
+    paged_octree *po = calloc(1, sizeof(*po));
+    paged_io *io = calloc(1, sizeof(*io));
+    paged_entry *table = NULL;
+    paged_header h;
+    int j, ok;
+
+    if (!po || !io) {
+	free(po);
+	free(io);
+	close(fd);
+	return NULL;
+    }
+    po->io = io;
+    io->fd = fd;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->wake, NULL);
+    pthread_cond_init(&io->done, NULL);
+
+    /* a stream can only be read in order, from the start */
+    if (!read_stream(io, &h, sizeof(h)) ||
+	(memcmp(h.magic, PAGED_MAGIC, sizeof(h.magic)) != 0 &&
+	 memcmp(h.magic, PAGED_STREAM_MAGIC, sizeof(h.magic)) != 0)) {
+	fprintf(stderr, "%s: not a paged octree\n", name);
+	goto fail;
+    }
+    if (h.byte_order != PAGED_BYTE_ORDER) {
+	fprintf(stderr, "%s: written on a machine of another byte order\n",
+		name);
+	goto fail;
+    }
+    io->stream = memcmp(h.magic, PAGED_STREAM_MAGIC, sizeof(h.magic)) == 0;
+    io->npages = h.npages;
+    io->pages = calloc(h.npages, sizeof(*io->pages));
+    io->queue = malloc(sizeof(*io->queue)*h.npages);
+    if (h.npages < 1 || !io->pages || !io->queue) {
+	fprintf(stderr, "%s: cannot read page table\n", name);
+	goto fail;
+    }
+    for (j=0; j<h.npages; j++) {
+	io->pages[j].state = PAGE_ABSENT;
+	io->pages[j].next_loaded = -1;
+    }
+    if (io->stream) {
+	ok = read_record(io, &io->pages[0], 0);
+    } else {
+	table = malloc(sizeof(*table)*h.npages);
+	if (!table ||
+	    !read_all(io->fd, table, sizeof(*table)*h.npages, h.table)) {
+	    fprintf(stderr, "%s: cannot read page table\n", name);
+	    goto fail;
+	}
+	for (j=0; j<h.npages; j++)
+	    io->pages[j].e = table[j];
+	free(table);
+	table = NULL;
+	ok = read_page(io->fd, &io->pages[0], 0);
+    }
+    if (!ok) {
+	fprintf(stderr, "%s: cannot read root page\n", name);
+	goto fail;
+    }
+    io->pages[0].state = PAGE_LINKED;
+    io->loaded = -1;
+    io->remaining = io->stream ? h.npages - 1 : 0;
+
+    po->nv = h.nv;
+    po->nt = h.nt;
+    po->nnodes = h.nnodes;
+    po->npages = h.npages;
+    po->depth = h.depth;
+    po->cap = cap;
+    po->resident = 1;
+    po->bytes = io->pages[0].bytes;
+
+    /* the front only needs the tree's nodes and bounds */
+    memset(&po->bounds, 0, sizeof(po->bounds));
+    VecSet(po->bounds.min, h.min);
+    VecSet(po->bounds.max, h.max);
+    po->tree.mesh = &po->bounds;
+    po->tree.root = &io->pages[0].nodes[0].node;
+    po->tree.nnodes = h.nnodes;
+    if ((po->lod = lod_create(&po->tree)) == NULL)
+	goto fail;
+    /* saved fronts could refer to evicted nodes */
+    po->lod->front_caching = 0;
+    po->lod->front_depth = h.depth;
+
+    if (pthread_create(&io->thread, NULL, io->stream ? streamer : loader,
+		       io) != 0) {
+	fprintf(stderr, "%s: cannot start loader\n", name);
+	goto fail;
+    }
+    return po;
+
+fail:
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->wake);
+    pthread_cond_destroy(&io->done);
+    free(table);
+    if (io->pages) {
+	free(io->pages[0].nodes);
+	free(io->pages[0].tris);
+    }
+    free(io->pages);
+    free(io->queue);
+    close(io->fd);
+    lod_free(po->lod);
+    free(io);
+    free(po);
+    return NULL;
+}
+
+void
+paged_close(paged_octree *po)
+{
+    paged_io *io;
+    int j;
+
+    if (po == NULL)
+	return;
+    io = po->io;
+    pthread_mutex_lock(&io->lock);
+    io->quit = 1;
+    pthread_cond_signal(&io->wake);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->thread, NULL);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->wake);
+    pthread_cond_destroy(&io->done);
+
+    for (j=0; j<po->npages; j++) {
+	free(io->pages[j].nodes);
+	free(io->pages[j].tris);
+	free(io->pages[j].proxies);
+    }
+    free(io->pages);
+    free(io->queue);
+    close(io->fd);
+    lod_free(po->lod);
+    free(po->verts);
+    free(po->normals);
+    free(io);
+    free(po);
+}
+
+static paged_node *
+anchor_of(const paged_io *io, const paged_page *pg)
+{
+    return &io->pages[pg->e.anchor_page].nodes[pg->e.anchor];
+}
+
+/* hang loaded page p from its anchor node. pages whose anchor was evicted
+ * while they loaded are dropped. */
+static void
+link_page(paged_octree *po, int p)
+{
+    paged_io *io = po->io;
+    paged_page *pg = &io->pages[p];
+    lod_context *ctx = po->lod;
+    octree_node *a, *n;
+    unsigned j;
+
+    if (io->pages[pg->e.anchor_page].state != PAGE_LINKED) {
+	free(pg->nodes);
+	free(pg->tris);
+	pg->nodes = NULL;
+	pg->tris = NULL;
+	pg->state = PAGE_ABSENT;
+	return;
+    }
+    a = &anchor_of(io, pg)->node;
+    for (j=0; j<pg->e.nnodes; j++) {
+	n = &pg->nodes[j].node;
+	ctx->status[n->id] = STATUS_INACTIVE;
+	ctx->testid[n->id] = 0;
+	if (n->parent == NULL) {
+	    n->parent = a;
+	    a->subtree[pg->nodes[j].octant] = n;
+	}
+    }
+    a->leaf = 0;
+    io->pages[pg->e.anchor_page].nlinked++;
+    pg->state = PAGE_LINKED;
+    pg->stamp = io->frame;
+    po->resident++;
+    po->bytes += pg->bytes;
+    po->loads++;
+}
+
+static void
+evict_page(paged_octree *po, int p)
+{
+    paged_io *io = po->io;
+    paged_page *pg = &io->pages[p];
+    octree_node *a = &anchor_of(io, pg)->node;
+    int k;
+
+    for (k=0; k<8; k++)
+	a->subtree[k] = NULL;
+    a->leaf = 1;
+    io->pages[pg->e.anchor_page].nlinked--;
+    free(pg->nodes);
+    free(pg->tris);
+    free(pg->proxies);
+    pg->nodes = NULL;
+    pg->tris = NULL;
+    pg->proxies = NULL;
+    pg->state = PAGE_ABSENT;
+    io->evicted++;
+    po->resident--;
+    po->bytes -= pg->bytes;
+    po->evictions++;
+}
+
+/* the least recently needed page that nothing hangs from and that the front
+ * does not reach into, or -1 */
+static int
+lru_page(const paged_octree *po)
+{
+    const paged_io *io = po->io;
+    const paged_page *pg;
+    int p, best = -1;
+
+    for (p=1; p<po->npages; p++) {
+	pg = &io->pages[p];
+	if (pg->state != PAGE_LINKED || pg->nlinked || pg->stamp == io->frame)
+	    continue;
+	if (po->lod->status[anchor_of(io, pg)->node.id] == STATUS_ACTIVE)
+	    continue;
+	if (best < 0 || pg->stamp < io->pages[best].stamp)
+	    best = p;
+    }
+    return best;
+}
+
+/* the lazy incremental update leaves inactive nodes on the list for the next
+ * update to drop; drop them now, as their pages may go */
+static void
+purge_front(lod_context *ctx)
+{
+    active_node **a = &ctx->active_list, *dead;
+
+    while (*a) {
+	if (ctx->status[(*a)->node->id] != STATUS_BOUNDARY) {
+	    dead = *a;
+	    *a = dead->next;
+	    free(dead);
+	} else {
+	    a = &(*a)->next;
+	}
+    }
+}
+
+/* a node waiting for its page is a leaf, which lod_priority() rates 0 */
+static real
+stub_priority(const lod_context *ctx, octree_node *n, const view_params *vp)
+{
+    char leaf = n->leaf;
+    real p;
+
+    n->leaf = 0;
+    p = lod_priority(ctx, n, vp);
+    n->leaf = leaf;
+    return p;
+}
+
+/* a page and the pages above it are in use */
+static void
+stamp_pages(paged_io *io, int p)
+{
+    while (p >= 0 && io->pages[p].stamp != io->frame) {
+	io->pages[p].stamp = io->frame;
+	p = io->pages[p].e.anchor_page;
+    }
+}
+
+void
+paged_update(paged_octree *po, const view_params *vp)
+{
+    paged_io *io = po->io;
+    lod_context *ctx = po->lod;
+    view_params ahead;
+    active_node *a;
+    paged_node *pn;
+    paged_page *pg;
+    vec3 d;
+    real want;
+    int p, q, next, full;
+
+    TRACE_BEGIN("paged_update");
+    io->frame++;
+    po->loads = po->evictions = 0;
+
+    /* pages read since the last update join the tree, in the order they
+     * were read: a page of a stream can hang from the one just before it */
+    pthread_mutex_lock(&io->lock);
+    p = io->loaded;
+    io->loaded = -1;
+    io->nloaded = 0;
+    pthread_mutex_unlock(&io->lock);
+    for (q = -1; p >= 0; p = next) {
+	next = io->pages[p].next_loaded;
+	io->pages[p].next_loaded = q;
+	q = p;
+    }
+    for (p = q; p >= 0; p = next) {
+	next = io->pages[p].next_loaded;
+	link_page(po, p);
+    }
+
+    lod_update(ctx, vp);
+    purge_front(ctx);
+
+    /* where the camera will be in a few frames if it keeps moving */
+    ahead = *vp;
+    if (io->have_eye) {
+	VecSub(d, vp->eye, io->last_eye);
+	VecSAdd(ahead.eye, vp->eye, d, PREFETCH_FRAMES);
+    }
+    VecSet(io->last_eye, vp->eye);
+    io->have_eye = 1;
+
+    /* the pages the front is in are needed. the pages below it are wanted as
+     * much as the nodes they hang from are close to being expanded, now or
+     * at the extrapolated view. */
+    full = po->bytes > PREFETCH_FULL * po->cap;
+    pthread_mutex_lock(&io->lock);
+    for (p=0; p<io->nqueued; p++)
+	io->pages[io->queue[p]].state = PAGE_ABSENT;
+    io->nqueued = 0;
+    for (a = ctx->active_list; a; a = a->next) {
+	pn = (paged_node *)a->node;
+	stamp_pages(io, pn->page);
+	if (pn->child_page < 0)
+	    continue;
+	pg = &io->pages[pn->child_page];
+	want = fmax(stub_priority(ctx, a->node, vp),
+		    stub_priority(ctx, a->node, &ahead));
+	if (want < PREFETCH_PRIORITY || (want < 1 && full))
+	    continue;
+	if (pg->state == PAGE_LINKED) {
+	    pg->stamp = io->frame;
+	} else if (pg->state == PAGE_ABSENT && !io->stream) {
+	    pg->state = PAGE_QUEUED;
+	    pg->want = want;
+	    io->queue[io->nqueued++] = pn->child_page;
+	}
+    }
+    po->pending = io->nqueued + io->loading + io->nloaded + io->remaining;
+    if (io->nqueued)
+	pthread_cond_signal(&io->wake);
+    pthread_mutex_unlock(&io->lock);
+
+    /* what a stream has sent cannot be read again */
+    while (!io->stream && po->bytes > po->cap && (p = lru_page(po)) >= 0)
+	evict_page(po, p);
+    TRACE_END();
+}
+
+void
+paged_wait(paged_octree *po)
+{
+    paged_io *io = po->io;
+
+    pthread_mutex_lock(&io->lock);
+    while (io->nqueued || io->loading || io->remaining)
+	pthread_cond_wait(&io->done, &io->lock);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* The front node covering position v, from node n on its way down from
+ * the root, which may be anywhere on it: below the front, the walk climbs
+ * back to it, as lod_extract() moves its proxies. */
+static const paged_node *
+find_proxy(const lod_context *ctx, const octree_node *n, const vec3 v)
+{
+    int k;
+
+    while (ctx->status[n->id] == STATUS_INACTIVE && n->parent)
+	n = n->parent;
+    while (ctx->status[n->id] == STATUS_ACTIVE) {
+	k = 0;
+	if (v[0] >= n->bb_midpt[0]) k|=4;
+	if (v[1] >= n->bb_midpt[1]) k|=2;
+	if (v[2] >= n->bb_midpt[2]) k|=1;
+	if (n->subtree[k] == NULL)
+	    break;
+	n = n->subtree[k];
+    }
+    return (const paged_node *)n;
+}
+
+/* the proxies of page pg's triangles, usable since no page they could
+ * point into has been evicted since they were found; NULL if out of
+ * memory */
+static const paged_node *(*page_proxies(paged_octree *po, paged_page *pg))[3]
+{
+    size_t size = sizeof(*pg->proxies)*(pg->e.ntris ? pg->e.ntris : 1);
+
+    if (pg->proxies == NULL) {
+	if ((pg->proxies = malloc(size)) == NULL)
+	    return NULL;
+	pg->bytes += size;
+	po->bytes += size;
+    } else if (pg->proxy_evictions == po->io->evicted) {
+	return pg->proxies;
+    }
+    memset(pg->proxies, 0, size);
+    pg->proxy_evictions = po->io->evicted;
+    return pg->proxies;
+}
+
+/* room for another triangle in po->verts and po->normals; 0 if out of
+ * memory */
+static int
+grow_output(paged_octree *po)
+{
+    int max = po->io->maxtris ? 2*po->io->maxtris : 4096;
+    vec3 *verts, *normals;
+
+    if ((verts = realloc(po->verts, sizeof(*verts)*3*max)) == NULL)
+	return 0;
+    po->verts = verts;
+    if ((normals = realloc(po->normals, sizeof(*normals)*3*max)) == NULL)
+	return 0;
+    po->normals = normals;
+    po->io->maxtris = max;
+    return 1;
+}
+
+/* Emit the triangles activated at n and below, as lod_extract() does, each
+ * corner's proxy being moved from where the last extraction found it. 0 if
+ * out of memory. */
+static int
+extract_node(paged_octree *po, const octree_node *n)
+{
+    const lod_context *ctx = po->lod;
+    const paged_node *pn = (const paged_node *)n, *p[3];
+    const paged_node *(*proxies)[3];
+    paged_page *pg;
+    vec3 (*tris)[3];
+    unsigned j;
+    int k;
+
+    if (ctx->status[n->id] != STATUS_ACTIVE)
+	return 1;
+    pg = &po->io->pages[pn->page];
+    tris = pg->tris + pn->first_tri;
+    if ((proxies = page_proxies(po, pg)) == NULL)
+	return 0;
+    proxies += pn->first_tri;
+    for (j=0; j<pn->ntris; j++) {
+	for (k=0; k<3; k++)
+	    p[k] = proxies[j][k] = find_proxy(ctx, proxies[j][k] ?
+					      &proxies[j][k]->node :
+					      ctx->tree->root, tris[j][k]);
+	if (p[0] == p[1] || p[0] == p[2] || p[1] == p[2] ||
+	    p[0]->node.rep_vindex == p[1]->node.rep_vindex ||
+	    p[0]->node.rep_vindex == p[2]->node.rep_vindex ||
+	    p[1]->node.rep_vindex == p[2]->node.rep_vindex)
+	    continue;
+	if (po->rendered == po->io->maxtris && !grow_output(po))
+	    return 0;
+	for (k=0; k<3; k++) {
+	    VecSet(po->verts[3*po->rendered+k], p[k]->rep_vertex);
+	    VecSet(po->normals[3*po->rendered+k], p[k]->node.rep_vnormal);
+	}
+	po->rendered++;
+    }
+    for (k=0; k<8; k++)
+	if (n->subtree[k] && !extract_node(po, n->subtree[k]))
+	    return 0;
+    return 1;
+}
+
+int
+paged_extract(paged_octree *po)
+{
+    TRACE_BEGIN("paged_extract");
+    po->rendered = 0;
+    if (!extract_node(po, po->tree.root))
+	fprintf(stderr, "paged: out of memory extracting triangles\n");
+    po->collapsed = po->nt - po->rendered;
+    TRACE_END();
+    return po->rendered;
+}
@@ -0,0 +1,99 @@
+#ifndef _PAGED_H_
+#define _PAGED_H_
+
+#include <stddef.h>
+
+#include "lod.h"
+#include "mesh.h"
+#include "octree.h"
+#include "view_params.h"
+
+/* Out-of-core octrees. The tree is written to a file in pages: the root
+ * page holds the top page_depth levels, and below every node at the bottom
+ * level of a page hangs one page with its children and their subtrees, down
+ * another page_depth levels. Each page carries, for its nodes, the node
+ * data, the representative vertices and the triangles they activate (with
+ * the positions of their corners), so that only the pages the front reaches
+ * into need to be in memory.
+ *
+ * A paged_octree keeps the pages it has loaded linked into an ordinary
+ * octree, with its own lod_context for the front. A node whose page below
+ * is not loaded yet acts as a leaf, so the front stops there and its coarse
+ * triangles keep being drawn. Pages the front wants are read by a loader
+ * thread, as are the pages below it that the front is about to want (by
+ * projected size, at the view extrapolated from the camera's motion), and
+ * the least recently needed pages are dropped once the cap is exceeded.
+ *
+ * For progressive transmission, paged_stream_write() rewrites a paged file
+ * as a stream: the pages, coarse to fine, each after the page it hangs
+ * from, so that any prefix of it is a valid coarser tree. A stream is read
+ * in order by the loader as it arrives, from a file, pipe or socket, its
+ * pages being linked in as they come, without a rebuild; the front refines
+ * into them once they are there. The root page is all that is needed to
+ * start drawing, and none are dropped, as they cannot be read again. */
+
+typedef struct paged_io paged_io;
+
+typedef struct {
+    octree	    tree;		/* loaded part of the tree	    */
+    mesh	    bounds;		/* no geometry, just the box	    */
+    lod_context	   *lod;		/* front over the loaded part	    */
+
+    int		    nv, nt;		/* of the whole mesh		    */
+    int		    nnodes, npages, depth;
+    size_t	    cap;		/* bytes of pages to keep loaded    */
+
+    /* from the last paged_extract(): three corners per triangle */
+    vec3	   *verts;
+    vec3	   *normals;
+    int		    rendered;
+    int		    collapsed;
+
+    /* statistics */
+    int		    resident;		/* pages in memory ..		    */
+    size_t	    bytes;		/*	.. and their size	    */
+    int		    pending;		/* pages requested, not loaded yet  */
+    int		    loads;		/* pages linked in, last update	    */
+    int		    evictions;		/* pages dropped, last update	    */
+
+    paged_io	   *io;			/* loader thread and page table	    */
+} paged_octree;
+
+/* write tree t to file in pages of page_depth levels; 0 on error */
+int	      paged_write(const octree *t, const char *file, int page_depth);
+
+/* Build the paged octree of a PLY file without loading it, in about mem
+ * bytes of memory, with temporary files in tmpdir (see pagebuild.c for how
+ * the tree differs from the one paged_write() writes); 0 on error. */
+int	      paged_build(const char *ply, const char *file, int page_depth,
+			  size_t mem, const char *tmpdir);
+
+/* Write the paged octree in paged_file as a stream to stream_file, the
+ * pages in order of the radius of the node they refine, largest first;
+ * 0 on error. Fewer levels per page make the root page, what a viewer
+ * waits for, smaller. */
+int	      paged_stream_write(const char *paged_file,
+				 const char *stream_file);
+
+/* Open a paged octree or a stream, loading its root page, and keeping up to
+ * cap bytes of pages in memory (more if the front needs them; a stream
+ * keeps all it gets). NULL on error. paged_fdopen() reads it from fd,
+ * which it takes over, and which need not be seekable if it is a stream;
+ * name is for messages. */
+paged_octree *paged_open(const char *file, size_t cap);
+paged_octree *paged_fdopen(int fd, const char *name, size_t cap);
+void	      paged_close(paged_octree *po);
+
+/* Link in the pages loaded since the last update, update the front for view
+ * vp (in object coordinates), queue the pages the front wants or soon will,
+ * and drop pages over the cap. */
+void	      paged_update(paged_octree *po, const view_params *vp);
+
+/* collect the simplified triangles of the current front into po->verts and
+ * po->normals, returning their number */
+int	      paged_extract(paged_octree *po);
+
+/* wait for all queued pages to load, or the rest of a stream to arrive */
+void	      paged_wait(paged_octree *po);
+
+#endif // !_PAGED_H_
@@ -0,0 +1,87 @@
+#ifndef _PAGEFILE_H_
+#define _PAGEFILE_H_
+
+#include <stdint.h>
+
+#include "mesh.h"
+#include "octree.h"
+
+/* Layout of paged octree files (see paged.h), shared by the writers and the
+ * reader. */
+
+#define PAGED_MAGIC		"LODPAGE1"
+#define PAGED_STREAM_MAGIC	"LODSTRM1"
+#define PAGED_BYTE_ORDER	0x01020304u
+
+/* The file is written in the byte order and with the float layout of the
+ * machine that wrote it: a header, the pages, and a table of the pages. A
+ * page is its nodes, in preorder, followed by the triangles they activate,
+ * in the same order. Nodes refer to each other by index within the page.
+ * Every child of a node is on the node's page or, all of them, on its
+ * child_page. */
+typedef struct {
+    char	magic[8];
+    uint32_t	byte_order;
+    int32_t	page_depth;
+    uint32_t	nv, nt;
+    int32_t	nnodes, npages, depth;
+    float	min[3], max[3];
+    uint64_t	table;			/* offset of the page table	    */
+} paged_header;
+
+/* A stream (see paged_stream_write()) has the same header, without a table,
+ * followed by one record per page: its paged_entry, then its nodes and
+ * triangles as in the file. Pages are numbered in the order they come, so
+ * every page comes after the page it hangs from, and anchor_page and
+ * child_page refer to that numbering; offset is unused. */
+typedef struct {
+    uint64_t	offset;
+    uint32_t	nnodes, ntris;
+    int32_t	anchor_page;		/* page of the node it hangs from ..*/
+    int32_t	anchor;			/*	.. and its index there	    */
+} paged_entry;
+
+typedef struct {
+    int32_t	id;
+    uint8_t	depth, leaf, octant, pad;
+    int32_t	rep_vindex;
+    float	rep_vertex[3], rep_vnormal[3];
+    float	sp_center[3], sp_radius;
+    float	bb_midpt[3], bb_extent[3];
+    float	cone_normal[3], cone_angle;
+    int32_t	parent;			/* -1 at the top of a page	    */
+    int32_t	child[8];		/* -1 if none or on another page    */
+    int32_t	child_page;		/* page of the children, or -1	    */
+    uint32_t	first_tri, ntris;
+} paged_disk_node;
+
+/* Layout of a tree of octree nodes in pages, as paged_write() lays out the
+ * whole tree: the nodes below a node whose depth is a multiple of
+ * page_depth levels below the top of its page start a new page. With
+ * with_root, the root is on the first page; without, the root is left out
+ * and the first page, anchored at the root (anchor_page and anchor -1),
+ * holds its children, for builders that place the root themselves. */
+typedef struct {
+    int		  page_depth;
+    int		  base;			/* depth above the first page	    */
+    int		 *page;			/* per node id			    */
+    int		 *local;		/* per node id, index in its page   */
+    paged_entry	 *entries;		/* without offsets		    */
+    const octree_node **anchors;	/* per page, NULL for the root's    */
+    int		  npages, maxpages;
+} page_plan;
+
+/* plan the pages of the nnodes nodes below root; 0 if out of memory */
+int	page_plan_init(page_plan *pp, const octree_node *root, int nnodes,
+		       int with_root, int page_depth);
+void	page_plan_free(page_plan *pp);
+
+/* Fill in the nodes and triangles of one page (page -1: just the root of a
+ * plan without it), the vertices of the nodes and triangles being those of
+ * mesh m, and vindex, if not NULL, mapping them to the indices to record. */
+void	page_plan_fill(const page_plan *pp, int page,
+		       const octree_node *root, const mesh *m,
+		       const uint32_t *vindex, paged_disk_node *nodes,
+		       float (*tris)[9]);
+
+#endif // !_PAGEFILE_H_
@@ -0,0 +1,148 @@
+/* Writes the octree of a mesh as a paged octree (see paged.h), which the
+ * viewer and the benchmark then page in as the view needs it. With -m, the
+ * tree of a PLY file is built out of core, for meshes larger than memory.
+ * With -s, it is written as a stream, coarse pages first, for viewers to
+ * read as it arrives; a paged octree given instead of a mesh is rewritten
+ * as one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "mesh.h"
+#include "octree.h"
+#include "paged.h"
+#include "synth.h"
+#include "timer.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file | synth:kind:triangles[:seed]> "
+	"<paged file>\n"
+	"  -d levels     octree levels per page (5)\n"
+	"  -m megabytes  build out of core in about this much memory\n"
+	"  -s            write a stream, coarse pages first\n"
+	"  -T dir        directory for temporary files ($TMPDIR or /tmp)\n",
+	prog);
+    exit(1);
+}
+
+static int
+write_stream(const char *paged_file, const char *stream_file)
+{
+    double t = get_timer();
+
+    if (!paged_stream_write(paged_file, stream_file))
+	return 0;
+    fprintf(stderr, "Wrote stream %s [%gs]\n", stream_file, get_timer() - t);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long ntris;
+    unsigned seed;
+    int c, kind, page_depth = 5, stream = 0, fd;
+    const char *file, *out, *tmpdir = getenv("TMPDIR");
+    char tmp[4096];
+    size_t len;
+    double megabytes = 0;
+    mesh *m = NULL;
+    octree *tree;
+    double t;
+
+    while ((c = getopt(argc, argv, "d:m:sT:")) != -1) {
+	switch (c) {
+	    case 'd':
+		if ((page_depth = atoi(optarg)) < 1)
+		    usage(argv[0]);
+		break;
+	    case 'm':
+		if ((megabytes = atof(optarg)) <= 0)
+		    usage(argv[0]);
+		break;
+	    case 's': stream = 1; break;
+	    case 'T': tmpdir = optarg; break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-2)
+	usage(argv[0]);
+    file = argv[optind];
+    out = argv[optind+1];
+    if (tmpdir == NULL)
+	tmpdir = "/tmp";
+
+    if (stream) {
+	len = strlen(file);
+	if (len >= 5 && strcasecmp(file + len - 5, ".lodp") == 0)
+	    return write_stream(file, out) ? 0 : 1;
+	/* the paged octree to rewrite goes to a temporary file first */
+	snprintf(tmp, sizeof(tmp), "%s/lod-page-XXXXXX", tmpdir);
+	if ((fd = mkstemp(tmp)) < 0) {
+	    perror(tmp);
+	    exit(1);
+	}
+	close(fd);
+	out = tmp;
+    }
+
+    if (megabytes > 0) {
+	t = get_timer();
+	if (!paged_build(file, out, page_depth, megabytes*1024*1024,
+			 tmpdir)) {
+	    fprintf(stderr, "%s: error building %s\n", file, out);
+	    if (stream)
+		unlink(tmp);
+	    exit(1);
+	}
+	fprintf(stderr, "Built %s [%gs]\n", out, get_timer() - t);
+    } else {
+	t = get_timer();
+	switch (synth_parse_name(file, &kind, &ntris, &seed)) {
+	    case 0: m = mesh_load(file); break;
+	    case 1: m = synth_mesh(kind, ntris, seed); break;
+	}
+	if (m == NULL) {
+	    fprintf(stderr, "%s: error loading mesh\n", file);
+	    if (stream)
+		unlink(tmp);
+	    exit(1);
+	}
+	fprintf(stderr, "Loaded %s [%gs]\n", file, get_timer() - t);
+
+	t = get_timer();
+	if ((tree = octree_create(m)) == NULL) {
+	    fprintf(stderr, "%s: error building octree\n", file);
+	    if (stream)
+		unlink(tmp);
+	    exit(1);
+	}
+	fprintf(stderr, "Built octree of %d nodes [%gs]\n", tree->nnodes,
+		get_timer() - t);
+
+	t = get_timer();
+	if (!paged_write(tree, out, page_depth)) {
+	    if (stream)
+		unlink(tmp);
+	    exit(1);
+	}
+	fprintf(stderr, "Wrote %s [%gs]\n", out, get_timer() - t);
+
+	octree_free(tree);
+	mesh_free(m);
+    }
+
+    if (stream) {
+	c = write_stream(out, argv[optind+1]);
+	unlink(tmp);
+	if (!c)
+	    exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+#define MAX_THREADS	64
+
+typedef struct {
+    void	      (*fn)(void *arg, int i);
+    void	       *arg;
+    int			n;
+    atomic_int		next;		/* next index to hand out	    */
+} parallel_job;
+
+static void *
+worker(void *p)
+{
+    parallel_job *job = p;
+    int i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n)
+	job->fn(job->arg, i);
+    return NULL;
+}
+
+int
+parallel_threads(void)
+{
+    static int nthreads = 0;
+    const char *s;
+    long n;
+
+    if (nthreads == 0) {
+	s = getenv("LOD_THREADS");
+	n = s ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > MAX_THREADS) n = MAX_THREADS;
+	nthreads = n;
+    }
+    return nthreads;
+}
+
+void
+parallel_for(int n, void (*fn)(void *arg, int i), void *arg)
+{
+    pthread_t tid[MAX_THREADS];
+    parallel_job job;
+    int j, nthreads;
+
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    atomic_init(&job.next, 0);
+
+    nthreads = parallel_threads();
+    if (nthreads > n) nthreads = n;
+
+    /* the calling thread does its share of the work too */
+    for (j=1; j<nthreads; j++)
+	if (pthread_create(&tid[j], NULL, worker, &job) != 0)
+	    break;
+    nthreads = j;
+    worker(&job);
+    for (j=1; j<nthreads; j++)
+	pthread_join(tid[j], NULL);
+}
+
+struct queue {
+    pthread_mutex_t	lock;
+    pthread_cond_t	put, got;	/* an item put, or taken	    */
+    int			capacity, head, n;
+    int			closed;
+    void	       *items[];
+};
+
+queue *
+queue_create(int capacity)
+{
+    queue *q = malloc(sizeof(*q) + sizeof(*q->items)*capacity);
+
+    if (q == NULL)
+	return NULL;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->put, NULL);
+    pthread_cond_init(&q->got, NULL);
+    q->capacity = capacity;
+    q->head = q->n = 0;
+    q->closed = 0;
+    return q;
+}
+
+void
+queue_put(queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->n == q->capacity)
+	pthread_cond_wait(&q->got, &q->lock);
+    q->items[(q->head + q->n++) % q->capacity] = item;
+    pthread_cond_signal(&q->put);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void *
+queue_get(queue *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->n == 0 && !q->closed)
+	pthread_cond_wait(&q->put, &q->lock);
+    if (q->n > 0) {
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->n--;
+	pthread_cond_signal(&q->got);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+void
+queue_close(queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->put);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+queue_free(queue *q)
+{
+    if (q) {
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->put);
+	pthread_cond_destroy(&q->got);
+	free(q);
+    }
+}
+
+struct stage {
+    pthread_t		tid;
+    void	      (*fn)(void *arg);
+    void	       *arg;
+};
+
+static void *
+run_stage(void *p)
+{
+    stage *s = p;
+
+    s->fn(s->arg);
+    return NULL;
+}
+
+stage *
+stage_start(void (*fn)(void *arg), void *arg)
+{
+    stage *s;
+
+    if (parallel_threads() == 1 || (s = malloc(sizeof(*s))) == NULL)
+	return NULL;
+    s->fn = fn;
+    s->arg = arg;
+    if (pthread_create(&s->tid, NULL, run_stage, s) != 0) {
+	free(s);
+	return NULL;
+    }
+    return s;
+}
+
+void
+stage_join(stage *s)
+{
+    pthread_join(s->tid, NULL);
+    free(s);
+}
@@ -0,0 +1,31 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+/* number of worker threads used by parallel_for (LOD_THREADS overrides the
+ * number of online processors) */
+int  parallel_threads(void);
+
+/* call fn(arg, i) for every i in [0,n), spread over parallel_threads()
+ * threads. returns once all calls have completed. */
+void parallel_for(int n, void (*fn)(void *arg, int i), void *arg);
+
+/* A bounded queue of items handed from one stage of a pipeline to the next:
+ * queue_put() waits while it is full, and queue_get() while it is empty,
+ * returning NULL once it is also closed. NULL if out of memory. */
+typedef struct queue queue;
+
+queue *queue_create(int capacity);
+void  queue_put(queue *q, void *item);
+void *queue_get(queue *q);
+void  queue_close(queue *q);
+void  queue_free(queue *q);
+
+/* run fn(arg) as a stage of a pipeline, on a thread of its own, until
+ * stage_join(). NULL if there is to be just the one thread, or none can be
+ * started, for the caller to run the stages in turn itself. */
+typedef struct stage stage;
+
+stage *stage_start(void (*fn)(void *arg), void *arg);
+void  stage_join(stage *s);
+
+#endif // !_PARALLEL_H_
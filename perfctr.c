@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+perfctr_phase perfctr_phases[PERF_NPHASES];
+
+static unsigned long long phase_start[PERF_NPHASES][PERF_NCOUNTERS];
+static int fds[PERF_NCOUNTERS] = { -1, -1, -1, -1, -1 };
+static int enabled = 0;
+static _Thread_local int owner = 0;	/* this thread enabled counting */
+
+static const char *const phase_names[PERF_NPHASES] = {
+    "octree build", "octree associate", "octree activators",
+    "octree cones", "lod update", "lod extract"
+};
+
+static const char *const counter_names[PERF_NCOUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+#ifdef __linux__
+static int
+open_counter(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+int
+perfctr_enable(void)
+{
+#ifdef __linux__
+    if (enabled)
+	return owner;
+
+    fds[PERF_CYCLES] =
+	open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    if (fds[PERF_CYCLES] < 0) {
+	perror("perf_event_open");
+	return 0;
+    }
+    fds[PERF_INSTRUCTIONS] =
+	open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[PERF_L1D_MISSES] =
+	open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		     PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		     PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    fds[PERF_LLC_MISSES] =
+	open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds[PERF_BRANCH_MISSES] =
+	open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    enabled = owner = 1;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int
+perfctr_enabled(void)
+{
+    return enabled;
+}
+
+static void
+read_counters(unsigned long long count[PERF_NCOUNTERS])
+{
+    int k;
+
+    for (k=0; k<PERF_NCOUNTERS; k++)
+	if (fds[k] < 0 ||
+	    read(fds[k], &count[k], sizeof(count[k])) != sizeof(count[k]))
+	    count[k] = 0;
+}
+
+void
+perfctr_begin(int phase)
+{
+    if (owner)
+	read_counters(phase_start[phase]);
+}
+
+void
+perfctr_end(int phase)
+{
+    unsigned long long now[PERF_NCOUNTERS];
+    int k;
+
+    if (!owner)
+	return;
+    read_counters(now);
+    for (k=0; k<PERF_NCOUNTERS; k++)
+	perfctr_phases[phase].count[k] += now[k] - phase_start[phase][k];
+    perfctr_phases[phase].spans++;
+}
+
+void
+perfctr_reset(int phase)
+{
+    memset(&perfctr_phases[phase], 0, sizeof(perfctr_phases[phase]));
+}
+
+const char *
+perfctr_phase_name(int phase)
+{
+    return phase_names[phase];
+}
+
+const char *
+perfctr_counter_name(int counter)
+{
+    return counter_names[counter];
+}
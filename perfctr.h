@@ -0,0 +1,55 @@
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+/* Hardware performance counters per LOD phase, from perf_event_open() on
+ * Linux; elsewhere, or where the counters are not accessible, perfctr_enable()
+ * fails and the rest does nothing.
+ *
+ * Counting covers the thread that enabled it, plus threads it starts
+ * afterwards once they have exited (such as parallel_for() workers). Phases
+ * are only accounted on the enabling thread; spans of a phase running on
+ * other threads are ignored. */
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NCOUNTERS
+};
+
+enum {
+    /* When octree_create() associates vertices and finds activators on a
+     * stage alongside the build, as it does with more than one thread, that
+     * work is counted in PHASE_OCTREE_BUILD: ASSOCIATE then has no spans, and
+     * ACTIVATORS only the triangles across the root, done after. */
+    PHASE_OCTREE_BUILD,
+    PHASE_OCTREE_ASSOCIATE,
+    PHASE_OCTREE_ACTIVATORS,
+    PHASE_OCTREE_CONES,
+    PHASE_LOD_UPDATE,		/* lod_update(), including reseeding */
+    PHASE_LOD_EXTRACT,		/* triangle loop of lod_extract() */
+    PERF_NPHASES
+};
+
+typedef struct {
+    unsigned long long	count[PERF_NCOUNTERS];	/* accumulated		    */
+    int			spans;			/* begin/end pairs	    */
+} perfctr_phase;
+
+extern perfctr_phase perfctr_phases[PERF_NPHASES];
+
+/* start counting; returns 0 if counters are unavailable. counters that the
+ * hardware lacks read as 0 */
+int	    perfctr_enable(void);
+int	    perfctr_enabled(void);
+
+void	    perfctr_begin(int phase);
+void	    perfctr_end(int phase);
+void	    perfctr_reset(int phase);
+
+const char *perfctr_phase_name(int phase);
+const char *perfctr_counter_name(int counter);
+
+#endif /* !_PERFCTR_H_ */
@@ -0,0 +1,753 @@
+/* Reading of PLY files (see ply.h).
+ *
+ * The header is compiled into a decode plan: the type and offset of every
+ * vertex property, and the layout of the faces. Binary vertices are read a
+ * buffer at a time and decoded by a kernel chosen from the plan. When the
+ * positions (and normals) are consecutive floats or doubles, the colors
+ * consecutive bytes, and the file is in the machine's byte order, one of
+ * the packed kernels copies each of them with a fixed-size load, the
+ * others being skipped over with the record; files of positions alone are
+ * read straight into the caller's array. Anything else goes through the
+ * generic kernel, which converts property by property.
+ *
+ * Faces of three vertices with a uchar count and 32-bit indices, with no
+ * other properties, are likewise copied straight out of the buffer; other
+ * faces are read one at a time, and polygons cut into fans of triangles.
+ *
+ * Files are written in that fast layout: float positions (and normals),
+ * and faces of a uchar count and 32-bit indices. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "ply.h"
+
+enum Field {
+    X,Y,Z,
+    NX,NY,NZ,
+    RED,GREEN,BLUE,
+    IGNORED
+};
+
+static const char *const kFieldStrings[] = {
+  "x","y","z",
+  "nx","ny","nz",
+  "red","green","blue",
+  "ignored"
+};
+
+/* integer types first */
+enum Type {
+    INT8, UINT8, INT16, UINT16, INT32, UINT32,
+    FLOAT32, FLOAT64,
+    NTYPES
+};
+
+static const struct {
+    const char *name, *alias;
+    unsigned size;
+} kTypes[NTYPES] = {
+  {"char", "int8", 1}, {"uchar", "uint8", 1},
+  {"short", "int16", 2}, {"ushort", "uint16", 2},
+  {"int", "int32", 4}, {"uint", "uint32", 4},
+  {"float", "float32", 4}, {"double", "float64", 8},
+};
+
+struct Property {
+    enum Field field;
+    enum Type type;
+    unsigned offset;			/* within the vertex record */
+};
+
+static const char kComment[] = "comment";
+static const char kElementVertex[] = "element vertex ";
+static const char kElementFace[] = "element face ";
+static const char kPropertyList[] = "property list ";
+
+enum {
+    kMaxVertexFields = 32,
+    kMaxPolygon = 1024,			/* vertices of a face */
+    kBufferSize = 1 << 16
+};
+
+typedef void decode_fn(const ply_reader *r, const uint8_t *p, unsigned n,
+		       vec3 *verts, vec3 *normals, color3ub *colors);
+
+struct ply_reader {
+    FILE *fp;
+    bool ascii, swap;
+    unsigned nv, nf;
+
+    /* the vertices */
+    struct Property props[kMaxVertexFields];
+    unsigned nprops, stride;
+    int field[IGNORED];			/* property of each, or -1 */
+    bool packed, direct;
+    bool dbl;				/* packed positions are doubles */
+    unsigned pos_offset, normal_offset, color_offset;
+
+    /* the faces */
+    enum Type count_type, index_type;
+    unsigned before_skip, after_skip;	/* bytes of other properties */
+    unsigned nbefore;			/* properties before the list */
+    bool fast_tris;
+
+    /* binary input not yet decoded */
+    uint8_t *buf;
+    size_t pos, end;
+
+    /* the face being cut into triangles: poly[0], poly[fan], poly[fan+1]
+     * is the next */
+    uint32_t poly[kMaxPolygon];
+    unsigned npoly, fan;
+
+    unsigned vread, facesread;		/* vertices and faces read so far */
+};
+
+static int
+parse_type(const char *s)
+{
+    for (int t=0; t<NTYPES; t++)
+	if (!strcmp(s, kTypes[t].name) || !strcmp(s, kTypes[t].alias))
+	    return t;
+    return -1;
+}
+
+static bool
+big_endian(void)
+{
+    const union { uint16_t i; uint8_t b[2]; } u = { 1 };
+    return u.b[0] == 0;
+}
+
+/* a value of the given type at p */
+static double
+get(const uint8_t *p, enum Type t, bool swap)
+{
+    uint8_t b[8];
+
+    if (swap) {
+	for (unsigned k=0; k<kTypes[t].size; k++)
+	    b[k] = p[kTypes[t].size-1-k];
+	p = b;
+    }
+    switch (t) {
+	case INT8: return (int8_t)p[0];
+	case UINT8: return p[0];
+	case INT16: { int16_t v; memcpy(&v, p, sizeof(v)); return v; }
+	case UINT16: { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+	case INT32: { int32_t v; memcpy(&v, p, sizeof(v)); return v; }
+	case UINT32: { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+	case FLOAT32: { float v; memcpy(&v, p, sizeof(v)); return v; }
+	case FLOAT64: { double v; memcpy(&v, p, sizeof(v)); return v; }
+	default: return 0;
+    }
+}
+
+/* colors of a floating type are taken to be in [0,1], others in [0,255] */
+static uint8_t
+to_color(double v, enum Type t)
+{
+    if (t >= FLOAT32)
+	v = v*255 + 0.5;
+    return v <= 0 ? 0 : v >= 255 ? 255 : (uint8_t)v;
+}
+
+static void
+put(unsigned i, enum Field f, enum Type t, double v, vec3 *verts,
+    vec3 *normals, color3ub *colors)
+{
+    switch (f) {
+	case X: case Y: case Z: verts[i][f-X] = v; break;
+	case NX: case NY: case NZ: if (normals) normals[i][f-NX] = v; break;
+	case RED: case GREEN: case BLUE:
+	    if (colors) colors[i][f-RED] = to_color(v, t);
+	    break;
+	default: break;
+    }
+}
+
+static void
+decode_generic(const ply_reader *r, const uint8_t *p, unsigned n,
+	       vec3 *verts, vec3 *normals, color3ub *colors)
+{
+    for (unsigned i=0; i<n; i++, p += r->stride)
+	for (unsigned j=0; j<r->nprops; j++) {
+	    const struct Property *q = &r->props[j];
+
+	    if (q->field != IGNORED)
+		put(i, q->field, q->type, get(p + q->offset, q->type, r->swap),
+		    verts, normals, colors);
+	}
+}
+
+/* the packed kernels, specialized on the constant flags */
+static inline void
+decode_packed(const ply_reader *r, const uint8_t *p, unsigned n,
+	      vec3 *verts, vec3 *normals, color3ub *colors,
+	      const bool dbl, const bool has_normals, const bool has_colors)
+{
+    const unsigned stride = r->stride;
+    const uint8_t *pos = p + r->pos_offset, *nrm = p + r->normal_offset;
+    const uint8_t *col = p + r->color_offset;
+
+    for (unsigned i=0; i<n; i++) {
+	if (dbl) {
+	    double d[3];
+	    memcpy(d, pos, sizeof(d));
+	    verts[i][0] = d[0]; verts[i][1] = d[1]; verts[i][2] = d[2];
+	    if (has_normals) {
+		memcpy(d, nrm, sizeof(d));
+		normals[i][0] = d[0]; normals[i][1] = d[1]; normals[i][2] = d[2];
+	    }
+	} else {
+	    float f[3];
+	    memcpy(f, pos, sizeof(f));
+	    verts[i][0] = f[0]; verts[i][1] = f[1]; verts[i][2] = f[2];
+	    if (has_normals) {
+		memcpy(f, nrm, sizeof(f));
+		normals[i][0] = f[0]; normals[i][1] = f[1]; normals[i][2] = f[2];
+	    }
+	}
+	if (has_colors)
+	    memcpy(colors[i], col, sizeof(*colors));
+	pos += stride;
+	nrm += stride;
+	col += stride;
+    }
+}
+
+#define PACKED_KERNEL(name, dbl, has_normals, has_colors)		\
+static void								\
+name(const ply_reader *r, const uint8_t *p, unsigned n, vec3 *verts,	\
+     vec3 *normals, color3ub *colors)					\
+{									\
+    decode_packed(r, p, n, verts, normals, colors, dbl, has_normals,	\
+		  has_colors);						\
+}
+
+PACKED_KERNEL(decode_xyz, false, false, false)
+PACKED_KERNEL(decode_xyz_rgb, false, false, true)
+PACKED_KERNEL(decode_xyz_n, false, true, false)
+PACKED_KERNEL(decode_xyz_n_rgb, false, true, true)
+PACKED_KERNEL(decode_dxyz, true, false, false)
+PACKED_KERNEL(decode_dxyz_rgb, true, false, true)
+PACKED_KERNEL(decode_dxyz_n, true, true, false)
+PACKED_KERNEL(decode_dxyz_n_rgb, true, true, true)
+
+/* by doubles, normals, colors */
+static decode_fn *const kPackedKernels[2][2][2] = {
+    { { decode_xyz, decode_xyz_rgb }, { decode_xyz_n, decode_xyz_n_rgb } },
+    { { decode_dxyz, decode_dxyz_rgb }, { decode_dxyz_n, decode_dxyz_n_rgb } },
+};
+
+/* whether fields f, f+1 and f+2 are consecutive, of type t */
+static bool
+consecutive(const ply_reader *r, enum Field f, enum Type t)
+{
+    const struct Property *p = r->props;
+
+    for (int k=0; k<3; k++)
+	if (p[r->field[f+k]].type != t ||
+	    p[r->field[f+k]].offset != p[r->field[f]].offset + k*kTypes[t].size)
+	    return false;
+    return true;
+}
+
+static void
+plan_vertices(ply_reader *r)
+{
+    const enum Type t = r->props[r->field[X]].type;
+
+    r->packed = !r->ascii && !r->swap &&
+		(t == FLOAT32 || t == FLOAT64) && consecutive(r, X, t) &&
+		(r->field[NX] < 0 || consecutive(r, NX, t)) &&
+		(r->field[RED] < 0 || consecutive(r, RED, UINT8));
+    if (!r->packed)
+	return;
+    r->dbl = t == FLOAT64;
+    r->pos_offset = r->props[r->field[X]].offset;
+    if (r->field[NX] >= 0)
+	r->normal_offset = r->props[r->field[NX]].offset;
+    if (r->field[RED] >= 0)
+	r->color_offset = r->props[r->field[RED]].offset;
+    r->direct = !r->dbl && r->stride == sizeof(vec3) &&
+		sizeof(vec3) == 3*sizeof(float);
+}
+
+ply_reader *
+ply_open(const char *file, unsigned *nv, unsigned *nt, int *normals,
+	 int *colors)
+{
+    ply_reader *const r=malloc(sizeof(*r));
+    FILE *const fp=fopen(file, "r");
+    if (!r || !fp)
+	goto fail;
+    memset(r, 0, sizeof(*r));
+    r->fp = fp;
+
+    char buf[256]={0};
+    if (!fgets(buf, sizeof(buf), fp) || strcmp(buf, "ply\n"))
+	goto fail;
+    if (!fgets(buf, sizeof(buf), fp))
+	goto fail;
+    r->ascii = !strcmp(buf, "format ascii 1.0\n");
+    bool binary_le = !strcmp(buf, "format binary_little_endian 1.0\n");
+    bool binary_be = !strcmp(buf, "format binary_big_endian 1.0\n");
+    if (!r->ascii && !binary_le && !binary_be) {
+	fprintf(stderr, "expected ascii, binary_little_endian, or binary_big_endian 1.0 format!\n");
+	goto fail;
+    }
+    r->swap = !r->ascii && binary_be != big_endian();
+    do {
+	fgets(buf, sizeof(buf), fp);
+    } while (strncmp(buf, kComment, strlen(kComment)) == 0);
+
+    /* read number of vertices */
+    if (strncmp(buf, kElementVertex, strlen(kElementVertex)) == 0) {
+	r->nv=strtoul(buf+strlen(kElementVertex), NULL, 10);
+    } else {
+	fprintf(stderr, "Expected line starting with: '%s', got: %s\n", kElementVertex, buf);
+    }
+    if (r->nv <= 0)
+	goto fail;
+
+    struct Property *props = r->props;
+    for (int f=0; f<IGNORED; f++)
+	r->field[f] = -1;
+    while (fgets(buf,sizeof(buf),fp) && strncmp(buf,"property ",9)==0) {
+	if (r->nprops == kMaxVertexFields) {
+	    fprintf(stderr, "Too many per-vertex fields\n");
+	    goto fail;
+	}
+	char type[256]={0}, field[256]={0};
+	sscanf(buf, "property %255s %255s\n", type, field);
+	int t = parse_type(type);
+	if (t < 0) {
+	    fprintf(stderr, "unsupported vertex property type %s\n", type);
+	    goto fail;
+	}
+	enum Field f = X;
+	while (f < IGNORED && strcmp(kFieldStrings[f], field))
+	    f++;
+	if (f == IGNORED) {
+	    fprintf(stderr, "Warning: ignoring field %s %s\n", type, field);
+	} else if (r->field[f] != -1) {
+	    fprintf(stderr, "Repeated field %s\n", field);
+	    goto fail;
+	} else {
+	    r->field[f] = r->nprops;
+	}
+	props[r->nprops].field = f;
+	props[r->nprops].type = t;
+	props[r->nprops].offset = r->stride;
+	r->stride += kTypes[t].size;
+	r->nprops++;
+    }
+    printf("{x,y,z}={%d,%d,%d} {nx,ny,nz}={%d,%d,%d} {r,g,b}={%d,%d,%d}\n",
+	   r->field[X], r->field[Y], r->field[Z],
+	   r->field[NX], r->field[NY], r->field[NZ],
+	   r->field[RED], r->field[GREEN], r->field[BLUE]);
+    for (unsigned i=0; i<r->nprops; ++i) {
+	printf("Field %u: %s %s\n",
+	       i, kFieldStrings[props[i].field], kTypes[props[i].type].name);
+    }
+    if (r->field[X]<0 || r->field[Y]<0 || r->field[Z]<0) {
+	fprintf(stderr, "Missing X, Y, or Z field(s)\n");
+	goto fail;
+    }
+
+    if (r->field[NX]>=0 || r->field[NY]>=0 || r->field[NZ]>=0) {
+	if (r->field[NX]<0 || r->field[NY]<0 || r->field[NZ]<0) {
+	    fprintf(stderr, "Bad NX, NY, or NZ field(s)\n");
+	    goto fail;
+	}
+    }
+
+    if (r->field[RED]>=0 || r->field[GREEN]>=0 || r->field[BLUE]>=0) {
+	if (r->field[RED]<0 || r->field[GREEN]<0 || r->field[BLUE]<0) {
+	    fprintf(stderr, "Bad R, G, or B field(s)\n");
+	    goto fail;
+	}
+    }
+
+    if (strncmp(buf, kElementFace, strlen(kElementFace)) == 0) {
+	r->nf=strtoul(buf+strlen(kElementFace), NULL, 10);
+    } else {
+	fprintf(stderr, "Expected: '%s', but got: %s\n", kElementFace, buf);
+    }
+    if (r->nf <= 0)
+	goto fail;
+
+    bool got_face_format = false;
+    for (;;) {
+	if (!fgets(buf, sizeof(buf), fp))
+	    goto fail;
+	if (strncmp(buf, kPropertyList, strlen(kPropertyList)) == 0) {
+	    char s0[32] = {0}, s1[32] = {0}, s2[32] = {0};
+	    if (sscanf(buf + strlen(kPropertyList), "%31s %31s %31s\n", s0, s1, s2) != 3) {
+		fprintf(stderr, "Ignoring property list line: %s", buf);
+		continue;
+	    }
+	    int count_type = parse_type(s0), index_type = parse_type(s1);
+	    if (count_type < 0 || count_type >= FLOAT32) {
+		fprintf(stderr, "only integer vertex count types are supported\n");
+		goto fail;
+	    }
+	    if (index_type < 0 || index_type >= FLOAT32) {
+		fprintf(stderr, "only integer vertex index types are supported\n");
+		goto fail;
+	    }
+	    if (strcmp(s2, "vertex_index") && strcmp(s2, "vertex_indices")) {
+		fprintf(stderr, "only vertex_index or vertex_indices are supported\n");
+		goto fail;
+	    }
+	    r->count_type = count_type;
+	    r->index_type = index_type;
+	    got_face_format = true;
+	} else if (strncmp(buf, "property ", 9) == 0) {
+	    char type[32] = {0};
+	    sscanf(buf, "property %31s", type);
+	    int t = parse_type(type);
+	    if (t < 0) {
+		fprintf(stderr, "unsupported face property type %s\n", type);
+		goto fail;
+	    }
+	    fprintf(stderr, "ignoring: %s", buf);
+	    if (got_face_format) {
+		r->after_skip += kTypes[t].size;
+	    } else {
+		r->before_skip += kTypes[t].size;
+		r->nbefore++;
+	    }
+	} else if (strcmp(buf, "end_header\n") == 0) {
+	    break;
+	} else {
+	    fprintf(stderr, "Warning: ignoring PLY line: %s\n", buf);
+	}
+    }
+    if (!got_face_format)
+	goto fail;
+
+    plan_vertices(r);
+    r->fast_tris = !r->ascii && !r->swap && r->count_type == UINT8 &&
+		   kTypes[r->index_type].size == 4 &&
+		   r->before_skip == 0 && r->after_skip == 0;
+    if (!r->ascii)
+	printf("Decoding %u-byte vertex records with the %s kernel, "
+	       "%s faces\n", r->stride,
+	       r->direct ? "direct" : r->packed ? "packed" : "generic",
+	       r->fast_tris ? "packed" : "generic");
+    if (!r->ascii && (r->buf = malloc(kBufferSize)) == NULL)
+	goto fail;
+
+    *nv = r->nv;
+    *nt = r->nf;
+    *normals = r->field[NX] >= 0;
+    *colors = r->field[RED] >= 0;
+    return r;
+
+fail:
+    if (fp)
+	fclose(fp);
+    if (r)
+	free(r->buf);
+    free(r);
+    return NULL;
+}
+
+/* make n bytes of binary input ready at buf+pos, reading as much as fits.
+ * 0 at the end of the file. */
+static int
+fill(ply_reader *r, size_t n)
+{
+    if (r->end - r->pos >= n)
+	return 1;
+    memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+    r->end -= r->pos;
+    r->pos = 0;
+    r->end += fread(r->buf + r->end, 1, kBufferSize - r->end, r->fp);
+    return r->end >= n;
+}
+
+static int
+read_ascii_vertices(ply_reader *r, unsigned n, vec3 *verts, vec3 *normals,
+		    color3ub *colors)
+{
+    char buf[256];
+
+    for (unsigned i=0; i<n; i++) {
+	if (!fgets(buf, sizeof(buf), r->fp))
+	    return 0;
+	char *ptr=buf;
+	for (unsigned j=0; j<r->nprops; j++) {
+	    const struct Property *q = &r->props[j];
+	    put(i, q->field, q->type, strtod(ptr,&ptr), verts, normals,
+		colors);
+	}
+    }
+    return 1;
+}
+
+int
+ply_read_vertices(ply_reader *r, unsigned n, vec3 *verts, vec3 *normals,
+		  color3ub *colors)
+{
+    if (n > r->nv - r->vread) {
+	fprintf(stderr, "only %u vertices left to read\n", r->nv - r->vread);
+	return 0;
+    }
+    if (r->field[NX] < 0)
+	normals = NULL;
+    if (r->field[RED] < 0)
+	colors = NULL;
+    if (r->ascii) {
+	if (!read_ascii_vertices(r, n, verts, normals, colors))
+	    return 0;
+    } else if (r->direct) {
+	/* nothing has gone through the buffer yet */
+	if (fread(verts, sizeof(*verts), n, r->fp) != n) {
+	    fprintf(stderr, "vertex I/O error\n");
+	    return 0;
+	}
+    } else {
+	decode_fn *decode = r->packed ?
+	    kPackedKernels[r->dbl][normals != NULL][colors != NULL] :
+	    decode_generic;
+
+	for (unsigned i=0, k; i<n; i+=k) {
+	    k = n - i < kBufferSize / r->stride ? n - i :
+		kBufferSize / r->stride;
+	    if (!fill(r, (size_t)k*r->stride)) {
+		fprintf(stderr, "vertex I/O error\n");
+		return 0;
+	    }
+	    decode(r, r->buf + r->pos, k, verts + i,
+		   normals ? normals + i : NULL, colors ? colors + i : NULL);
+	    r->pos += (size_t)k*r->stride;
+	}
+    }
+    r->vread += n;
+    return 1;
+}
+
+/* the next face, into poly[]. 0 on error */
+static int
+read_face(ply_reader *r)
+{
+    unsigned index = r->facesread++;
+
+    r->npoly = 0;
+    r->fan = 1;
+    if (r->ascii) {
+	char buf[kBufferSize], *ptr = buf, *end;
+
+	if (!fgets(buf, sizeof(buf), r->fp)) {
+	    fprintf(stderr, "face %u failed to read\n", index);
+	    return 0;
+	}
+	for (unsigned j=0; j<r->nbefore; j++)
+	    strtod(ptr, &ptr);
+	long count = strtol(ptr, &end, 10);
+	for (ptr = end; r->npoly < count && r->npoly < kMaxPolygon; ptr = end) {
+	    long v = strtol(ptr, &end, 10);
+	    if (end == ptr)
+		break;
+	    r->poly[r->npoly++] = v < 0 ? r->nv : v;
+	}
+	if (r->npoly != count) {
+	    fprintf(stderr, "face %u failed to read: %s\n", index, buf);
+	    return 0;
+	}
+    } else {
+	const unsigned csize = kTypes[r->count_type].size;
+	const unsigned isize = kTypes[r->index_type].size;
+
+	if (!fill(r, r->before_skip + csize)) {
+	    fprintf(stderr, "face vertex count I/O error\n");
+	    return 0;
+	}
+	double count = get(r->buf + r->pos + r->before_skip, r->count_type,
+			   r->swap);
+	if (count < 0 || count > kMaxPolygon) {
+	    fprintf(stderr, "face %u has %.0f vertices\n", index, count);
+	    return 0;
+	}
+	size_t size = r->before_skip + csize + count*isize + r->after_skip;
+	if (!fill(r, size)) {
+	    fprintf(stderr, "face index I/O error\n");
+	    return 0;
+	}
+	const uint8_t *p = r->buf + r->pos + r->before_skip + csize;
+	for (; r->npoly < count; p += isize) {
+	    double v = get(p, r->index_type, r->swap);
+	    r->poly[r->npoly++] = v < 0 ? r->nv : (uint32_t)v;
+	}
+	r->pos += size;
+    }
+    for (unsigned j = 0; j < r->npoly; ++j) {
+	if (r->poly[j] >= r->nv) {
+	    fprintf(stderr, "face %u index %u out of range\n", index, j);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* faces of three vertices copied straight out of the buffer, up to n of
+ * them, stopping at any other. -1 if one is out of range */
+static int
+read_triangles(ply_reader *r, unsigned n, index3u *tris)
+{
+    unsigned i = 0;
+
+    while (i < n && r->facesread < r->nf) {
+	size_t avail = (r->end - r->pos) / 13;
+	if (avail == 0) {
+	    if (!fill(r, 13))
+		break;
+	    continue;
+	}
+	const uint8_t *p = r->buf + r->pos;
+	unsigned k = 0, m = n - i < avail ? n - i : avail;
+	if (m > r->nf - r->facesread)
+	    m = r->nf - r->facesread;
+	for (; k < m && p[0] == 3; k++, p += 13) {
+	    memcpy(tris[i+k], p + 1, sizeof(*tris));
+	    if (tris[i+k][0] >= r->nv || tris[i+k][1] >= r->nv ||
+		tris[i+k][2] >= r->nv) {
+		fprintf(stderr, "face %u index out of range\n",
+			r->facesread + k);
+		return -1;
+	    }
+	}
+	r->pos += 13*k;
+	r->facesread += k;
+	i += k;
+	if (k < m)
+	    break;
+    }
+    return i;
+}
+
+int
+ply_read_faces(ply_reader *r, unsigned n, index3u *tris)
+{
+    unsigned i = 0;
+
+    if (r->vread != r->nv) {
+	fprintf(stderr, "%u vertices left to read before the faces\n",
+		r->nv - r->vread);
+	return -1;
+    }
+    while (i < n) {
+	if (r->fan + 1 < r->npoly) {
+	    tris[i][0] = r->poly[0];
+	    tris[i][1] = r->poly[r->fan];
+	    tris[i][2] = r->poly[r->fan+1];
+	    r->fan++;
+	    i++;
+	    continue;
+	}
+	if (r->facesread == r->nf)
+	    break;
+	if (r->fast_tris) {
+	    int k = read_triangles(r, n - i, tris + i);
+	    if (k < 0)
+		return -1;
+	    i += k;
+	    if (i == n || r->facesread == r->nf)
+		continue;
+	}
+	if (!read_face(r))
+	    return -1;
+    }
+    return i;
+}
+
+void
+ply_close(ply_reader *r)
+{
+    if (r == NULL)
+	return;
+    if (r->facesread == r->nf && r->fan + 1 >= r->npoly) {
+	long position = ftell(r->fp) - (long)(r->end - r->pos);
+	fseek(r->fp, 0, SEEK_END);
+	if (ftell(r->fp) != position)
+	    fprintf(stderr, "warning: %ld byte(s) not read\n", ftell(r->fp) - position);
+    }
+    fclose(r->fp);
+    free(r->buf);
+    free(r);
+}
+
+int
+ply_write(const char *file, unsigned nv, const vec3 *verts,
+	  const vec3 *normals, unsigned nt, const index3u *tris)
+{
+    const unsigned vsize = (normals ? 6 : 3) * sizeof(float);
+    const unsigned fsize = 1 + sizeof(index3u);
+    uint8_t *buf, *p;
+    unsigned i, k;
+    float f[6];
+    FILE *fp;
+    bool ok;
+
+    if ((fp = fopen(file, "wb")) == NULL) {
+	perror(file);
+	return 0;
+    }
+    if ((buf = malloc(kBufferSize)) == NULL) {
+	fprintf(stderr, "%s: out of memory\n", file);
+	fclose(fp);
+	return 0;
+    }
+    ok = fprintf(fp, "ply\n"
+		 "format binary_%s_endian 1.0\n"
+		 "element vertex %u\n"
+		 "property float x\n"
+		 "property float y\n"
+		 "property float z\n"
+		 "%s"
+		 "element face %u\n"
+		 "property list uchar int vertex_indices\n"
+		 "end_header\n", big_endian() ? "big" : "little", nv,
+		 normals ? "property float nx\n"
+			   "property float ny\n"
+			   "property float nz\n" : "", nt) > 0;
+
+    p = buf;
+    for (i=0; ok && i<nv; i++) {
+	if (p + vsize > buf + kBufferSize) {
+	    ok = fwrite(buf, 1, p - buf, fp) == (size_t)(p - buf);
+	    p = buf;
+	}
+	for (k=0; k<3; k++)
+	    f[k] = verts[i][k];
+	if (normals)
+	    for (k=0; k<3; k++)
+		f[3+k] = normals[i][k];
+	memcpy(p, f, vsize);
+	p += vsize;
+    }
+    for (i=0; ok && i<nt; i++) {
+	if (p + fsize > buf + kBufferSize) {
+	    ok = fwrite(buf, 1, p - buf, fp) == (size_t)(p - buf);
+	    p = buf;
+	}
+	*p = 3;
+	memcpy(p + 1, tris[i], sizeof(index3u));
+	p += fsize;
+    }
+    if (ok)
+	ok = fwrite(buf, 1, p - buf, fp) == (size_t)(p - buf);
+    free(buf);
+    if (fclose(fp) != 0)
+	ok = false;
+    if (!ok)
+	perror(file);
+    return ok;
+}
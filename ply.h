@@ -0,0 +1,37 @@
+#ifndef _PLY_H_
+#define _PLY_H_
+
+#include "mesh.h"
+
+/* Streaming PLY reader, for reading meshes a chunk at a time: all the
+ * vertices first, then the faces. */
+typedef struct ply_reader ply_reader;
+
+/* Open a PLY file and read its header, setting the number of vertices and
+ * faces and whether the vertices have normals and colors. The faces are the
+ * triangles unless some are polygons. NULL (having said why) on error. */
+ply_reader *ply_open(const char *file, unsigned *nv, unsigned *nt,
+		     int *normals, int *colors);
+
+/* Read the next n vertices. normals and colors may be NULL to skip them.
+ * 0 on error. */
+int	    ply_read_vertices(ply_reader *r, unsigned n, vec3 *verts,
+			      vec3 *normals, color3ub *colors);
+
+/* Read up to n triangles, once all vertices are read, returning how many:
+ * fewer than n only once the faces are all read. Polygons are cut into
+ * fans, and faces of fewer than three vertices give none. -1 on error, or
+ * if an index is out of range. Triangles that repeat a vertex are read as
+ * they are, for the caller to drop (see mesh_weld()). */
+int	    ply_read_faces(ply_reader *r, unsigned n, index3u *tris);
+
+/* close, warning about trailing bytes if all triangles were read */
+void	    ply_close(ply_reader *r);
+
+/* Write nv vertices, with their normals unless normals is NULL, and nt
+ * triangles as a binary PLY file in the byte order of this machine. 0
+ * (having said why) on error. */
+int	    ply_write(const char *file, unsigned nv, const vec3 *verts,
+		      const vec3 *normals, unsigned nt, const index3u *tris);
+
+#endif // !_PLY_H_
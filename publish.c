@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mesh.h"
+#include "publish.h"
+#include "vec3.h"
+
+struct publisher {
+    char	   *name;
+    publish_header *h;
+    size_t	    size;
+    uint64_t	    frames;
+};
+
+static publish_slot *
+slot_of(const publish_header *h, uint64_t frame)
+{
+    return (publish_slot *)((char *)h + h->slots +
+			    h->slot_bytes * (frame % h->nslots));
+}
+
+publisher *
+publish_create(const char *name, const mesh *m, int nslots)
+{
+    publisher *p = calloc(1, sizeof(*p));
+    publish_header *h;
+    float (*verts)[3], (*normals)[3];
+    uint64_t slot_bytes, at;
+    unsigned v;
+    int fd;
+    vec3 x;
+
+    if (p == NULL || (p->name = strdup(name)) == NULL) {
+	free(p);
+	fprintf(stderr, "%s: out of memory\n", name);
+	return NULL;
+    }
+    if (nslots < 2)
+	nslots = 2;
+    slot_bytes = sizeof(publish_slot) + sizeof(uint32_t)*3*(uint64_t)m->nt;
+    slot_bytes = (slot_bytes + 63) & ~(uint64_t)63;
+    at = (sizeof(*h) + 63) & ~(uint64_t)63;
+    p->size = at + 2*sizeof(*verts)*(uint64_t)m->nv;
+    p->size = (p->size + 63) & ~(size_t)63;
+    p->size += slot_bytes * nslots;
+
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 ||
+	ftruncate(fd, p->size) < 0 ||
+	(h = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+	MAP_FAILED) {
+	perror(name);
+	if (fd >= 0) {
+	    close(fd);
+	    shm_unlink(name);
+	}
+	free(p->name);
+	free(p);
+	return NULL;
+    }
+    close(fd);
+    p->h = h;
+
+    /* a new object is all zeros: no frames yet */
+    memcpy(h->magic, PUBLISH_MAGIC, sizeof(h->magic));
+    h->byte_order = PUBLISH_BYTE_ORDER;
+    h->nv = m->nv;
+    h->nt = m->nt;
+    h->nslots = nslots;
+    h->slot_bytes = slot_bytes;
+    h->verts = at;
+    h->normals = at + sizeof(*verts)*(uint64_t)m->nv;
+    h->slots = p->size - slot_bytes * nslots;
+    verts = (float (*)[3])((char *)h + h->verts);
+    normals = (float (*)[3])((char *)h + h->normals);
+    for (v=0; v<m->nv; v++) {
+	MeshVertex(x, m, v);
+	VecSet(verts[v], x);
+	MeshNormal(x, m, v);
+	VecSet(normals[v], x);
+    }
+    return p;
+}
+
+void
+publish_frame(publisher *p, const int *tri_index, int nindices)
+{
+    publish_header *h = p->h;
+    publish_slot *s = slot_of(h, p->frames);
+
+    /* readers of the frame this slot held can tell from the odd number
+     * that it is going */
+    atomic_store_explicit(&s->seq, 2*p->frames + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->nindices = nindices;
+    memcpy(s + 1, tri_index, sizeof(*tri_index)*nindices);
+    atomic_store_explicit(&s->seq, 2*p->frames + 2, memory_order_release);
+    atomic_store_explicit(&h->frames, ++p->frames, memory_order_release);
+}
+
+void
+publish_free(publisher *p)
+{
+    if (p == NULL)
+	return;
+    atomic_store_explicit(&p->h->closed, 1, memory_order_release);
+    munmap(p->h, p->size);
+    shm_unlink(p->name);
+    free(p->name);
+    free(p);
+}
+
+subscriber *
+subscribe_open(const char *name)
+{
+    subscriber *s = calloc(1, sizeof(*s));
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (s == NULL)
+	return NULL;
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0 || fstat(fd, &st) < 0 ||
+	(map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	MAP_FAILED) {
+	perror(name);
+	if (fd >= 0)
+	    close(fd);
+	free(s);
+	return NULL;
+    }
+    close(fd);
+    s->h = map;
+    s->size = st.st_size;
+    if ((size_t)st.st_size < sizeof(*s->h) ||
+	memcmp(s->h->magic, PUBLISH_MAGIC, sizeof(s->h->magic)) != 0 ||
+	s->h->byte_order != PUBLISH_BYTE_ORDER ||
+	s->h->slots + s->h->slot_bytes * s->h->nslots > s->size) {
+	fprintf(stderr, "%s: not a LOD publication of this byte order\n",
+		name);
+	subscribe_close(s);
+	return NULL;
+    }
+    s->verts = (const float (*)[3])((const char *)s->h + s->h->verts);
+    s->normals = (const float (*)[3])((const char *)s->h + s->h->normals);
+    return s;
+}
+
+void
+subscribe_close(subscriber *s)
+{
+    if (s == NULL)
+	return;
+    munmap((void *)s->h, s->size);
+    free(s);
+}
+
+const uint32_t *
+subscribe_latest(const subscriber *s, uint64_t *frame, uint32_t *nindices,
+		 uint64_t *seq)
+{
+    const publish_slot *slot;
+    uint64_t n;
+
+    /* the slot of the last frame may already be taken by a later one, in
+     * which case that is the one to read */
+    for (;;) {
+	n = atomic_load_explicit(&((publish_header *)s->h)->frames,
+				 memory_order_acquire);
+	if (n == 0)
+	    return NULL;
+	slot = slot_of(s->h, n - 1);
+	*seq = atomic_load_explicit(&((publish_slot *)slot)->seq,
+				    memory_order_acquire);
+	if (*seq == 2*n)
+	    break;
+    }
+    *frame = n - 1;
+    *nindices = slot->nindices;
+    return (const uint32_t *)(slot + 1);
+}
+
+int
+subscribe_valid(const subscriber *s, uint64_t frame, uint64_t seq)
+{
+    const publish_slot *slot = slot_of(s->h, frame);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&((publish_slot *)slot)->seq,
+				memory_order_relaxed) == seq;
+}
@@ -0,0 +1,81 @@
+#ifndef _PUBLISH_H_
+#define _PUBLISH_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "mesh.h"
+
+/* Publication of a mesh's simplified triangles to other processes on the
+ * host, through POSIX shared memory, so that recorders, analysis tools or
+ * a second renderer can follow the LOD without redoing it. The memory
+ * object holds a header, the mesh's vertices and normals (written once),
+ * and a ring of slots, each with room for every triangle of the mesh. The
+ * producer writes frame f to slot f % nslots, never waiting for readers;
+ * each slot is a seqlock, its sequence number odd while it is written, so
+ * a reader, reading a slot in place, can tell afterwards whether what it
+ * read was overwritten meanwhile. A reader keeping up with the producer
+ * has nslots - 1 frames' time to read one.
+ *
+ * Everything is in the byte order and float layout of the producer. */
+
+#define PUBLISH_MAGIC		"LODSHM01"
+#define PUBLISH_BYTE_ORDER	0x01020304u
+#define PUBLISH_SLOTS		4
+
+typedef struct {
+    char	     magic[8];
+    uint32_t	     byte_order;
+    uint32_t	     nv, nt;
+    uint32_t	     nslots;
+    uint64_t	     slot_bytes;	/* a slot, header and indices	    */
+    uint64_t	     verts;		/* offsets of the vertices (float
+					 * x, y, z), ..			    */
+    uint64_t	     normals;		/*	.. their normals ..	    */
+    uint64_t	     slots;		/*	.. and the first slot	    */
+    atomic_ullong    frames;		/* frames published so far	    */
+    atomic_uint	     closed;		/* set when the producer is done    */
+} publish_header;
+
+typedef struct {
+    atomic_ullong    seq;		/* 2f+1 while frame f is written,
+					 * 2f+2 once it is		    */
+    uint32_t	     nindices;		/* followed by that many, 3 per
+					 * triangle, indexing the vertices  */
+    uint32_t	     pad;
+} publish_slot;
+
+typedef struct publisher publisher;
+
+/* Create the shared memory object name (as for shm_open(), "/name") for
+ * mesh m, replacing any of that name, and write the vertices. NULL (having
+ * said why) on error. */
+publisher  *publish_create(const char *name, const mesh *m, int nslots);
+/* publish the triangles of a lod_extract() as the next frame */
+void	    publish_frame(publisher *p, const int *tri_index, int nindices);
+/* mark the publication closed and remove its name; readers who have it
+ * mapped keep it */
+void	    publish_free(publisher *p);
+
+/* a reader's mapping of a publication */
+typedef struct {
+    const publish_header *h;
+    const float	       (*verts)[3];
+    const float	       (*normals)[3];
+    size_t		 size;
+} subscriber;
+
+/* map publication name; NULL (having said why) on error */
+subscriber *subscribe_open(const char *name);
+void	    subscribe_close(subscriber *s);
+
+/* The indices of the last frame published, in place, or NULL if there is
+ * none yet; *frame gets its number, *nindices their number, and *seq what
+ * subscribe_valid() needs. */
+const uint32_t *subscribe_latest(const subscriber *s, uint64_t *frame,
+				 uint32_t *nindices, uint64_t *seq);
+/* whether what was read of frame since subscribe_latest() was all written
+ * by then and has not been overwritten since */
+int	    subscribe_valid(const subscriber *s, uint64_t frame, uint64_t seq);
+
+#endif // !_PUBLISH_H_
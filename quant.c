@@ -0,0 +1,84 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "quant.h"
+#include "vec3.h"
+
+void
+quant_box_init(quant_box *b, const vec3 min, const vec3 max)
+{
+    real ext = 0;
+    int k;
+
+    for (k=0; k<3; k++) {
+	b->mid[k] = (min[k] + max[k])/2;
+	if (ext < (max[k] - min[k])/2)
+	    ext = (max[k] - min[k])/2;
+    }
+    b->scale = ext > 0 ? ext/QUANT_MAX : 1;
+}
+
+void
+quant_encode(const quant_box *b, const vec3 p, int16_t q[3])
+{
+    real t;
+    int k;
+
+    for (k=0; k<3; k++) {
+	t = rint((p[k] - b->mid[k])/b->scale);
+	q[k] = t > QUANT_MAX ? QUANT_MAX : t < -QUANT_MAX ? -QUANT_MAX : t;
+    }
+}
+
+static real
+sign(real x)
+{
+    return x < 0 ? -1 : 1;
+}
+
+uint32_t
+oct_encode(const vec3 n, int bits)
+{
+    const int max = bits == 16 ? 127 : 32767;
+    real l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+    real u = 0, v = 0, t;
+    int qu, qv;
+
+    if (l1 > 0) {
+	u = n[0]/l1;
+	v = n[1]/l1;
+	if (n[2] < 0) {
+	    t = (1 - fabs(v))*sign(u);
+	    v = (1 - fabs(u))*sign(v);
+	    u = t;
+	}
+    }
+    qu = rint(u*max);
+    qv = rint(v*max);
+    if (bits == 16)
+	return (uint8_t)qu | (uint32_t)(uint8_t)qv << 8;
+    return (uint16_t)qu | (uint32_t)(uint16_t)qv << 16;
+}
+
+void
+oct_decode(uint32_t o, int bits, vec3 n)
+{
+    real u, v, t;
+
+    if (bits == 16) {
+	u = (int8_t)(o & 0xff)/127.0;
+	v = (int8_t)(o >> 8 & 0xff)/127.0;
+    } else {
+	u = (int16_t)(o & 0xffff)/32767.0;
+	v = (int16_t)(o >> 16)/32767.0;
+    }
+    n[2] = 1 - fabs(u) - fabs(v);
+    if (n[2] < 0) {
+	t = (1 - fabs(v))*sign(u);
+	v = (1 - fabs(u))*sign(v);
+	u = t;
+    }
+    n[0] = u;
+    n[1] = v;
+    VecNormalize(n);
+}
@@ -0,0 +1,40 @@
+#ifndef _QUANT_H_
+#define _QUANT_H_
+
+#include <stdint.h>
+
+#include "vec3.h"
+
+/* Compact encodings of positions and unit vectors (see mesh_compact()).
+ *
+ * Positions are quantized to 16-bit signed integers within a box, with the
+ * same step on every axis, so that dequantizing is a uniform scale and a
+ * translation (which the viewer folds into the model matrix, keeping normal
+ * transforms correct). The error is at most half a step per axis.
+ *
+ * Unit vectors are octahedral-encoded: projected onto the octahedron
+ * |x|+|y|+|z| = 1, the lower half folded over the upper, and the two
+ * coordinates stored as signed normalized integers of 8 bits (16 bits in
+ * all) or 16 bits (32 bits in all). */
+
+#define QUANT_MAX	32767
+
+typedef struct {
+    vec3	mid;
+    real	scale;			/* size of a step		    */
+} quant_box;
+
+void	 quant_box_init(quant_box *b, const vec3 min, const vec3 max);
+void	 quant_encode(const quant_box *b, const vec3 p, int16_t q[3]);
+
+#define QuantDecode(p, b, q) \
+    (p)[0]=(b)->mid[0]+(b)->scale*(q)[0], \
+    (p)[1]=(b)->mid[1]+(b)->scale*(q)[1], \
+    (p)[2]=(b)->mid[2]+(b)->scale*(q)[2]
+
+/* bits is 16 or 32; n need not be normalized (a zero vector decodes as
+ * +z) */
+uint32_t oct_encode(const vec3 n, int bits);
+void	 oct_decode(uint32_t o, int bits, vec3 n);
+
+#endif // !_QUANT_H_
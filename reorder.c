@@ -0,0 +1,306 @@
+/* Reordering of meshes for locality (see mesh_reorder()).
+ *
+ * Vertices are sorted along a Morton curve through the bounding box, 21
+ * bits to an axis, so that vertices close in space are close in memory:
+ * the octree's per-vertex arrays and the LOD proxies are then read in
+ * runs rather than at random.
+ *
+ * Triangles are then ordered for the post-transform vertex cache with Tom
+ * Forsyth's "linear-speed vertex cache optimisation": every vertex is
+ * scored by its position in a simulated LRU cache and by how few of its
+ * triangles remain, the triangle with the best score among those of the
+ * cached vertices is emitted next, and when none is left the next one not
+ * yet emitted is, found by a scan from where the last such scan ended. */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "trace.h"
+
+#define CACHE_SIZE	32		/* simulated LRU cache		    */
+#define CACHE_DECAY	1.5
+#define LAST_TRI_SCORE	0.75		/* of the last triangle's vertices  */
+#define VALENCE_SCALE	2.0
+#define VALENCE_POWER	0.5
+#define MAX_VALENCE	64		/* scores looked up below this	    */
+
+typedef struct {
+    uint64_t	key;
+    uint32_t	v;
+} morton_rec;
+
+/* spread the low 21 bits of x to every third bit */
+static uint64_t
+spread(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8)  & 0x100f00f00f00f00full;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2)  & 0x1249249249249249ull;
+    return x;
+}
+
+static int
+cmp_morton(const void *a, const void *b)
+{
+    const morton_rec *p = a, *q = b;
+
+    if (p->key != q->key)
+	return p->key < q->key ? -1 : 1;
+    return p->v < q->v ? -1 : p->v > q->v;
+}
+
+/* apply the permutation to an array of n elements of the given size:
+ * element j moves from order[j]. 0 if out of memory. */
+static int
+permute(void *array, size_t size, unsigned n, const uint32_t *order)
+{
+    char *from = array, *to;
+
+    if (array == NULL)
+	return 1;
+    if ((to = malloc(size*n)) == NULL)
+	return 0;
+    for (unsigned j=0; j<n; j++)
+	memcpy(to + size*j, from + size*order[j], size);
+    memcpy(array, to, size*n);
+    free(to);
+    return 1;
+}
+
+static int
+reorder_vertices(mesh *m)
+{
+    morton_rec *recs = malloc(sizeof(*recs)*m->nv);
+    uint32_t *order = malloc(sizeof(*order)*m->nv);
+    real scale = 0;
+    int ok = 0;
+
+    if (!recs || !order)
+	goto done;
+    for (int k=0; k<3; k++)
+	if (scale < m->max[k] - m->min[k])
+	    scale = m->max[k] - m->min[k];
+    scale = scale > 0 ? 0x1fffff / scale : 0;
+    for (unsigned j=0; j<m->nv; j++) {
+	recs[j].v = j;
+	recs[j].key = 0;
+	for (int k=0; k<3; k++)
+	    recs[j].key |= spread((m->verts[j][k] - m->min[k])*scale) << k;
+    }
+    qsort(recs, m->nv, sizeof(*recs), cmp_morton);
+
+    /* order[] is where each vertex comes from; recs[].v is reused for
+     * where each vertex goes */
+    for (unsigned j=0; j<m->nv; j++)
+	order[j] = recs[j].v;
+    for (unsigned j=0; j<m->nv; j++)
+	recs[order[j]].v = j;
+    if (!permute(m->verts, sizeof(*m->verts), m->nv, order) ||
+	!permute(m->vnormals, sizeof(*m->vnormals), m->nv, order) ||
+	!permute(m->vcolors, sizeof(*m->vcolors), m->nv, order) ||
+	!permute(m->vtexcoords, sizeof(*m->vtexcoords), m->nv, order))
+	goto done;
+    for (unsigned j=0; j<m->nt; j++)
+	for (int k=0; k<3; k++)
+	    m->tris[j][k] = recs[m->tris[j][k]].v;
+    ok = 1;
+
+done:
+    free(recs);
+    free(order);
+    return ok;
+}
+
+typedef struct {
+    float	 score;
+    int		 cache;			/* position in cache, or -1	    */
+    uint32_t	 remaining;		/* triangles not yet emitted	    */
+    uint32_t	 first;			/* into the triangle lists	    */
+} forsyth_vertex;
+
+static float cache_scores[CACHE_SIZE];
+static float valence_scores[MAX_VALENCE];
+/* meshes may be reordered on several threads at once */
+static pthread_once_t scores_once = PTHREAD_ONCE_INIT;
+
+static void
+init_scores(void)
+{
+    for (int j=0; j<CACHE_SIZE; j++)
+	cache_scores[j] = j < 3 ? LAST_TRI_SCORE :
+	    pow(1 - (j - 3)/(double)(CACHE_SIZE - 3), CACHE_DECAY);
+    for (int j=1; j<MAX_VALENCE; j++)
+	valence_scores[j] = VALENCE_SCALE * pow(j, -VALENCE_POWER);
+}
+
+static float
+vertex_score(const forsyth_vertex *v)
+{
+    float s;
+
+    if (v->remaining == 0)
+	return -1;
+    s = v->cache >= 0 ? cache_scores[v->cache] : 0;
+    return s + (v->remaining < MAX_VALENCE ? valence_scores[v->remaining] :
+		VALENCE_SCALE * pow(v->remaining, -VALENCE_POWER));
+}
+
+/* order[] receives the triangles in their new order. 0 if out of memory */
+static int
+forsyth(const mesh *m, uint32_t *order)
+{
+    forsyth_vertex *verts = calloc(m->nv, sizeof(*verts));
+    uint32_t *lists = malloc(sizeof(*lists)*3*m->nt);
+    char *emitted = calloc(m->nt, 1);
+    uint32_t cache[CACHE_SIZE + 3], next[CACHE_SIZE + 3];
+    unsigned ncache = 0, nnext, scan = 0, best;
+    float score, best_score;
+    int ok = 0;
+
+    if (!verts || !lists || !emitted)
+	goto done;
+    pthread_once(&scores_once, init_scores);
+
+    /* the triangles of each vertex */
+    for (unsigned j=0; j<m->nt; j++)
+	for (int k=0; k<3; k++)
+	    verts[m->tris[j][k]].remaining++;
+    for (unsigned j=0, n=0; j<m->nv; j++) {
+	verts[j].first = n;
+	n += verts[j].remaining;
+	verts[j].remaining = 0;
+	verts[j].cache = -1;
+    }
+    for (unsigned j=0; j<m->nt; j++)
+	for (int k=0; k<3; k++) {
+	    forsyth_vertex *v = &verts[m->tris[j][k]];
+	    lists[v->first + v->remaining++] = j;
+	}
+    for (unsigned j=0; j<m->nv; j++)
+	verts[j].score = vertex_score(&verts[j]);
+
+    best = m->nt;
+    for (unsigned t=0; t<m->nt; t++) {
+	/* nothing in the cache to go on: the next one not emitted */
+	if (best == m->nt) {
+	    while (emitted[scan])
+		scan++;
+	    best = scan;
+	}
+	order[t] = best;
+	emitted[best] = 1;
+
+	/* its vertices go to the front of the cache, and lose it from
+	 * their lists */
+	nnext = 0;
+	for (int k=0; k<3; k++) {
+	    uint32_t u = m->tris[best][k];
+	    forsyth_vertex *v = &verts[u];
+	    uint32_t *l = &lists[v->first];
+
+	    for (uint32_t i=0; i<v->remaining; i++)
+		if (l[i] == best) {
+		    l[i] = l[--v->remaining];
+		    break;
+		}
+	    next[nnext++] = u;
+	}
+	for (unsigned i=0; i<ncache; i++)
+	    if (cache[i] != next[0] && cache[i] != next[1] &&
+		cache[i] != next[2])
+		next[nnext++] = cache[i];
+	for (unsigned i=0; i<nnext; i++)
+	    verts[next[i]].cache = i < CACHE_SIZE ? (int)i : -1;
+	ncache = nnext < CACHE_SIZE ? nnext : CACHE_SIZE;
+	memcpy(cache, next, sizeof(*cache)*ncache);
+
+	/* rescore, and pick the best triangle of the cached vertices */
+	for (unsigned i=0; i<nnext; i++)
+	    verts[next[i]].score = vertex_score(&verts[next[i]]);
+	best = m->nt;
+	best_score = -1;
+	for (unsigned i=0; i<ncache; i++) {
+	    const forsyth_vertex *v = &verts[cache[i]];
+
+	    for (uint32_t l=0; l<v->remaining; l++) {
+		uint32_t j = lists[v->first + l];
+
+		score = verts[m->tris[j][0]].score +
+			verts[m->tris[j][1]].score + verts[m->tris[j][2]].score;
+		if (score > best_score) {
+		    best_score = score;
+		    best = j;
+		}
+	    }
+	}
+    }
+    ok = 1;
+
+done:
+    free(verts);
+    free(lists);
+    free(emitted);
+    return ok;
+}
+
+/* vertices transformed per triangle with a FIFO cache of n entries */
+static double
+acmr(const mesh *m, unsigned n)
+{
+    uint32_t *stamp = calloc(m->nv, sizeof(*stamp));
+    unsigned long misses = 0;
+    uint32_t time = 0;
+
+    if (stamp == NULL || m->nt == 0) {
+	free(stamp);
+	return 0;
+    }
+    /* a vertex is in the cache if it missed fewer than n misses ago */
+    for (unsigned j=0; j<m->nt; j++)
+	for (int k=0; k<3; k++) {
+	    uint32_t *s = &stamp[m->tris[j][k]];
+
+	    if (*s == 0 || time - *s >= n) {
+		*s = ++time;
+		misses++;
+	    }
+	}
+    free(stamp);
+    return (double)misses / m->nt;
+}
+
+int
+mesh_reorder(mesh *m)
+{
+    uint32_t *order;
+    double before;
+    int ok = 0;
+
+    if (m->nv == 0)
+	return 1;
+    TRACE_BEGIN("reorder");
+    before = acmr(m, 16);
+    if (!reorder_vertices(m) ||
+	(order = malloc(sizeof(*order)*(m->nt ? m->nt : 1))) == NULL)
+	goto done;
+    if (forsyth(m, order) &&
+	permute(m->tris, sizeof(*m->tris), m->nt, order) &&
+	permute(m->tnormals, sizeof(*m->tnormals), m->nt, order)) {
+	printf("Reordered %u vertices and %u triangles: %.3f vertices "
+	       "transformed per triangle, from %.3f\n", m->nv, m->nt,
+	       acmr(m, 16), before);
+	ok = 1;
+    }
+    free(order);
+
+done:
+    TRACE_END();
+    return ok;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+# Front update check: per-frame update time of the incremental, top-down
+# and hybrid front updates over camera paths of three kinds, one CSV row
+# per mesh and path. Exits with status 1 if hybrid is slower than the
+# faster of the other two by more than the tolerance, that is if its cost
+# model picks the slower update.
+#
+# usage: reseed.sh [-n frames] [-r runs] [-t percent] [meshes...]
+#   -n frames   frames of each path (360)
+#   -r runs     runs of each update, the fastest counting (5)
+#   -t percent  tolerance for timing noise (15)
+#   meshes      PLY files or synth: names (synth:terrain:200k
+#               synth:sphere:500k synth:scans:200k)
+# The paths are an orbit, a degree a frame; a pan, the gaze swinging 30
+# degrees either way of the model and back; and a teleport, the orbit
+# jumping 90 degrees around, nearer or farther, and the gaze from 12
+# degrees one side of the model to 12 degrees the other, every 45 frames.
+
+frames=360
+runs=5
+tolerance=15
+bin=$(dirname "$0")
+
+while getopts n:r:t: c; do
+    case $c in
+	n) frames=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	t) tolerance=$OPTARG ;;
+	*) sed -n '8,17s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- synth:terrain:200k synth:sphere:500k synth:scans:200k
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+awk -v n="$frames" 'BEGIN {
+    for (j = 0; j < n; j++) {
+	a = atan2(0, -1)/6 * sin(2*atan2(0, -1) * j/n)
+	printf "3 0 0 %.6f 0 %.6f 0 1 0\n", -cos(a), sin(a)
+    } }' >"$dir/pan"
+awk -v n="$frames" 'BEGIN {
+    for (j = 0; j < n; j++) {
+	k = int(j/45)
+	t = (j + 90*k) * atan2(0, -1)/180
+	a = (k % 2 ? 12 : -12) * atan2(0, -1)/180
+	d = k % 2 ? 4.5 : 2
+	printf "%.6f 0 %.6f %.6f 0 %.6f 0 1 0\n",
+	    d*cos(t), d*sin(t), -cos(t + a), -sin(t + a)
+    } }' >"$dir/teleport"
+
+failed=0
+echo "mesh,path,incremental_ms,top-down_ms,hybrid_ms,hybrid_rebuilds"
+for mesh in "$@"; do
+    for path in orbit pan teleport; do
+	row=$mesh,$path
+	file=
+	[ $path = orbit ] || file=$dir/$path
+	for mode in incremental top-down hybrid; do
+	    best=
+	    run=0
+	    while [ $run -lt "$runs" ]; do
+		# without front caching, top-down is a rebuild every frame
+		out=$("$bin/lod-bench" -s -c -n "$frames" -r $mode "$mesh" \
+		      $file 2>&1 >/dev/null | grep ' frames: ')
+		if [ -z "$out" ]; then
+		    echo "$mesh: benchmark failed" >&2
+		    exit 1
+		fi
+		# "<n> frames: update <ms>ms ... (<n> rebuilds, ..."
+		ms=$(echo "$out" | sed 's/.*update \([0-9.]*\)ms.*/\1/')
+		best=$(echo "$best $ms" |
+		       awk '{ print NF < 2 || $2 < $1 ? $NF : $1 }')
+		run=$((run + 1))
+	    done
+	    row=$row,$best
+	    rebuilds=$(echo "$out" | sed 's/.*(\([0-9]*\) rebuilds.*/\1/')
+	done
+	echo "$row,$rebuilds"
+	if ! echo "$row" | awk -F, -v t="$tolerance" \
+	    '{ best = $3 < $4 ? $3 : $4; exit !($5 <= best * (1 + t/100)) }'
+	then
+	    echo "$mesh: hybrid is slower than the faster update on the" \
+		 "$path" >&2
+	    failed=1
+	fi
+    done
+done
+exit $failed
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Scaling benchmark: load, octree build and per-frame LOD throughput of
+# synthetic meshes of growing size, one CSV row per size.
+#
+# usage: scaling.sh [-m] [-k kind] [-n frames] [-d dir] [sizes...]
+#   -m        generate the meshes in memory instead of writing PLY files
+#   -k kind   sphere, terrain, scans or sheets (sphere)
+#   -n frames frames of the orbit per size (90)
+#   -d dir    where to write the PLY files (/tmp), removed afterwards
+#   sizes     triangle counts, with k, m or g suffixes (10k 100k 1m 10m)
+
+memory=0
+kind=sphere
+frames=90
+dir=/tmp
+bin=$(dirname "$0")
+
+while getopts mk:n:d: c; do
+    case $c in
+	m) memory=1 ;;
+	k) kind=$OPTARG ;;
+	n) frames=$OPTARG ;;
+	d) dir=$OPTARG ;;
+	*) sed -n '5,10s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 10k 100k 1m 10m
+
+header=1
+for size in "$@"; do
+    if [ $memory = 1 ]; then
+	mesh=synth:$kind:$size
+    else
+	mesh=$dir/lod-scaling-$kind-$size.ply
+	"$bin/lod-synth" -k "$kind" -t "$size" "$mesh" || exit 1
+    fi
+    "$bin/lod-bench" -s -n "$frames" "$mesh" 2>/dev/null > "$dir/lod-scaling.$$"
+    status=$?
+    [ $memory = 1 ] || rm -f "$mesh"
+    if [ $status != 0 ]; then
+	echo "$mesh: benchmark failed" >&2
+	rm -f "$dir/lod-scaling.$$"
+	exit 1
+    fi
+    # lod-bench -s prints a header and one row
+    if [ $header = 1 ]; then
+	sed -n 1p "$dir/lod-scaling.$$" | sed 's/^/kind,size,/'
+	header=0
+    fi
+    sed -n 2p "$dir/lod-scaling.$$" | sed "s/^/$kind,$size,/"
+    rm -f "$dir/lod-scaling.$$"
+done
@@ -0,0 +1,777 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "lod.h"
+#include "mesh.h"
+#include "octree.h"
+#include "paged.h"
+#include "parallel.h"
+#include "perfctr.h"
+#include "publish.h"
+#include "scene.h"
+#include "synth.h"
+#include "timer.h"
+#include "trace.h"
+#include "vec3.h"
+#include "view_params.h"
+
+/* default megabytes of pages of a paged octree to keep loaded */
+#define PAGE_CACHE_MB	512
+
+/* vertices of a model shown while its octree is built */
+#define PREVIEW_POINTS	65536
+
+static void
+set_rotation(real r[9], real ax, real ay, real az, real degrees)
+{
+    real l = sqrt(ax*ax + ay*ay + az*az);
+    real c, s, t;
+
+    if (l == 0) {
+	ax = 1; ay = az = 0;
+	degrees = 0;
+    } else {
+	ax /= l; ay /= l; az /= l;
+    }
+    c = cos(degrees * DEG2RAD);
+    s = sin(degrees * DEG2RAD);
+    t = 1 - c;
+    r[0] = t*ax*ax + c;    r[1] = t*ax*ay - s*az; r[2] = t*ax*az + s*ay;
+    r[3] = t*ax*ay + s*az; r[4] = t*ay*ay + c;    r[5] = t*ay*az - s*ax;
+    r[6] = t*ax*az - s*ay; r[7] = t*ay*az + s*ax; r[8] = t*az*az + c;
+}
+
+/* PLY files named in a scene file are relative to it */
+static char *
+object_path(const char *scene_file, const char *file)
+{
+    const char *slash = strrchr(scene_file, '/');
+    int dirlen = slash && file[0] != '/' &&
+		 strncmp(file, "synth:", 6) != 0 ? slash - scene_file + 1 : 0;
+    char *path = malloc(dirlen + strlen(file) + 1);
+
+    memcpy(path, scene_file, dirlen);
+    strcpy(path + dirlen, file);
+    return path;
+}
+
+static int
+add_object(scene *s, const char *file)
+{
+    scene_object *o;
+    scene_model *m;
+    int j;
+
+    /* objects of the same file share its model */
+    for (j=0; j<s->nmodels; j++)
+	if (strcmp(s->models[j].file, file) == 0)
+	    break;
+    if (j == s->nmodels) {
+	m = realloc(s->models, sizeof(*m)*(s->nmodels+1));
+	if (m == NULL)
+	    return 0;
+	s->models = m;
+	m = &s->models[s->nmodels++];
+	memset(m, 0, sizeof(*m));
+	m->file = strdup(file);
+    }
+
+    o = realloc(s->objects, sizeof(*o)*(s->nobjects+1));
+    if (o == NULL)
+	return 0;
+    s->objects = o;
+    o = &s->objects[s->nobjects++];
+    memset(o, 0, sizeof(*o));
+    o->model = j;
+    o->scale = 1;
+    set_rotation(o->rotate, 1, 0, 0, 0);
+    s->models[j].nobjects++;
+    return 1;
+}
+
+static int
+parse_scene(scene *s, const char *file)
+{
+    char buf[1024], name[1024];
+    float scale, t[3], axis[3], angle;
+    scene_object *o;
+    char *path;
+    int lineno = 0;
+    int k, ok;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+	perror(file);
+	return 0;
+    }
+    while (fgets(buf, sizeof(buf), fp)) {
+	lineno++;
+	buf[strcspn(buf, "#\r\n")] = '\0';
+	if (sscanf(buf, "%1023s", name) != 1)
+	    continue;
+	if (strcmp(name, "budget") == 0) {
+	    if (sscanf(buf, "%*s %d", &s->budget) != 1 || s->budget < 0)
+		goto bad_line;
+	    continue;
+	}
+	if (strcmp(name, "mesh") != 0)
+	    goto bad_line;
+
+	k = sscanf(buf, "%*s %1023s %f %f %f %f %f %f %f %f", name, &scale,
+		   &t[0], &t[1], &t[2], &axis[0], &axis[1], &axis[2], &angle);
+	if (k != 1 && k != 2 && k != 5 && k != 9)
+	    goto bad_line;
+	path = object_path(file, name);
+	ok = add_object(s, path);
+	free(path);
+	if (!ok)
+	    break;
+	o = &s->objects[s->nobjects-1];
+	if (k >= 2)
+	    o->scale = scale;
+	if (k >= 5)
+	    VecSet(o->translate, t);
+	if (k == 9)
+	    set_rotation(o->rotate, axis[0], axis[1], axis[2], angle);
+	if (o->scale <= 0)
+	    goto bad_line;
+    }
+    fclose(fp);
+    if (s->nobjects == 0) {
+	fprintf(stderr, "%s: no meshes in scene\n", file);
+	return 0;
+    }
+    return 1;
+
+bad_line:
+    fprintf(stderr, "%s:%d: expected 'mesh <PLY file> [scale [tx ty tz "
+	    "[ax ay az degrees]]]' or 'budget <triangles>'\n", file, lineno);
+    fclose(fp);
+    return 0;
+}
+
+/* sample at most PREVIEW_POINTS vertices of a loaded model, to stand in for
+ * it until its octree is built */
+static int
+sample_preview(scene_model *m)
+{
+    const mesh *from = m->mesh;
+    unsigned step = from->nv / PREVIEW_POINTS + 1, v;
+    int n = 0;
+
+    m->preview_points = malloc(sizeof(vec3)*(from->nv/step + 1));
+    m->preview_normals = malloc(sizeof(vec3)*(from->nv/step + 1));
+    if (m->preview_points == NULL || m->preview_normals == NULL)
+	return 0;
+    for (v=0; v<from->nv; v+=step, n++) {
+	MeshVertex(m->preview_points[n], from, v);
+	MeshNormal(m->preview_normals[n], from, v);
+    }
+    m->npreview = n;
+    return 1;
+}
+
+static void
+load_model(void *arg, int i)
+{
+    scene *s = arg;
+    scene_model *m = &s->models[i];
+    unsigned long long ntris;
+    unsigned seed;
+    int kind;
+    double t;
+
+    t = get_timer();
+    switch (synth_parse_name(m->file, &kind, &ntris, &seed)) {
+	case 0: m->mesh = mesh_load(m->file); break;
+	case 1: m->mesh = synth_mesh(kind, ntris, seed); break;
+    }
+    if (m->mesh == NULL ||
+	(s->weld > 0 && !mesh_weld(m->mesh, s->weld)) ||
+	(s->reorder && !mesh_reorder(m->mesh)) ||
+	!sample_preview(m)) {
+	mesh_free(m->mesh);
+	m->mesh = NULL;
+	return;
+    }
+    m->load_time = get_timer() - t;
+}
+
+static void
+build_model(void *arg, int i)
+{
+    scene *s = arg;
+    scene_model *m = &s->models[i];
+    double t;
+
+    t = get_timer();
+    if (s->compact && !mesh_compact(m->mesh, s->compact))
+	return;
+    m->tree = octree_create(m->mesh);
+    mesh_release(m->mesh);
+    m->build_time = get_timer() - t;
+}
+
+scene *
+scene_open(const char *file)
+{
+    scene *s = malloc(sizeof(*s));
+    size_t len = strlen(file);
+    int ok;
+
+    if (s == NULL)
+	return NULL;
+    memset(s, 0, sizeof(*s));
+    s->detail_threshold = 1e-9;
+    s->silhouette_threshold = 5e-10;
+    s->reseed_mode = RESEED_HYBRID;
+    s->front_caching = 1;
+    s->instancing = 1;
+
+    if (len >= 5 && (strcasecmp(file + len - 5, ".lodp") == 0 ||
+		     strcasecmp(file + len - 5, ".lods") == 0)) {
+	const char *mb = getenv("LOD_PAGE_CACHE_MB");
+	size_t cap = (mb ? strtoul(mb, NULL, 10) : PAGE_CACHE_MB) << 20;
+
+	if ((s->paged = paged_open(file, cap)) == NULL) {
+	    scene_free(s);
+	    return NULL;
+	}
+	s->paged_object.model = -1;
+	s->paged_object.scale = 1;
+	set_rotation(s->paged_object.rotate, 1, 0, 0, 0);
+	return s;
+    }
+    if ((len >= 4 && strcasecmp(file + len - 4, ".ply") == 0) ||
+	strncmp(file, "synth:", 6) == 0)
+	ok = add_object(s, file);
+    else
+	ok = parse_scene(s, file);
+    if (!ok) {
+	scene_free(s);
+	return NULL;
+    }
+
+    if (getenv("LOD_WELD"))
+	s->weld = atof(getenv("LOD_WELD"));
+    if (getenv("LOD_REORDER"))
+	s->reorder = atoi(getenv("LOD_REORDER")) != 0;
+    if (getenv("LOD_COMPACT") && *getenv("LOD_COMPACT")) {
+	s->compact = atoi(getenv("LOD_COMPACT"));
+	if (s->compact != 16 && s->compact != 32) {
+	    fprintf(stderr, "LOD_COMPACT: expected 16 or 32 normal bits\n");
+	    s->compact = 0;
+	}
+    }
+    return s;
+}
+
+int
+scene_load_meshes(scene *s)
+{
+    int j;
+
+    parallel_for(s->nmodels, load_model, s);
+    for (j=0; j<s->nmodels; j++)
+	if (s->models[j].mesh == NULL) {
+	    fprintf(stderr, "%s: error loading mesh\n", s->models[j].file);
+	    return 0;
+	}
+    return 1;
+}
+
+int
+scene_build(scene *s)
+{
+    const char *name;
+    int j;
+
+    parallel_for(s->nmodels, build_model, s);
+    for (j=0; j<s->nmodels; j++)
+	if (s->models[j].tree == NULL) {
+	    fprintf(stderr, "%s: error building octree\n", s->models[j].file);
+	    return 0;
+	}
+    if ((name = getenv("LOD_PUBLISH")) && *name) {
+	if (s->nobjects != 1)
+	    fprintf(stderr, "LOD_PUBLISH: only a single mesh is published\n");
+	else
+	    s->publish = publish_create(name, s->models[0].mesh,
+					PUBLISH_SLOTS);
+    }
+    return 1;
+}
+
+void
+scene_publish(const scene *s)
+{
+    const lod_context *lod;
+
+    if (s->publish == NULL || s->nbuckets == 0)
+	return;
+    lod = s->buckets[0].lod;
+    publish_frame(s->publish, lod->tri_index, lod->nindices);
+}
+
+scene *
+scene_load(const char *file)
+{
+    scene *s = scene_open(file);
+
+    if (s && (!scene_load_meshes(s) || !scene_build(s))) {
+	scene_free(s);
+	return NULL;
+    }
+    return s;
+}
+
+static void
+free_buckets(scene *s)
+{
+    int j;
+
+    for (j=0; j<s->nbuckets; j++)
+	lod_free(s->buckets[j].lod);
+    free(s->buckets);
+    free(s->bucket_objects);
+    s->buckets = NULL;
+    s->bucket_objects = NULL;
+    s->nbuckets = 0;
+}
+
+void
+scene_free(scene *s)
+{
+    scene_model *m;
+    int j;
+
+    if (s) {
+	free_buckets(s);
+	for (j=0; j<s->nmodels; j++) {
+	    m = &s->models[j];
+	    if (m->tree)
+		octree_free(m->tree);
+	    mesh_free(m->mesh);
+	    free(m->preview_points);
+	    free(m->preview_normals);
+	    free(m->file);
+	}
+	free(s->models);
+	free(s->objects);
+	paged_close(s->paged);
+	publish_free(s->publish);
+	free(s);
+    }
+}
+
+static void
+flip_model(void *arg, int i)
+{
+    scene_model *m = &((scene *)arg)->models[i];
+
+    mesh_flip(m->mesh);
+    octree_flip(m->tree);
+}
+
+void
+scene_flip(scene *s)
+{
+    /* the fronts were chosen for the old orientation */
+    free_buckets(s);
+    parallel_for(s->nmodels, flip_model, s);
+}
+
+static void
+object_to_world(const scene_object *o, vec3 w, const vec3 p)
+{
+    vec3 q;
+
+    VecScale(q, p, o->scale);
+    w[0] = VecDot(&o->rotate[0], q) + o->translate[0];
+    w[1] = VecDot(&o->rotate[3], q) + o->translate[1];
+    w[2] = VecDot(&o->rotate[6], q) + o->translate[2];
+}
+
+/* rotate direction d into object coordinates (by the transposed rotation) */
+static void
+direction_to_object(const scene_object *o, vec3 w, const vec3 d)
+{
+    const real *r = o->rotate;
+
+    w[0] = r[0]*d[0] + r[3]*d[1] + r[6]*d[2];
+    w[1] = r[1]*d[0] + r[4]*d[1] + r[7]*d[2];
+    w[2] = r[2]*d[0] + r[5]*d[1] + r[8]*d[2];
+}
+
+/* grow min, max by the world box of mesh m placed as object o */
+static void
+fit_object(const scene_object *o, const mesh *m, vec3 min, vec3 max)
+{
+    vec3 c, w;
+    int j;
+
+    for (j=0; j<8; j++) {
+	c[0] = (j & 4 ? m->max : m->min)[0];
+	c[1] = (j & 2 ? m->max : m->min)[1];
+	c[2] = (j & 1 ? m->max : m->min)[2];
+	object_to_world(o, w, c);
+	min[0] = fmin(min[0], w[0]); max[0] = fmax(max[0], w[0]);
+	min[1] = fmin(min[1], w[1]); max[1] = fmax(max[1], w[1]);
+	min[2] = fmin(min[2], w[2]); max[2] = fmax(max[2], w[2]);
+    }
+}
+
+void
+scene_fit(scene *s)
+{
+    vec3 min, max, mid;
+    real size, k;
+    scene_object *o;
+    int i;
+
+    min[0] = min[1] = min[2] = HUGE_VAL;
+    max[0] = max[1] = max[2] = -HUGE_VAL;
+    for (i=0; i<s->nobjects; i++) {
+	o = &s->objects[i];
+	fit_object(o, s->models[o->model].mesh, min, max);
+    }
+    if (s->paged)
+	fit_object(&s->paged_object, &s->paged->bounds, min, max);
+
+    size = fmax(max[0]-min[0], fmax(max[1]-min[1], max[2]-min[2]));
+    if (size == 0)
+	return;
+    k = 2.0 / size;
+    VecBlend(mid, min, max, 0.5);
+    for (i=0; i<s->nobjects; i++) {
+	o = &s->objects[i];
+	o->scale *= k;
+	VecSub(o->translate, o->translate, mid);
+	VecScale(o->translate, o->translate, k);
+    }
+    if (s->paged) {
+	o = &s->paged_object;
+	o->scale *= k;
+	VecSub(o->translate, o->translate, mid);
+	VecScale(o->translate, o->translate, k);
+    }
+}
+
+void
+scene_matrix(const scene_object *o, real matrix[16])
+{
+#define M(i,j)	matrix[4*j+i]
+    int i, j;
+
+    for (i=0; i<3; i++) {
+	for (j=0; j<3; j++)
+	    M(i,j) = o->rotate[3*i+j] * o->scale;
+	M(i,3) = o->translate[i];
+	M(3,i) = 0;
+    }
+    M(3,3) = 1;
+#undef M
+}
+
+/* Projected areas only depend on ratios of lengths, so scaling the near and
+ * far planes along with everything else leaves them (and hence the
+ * refinement) the same as in the scene. */
+void
+scene_object_view(scene_object *o, const view_params *vp)
+{
+    vec3 d, eye, gaze, up;
+
+    VecSub(d, vp->eye, o->translate);
+    direction_to_object(o, eye, d);
+    VecScale(eye, eye, 1.0/o->scale);
+    direction_to_object(o, gaze, vp->gaze);
+    direction_to_object(o, up, vp->up);
+    view_setup(&o->view, eye, gaze, up, vp->fovy, vp->r / vp->u,
+	       vp->znear / o->scale, vp->zfar / o->scale);
+}
+
+/* Instances are bucketed by their view in object coordinates: the direction
+ * and distance of the eye from the model, and the gaze and up directions.
+ * Within a bucket the fronts would come out nearly identical, so the first
+ * object's front is used for all of them. */
+#define BUCKET_ANGLE		(2*DEG2RAD)
+#define BUCKET_DIST_STEPS	8	/* buckets per doubling of distance */
+
+static void
+quantize_direction(int key[3], const vec3 d)
+{
+    key[0] = floor(d[0] / BUCKET_ANGLE + 0.5);
+    key[1] = floor(d[1] / BUCKET_ANGLE + 0.5);
+    key[2] = floor(d[2] / BUCKET_ANGLE + 0.5);
+}
+
+static void
+bucket_key(const scene *s, int object, int key[SCENE_KEY_SIZE])
+{
+    const scene_object *o = &s->objects[object];
+    const mesh *m = s->models[o->model].mesh;
+    vec3 c, d;
+    real r, l;
+
+    memset(key, 0, sizeof(*key)*SCENE_KEY_SIZE);
+    key[0] = o->model;
+    if (!s->instancing) {
+	key[1] = object;
+	return;
+    }
+
+    VecBlend(c, m->min, m->max, 0.5);
+    VecSub(d, m->max, m->min);
+    r = fmax(0.5 * sqrt(VecDot(d, d)), 1e-6);
+    VecSub(d, o->view.eye, c);
+    l = fmax(sqrt(VecDot(d, d)), 1e-3 * r);
+    VecScale(d, d, 1.0/l);
+
+    key[1] = floor(log2(l / r) * BUCKET_DIST_STEPS);
+    quantize_direction(&key[2], d);
+    quantize_direction(&key[5], o->view.gaze);
+    quantize_direction(&key[8], o->view.up);
+}
+
+typedef struct {
+    int		key[SCENE_KEY_SIZE];
+    int		object;
+} keyed_object;
+
+static int
+key_cmp(const int *a, const int *b)
+{
+    int j;
+
+    for (j=0; j<SCENE_KEY_SIZE; j++)
+	if (a[j] != b[j])
+	    return a[j] < b[j] ? -1 : 1;
+    return 0;
+}
+
+static int
+keyed_cmp(const void *a, const void *b)
+{
+    const keyed_object *ka = a, *kb = b;
+    int k = key_cmp(ka->key, kb->key);
+
+    return k ? k : ka->object - kb->object;
+}
+
+/* Regroup the objects into buckets, in key order. Buckets that keep their
+ * key keep their front; fronts of buckets that went away are reused for new
+ * buckets of the same model, as they are likely to be close to what is
+ * needed. */
+static void
+update_buckets(scene *s)
+{
+    keyed_object *ko = malloc(sizeof(*ko)*s->nobjects);
+    scene_bucket *old = s->buckets, *b;
+    lod_context **spare = malloc(sizeof(*spare)*(s->nbuckets+1));
+    int nold = s->nbuckets, nspare = 0;
+    int i, j, k, cmp;
+
+    for (j=0; j<s->nobjects; j++) {
+	bucket_key(s, j, ko[j].key);
+	ko[j].object = j;
+    }
+    qsort(ko, s->nobjects, sizeof(*ko), keyed_cmp);
+
+    free(s->bucket_objects);
+    s->bucket_objects = malloc(sizeof(*s->bucket_objects)*s->nobjects);
+    s->buckets = malloc(sizeof(*s->buckets)*s->nobjects);
+    s->nbuckets = 0;
+
+    for (i=j=0; j<s->nobjects; j++) {
+	if (j == 0 || key_cmp(ko[j].key, ko[j-1].key) != 0) {
+	    b = &s->buckets[s->nbuckets++];
+	    memcpy(b->key, ko[j].key, sizeof(b->key));
+	    b->lod = NULL;
+	    b->objects = &s->bucket_objects[j];
+	    b->nobjects = 0;
+
+	    /* both lists are in key order */
+	    for (; i<nold && (cmp=key_cmp(old[i].key, b->key)) <= 0; i++) {
+		if (cmp == 0)
+		    b->lod = old[i].lod;
+		else
+		    spare[nspare++] = old[i].lod;
+	    }
+	}
+	b->objects[b->nobjects++] = ko[j].object;
+	s->objects[ko[j].object].bucket = s->nbuckets-1;
+    }
+    for (; i<nold; i++)
+	spare[nspare++] = old[i].lod;
+
+    for (j=0; j<s->nbuckets; j++) {
+	b = &s->buckets[j];
+	if (b->lod)
+	    continue;
+	for (k=0; k<nspare; k++)
+	    if (spare[k]->tree == s->models[b->key[0]].tree)
+		break;
+	if (k < nspare) {
+	    b->lod = spare[k];
+	    spare[k] = spare[--nspare];
+	} else {
+	    b->lod = lod_create(s->models[b->key[0]].tree);
+	}
+    }
+    for (k=0; k<nspare; k++)
+	lod_free(spare[k]);
+
+    free(spare);
+    free(old);
+    free(ko);
+}
+
+/* max-heap of boundary nodes of all buckets, by lod_priority() per
+ * triangle expanding them costs */
+typedef struct {
+    real	 priority;
+    int		 bucket;
+    octree_node	*node;
+} budget_node;
+
+typedef struct {
+    budget_node	*nodes;
+    int		 n, max;
+} budget_heap;
+
+static void
+heap_push(budget_heap *h, real priority, int bucket, octree_node *node)
+{
+    budget_node b = { priority, bucket, node };
+    int i, p;
+
+    if (h->n == h->max) {
+	h->max = h->max ? 2*h->max : 1024;
+	h->nodes = realloc(h->nodes, sizeof(*h->nodes)*h->max);
+    }
+    for (i=h->n++; i>0 && h->nodes[p=(i-1)/2].priority < priority; i=p)
+	h->nodes[i] = h->nodes[p];
+    h->nodes[i] = b;
+}
+
+static budget_node
+heap_pop(budget_heap *h)
+{
+    budget_node top = h->nodes[0];
+    budget_node b = h->nodes[--h->n];
+    int i, c;
+
+    for (i=0; (c=2*i+1) < h->n; i=c) {
+	if (c+1 < h->n && h->nodes[c+1].priority > h->nodes[c].priority)
+	    c++;
+	if (h->nodes[c].priority <= b.priority)
+	    break;
+	h->nodes[i] = h->nodes[c];
+    }
+    h->nodes[i] = b;
+    return top;
+}
+
+static void
+push_node(budget_heap *h, const scene *s, int bucket, octree_node *n)
+{
+    const scene_bucket *b = &s->buckets[bucket];
+    real p = lod_priority(b->lod, n, &s->objects[b->objects[0]].view);
+    int cost = (n->activated ? n->activated[0] : 0) * b->nobjects;
+
+    /* lod_update would not expand it, so neither do we; nodes that cost
+     * nothing are expanded whatever their order */
+    if (p >= 1)
+	heap_push(h, cost > 0 ? p / cost : INFINITY, bucket, n);
+}
+
+void
+scene_update(scene *s, const view_params *vp)
+{
+    budget_heap heap = { NULL, 0, 0 };
+    budget_node bn;
+    scene_bucket *b;
+    lod_context *lod;
+    octree_node *n;
+    int j, k, cost;
+
+    TRACE_BEGIN("scene_update");
+    TRACE_BEGIN("bucket objects");
+    for (j=0; j<s->nobjects; j++)
+	scene_object_view(&s->objects[j], vp);
+    update_buckets(s);
+    TRACE_END();
+    s->triangles = s->expansions = 0;
+
+    for (j=0; j<s->nbuckets; j++) {
+	lod = s->buckets[j].lod;
+	lod->detail_threshold = s->detail_threshold;
+	lod->silhouette_threshold = s->silhouette_threshold;
+	lod->reseed_mode = s->reseed_mode;
+	lod->front_caching = s->front_caching;
+	s->num_reseeds -= lod->num_reseeds;
+	s->num_restores -= lod->num_restores;
+    }
+
+    if (s->budget <= 0) {
+	for (j=0; j<s->nbuckets; j++) {
+	    b = &s->buckets[j];
+	    lod_update(b->lod, &s->objects[b->objects[0]].view);
+	}
+    } else {
+	/* expanding a node brings in the triangles it activates, so greedily
+	 * spend the budget on the nodes that reduce the projected error most
+	 * per triangle, passing over those that no longer fit for cheaper
+	 * ones after them */
+	TRACE_BEGIN("allocate budget");
+	perfctr_begin(PHASE_LOD_UPDATE);
+	for (j=0; j<s->nbuckets; j++) {
+	    b = &s->buckets[j];
+	    lod_begin_front(b->lod);
+	    push_node(&heap, s, j, b->lod->tree->root);
+	}
+	while (heap.n > 0) {
+	    bn = heap_pop(&heap);
+	    b = &s->buckets[bn.bucket];
+	    n = bn.node;
+	    cost = (n->activated ? n->activated[0] : 0) * b->nobjects;
+	    /* the free nodes come first, so once the budget is spent none of
+	     * those left fit */
+	    if (s->triangles == s->budget && cost > 0)
+		break;
+	    if (s->triangles + cost > s->budget)
+		continue;
+	    lod_expand(b->lod, n);
+	    s->triangles += cost;
+	    s->expansions++;
+	    for (k=0; k<8; k++)
+		if (n->subtree[k])
+		    push_node(&heap, s, bn.bucket, n->subtree[k]);
+	}
+	for (j=0; j<s->nbuckets; j++) {
+	    b = &s->buckets[j];
+	    lod_end_front(b->lod, &s->objects[b->objects[0]].view);
+	}
+	free(heap.nodes);
+	perfctr_end(PHASE_LOD_UPDATE);
+	TRACE_END();
+    }
+
+    for (j=0; j<s->nbuckets; j++) {
+	s->num_reseeds += s->buckets[j].lod->num_reseeds;
+	s->num_restores += s->buckets[j].lod->num_restores;
+    }
+
+    if (s->paged) {
+	lod = s->paged->lod;
+	lod->detail_threshold = s->detail_threshold;
+	lod->silhouette_threshold = s->silhouette_threshold;
+	lod->reseed_mode = s->reseed_mode;
+	scene_object_view(&s->paged_object, vp);
+	paged_update(s->paged, &s->paged_object.view);
+    }
+    TRACE_END();
+}
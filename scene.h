@@ -0,0 +1,154 @@
+#ifndef _SCENE_H_
+#define _SCENE_H_
+
+#include "lod.h"
+#include "mesh.h"
+#include "octree.h"
+#include "paged.h"
+#include "publish.h"
+#include "vec3.h"
+#include "view_params.h"
+
+/* a mesh and its octree, loaded once however many objects use it */
+typedef struct {
+    char	 *file;			/* PLY file the mesh came from	    */
+    mesh	 *mesh;
+    octree	 *tree;
+    int		  nobjects;		/* objects (instances) using it	    */
+    double	  load_time;		/* seconds reading the mesh ..	    */
+    double	  build_time;		/*	.. and building its octree  */
+
+    vec3	 *preview_points;	/* a sample of the vertices, to draw
+					 * until the octree is built	    */
+    vec3	 *preview_normals;
+    int		  npreview;
+} scene_model;
+
+/* an instance of a model: world = translate + rotate * (scale * object) */
+typedef struct {
+    int		  model;		/* index into scene models	    */
+    real	  scale;		/* uniform scale ..		    */
+    real	  rotate[9];		/*   .. then rotation (row major) ..*/
+    vec3	  translate;		/*   .. then translation	    */
+
+    view_params	  view;			/* scene view in object coordinates */
+    int		  bucket;		/* bucket of the last update	    */
+} scene_object;
+
+/* instances of one model whose object-space views are close enough that
+ * they can share one front, and be drawn together */
+#define SCENE_KEY_SIZE	11
+
+typedef struct {
+    int		  key[SCENE_KEY_SIZE];	/* model, then quantized view	    */
+    lod_context	 *lod;			/* front for the first object's view*/
+    int		 *objects;		/* objects in the bucket	    */
+    int		  nobjects;
+} scene_bucket;
+
+typedef struct {
+    int		  nmodels;
+    scene_model	 *models;
+    int		  nobjects;
+    scene_object *objects;
+
+    int		  nbuckets;
+    scene_bucket *buckets;
+    int		 *bucket_objects;	/* storage for bucket object lists  */
+
+    paged_octree *paged;		/* or, instead of models, one paged
+					 * octree ..			    */
+    scene_object  paged_object;		/*	.. placed like an object    */
+    int		  compact;		/* normal bits of compacted models,
+					 * or 0 (see mesh_compact())	    */
+    float	  weld;			/* welding distance, or 0	    */
+    int		  reorder;		/* whether to reorder models	    */
+    publisher	 *publish;		/* of the front, or NULL	    */
+
+    /* LOD settings, applied to every bucket's lod_context */
+    float	  detail_threshold;
+    float	  silhouette_threshold;
+    int		  reseed_mode;
+    int		  front_caching;
+
+    int		  instancing;		/* share fronts between instances
+					 * seen from about the same view,
+					 * rather than one per object	    */
+    int		  budget;		/* triangles per frame, or 0 to let
+					 * each front refine to the
+					 * thresholds			    */
+
+    /* statistics from the last scene_update() */
+    int		  triangles;		/* triangles the fronts activate    */
+    int		  expansions;		/* nodes expanded under the budget  */
+    /* since loading */
+    int		  num_reseeds;
+    int		  num_restores;
+} scene;
+
+/* Load a scene: either a single PLY file (or synthetic mesh, see synth.h),
+ * a paged octree (.lodp, or a stream of one, .lods, see paged.h;
+ * LOD_PAGE_CACHE_MB sets how many megabytes of its pages to keep loaded),
+ * or a scene file with one line
+ *
+ *	mesh <PLY file> [scale [tx ty tz [ax ay az degrees]]]
+ *
+ * per object (PLY files are relative to the scene file, and objects naming
+ * the same file are instances of one model; synth: names generate the mesh
+ * in memory), an optional
+ *
+ *	budget <triangles>
+ *
+ * line, and #-comments. The models are loaded and their octrees built in
+ * parallel. If LOD_WELD is set, vertices of a model within that distance
+ * of each other are welded first (see mesh_weld()). If LOD_REORDER is set
+ * (and not 0), their vertices and triangles are reordered for locality (see
+ * mesh_reorder()). If LOD_COMPACT is 16 or 32, the models are compacted,
+ * with normals of that many bits (see mesh_compact()). If LOD_PUBLISH
+ * names a shared memory object ("/name"), a single mesh's simplified
+ * triangles are published there each frame (see publish.h and
+ * scene_publish()). */
+scene  *scene_load(const char *file);
+void	scene_free(scene *s);
+
+/* scene_load() in steps, for a viewer to show something while the rest
+ * loads: scene_open() reads the scene file (or opens the paged octree,
+ * which is then all there is to do), scene_load_meshes() loads the models'
+ * meshes and samples each one's preview points, after which their bounds
+ * are known and scene_fit() can be called, and scene_build() builds the
+ * octrees. The last two print an error and return 0 on failure, leaving
+ * the scene to be freed. */
+scene  *scene_open(const char *file);
+int	scene_load_meshes(scene *s);
+int	scene_build(scene *s);
+
+/* publish the triangles of the front's last lod_extract(), if the scene
+ * is published */
+void	scene_publish(const scene *s);
+
+/* rescale and recenter the whole scene to fit in [-1,1]^3 */
+void	scene_fit(scene *s);
+
+/* flip the winding order of all models, and the normals of their
+ * octrees */
+void	scene_flip(scene *s);
+
+/* OpenGL (column major) object-to-world matrix of o */
+void	scene_matrix(const scene_object *o, real matrix[16]);
+
+/* set o->view to view vp (of the scene) in o's object coordinates */
+void	scene_object_view(scene_object *o, const view_params *vp);
+
+/* Sort the objects into buckets for view vp and update each bucket's front,
+ * and the paged octree's if there is one. With a budget, the fronts are
+ * rebuilt together from the roots every frame, always expanding next the
+ * boundary node (of any bucket) with the largest projected area relative to
+ * its threshold per triangle it costs, and passing over nodes that no
+ * longer fit, until no node needs expanding. An expansion costs the
+ * triangles it activates times the number of objects in the bucket. As the
+ * fronts are rebuilt, reseed_mode and front_caching have no effect then.
+ * Paged octrees, whose triangles are not all known, always refine to the
+ * thresholds. */
+void	scene_update(scene *s, const view_params *vp);
+
+#endif // !_SCENE_H_
@@ -0,0 +1,646 @@
+/* The LOD server and its client (see serve.h). */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "campath.h"
+#include "lod.h"
+#include "mesh.h"
+#include "quant.h"
+#include "scene.h"
+#include "serve.h"
+#include "vec3.h"
+
+/* how often the server looks up from waiting for clients to see if it is
+ * done */
+#define ACCEPT_POLL_MS	100
+
+/* sockets */
+
+/* split [host:]port; 0 if it does not fit */
+static int
+split_address(const char *address, char *host, size_t size,
+	      const char **port)
+{
+    const char *colon = strrchr(address, ':');
+
+    if (colon == NULL) {
+	snprintf(host, size, "127.0.0.1");
+	*port = address;
+	return 1;
+    }
+    if ((size_t)(colon - address) >= size)
+	return 0;
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    *port = colon + 1;
+    return 1;
+}
+
+static int
+open_socket(const char *address, int listening)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un un;
+    const char *port;
+    char host[256];
+    int fd = -1, one = 1, err;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	if (strlen(address + 5) >= sizeof(un.sun_path)) {
+	    fprintf(stderr, "%s: path too long\n", address);
+	    return -1;
+	}
+	strcpy(un.sun_path, address + 5);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	    perror(address);
+	    return -1;
+	}
+	/* a socket left behind by a server that is gone */
+	if (listening)
+	    unlink(un.sun_path);
+	if (listening ? bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+			listen(fd, SOMAXCONN) < 0
+		      : connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+	    perror(address);
+	    close(fd);
+	    return -1;
+	}
+	return fd;
+    }
+
+    if (!split_address(address, host, sizeof(host), &port)) {
+	fprintf(stderr, "%s: bad address\n", address);
+	return -1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+	fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+	return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	if (listening)
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+			listen(fd, SOMAXCONN) == 0
+		      : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+	perror(address);
+	return -1;
+    }
+    /* poses and frames are small, and each waits for the other */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int
+serve_listen(const char *address)
+{
+    return open_socket(address, 1);
+}
+
+int
+serve_connect(const char *address)
+{
+    return open_socket(address, 0);
+}
+
+static int
+send_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t r;
+
+    while (size > 0) {
+	r = send(fd, p, size, MSG_NOSIGNAL);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+    }
+    return 1;
+}
+
+/* 0 on error or if the other end is gone */
+static int
+recv_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (size > 0) {
+	r = recv(fd, p, size, 0);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return 0;
+	p += r;
+	size -= r;
+    }
+    return 1;
+}
+
+/* frames */
+
+typedef struct {
+    unsigned char *data;
+    size_t	   size, room;
+} buffer;
+
+static int
+put_bytes(buffer *b, const void *p, size_t size)
+{
+    unsigned char *d;
+
+    if (size == 0)
+	return 1;
+    if (b->size + size > b->room) {
+	size_t room = b->room ? 2*b->room : 4096;
+
+	while (room < b->size + size)
+	    room *= 2;
+	if ((d = realloc(b->data, room)) == NULL)
+	    return 0;
+	b->data = d;
+	b->room = room;
+    }
+    memcpy(b->data + b->size, p, size);
+    b->size += size;
+    return 1;
+}
+
+static int
+put_varint(buffer *b, uint32_t x)
+{
+    unsigned char v[5];
+    int n = 0;
+
+    while (x >= 0x80) {
+	v[n++] = x | 0x80;
+	x >>= 7;
+    }
+    v[n++] = x;
+    return put_bytes(b, v, n);
+}
+
+/* read from the bytes at *p up to end; 0 if they run out */
+static int
+get_bytes(const unsigned char **p, const unsigned char *end, void *out,
+	  size_t size)
+{
+    if ((size_t)(end - *p) < size)
+	return 0;
+    memcpy(out, *p, size);
+    *p += size;
+    return 1;
+}
+
+static int
+get_varint(const unsigned char **p, const unsigned char *end, uint32_t *x)
+{
+    int shift;
+
+    *x = 0;
+    for (shift = 0; *p < end && shift < 35; shift += 7) {
+	*x |= (uint32_t)(**p & 0x7f) << shift;
+	if (!(*(*p)++ & 0x80))
+	    return 1;
+    }
+    return 0;
+}
+
+/* the server */
+
+struct serve_server {
+    const octree    *tree;
+    scene_object     object;
+    int		     fd;
+    char	    *path;		/* of a unix socket, to remove	    */
+
+    pthread_t	     thread;
+    pthread_mutex_t  lock;		/* guards the fields below	    */
+    pthread_cond_t   idle;		/* the last client left		    */
+    int		     nclients;
+    int		     quit;
+};
+
+/* what a client has of the simplified mesh, as of its last frame */
+typedef struct {
+    serve_server    *sv;
+    int		     fd;
+    lod_context	    *lod;
+    uint32_t	    *sent;		/* bit per vertex sent		    */
+    int		    *faces;		/* mesh triangles that have a
+					 * simplified one, ascending ..	    */
+    int		   (*tris)[3];		/*	.. and those		    */
+    int		     ntris;
+    uint32_t	    *fresh;		/* vertices of this frame's set
+					 * triangles not sent before	    */
+    buffer	     out;
+} session;
+
+static int
+cmp_uint(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* the changes from the session's triangles to those of its front's last
+ * extraction, into s->out after a header */
+static int
+encode_frame(session *s, unsigned frame)
+{
+    const lod_context *ctx = s->lod;
+    const mesh *m = s->sv->tree->mesh;
+    const int *cur = ctx->tri_index, *faces = ctx->tri_faces;
+    int ncur = ctx->nindices / 3, i, j, k, nfresh = 0;
+    uint32_t last_removed = 0, last_set = 0, v, normal;
+    buffer rem = { NULL, 0, 0 }, set = { NULL, 0, 0 };
+    serve_frame f;
+    vec3 p, n;
+    float pf[3];
+    int ok = 1;
+
+    memset(&f, 0, sizeof(f));
+    f.frame = frame;
+    f.rendered = ncur;
+
+    /* both lists are in mesh triangle order */
+    for (i = j = 0; ok && (i < s->ntris || j < ncur); ) {
+	if (j == ncur || (i < s->ntris && s->faces[i] < faces[j])) {
+	    ok = put_varint(&rem, s->faces[i] - last_removed);
+	    last_removed = s->faces[i++];
+	    f.nremoved++;
+	    continue;
+	}
+	if (i < s->ntris && s->faces[i] == faces[j]) {
+	    if (s->tris[i][0] == cur[3*j] && s->tris[i][1] == cur[3*j+1] &&
+		s->tris[i][2] == cur[3*j+2]) {
+		i++;
+		j++;
+		continue;
+	    }
+	    i++;
+	}
+	ok = put_varint(&set, faces[j] - last_set);
+	last_set = faces[j];
+	for (k=0; ok && k<3; k++) {
+	    uint32_t u = cur[3*j+k];
+
+	    ok = put_varint(&set, u);
+	    if (!(s->sent[u/32] & 1u << u%32)) {
+		s->sent[u/32] |= 1u << u%32;
+		s->fresh[nfresh++] = u;
+	    }
+	}
+	f.nset++;
+	j++;
+    }
+
+    qsort(s->fresh, nfresh, sizeof(*s->fresh), cmp_uint);
+    s->out.size = 0;
+    ok = ok && put_bytes(&s->out, &f, sizeof(f));
+    for (i=0; ok && i<nfresh; i++) {
+	v = s->fresh[i];
+	MeshVertex(p, m, v);
+	MeshNormal(n, m, v);
+	VecSet(pf, p);
+	normal = oct_encode(n, 32);
+	ok = put_varint(&s->out, v - (i ? s->fresh[i-1] : 0)) &&
+	     put_bytes(&s->out, pf, sizeof(pf)) &&
+	     put_bytes(&s->out, &normal, sizeof(normal));
+    }
+    f.nverts = nfresh;
+    ok = ok && put_bytes(&s->out, rem.data, rem.size) &&
+	 put_bytes(&s->out, set.data, set.size);
+    free(rem.data);
+    free(set.data);
+    if (!ok)
+	return 0;
+    f.bytes = s->out.size - sizeof(f);
+    memcpy(s->out.data, &f, sizeof(f));
+
+    /* what the client has now */
+    if (ncur > 0) {
+	int *nf = realloc(s->faces, sizeof(*s->faces)*ncur);
+	int (*nt)[3] = realloc(s->tris, sizeof(*s->tris)*ncur);
+
+	if (nf)
+	    s->faces = nf;
+	if (nt)
+	    s->tris = nt;
+	if (!nf || !nt)
+	    return 0;
+	memcpy(s->faces, faces, sizeof(*s->faces)*ncur);
+	memcpy(s->tris, cur, sizeof(*s->tris)*ncur);
+    }
+    s->ntris = ncur;
+    return 1;
+}
+
+static void *
+serve_session(void *arg)
+{
+    session *s = arg;
+    serve_server *sv = s->sv;
+    const mesh *m = sv->tree->mesh;
+    scene_object o = sv->object;
+    serve_hello h;
+    serve_pose pose;
+    view_params vp;
+    camera c;
+    real matrix[16];
+    unsigned frame = 0;
+
+    s->lod = lod_create(sv->tree);
+    s->sent = calloc(m->nv/32 + 1, sizeof(*s->sent));
+    s->fresh = malloc(sizeof(*s->fresh)*(m->nv ? m->nv : 1));
+    if (s->lod == NULL || !s->sent || !s->fresh ||
+	(s->lod->tri_faces = malloc(sizeof(int)*(m->nt ? m->nt : 1))) ==
+	NULL) {
+	fprintf(stderr, "serve: out of memory for a client\n");
+	goto done;
+    }
+    /* with a thread per client, a front rebuilt on parallel_for() workers
+     * of its own would start a pool per client per frame: updates stay
+     * incremental on this thread, from a front of just the root */
+    s->lod->reseed_mode = RESEED_NEVER;
+    s->lod->front_caching = 0;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SERVE_MAGIC, sizeof(h.magic));
+    h.byte_order = SERVE_BYTE_ORDER;
+    h.nv = m->nv;
+    h.nt = m->nt;
+    scene_matrix(&o, matrix);
+    memcpy(h.matrix, matrix, sizeof(h.matrix));
+    VecSet(h.min, m->min);
+    VecSet(h.max, m->max);
+    if (!send_all(s->fd, &h, sizeof(h)))
+	goto done;
+
+    while (recv_all(s->fd, &pose, sizeof(pose))) {
+	VecSet(c.eye, pose.eye);
+	VecSet(c.gaze, pose.gaze);
+	VecSet(c.up, pose.up);
+	c.fovy = pose.fovy;
+	campath_view(&c, pose.aspect, &vp);
+	scene_object_view(&o, &vp);
+	s->lod->detail_threshold = pose.detail_threshold;
+	s->lod->silhouette_threshold = pose.silhouette_threshold;
+	if (frame == 0) {
+	    lod_begin_front(s->lod);
+	    lod_end_front(s->lod, &o.view);
+	}
+	lod_update(s->lod, &o.view);
+	lod_extract(s->lod);
+	if (!encode_frame(s, frame++)) {
+	    fprintf(stderr, "serve: out of memory for a client\n");
+	    break;
+	}
+	if (!send_all(s->fd, s->out.data, s->out.size))
+	    break;
+    }
+
+done:
+    close(s->fd);
+    lod_free(s->lod);
+    free(s->sent);
+    free(s->fresh);
+    free(s->faces);
+    free(s->tris);
+    free(s->out.data);
+    free(s);
+
+    pthread_mutex_lock(&sv->lock);
+    if (--sv->nclients == 0)
+	pthread_cond_broadcast(&sv->idle);
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
+
+static void *
+serve_accept(void *arg)
+{
+    serve_server *sv = arg;
+    struct pollfd pfd = { sv->fd, POLLIN, 0 };
+    pthread_t tid;
+    session *s;
+    int fd, quit;
+
+    for (;;) {
+	pthread_mutex_lock(&sv->lock);
+	quit = sv->quit;
+	pthread_mutex_unlock(&sv->lock);
+	if (quit)
+	    break;
+	if (poll(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+	    continue;
+	if ((fd = accept(sv->fd, NULL, NULL)) < 0)
+	    continue;
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+	    close(fd);
+	    continue;
+	}
+	s->sv = sv;
+	s->fd = fd;
+	pthread_mutex_lock(&sv->lock);
+	sv->nclients++;
+	pthread_mutex_unlock(&sv->lock);
+	if (pthread_create(&tid, NULL, serve_session, s) != 0) {
+	    fprintf(stderr, "serve: cannot start a client's thread\n");
+	    close(fd);
+	    free(s);
+	    pthread_mutex_lock(&sv->lock);
+	    sv->nclients--;
+	    pthread_mutex_unlock(&sv->lock);
+	    continue;
+	}
+	pthread_detach(tid);
+    }
+    return NULL;
+}
+
+serve_server *
+serve_start(const octree *tree, const scene_object *o, int fd)
+{
+    serve_server *sv = calloc(1, sizeof(*sv));
+    struct sockaddr_un un;
+    socklen_t len = sizeof(un);
+
+    if (sv == NULL) {
+	close(fd);
+	return NULL;
+    }
+    sv->tree = tree;
+    sv->object = *o;
+    sv->fd = fd;
+    if (getsockname(fd, (struct sockaddr *)&un, &len) == 0 &&
+	un.sun_family == AF_UNIX)
+	sv->path = strdup(un.sun_path);
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->idle, NULL);
+    if (pthread_create(&sv->thread, NULL, serve_accept, sv) != 0) {
+	fprintf(stderr, "serve: cannot start the server's thread\n");
+	pthread_mutex_destroy(&sv->lock);
+	pthread_cond_destroy(&sv->idle);
+	close(fd);
+	free(sv->path);
+	free(sv);
+	return NULL;
+    }
+    return sv;
+}
+
+void
+serve_stop(serve_server *sv)
+{
+    if (sv == NULL)
+	return;
+    pthread_mutex_lock(&sv->lock);
+    sv->quit = 1;
+    pthread_mutex_unlock(&sv->lock);
+    pthread_join(sv->thread, NULL);
+    close(sv->fd);
+    if (sv->path)
+	unlink(sv->path);
+
+    pthread_mutex_lock(&sv->lock);
+    while (sv->nclients > 0)
+	pthread_cond_wait(&sv->idle, &sv->lock);
+    pthread_mutex_unlock(&sv->lock);
+    pthread_mutex_destroy(&sv->lock);
+    pthread_cond_destroy(&sv->idle);
+    free(sv->path);
+    free(sv);
+}
+
+/* the client */
+
+serve_client *
+serve_client_open(const char *address)
+{
+    serve_client *c = calloc(1, sizeof(*c));
+    unsigned j;
+
+    if (c == NULL)
+	return NULL;
+    if ((c->fd = serve_connect(address)) < 0) {
+	free(c);
+	return NULL;
+    }
+    if (!recv_all(c->fd, &c->hello, sizeof(c->hello)) ||
+	memcmp(c->hello.magic, SERVE_MAGIC, sizeof(c->hello.magic)) != 0 ||
+	c->hello.byte_order != SERVE_BYTE_ORDER) {
+	fprintf(stderr, "%s: not a LOD server of this byte order\n", address);
+	serve_client_close(c);
+	return NULL;
+    }
+    c->verts = calloc(c->hello.nv ? c->hello.nv : 1, sizeof(*c->verts));
+    c->normals = calloc(c->hello.nv ? c->hello.nv : 1, sizeof(*c->normals));
+    c->tris = malloc(sizeof(*c->tris)*(c->hello.nt ? c->hello.nt : 1));
+    if (!c->verts || !c->normals || !c->tris) {
+	fprintf(stderr, "%s: out of memory\n", address);
+	serve_client_close(c);
+	return NULL;
+    }
+    for (j=0; j<c->hello.nt; j++)
+	c->tris[j][0] = c->tris[j][1] = c->tris[j][2] = -1;
+    return c;
+}
+
+void
+serve_client_close(serve_client *c)
+{
+    if (c == NULL)
+	return;
+    close(c->fd);
+    free(c->verts);
+    free(c->normals);
+    free(c->tris);
+    free(c);
+}
+
+/* apply a frame's vertices and triangles; 0 if they do not fit */
+static int
+apply_frame(serve_client *c, const unsigned char *p, const unsigned char *end)
+{
+    const serve_frame *f = &c->last;
+    uint32_t j, v = 0, t = 0, x, normal;
+    float pf[3];
+    int k;
+
+    for (j=0; j<f->nverts; j++) {
+	if (!get_varint(&p, end, &x) || (v += x) >= c->hello.nv ||
+	    !get_bytes(&p, end, pf, sizeof(pf)) ||
+	    !get_bytes(&p, end, &normal, sizeof(normal)))
+	    return 0;
+	VecSet(c->verts[v], pf);
+	oct_decode(normal, 32, c->normals[v]);
+    }
+    for (j=0; j<f->nremoved; j++) {
+	if (!get_varint(&p, end, &x) || (t += x) >= c->hello.nt ||
+	    c->tris[t][0] < 0)
+	    return 0;
+	c->tris[t][0] = c->tris[t][1] = c->tris[t][2] = -1;
+	c->ntris--;
+    }
+    for (j=0, t=0; j<f->nset; j++) {
+	if (!get_varint(&p, end, &x) || (t += x) >= c->hello.nt)
+	    return 0;
+	if (c->tris[t][0] < 0)
+	    c->ntris++;
+	for (k=0; k<3; k++) {
+	    if (!get_varint(&p, end, &x) || x >= c->hello.nv)
+		return 0;
+	    c->tris[t][k] = x;
+	}
+    }
+    return p == end;
+}
+
+int
+serve_client_frame(serve_client *c, const serve_pose *pose)
+{
+    unsigned char *data;
+    int ok;
+
+    if (!send_all(c->fd, pose, sizeof(*pose)) ||
+	!recv_all(c->fd, &c->last, sizeof(c->last)))
+	return 0;
+    if ((data = malloc(c->last.bytes ? c->last.bytes : 1)) == NULL)
+	return 0;
+    ok = recv_all(c->fd, data, c->last.bytes) &&
+	 apply_frame(c, data, data + c->last.bytes) &&
+	 c->ntris == (int)c->last.rendered;
+    free(data);
+    c->bytes = sizeof(c->last) + c->last.bytes;
+    c->frame++;
+    return ok;
+}
@@ -0,0 +1,102 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "campath.h"
+#include "octree.h"
+#include "scene.h"
+
+/* View-dependent LOD over a socket. A server holds one octree (placed in
+ * the scene like an object) and serves any number of clients at once, each
+ * on a thread of its own with its own lod_context over the shared tree,
+ * whose front it updates incrementally itself. A client sends camera
+ * poses; for each, the server updates the client's front and answers with
+ * what changed since the client's last frame:
+ *
+ *	- the vertices (of the mesh) the client has not been sent before,
+ *	  with their positions and octahedral normals;
+ *	- the mesh triangles whose simplified triangle is gone;
+ *	- the mesh triangles whose simplified triangle is new or changed,
+ *	  with its three vertices.
+ *
+ * A client keeps, per mesh triangle, the simplified triangle standing for
+ * it, if any, so the whole index list is never sent again. Triangle
+ * numbers go out in increasing order as varints of the gaps between them,
+ * vertex numbers as varints. Everything else is in the byte order and float
+ * layout of the server; both ends are meant to be the same machine, or
+ * alike. Addresses are unix:<path> or [host:]port (the host defaulting to
+ * the loopback address). */
+
+#define SERVE_MAGIC	"LODSERV1"
+#define SERVE_BYTE_ORDER	0x01020304u
+
+/* sent by the server on accepting a client */
+typedef struct {
+    char	magic[8];
+    uint32_t	byte_order;		/* SERVE_BYTE_ORDER		    */
+    uint32_t	nv, nt;			/* of the mesh			    */
+    float	matrix[16];		/* object to scene, column major    */
+    float	min[3], max[3];		/* of the mesh			    */
+} serve_hello;
+
+/* sent by a client for each frame: a camera in scene coordinates (see
+ * campath.h) and the thresholds of the front, as fractions of the
+ * viewport's area (see lod_context) */
+typedef struct {
+    float	eye[3], gaze[3], up[3];
+    float	fovy;			/* degrees			    */
+    float	aspect;
+    float	detail_threshold;
+    float	silhouette_threshold;
+} serve_pose;
+
+/* the server's answer, followed by bytes bytes of vertices, removed
+ * triangles and set triangles, in that order */
+typedef struct {
+    uint32_t	frame;
+    uint32_t	bytes;
+    uint32_t	nverts;			/* index, 3 floats, normal	    */
+    uint32_t	nremoved;		/* triangle			    */
+    uint32_t	nset;			/* triangle, 3 vertices		    */
+    uint32_t	rendered;		/* simplified triangles in all	    */
+} serve_frame;
+
+typedef struct serve_server serve_server;
+
+/* listen at / connect to an address; a socket, or -1 (having said why) */
+int	      serve_listen(const char *address);
+int	      serve_connect(const char *address);
+
+/* Serve tree, placed as object o, to the clients connecting on socket fd
+ * (taken over), on a thread of its own. The tree must not change while it
+ * is served. NULL on error. */
+serve_server *serve_start(const octree *tree, const scene_object *o, int fd);
+/* stop accepting clients, wait for the connected ones to leave, and free
+ * the server */
+void	      serve_stop(serve_server *sv);
+
+/* a client's copy of the simplified mesh */
+typedef struct {
+    int		fd;
+    serve_hello	hello;
+    vec3       *verts;			/* those sent so far		    */
+    vec3       *normals;
+    int	      (*tris)[3];		/* per mesh triangle, the simplified
+					 * one, or -1s			    */
+    int		ntris;			/* simplified triangles		    */
+    unsigned	frame;
+
+    /* of the last frame */
+    serve_frame	last;
+    size_t	bytes;			/* received, header and all	    */
+} serve_client;
+
+/* connect to a server; NULL (having said why) on error */
+serve_client *serve_client_open(const char *address);
+void	      serve_client_close(serve_client *c);
+/* send a pose and apply the answer; 0 on error */
+int	      serve_client_frame(serve_client *c, const serve_pose *pose);
+
+#endif // !_SERVE_H_
@@ -0,0 +1,212 @@
+/* Serves the view-dependent LOD of a mesh over a socket (see serve.h). With
+ * -c, it runs that many loopback clients against itself instead of waiting
+ * for others, each orbiting the mesh from its own starting point and
+ * checking every frame's copy of the simplified mesh against the triangles
+ * a front of its own extracts for the same view. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "campath.h"
+#include "lod.h"
+#include "mesh.h"
+#include "scene.h"
+#include "serve.h"
+#include "vec3.h"
+#include "view_params.h"
+
+typedef struct {
+    const char	 *address;
+    const scene	 *sc;
+    const camera *path;
+    int		  nframes, first;
+    real	  aspect;
+
+    /* results */
+    int		  failed;		/* frame it failed at, or -1	    */
+    double	  bytes;		/* received over all frames	    */
+    size_t	  first_bytes;		/*	.. and in the first one	    */
+    double	  index_bytes;		/* of the full index lists	    */
+} loopback;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file | synth:<kind>:<triangles>> <address>\n"
+	"  -c clients    run this many loopback clients, then exit\n"
+	"  -n frames     frames of each client's orbit (360)\n"
+	"  -d distance   distance of the orbit (3)\n"
+	"  -W width, -H height   viewport aspect (1280x960)\n"
+	"  -D detail, -S silhouette   thresholds, in pixels\n"
+	"An address is unix:<path> or [host:]port. Without -c, serves until\n"
+	"killed; with it, exits with status 1 if any client's copy of the\n"
+	"simplified mesh differs from what the LOD of the view is.\n", prog);
+    exit(1);
+}
+
+/* 1 if the client has exactly the triangles of ref's last extraction */
+static int
+same_mesh(const serve_client *c, const lod_context *ref, const mesh *m)
+{
+    const int *t;
+    int j, k;
+    vec3 p;
+
+    if (c->ntris != ref->nindices / 3)
+	return 0;
+    for (j=0; j<ref->nindices/3; j++) {
+	t = &ref->tri_index[3*j];
+	for (k=0; k<3; k++) {
+	    if (c->tris[ref->tri_faces[j]][k] != t[k])
+		return 0;
+	    MeshVertex(p, m, t[k]);
+	    if (p[0] != c->verts[t[k]][0] || p[1] != c->verts[t[k]][1] ||
+		p[2] != c->verts[t[k]][2])
+		return 0;
+	}
+    }
+    return 1;
+}
+
+static void *
+run_loopback(void *arg)
+{
+    loopback *lb = arg;
+    const octree *tree = lb->sc->models[0].tree;
+    scene_object o = lb->sc->objects[0];
+    serve_client *c;
+    lod_context *ref;
+    serve_pose pose;
+    view_params vp;
+    const camera *cam;
+    int j;
+
+    lb->failed = 0;
+    if ((c = serve_client_open(lb->address)) == NULL)
+	return NULL;
+    ref = lod_create(tree);
+    ref->tri_faces = malloc(sizeof(int)*(tree->mesh->nt + 1));
+    ref->detail_threshold = lb->sc->detail_threshold;
+    ref->silhouette_threshold = lb->sc->silhouette_threshold;
+
+    memset(&pose, 0, sizeof(pose));
+    pose.aspect = lb->aspect;
+    pose.detail_threshold = lb->sc->detail_threshold;
+    pose.silhouette_threshold = lb->sc->silhouette_threshold;
+    for (j=0; j<lb->nframes; j++) {
+	cam = &lb->path[(lb->first + j) % lb->nframes];
+	VecSet(pose.eye, cam->eye);
+	VecSet(pose.gaze, cam->gaze);
+	VecSet(pose.up, cam->up);
+	pose.fovy = cam->fovy;
+	if (!serve_client_frame(c, &pose))
+	    break;
+
+	campath_view(cam, lb->aspect, &vp);
+	scene_object_view(&o, &vp);
+	lod_update(ref, &o.view);
+	lod_extract(ref);
+	if (!same_mesh(c, ref, tree->mesh))
+	    break;
+
+	lb->bytes += c->bytes;
+	lb->index_bytes += sizeof(*ref->tri_index) * ref->nindices;
+	if (j == 0)
+	    lb->first_bytes = c->bytes;
+    }
+    lb->failed = j < lb->nframes ? j : -1;
+    lod_free(ref);
+    serve_client_close(c);
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    int nframes = 360, width = 1280, height = 960, nclients = 0;
+    int c, j, fd, failed = 0;
+    real dist = 3.0, detail = -1, silhouette = -1;
+    const char *address;
+    serve_server *sv;
+    loopback *lb;
+    pthread_t *tid;
+    camera *path;
+    scene *sc;
+
+    while ((c = getopt(argc, argv, "c:n:d:W:H:D:S:")) != -1) {
+	switch (c) {
+	    case 'c': nclients = atoi(optarg); break;
+	    case 'n': nframes = atoi(optarg); break;
+	    case 'd': dist = atof(optarg); break;
+	    case 'W': width = atoi(optarg); break;
+	    case 'H': height = atoi(optarg); break;
+	    case 'D': detail = atof(optarg); break;
+	    case 'S': silhouette = atof(optarg); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-2 || nclients < 0 || nframes < 1 || width < 1 ||
+	height < 1)
+	usage(argv[0]);
+    address = argv[optind+1];
+
+    if ((sc = scene_load(argv[optind])) == NULL)
+	exit(1);
+    if (sc->nobjects != 1) {
+	fprintf(stderr, "%s: expected a single mesh\n", argv[optind]);
+	exit(1);
+    }
+    scene_fit(sc);
+    /* thresholds are given in pixels, like the viewer shows them */
+    if (detail > 0)
+	sc->detail_threshold = detail / (width * height);
+    if (silhouette > 0)
+	sc->silhouette_threshold = silhouette / (width * height);
+
+    if ((fd = serve_listen(address)) < 0 ||
+	(sv = serve_start(sc->models[0].tree, &sc->objects[0], fd)) == NULL)
+	exit(1);
+    printf("Serving %s at %s\n", argv[optind], address);
+    fflush(stdout);
+    if (nclients == 0)
+	for (;;)
+	    pause();
+
+    path = campath_orbit(nframes, dist);
+    lb = calloc(nclients, sizeof(*lb));
+    tid = malloc(sizeof(*tid)*nclients);
+    for (j=0; j<nclients; j++) {
+	lb[j].address = address;
+	lb[j].sc = sc;
+	lb[j].path = path;
+	lb[j].nframes = nframes;
+	lb[j].first = (long)j * nframes / nclients;
+	lb[j].aspect = (real)width / (real)height;
+	if (pthread_create(&tid[j], NULL, run_loopback, &lb[j]) != 0) {
+	    fprintf(stderr, "cannot start client %d\n", j);
+	    exit(1);
+	}
+    }
+    for (j=0; j<nclients; j++) {
+	pthread_join(tid[j], NULL);
+	if (lb[j].failed >= 0) {
+	    printf("client %d: diverges at frame %d\n", j, lb[j].failed);
+	    failed = 1;
+	    continue;
+	}
+	printf("client %d: %d frames match, %.1f KB per frame (%.1f KB the "
+	       "first), full index lists %.1f KB per frame\n", j, nframes,
+	       lb[j].bytes / nframes / 1024, lb[j].first_bytes / 1024.0,
+	       lb[j].index_bytes / nframes / 1024);
+    }
+    serve_stop(sv);
+    free(lb);
+    free(tid);
+    free(path);
+    scene_free(sc);
+    return failed;
+}
@@ -0,0 +1,96 @@
+/* Follows a LOD publication (see publish.h), as a recorder or a second
+ * renderer would: for each new frame it reads the triangles in place,
+ * checking that they index the published vertices, and prints how many
+ * there were, how many frames went by unread since the last one, and how
+ * many reads were overwritten under it and had to be redone. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "publish.h"
+
+/* between looks for a new frame */
+#define POLL_US		1000
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [-n frames] <name>\n"
+	"  -n frames     exit after reading this many (else when the\n"
+	"                producer is done)\n"
+	"The name is as given to LOD_PUBLISH, \"/<name>\". Exits with status 1\n"
+	"if a frame read whole indexes past the vertices.\n", prog);
+    exit(1);
+}
+
+/* 1 if the frame's indices are all vertices of the mesh */
+static int
+check_frame(const subscriber *s, const uint32_t *idx, uint32_t n)
+{
+    uint32_t j;
+
+    if (n % 3 != 0 || n > 3 * s->h->nt)
+	return 0;
+    for (j=0; j<n; j++)
+	if (idx[j] >= s->h->nv)
+	    return 0;
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t frame, seq, last = 0, nread = 0, limit = 0;
+    unsigned long retries = 0;
+    const uint32_t *idx;
+    uint32_t n;
+    subscriber *s;
+    int c, ok, done, bad = 0;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+	switch (c) {
+	    case 'n': limit = strtoull(optarg, NULL, 10); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-1)
+	usage(argv[0]);
+    if ((s = subscribe_open(argv[optind])) == NULL)
+	exit(1);
+    printf("%s: %u vertices, %u triangles, %u slots\n", argv[optind],
+	   s->h->nv, s->h->nt, s->h->nslots);
+
+    while (limit == 0 || nread < limit) {
+	done = atomic_load(&((publish_header *)s->h)->closed);
+	idx = subscribe_latest(s, &frame, &n, &seq);
+	if (idx == NULL || (nread > 0 && frame == last)) {
+	    /* closed before the look, so nothing new is coming */
+	    if (done)
+		break;
+	    usleep(POLL_US);
+	    continue;
+	}
+	/* n may be torn like the rest, so is only trusted as far as the
+	 * slot goes */
+	if (n > 3 * s->h->nt)
+	    n = 3 * s->h->nt;
+	ok = check_frame(s, idx, n);
+	if (!subscribe_valid(s, frame, seq)) {
+	    retries++;
+	    continue;
+	}
+	printf("frame %llu: %u triangles, %llu skipped, %lu retries%s\n",
+	       (unsigned long long)frame, n / 3,
+	       (unsigned long long)(nread > 0 ? frame - last - 1 : frame),
+	       retries, ok ? "" : ", BAD INDICES");
+	bad |= !ok;
+	retries = 0;
+	last = frame;
+	nread++;
+    }
+    printf("%llu frames read\n", (unsigned long long)nread);
+    subscribe_close(s);
+    return bad;
+}
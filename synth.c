@@ -0,0 +1,375 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "parallel.h"
+#include "synth.h"
+#include "trace.h"
+#include "vec3.h"
+
+#define NSCANS		16		/* patches of SYNTH_SCANS	    */
+#define NCLUSTERS	3		/* .. gathered around this many spots*/
+#define NSHEETS		8		/* patches of SYNTH_SHEETS	    */
+#define SHEET_GAP	1e-6		/* .. this far apart		    */
+
+static const char *const kind_names[SYNTH_NKINDS] = {
+    "sphere", "terrain", "scans", "sheets"
+};
+
+typedef struct {
+    int		kind;
+    unsigned	seed;
+    unsigned	npatches;
+    unsigned	n;			/* vertices along a patch side	    */
+    unsigned	nv, nt;
+
+    /* SYNTH_SCANS: lattice origin of each scan, and lattice spacing */
+    unsigned	origin[NSCANS][2];
+    real	step;
+} synth;
+
+int
+synth_kind(const char *name)
+{
+    int k;
+
+    for (k=0; k<SYNTH_NKINDS; k++)
+	if (strcmp(name, kind_names[k]) == 0)
+	    return k;
+    return -1;
+}
+
+const char *
+synth_kind_name(int kind)
+{
+    return kind_names[kind];
+}
+
+static unsigned
+hash(unsigned seed, int x, int y)
+{
+    unsigned h = seed * 0x9e3779b9u;
+
+    h ^= (unsigned)x * 0x85ebca6bu;
+    h ^= (unsigned)y * 0xc2b2ae35u;
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/* smoothly interpolated lattice noise in [0,1) */
+static double
+value_noise(unsigned seed, double x, double y)
+{
+    double fx = floor(x), fy = floor(y);
+    int xi = (int)fx, yi = (int)fy;
+    double u = x - fx, v = y - fy;
+    double a, b, c, d;
+
+    u = u*u*(3 - 2*u);
+    v = v*v*(3 - 2*v);
+    a = hash(seed, xi, yi) / 4294967296.0;
+    b = hash(seed, xi+1, yi) / 4294967296.0;
+    c = hash(seed, xi, yi+1) / 4294967296.0;
+    d = hash(seed, xi+1, yi+1) / 4294967296.0;
+    return (a + (b - a)*u) + ((c + (d - c)*u) - (a + (b - a)*u))*v;
+}
+
+/* fractal height in [-1,1) at (x,y) of [0,1]^2 */
+static double
+height(unsigned seed, double x, double y)
+{
+    double h = 0, amp = 0.5, freq = 4;
+    int k;
+
+    for (k=0; k<8; k++) {
+	h += amp * value_noise(seed + k, x*freq, y*freq);
+	amp *= 0.5;
+	freq *= 2;
+    }
+    return 2*h - 1;
+}
+
+static int
+synth_setup(synth *s, int kind, unsigned long long ntris, unsigned seed)
+{
+    unsigned long long cells, side, nv;
+    unsigned j, c, lattice;
+
+    memset(s, 0, sizeof(*s));
+    if (kind < 0 || kind >= SYNTH_NKINDS)
+	return 0;
+    s->kind = kind;
+    s->seed = seed;
+    s->npatches = kind == SYNTH_SPHERE ? 6 :
+		  kind == SYNTH_SCANS ? NSCANS :
+		  kind == SYNTH_SHEETS ? NSHEETS : 1;
+
+    /* two triangles per cell, in square patches */
+    cells = (ntris + 2*s->npatches - 1) / (2*s->npatches);
+    side = (unsigned long long)ceil(sqrt((double)cells));
+    while (side * side < cells)
+	side++;
+    if (side < 1)
+	side = 1;
+    nv = s->npatches * (side+1) * (side+1);
+    if (nv >= 1ull << 31) {
+	fprintf(stderr, "synthetic mesh of %llu triangles is too large\n",
+		ntris);
+	return 0;
+    }
+    s->n = side + 1;
+    s->nv = nv;
+    s->nt = 2 * s->npatches * side * side;
+
+    if (kind == SYNTH_SCANS) {
+	/* scans of n x n vertices on a lattice of 3n x 3n, each near one of
+	 * a few spots and overlapping the others there */
+	lattice = 3 * s->n;
+	s->step = 1.0 / (lattice - 1);
+	for (j=0; j<NSCANS; j++) {
+	    unsigned base[2], spread = s->n/2 + 1;
+	    int o;
+
+	    c = j % NCLUSTERS;
+	    base[0] = hash(seed, c, -1) % (lattice - s->n + 1);
+	    base[1] = hash(seed, c, -2) % (lattice - s->n + 1);
+	    for (c=0; c<2; c++) {
+		o = (int)base[c] + (int)(hash(seed, j, c) % spread) -
+		    (int)spread/2;
+		if (o < 0) o = 0;
+		if (o > (int)(lattice - s->n)) o = lattice - s->n;
+		s->origin[j][c] = o;
+	    }
+	}
+    }
+    return 1;
+}
+
+/* vertex (i,j) of patch p; i runs along the rows */
+static void
+synth_vertex(const synth *s, unsigned p, unsigned i, unsigned j, vec3 v)
+{
+    double u = (double)i / (s->n - 1), t = (double)j / (s->n - 1);
+    double x, z;
+    int a, sgn;
+
+    switch (s->kind) {
+	case SYNTH_SPHERE:
+	    /* face p of a cube, warped so the cells come out about equal
+	     * once projected, and oriented so that rows x columns points
+	     * outwards */
+	    a = p / 2;
+	    sgn = p & 1 ? -1 : 1;
+	    v[a] = sgn;
+	    v[(a+1)%3] = sgn * tan((2*u - 1) * M_PI/4);
+	    v[(a+2)%3] = tan((2*t - 1) * M_PI/4);
+	    VecNormalize(v);
+	    break;
+
+	case SYNTH_TERRAIN:
+	    v[0] = 2*t - 1;
+	    v[1] = 0.25 * height(s->seed, t, u);
+	    v[2] = 2*u - 1;
+	    break;
+
+	case SYNTH_SCANS:
+	    /* the lattice point, hence exactly the same vertex, for every scan
+	     * covering it */
+	    x = (s->origin[p][1] + j) * s->step;
+	    z = (s->origin[p][0] + i) * s->step;
+	    v[0] = 2*x - 1;
+	    v[1] = 0.25 * height(s->seed, x, z);
+	    v[2] = 2*z - 1;
+	    break;
+
+	case SYNTH_SHEETS:
+	    /* crowded towards the origin, where floats stay precise */
+	    v[0] = t*t*t*t;
+	    v[1] = p * SHEET_GAP;
+	    v[2] = u*u*u*u;
+	    break;
+    }
+}
+
+/* the two triangles of cell (i,j) of patch p */
+static void
+synth_cell(const synth *s, unsigned p, unsigned i, unsigned j, index3u t[2])
+{
+    unsigned v00 = p*s->n*s->n + i*s->n + j;
+    unsigned v10 = v00 + s->n;
+
+    t[0][0] = v00; t[0][1] = v10; t[0][2] = v10+1;
+    t[1][0] = v00; t[1][1] = v10+1; t[1][2] = v00+1;
+}
+
+typedef struct {
+    const synth	*s;
+    mesh	*m;
+} synth_job;
+
+static void
+fill_row(void *arg, int r)
+{
+    const synth_job *job = arg;
+    const synth *s = job->s;
+    unsigned p = r / s->n, i = r % s->n, j;
+
+    for (j=0; j<s->n; j++)
+	synth_vertex(s, p, i, j, job->m->verts[r*s->n + j]);
+    if (i+1 < s->n)
+	for (j=0; j+1<s->n; j++)
+	    synth_cell(s, p, i, j,
+		       &job->m->tris[2*((p*(s->n-1) + i)*(s->n-1) + j)]);
+}
+
+mesh *
+synth_mesh(int kind, unsigned long long ntris, unsigned seed)
+{
+    synth s;
+    synth_job job;
+    mesh *m;
+
+    if (!synth_setup(&s, kind, ntris, seed))
+	return NULL;
+    if ((m = malloc(sizeof(*m))) == NULL)
+	return NULL;
+    TRACE_BEGIN("synth_mesh");
+    memset(m, 0, sizeof(*m));
+    m->nv = s.nv;
+    m->nt = s.nt;
+    m->verts = malloc(sizeof(*m->verts)*m->nv);
+    m->tris = malloc(sizeof(*m->tris)*m->nt);
+    if (!m->verts || !m->tris)
+	goto fail;
+
+    job.s = &s;
+    job.m = m;
+    parallel_for(s.npatches * s.n, fill_row, &job);
+
+    if (!mesh_finish(m))
+	goto fail;
+    TRACE_END();
+    return m;
+
+fail:
+    mesh_free(m);
+    TRACE_END();
+    return NULL;
+}
+
+int
+synth_write_ply(const char *file, int kind, unsigned long long ntris,
+		unsigned seed)
+{
+    const union { unsigned u; unsigned char b[4]; } endian = { 1 };
+    synth s;
+    vec3 *row = NULL;
+    unsigned char *faces = NULL, *f;
+    index3u t[2];
+    unsigned p, i, j, k;
+    int32_t idx;
+    FILE *fp;
+
+    if (!synth_setup(&s, kind, ntris, seed))
+	return 0;
+    if ((fp = fopen(file, "wb")) == NULL) {
+	perror(file);
+	return 0;
+    }
+    /* the rows are written out in the byte order of this machine */
+    fprintf(fp, "ply\n"
+	    "format binary_%s_endian 1.0\n"
+	    "comment synthetic %s, seed %u\n"
+	    "element vertex %u\n"
+	    "property float x\n"
+	    "property float y\n"
+	    "property float z\n"
+	    "element face %u\n"
+	    "property list uchar int vertex_indices\n"
+	    "end_header\n", endian.b[0] ? "little" : "big",
+	    kind_names[kind], seed, s.nv, s.nt);
+
+    row = malloc(sizeof(*row)*s.n);
+    faces = malloc(2*(s.n-1) * (1 + sizeof(index3u)));
+    if (!row || !faces)
+	goto fail;
+
+    for (p=0; p<s.npatches; p++)
+	for (i=0; i<s.n; i++) {
+	    for (j=0; j<s.n; j++)
+		synth_vertex(&s, p, i, j, row[j]);
+	    if (fwrite(row, sizeof(*row), s.n, fp) != s.n)
+		goto fail;
+	}
+
+    for (p=0; p<s.npatches; p++)
+	for (i=0; i+1<s.n; i++) {
+	    f = faces;
+	    for (j=0; j+1<s.n; j++) {
+		synth_cell(&s, p, i, j, t);
+		for (k=0; k<6; k++) {
+		    if (k % 3 == 0)
+			*f++ = 3;
+		    idx = t[k/3][k%3];
+		    memcpy(f, &idx, sizeof(idx));
+		    f += sizeof(idx);
+		}
+	    }
+	    if (fwrite(faces, 1, f - faces, fp) != (size_t)(f - faces))
+		goto fail;
+	}
+
+    free(row);
+    free(faces);
+    if (fclose(fp) != 0) {
+	perror(file);
+	return 0;
+    }
+    return 1;
+
+fail:
+    perror(file);
+    free(row);
+    free(faces);
+    fclose(fp);
+    return 0;
+}
+
+unsigned long long
+synth_parse_count(const char *str)
+{
+    unsigned long long n;
+    char *end;
+
+    n = strtoull(str, &end, 10);
+    switch (*end) {
+	case 'k': case 'K': n *= 1000; end++; break;
+	case 'm': case 'M': n *= 1000000; end++; break;
+	case 'g': case 'G': n *= 1000000000; end++; break;
+    }
+    return end == str || *end ? 0 : n;
+}
+
+int
+synth_parse_name(const char *name, int *kind, unsigned long long *ntris,
+		 unsigned *seed)
+{
+    char kname[32], count[32];
+    int k;
+
+    if (strncmp(name, "synth:", 6) != 0)
+	return 0;
+    *seed = 1;
+    k = sscanf(name + 6, "%31[^:]:%31[^:]:%u", kname, count, seed);
+    if (k < 2 || (*kind = synth_kind(kname)) < 0 ||
+	(*ntris = synth_parse_count(count)) == 0) {
+	fprintf(stderr, "%s: expected synth:<kind>:<triangles>[:<seed>], "
+		"with kind one of sphere, terrain, scans or sheets\n", name);
+	return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef _SYNTH_H_
+#define _SYNTH_H_
+
+#include "mesh.h"
+
+/* Synthetic meshes for scaling tests. Every kind is made of square patches
+ * of grid vertices, two triangles per grid cell, so that any vertex or
+ * triangle can be computed on its own and meshes far larger than memory can
+ * be written out as they are generated. */
+enum {
+    SYNTH_SPHERE,	/* unit sphere, evenly tessellated (cube map)	    */
+    SYNTH_TERRAIN,	/* noisy height field				    */
+    SYNTH_SCANS,	/* overlapping range scans of one surface, in a few
+			 * clusters; overlaps repeat vertices exactly	    */
+    SYNTH_SHEETS,	/* stacked sheets a hair apart, crowded into one
+			 * corner, so the octree gets very deep		    */
+    SYNTH_NKINDS
+};
+
+/* kind of the given name, or -1 */
+int	    synth_kind(const char *name);
+const char *synth_kind_name(int kind);
+
+/* Generate a mesh of about ntris triangles (at least ntris, rounded up to
+ * whole patches), the same for the same seed. synth_mesh() builds it in
+ * memory, normals and all, like mesh_load(); synth_write_ply() streams it
+ * to a binary PLY file instead and returns 0 on error. Both fail if the
+ * mesh would have 2^31 vertices or more. */
+mesh	   *synth_mesh(int kind, unsigned long long ntris, unsigned seed);
+int	    synth_write_ply(const char *file, int kind,
+			    unsigned long long ntris, unsigned seed);
+
+/* a triangle count, with an optional k, m or g (thousands, millions or
+ * billions) suffix; 0 if malformed */
+unsigned long long synth_parse_count(const char *str);
+
+/* In-memory meshes can be named like files, as "synth:<kind>:<triangles>"
+ * or "synth:<kind>:<triangles>:<seed>" (see scene_load()). Returns 1 if
+ * the name is one, 0 if it is a file name, and -1 if it is malformed. */
+int	    synth_parse_name(const char *name, int *kind,
+			     unsigned long long *ntris, unsigned *seed);
+
+#endif // !_SYNTH_H_
@@ -0,0 +1,55 @@
+/* Writes synthetic meshes (see synth.h) as binary PLY files, for scaling
+ * tests with meshes of any size. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "synth.h"
+#include "timer.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [options] <PLY file>\n"
+	"  -k kind       sphere, terrain, scans or sheets (sphere)\n"
+	"  -t triangles  at least this many, with k, m or g suffixes (1m)\n"
+	"  -s seed       random seed (1)\n"
+	"The mesh is written as it is generated, so it may be far larger than\n"
+	"memory.\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long ntris = 1000000;
+    unsigned seed = 1;
+    int c, kind = SYNTH_SPHERE;
+    double t;
+
+    while ((c = getopt(argc, argv, "k:t:s:")) != -1) {
+	switch (c) {
+	    case 'k':
+		if ((kind = synth_kind(optarg)) < 0)
+		    usage(argv[0]);
+		break;
+	    case 't':
+		if ((ntris = synth_parse_count(optarg)) == 0)
+		    usage(argv[0]);
+		break;
+	    case 's': seed = strtoul(optarg, NULL, 10); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (optind != argc-1)
+	usage(argv[0]);
+
+    t = get_timer();
+    if (!synth_write_ply(argv[optind], kind, ntris, seed))
+	exit(1);
+    fprintf(stderr, "Wrote %s %s [%gs]\n", synth_kind_name(kind),
+	    argv[optind], get_timer() - t);
+    return 0;
+}
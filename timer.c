@@ -1,14 +1,15 @@
-#include <sys/time.h>
-#include <sys/resource.h>
+#include <time.h>
 
 #include "timer.h"
 
+/* elapsed (wall clock) seconds since an arbitrary point, from a monotonic
+ * clock, so it counts time spent waiting and is unaffected by clock changes */
 double
 get_timer(void)
 {
-    struct rusage ru;
+    struct timespec ts;
 
-    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
 }
@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_MAX_DEPTH	32
+
+typedef struct {
+    const char	*name;
+    uint64_t	 start, dur;		/* nanoseconds			    */
+} trace_event;
+
+/* Rings are never freed. When a thread exits, its ring is released for the
+ * next new thread to take over, so the short-lived threads of parallel_for()
+ * do not each cost a ring. */
+typedef struct trace_ring trace_ring;
+struct trace_ring {
+    trace_ring	       *next;		/* list of all rings		    */
+    atomic_int		owned;		/* in use by a live thread	    */
+    int			tid;
+    atomic_ulong	head;		/* events ever written		    */
+
+    int			depth;		/* open spans			    */
+    const char	       *open_name[TRACE_MAX_DEPTH];
+    uint64_t		open_start[TRACE_MAX_DEPTH];
+
+    trace_event		events[TRACE_RING_SIZE];
+};
+
+static _Atomic(trace_ring *) rings = NULL;
+static atomic_int nrings;
+static _Thread_local trace_ring *ring = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void
+release_ring(void *p)
+{
+    trace_ring *r = p;
+
+    r->depth = 0;
+    atomic_store(&r->owned, 0);
+}
+
+static void
+make_key(void)
+{
+    pthread_key_create(&key, release_ring);
+}
+
+static trace_ring *
+get_ring(void)
+{
+    trace_ring *r;
+    int expected;
+
+    if (ring)
+	return ring;
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+	expected = 0;
+	if (atomic_compare_exchange_strong(&r->owned, &expected, 1))
+	    break;
+    }
+    if (r == NULL) {
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+	    return NULL;
+	atomic_init(&r->owned, 1);
+	atomic_init(&r->head, 0);
+	r->tid = atomic_fetch_add(&nrings, 1) + 1;
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+	    ;
+    }
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(key, r);
+    return ring = r;
+}
+
+void
+trace_begin(const char *name)
+{
+    trace_ring *r = get_ring();
+
+    if (r == NULL)
+	return;
+    if (r->depth < TRACE_MAX_DEPTH) {
+	r->open_name[r->depth] = name;
+	r->open_start[r->depth] = now();
+    }
+    r->depth++;
+}
+
+void
+trace_end(void)
+{
+    trace_ring *r = ring;
+    unsigned long h;
+    trace_event *e;
+
+    if (r == NULL || r->depth == 0)
+	return;
+    if (--r->depth >= TRACE_MAX_DEPTH)
+	return;
+
+    /* only this thread writes the ring; the release store publishes the
+     * event to trace_dump() */
+    h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    e = &r->events[h % TRACE_RING_SIZE];
+    e->name = r->open_name[r->depth];
+    e->start = r->open_start[r->depth];
+    e->dur = now() - e->start;
+    atomic_store_explicit(&r->head, h+1, memory_order_release);
+}
+
+int
+trace_dump(const char *file)
+{
+    const trace_event *e;
+    unsigned long h, j, n;
+    trace_ring *r;
+    int first = 1;
+    FILE *fp;
+
+    if ((fp = fopen(file, "w")) == NULL) {
+	perror(file);
+	return 0;
+    }
+    fprintf(fp, "{\"traceEvents\":[");
+    for (r = atomic_load(&rings); r; r = r->next) {
+	h = atomic_load_explicit(&r->head, memory_order_acquire);
+	n = h < TRACE_RING_SIZE ? h : TRACE_RING_SIZE;
+	for (j=h-n; j<h; j++) {
+	    e = &r->events[j % TRACE_RING_SIZE];
+	    fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+		    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+		    first ? "" : ",", e->name, r->tid,
+		    e->start * 1e-3, e->dur * 1e-3);
+	    first = 0;
+	}
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Hot-path tracing. Spans are recorded only when built with LOD_TRACE
+ * defined (make TRACE=1); otherwise TRACE_BEGIN and TRACE_END compile to
+ * nothing. Every thread records into its own ring buffer, without locks,
+ * keeping the most recent TRACE_RING_SIZE spans. Spans must nest, and name
+ * must be a string constant. */
+#ifdef LOD_TRACE
+# define TRACE_BEGIN(name)	trace_begin(name)
+# define TRACE_END()		trace_end()
+#else
+# define TRACE_BEGIN(name)	((void)0)
+# define TRACE_END()		((void)0)
+#endif
+
+#define TRACE_RING_SIZE	(1<<16)
+
+void trace_begin(const char *name);
+void trace_end(void);
+
+/* write all recorded spans as Chrome trace event JSON (for about:tracing or
+ * ui.perfetto.dev). spans recorded while dumping may be torn. returns 0 on
+ * failure. */
+int  trace_dump(const char *file);
+
+#endif /* !_TRACE_H_ */